@@ -0,0 +1,115 @@
+#pragma once
+#include "atomic_mutex.h"
+
+/** Wait for an atomic_bit_mutex after try_lock() failed.
+@param word  the word that contains the lock bits
+@param bit   the position of the HOLDER bit */
+template<typename T>
+void bit_lock_wait(std::atomic<T> &word, unsigned bit) noexcept;
+/** Wake up a bit_lock_wait() after the lock bits were cleared.
+@param word  the word that contains the lock bits
+@param bit   the position of the HOLDER bit */
+template<typename T>
+void bit_lock_notify(std::atomic<T> &word, unsigned bit) noexcept;
+
+/** A non-recursive mutex in 2 bits of a word that also holds other data,
+such as the least significant bits of an aligned pointer in a hash table
+bucket. The data can be read by load() at any time, and it can be
+replaced by store() without affecting the lock bits.
+
+The HOLDER bit is set while the mutex is held, and the WAITER bit is
+set when lock() may be blocked. Unlike in mutex_storage, waiters are not
+counted: a lock() that had to wait will acquire the mutex with the
+WAITER bit set, so that the next unlock() will invoke a wake-up, which
+may turn out to be unnecessary.
+
+A blocked lock() waits on the 32-bit half of the word that contains the
+lock bits, by futex or equivalent. Any change of the other bits in that
+half may cause a spurious wake-up.
+
+Like atomic_mutex, the object is expected to be zero-initialized.
+@tparam T    the type of the word: uint32_t, uint64_t or uintptr_t
+@tparam BIT  the position of the HOLDER bit; BIT + 1 is the WAITER bit */
+template<typename T = uintptr_t, unsigned BIT = 0>
+class atomic_bit_mutex
+{
+  static_assert(sizeof(T) == 4 || sizeof(T) == 8, "unsupported word size");
+  static_assert(BIT + 1 < 8 * sizeof(T), "BIT is out of range");
+  static_assert(BIT % 32 != 31, "the lock bits must be in the same half");
+
+  std::atomic<T> word;
+public:
+  /** the lock is being held */
+  static constexpr T HOLDER = T(1) << BIT;
+  /** lock() may be waiting */
+  static constexpr T WAITER = T(2) << BIT;
+  /** the bits that are not available for data */
+  static constexpr T LOCK_BITS = HOLDER | WAITER;
+
+#ifdef __SANITIZE_THREAD__
+  atomic_bit_mutex() { __tsan_mutex_create(&word, __tsan_mutex_linker_init); }
+  ~atomic_bit_mutex()
+  { __tsan_mutex_destroy(&word, __tsan_mutex_linker_init); }
+#else
+  /** Default constructor */
+  constexpr atomic_bit_mutex() = default;
+#endif
+  /** No copy constructor */
+  atomic_bit_mutex(const atomic_bit_mutex&) = delete;
+  /** No assignment operator */
+  atomic_bit_mutex& operator=(const atomic_bit_mutex&) = delete;
+
+  /** @return the data bits (with LOCK_BITS clear) */
+  T load(std::memory_order order = std::memory_order_acquire) const noexcept
+  { return word.load(order) & ~LOCK_BITS; }
+  /** Replace the data bits, preserving the lock bits.
+  Typically, the caller would hold the mutex.
+  @param data  the data (with LOCK_BITS clear) */
+  void store(T data, std::memory_order order = std::memory_order_release)
+    noexcept
+  {
+    assert(!(data & LOCK_BITS));
+    T w = word.load(std::memory_order_relaxed);
+    while (!word.compare_exchange_weak(w, (w & LOCK_BITS) | data, order,
+                                       std::memory_order_relaxed));
+  }
+
+  bool is_locked() const noexcept
+  { return word.load(std::memory_order_acquire) & HOLDER; }
+  bool is_locked_or_waiting() const noexcept
+  { return word.load(std::memory_order_acquire) & LOCK_BITS; }
+
+  /** @return whether the mutex was acquired */
+  bool try_lock() noexcept
+  {
+    __tsan_mutex_pre_lock(&word, __tsan_mutex_try_lock);
+    bool locked = !(word.fetch_or(HOLDER, std::memory_order_acquire) &
+                    HOLDER);
+    __tsan_mutex_post_lock(&word, locked
+                           ? __tsan_mutex_try_lock
+                           : __tsan_mutex_try_lock_failed, 0);
+    return locked;
+  }
+
+  void lock() noexcept
+  {
+    __tsan_mutex_pre_lock(&word, 0);
+    if (word.fetch_or(HOLDER, std::memory_order_acquire) & HOLDER)
+      bit_lock_wait(word, BIT);
+    __tsan_mutex_post_lock(&word, 0, 0);
+  }
+
+  void unlock() noexcept
+  {
+    __tsan_mutex_pre_unlock(&word, 0);
+    T w = word.fetch_and(T(~LOCK_BITS), std::memory_order_release);
+    __tsan_mutex_post_unlock(&word, 0);
+    assert(w & HOLDER);
+    if (w & WAITER)
+    {
+      __tsan_mutex_pre_signal(&word, 0);
+      bit_lock_notify(word, BIT);
+      __tsan_mutex_post_signal(&word, 0);
+    }
+  }
+};
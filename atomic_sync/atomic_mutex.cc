@@ -1,57 +1,381 @@
 #include "atomic_shared_mutex.h"
+#include "atomic_bit_mutex.h"
+#include "parking_lot.h"
+#include "probes.h"
+#include <chrono>
+#include <cstdint>
 
-#if !defined _WIN32 && __cplusplus < 202002L
-/* Emulate the C++20 primitives */
-# include <climits>
-# if defined __linux__
-#  include <linux/futex.h>
-#  include <unistd.h>
-#  include <sys/syscall.h>
-#  define FUTEX(op,m,n)                                                 \
-   syscall(SYS_futex, m, FUTEX_ ## op ## _PRIVATE, n, nullptr, nullptr, 0)
-# elif defined __OpenBSD__
-#  include <sys/time.h>
-#  include <sys/futex.h>
-#  define FUTEX(op,m,n)                                                 \
-   futex((volatile uint32_t*) m, FUTEX_ ## op, n, nullptr, nullptr)
-# elif defined __FreeBSD__
-#   include <sys/types.h>
-#   include <sys/umtx.h>
-#   define FUTEX_WAKE UMTX_OP_WAKE_PRIVATE
-#   define FUTEX_WAIT UMTX_OP_WAIT_UINT_PRIVATE
-#   define FUTEX(op,m,n) _umtx_op(m, FUTEX_ ## op, n, nullptr, nullptr)
-# elif defined __DragonFly__
-#   include <unistd.h>
-#   define FUTEX_WAKE(m,n) umtx_wakeup(m,n)
-#   define FUTEX_WAIT(m,n) umtx_sleep(m,n,0)
-#   define FUTEX(op,m,n) FUTEX_ ## op((volatile int*) m, int(n))
-# else
-#  error "no C++20 nor futex support"
+#ifdef _WIN32
+# include <windows.h>
+# ifdef _MSC_VER
+#  pragma comment(lib, "Synchronization.lib")
 # endif
-template<>
-void mutex_storage<uint32_t>::notify_one() noexcept {FUTEX(WAKE, &m, 1);}
-template<>
-inline void mutex_storage<uint32_t>::wait(uint32_t old) const noexcept
-{FUTEX(WAIT, &m, old);}
 #endif
 
-#ifdef _WIN32
-# include <windows.h>
+#include <climits>
+/* FUTEX(): the primitives for USE_FUTEX, within a process.
+FUTEX_SHARED(): the same for memory that is shared between processes. */
+#if defined __linux__
+# include <cerrno>
+# include <cstdio>
+# include <cstdlib>
+# include <cstring>
+# include <linux/futex.h>
+# include <pthread.h>
+# include <unistd.h>
+# include <sys/syscall.h>
+# define FUTEX(op,m,n)                                                  \
+  syscall(SYS_futex, m, FUTEX_ ## op ## _PRIVATE, n, nullptr, nullptr, 0)
+# define FUTEX_SHARED(op,m,n)                                           \
+  syscall(SYS_futex, m, FUTEX_ ## op, n, nullptr, nullptr, 0)
+#elif defined __OpenBSD__
+# include <sys/time.h>
+# include <sys/futex.h>
+# define FUTEX(op,m,n)                                                  \
+  futex((volatile uint32_t*) m, FUTEX_ ## op, n, nullptr, nullptr)
+# define FUTEX_SHARED(op,m,n) FUTEX(op,m,n)
+#elif defined __FreeBSD__
+# include <sys/types.h>
+# include <sys/umtx.h>
+# define FUTEX_WAKE UMTX_OP_WAKE_PRIVATE
+# define FUTEX_WAIT UMTX_OP_WAIT_UINT_PRIVATE
+# define FUTEX_SHARED_WAKE UMTX_OP_WAKE
+# define FUTEX_SHARED_WAIT UMTX_OP_WAIT_UINT
+# define FUTEX(op,m,n) _umtx_op(m, FUTEX_ ## op, n, nullptr, nullptr)
+# define FUTEX_SHARED(op,m,n)                                           \
+  _umtx_op(m, FUTEX_SHARED_ ## op, n, nullptr, nullptr)
+#elif defined __DragonFly__
+# include <unistd.h>
+# define FUTEX_WAKE(m,n) umtx_wakeup(m,n)
+# define FUTEX_WAIT(m,n) umtx_sleep(m,n,0)
+# define FUTEX(op,m,n) FUTEX_ ## op((volatile int*) m, int(n))
+# define FUTEX_SHARED(op,m,n) FUTEX(op,m,n)
+#elif defined __APPLE__
+/* The interface that the libc++ std::atomic::wait() is based on */
+extern "C" int __ulock_wait(uint32_t op, void *addr, uint64_t value,
+                            uint32_t timeout_us);
+extern "C" int __ulock_wake(uint32_t op, void *addr, uint64_t wake_value);
+# define UL_COMPARE_AND_WAIT 1
+# define UL_COMPARE_AND_WAIT_SHARED 3
+# define ULF_WAKE_ALL 0x100
+# define FUTEX_WAKE(o,m,n) __ulock_wake(o | (n == 1 ? 0 : ULF_WAKE_ALL), m, 0)
+# define FUTEX_WAIT(o,m,n) __ulock_wait(o, m, n, 0)
+# define FUTEX(op,m,n) FUTEX_ ## op(UL_COMPARE_AND_WAIT, (void*) m, n)
+# define FUTEX_SHARED(op,m,n)                                           \
+  FUTEX_ ## op(UL_COMPARE_AND_WAIT_SHARED, (void*) m, n)
+#elif defined _WIN32 && defined USE_FUTEX
+static inline void futex_wait(const void *m, uint32_t old) noexcept
+{ WaitOnAddress(const_cast<void*>(m), &old, sizeof old, INFINITE); }
+static inline void futex_wake(const void *m, uint32_t n) noexcept
+{
+  if (n == 1)
+    WakeByAddressSingle(const_cast<void*>(m));
+  else
+    WakeByAddressAll(const_cast<void*>(m));
+}
+# define FUTEX(op,m,n) futex_ ## op(m, n)
+# define futex_WAIT futex_wait
+# define futex_WAKE futex_wake
+#elif defined USE_FUTEX
+# error "no C++20 nor futex support"
+#endif
+#include <algorithm>
+#include <thread>
+#if defined __i386__||defined __x86_64__||defined _M_IX86||defined _M_X64
+# ifdef _MSC_VER
+#  include <intrin.h>
+#  define HAVE_WAITPKG_INTRINSICS
+# elif defined __clang__ && __clang_major__ >= 9 || \
+  !defined __clang__ && defined __GNUC__ && __GNUC__ >= 9
+#  include <cpuid.h>
+#  include <immintrin.h>
+#  include <x86intrin.h>
+#  define HAVE_WAITPKG_INTRINSICS __attribute__((target("waitpkg")))
+# endif
+#endif
+
+/** Wait for a word to change from old, within a process */
+static inline void private_wait(const std::atomic<uint32_t> &word,
+                                uint32_t old) noexcept
+{
+#ifdef USE_FUTEX
+  FUTEX(WAIT, const_cast<std::atomic<uint32_t>*>(&word), old);
+#else
+  word.wait(old);
+#endif
+}
+
+/** Wake up private_wait()
+@param n  maximum number of waiters to wake up (1 or INT_MAX) */
+static inline void private_notify(std::atomic<uint32_t> &word, uint32_t n)
+  noexcept
+{
+#ifdef USE_FUTEX
+  FUTEX(WAKE, &word, n);
+#else
+  if (n == 1)
+    word.notify_one();
+  else
+    word.notify_all();
+#endif
+}
+
+void process_shared_wait(const std::atomic<uint32_t> &word, uint32_t old)
+  noexcept
+{
+#ifdef FUTEX_SHARED
+  FUTEX_SHARED(WAIT, const_cast<std::atomic<uint32_t>*>(&word), old);
+#else
+  atomic_wait_until(word, old, std::chrono::steady_clock::time_point::max(),
+                    true);
+#endif
+}
+
+void process_shared_notify(std::atomic<uint32_t> &word, uint32_t n) noexcept
+{
+#ifdef FUTEX_SHARED
+  FUTEX_SHARED(WAKE, &word, n);
+#else
+  /* process_shared_wait() is polling the word. */
+  (void) word;
+  (void) n;
+#endif
+}
+
+void atomic_word_wait(const std::atomic<uint32_t> &word, uint32_t old)
+  noexcept
+{ private_wait(word, old); }
+
+void atomic_word_notify(std::atomic<uint32_t> &word, uint32_t n) noexcept
+{ private_notify(word, n); }
+
+/** Wait for a word of a lock to change from old */
+template<bool ProcessShared>
+static inline void wait_word(const std::atomic<uint32_t> &word, uint32_t old)
+  noexcept
+{
+  if (ProcessShared)
+    process_shared_wait(word, old);
+  else
+    private_wait(word, old);
+}
+
+/** Wake up wait_word()
+@param n  maximum number of waiters to wake up (1 or INT_MAX) */
+template<bool ProcessShared>
+static inline void notify_word(std::atomic<uint32_t> &word, uint32_t n)
+  noexcept
+{
+  if (ProcessShared)
+    process_shared_notify(word, n);
+  else
+    private_notify(word, n);
+}
+
+/** @return the 32-bit half of a word that contains a bit */
+template<typename T>
+static std::atomic<uint32_t> &half_word(std::atomic<T> &word, unsigned bit)
+  noexcept
+{
+  static_assert(sizeof word == sizeof(T), "compatibility");
+  static_assert(sizeof(std::atomic<uint32_t>) == 4, "compatibility");
+  size_t half = sizeof word == 4 ? 0 : bit / 32;
+#if defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  if (sizeof word == 8)
+    half ^= 1;
+#endif
+  return reinterpret_cast<std::atomic<uint32_t>*>(&word)[half];
+}
+
+/** @return the aligned 32-bit word that contains a 16-bit lock word.
+The other half of the word must only be accessed as std::atomic<uint16_t>
+(for example, it is another 16-bit lock word), or it must be unused. */
+static std::atomic<uint32_t> &futex_word(const std::atomic<uint16_t> &word)
+  noexcept
+{
+  static_assert(sizeof word == 2, "compatibility");
+  return *reinterpret_cast<std::atomic<uint32_t>*>
+    (uintptr_t(&word) & ~uintptr_t(3));
+}
+
+/** @return the word that the waiters of a 32-bit lock word wait on */
+static inline std::atomic<uint32_t> &futex_word(std::atomic<uint32_t> &word)
+  noexcept
+{ return word; }
+
+/** @return the position of a 16-bit lock word in futex_word() */
+static unsigned futex_shift(const std::atomic<uint16_t> &word) noexcept
+{
+  unsigned shift = unsigned(uintptr_t(&word) & 2) * 8;
+#if defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  shift ^= 16;
+#endif
+  return shift;
+}
+
+/** @return the value of futex_word() while a 16-bit lock word is old.
+The other half is loaded as the std::atomic<uint16_t> that it is;
+if it is modified meanwhile, the wait will return immediately. */
+static uint32_t futex_value(const std::atomic<uint16_t> &word, uint16_t old)
+  noexcept
+{
+  const std::atomic<uint16_t> &other =
+    *reinterpret_cast<const std::atomic<uint16_t>*>(uintptr_t(&word) ^ 2);
+  const unsigned shift = futex_shift(word);
+  return uint32_t(old) << shift |
+    uint32_t(other.load(std::memory_order_relaxed)) << (shift ^ 16);
+}
+
+#if defined __linux__ || defined __FreeBSD__
+/** @return an absolute time of CLOCK_MONOTONIC,
+which is what std::chrono::steady_clock is based on */
+static timespec monotonic_timespec(std::chrono::steady_clock::time_point t)
+  noexcept
+{
+  using namespace std::chrono;
+  const auto d = t.time_since_epoch();
+  const auto sec = duration_cast<seconds>(d);
+  timespec ts;
+  ts.tv_sec = time_t(sec.count());
+  ts.tv_nsec = long(duration_cast<nanoseconds>(d - sec).count());
+  return ts;
+}
+#endif
+
+#ifdef __linux__
+/** @return the FUTEX_WAIT_BITSET and FUTEX_WAKE_BITSET mask of a 16-bit
+lock word, which tells its waiters apart from those of the other half of
+futex_word() */
+static uint32_t futex_bitset(const std::atomic<uint16_t> &word) noexcept
+{ return uintptr_t(&word) & 2 ? 2 : 1; }
+
+/** Wait for a 16-bit word of a lock to change from old, or for a
+deadline, on the 32-bit word that contains it
+@param ts  nullptr, or the deadline of CLOCK_MONOTONIC */
+template<bool ProcessShared>
+static inline void wait_word(const std::atomic<uint16_t> &word, uint16_t old,
+                             const timespec *ts) noexcept
+{
+  syscall(SYS_futex, &futex_word(word), ProcessShared
+          ? FUTEX_WAIT_BITSET : FUTEX_WAIT_BITSET_PRIVATE,
+          futex_value(word, old), ts, nullptr, futex_bitset(word));
+}
+#endif
+
+/** Wait for a 16-bit word of a lock to change from old, on the 32-bit
+word that contains it */
+template<bool ProcessShared>
+static inline void wait_word(const std::atomic<uint16_t> &word, uint16_t old)
+  noexcept
+{
+#ifdef __linux__
+  wait_word<ProcessShared>(word, old, nullptr);
+#else
+  wait_word<ProcessShared>(futex_word(word), futex_value(word, old));
+#endif
+}
+
+/** Wake up wait_word() on a 16-bit word. On Linux, the waiters of the
+other half of the 32-bit word are not affected. Elsewhere, the other half
+may belong to another lock, whose waiters share the wait queue; a single
+wake-up could be consumed by one of them, so all waiters will be woken
+up.
+@param n  maximum number of waiters to wake up (1 or INT_MAX) */
+template<bool ProcessShared>
+static inline void notify_word(std::atomic<uint16_t> &word, uint32_t n)
+  noexcept
+{
+#ifdef __linux__
+  syscall(SYS_futex, &futex_word(word), ProcessShared
+          ? FUTEX_WAKE_BITSET : FUTEX_WAKE_BITSET_PRIVATE,
+          n, nullptr, nullptr, futex_bitset(word));
+#else
+  (void) n;
+  notify_word<ProcessShared>(futex_word(word), INT_MAX);
+#endif
+}
+
+/** Wait for a word of a lock to change from old, or for a deadline
+@return whether the deadline had not been reached */
+template<bool ProcessShared>
+static inline bool wait_word_until(const std::atomic<uint32_t> &word,
+                                   uint32_t old,
+                                   std::chrono::steady_clock::time_point
+                                   deadline) noexcept
+{
+  if (deadline != std::chrono::steady_clock::time_point::max())
+    return atomic_wait_until(word, old, deadline, ProcessShared);
+  wait_word<ProcessShared>(word, old);
+  return true;
+}
+
+/** Wait for a 16-bit word of a lock to change from old, or for a deadline
+@return whether the deadline had not been reached */
+template<bool ProcessShared>
+static inline bool wait_word_until(const std::atomic<uint16_t> &word,
+                                   uint16_t old,
+                                   std::chrono::steady_clock::time_point
+                                   deadline) noexcept
+{
+  using std::chrono::steady_clock;
+  if (deadline == steady_clock::time_point::max())
+  {
+    wait_word<ProcessShared>(word, old);
+    return true;
+  }
+#ifdef __linux__
+  if (steady_clock::now() >= deadline)
+    return false;
+  const timespec ts = monotonic_timespec(deadline);
+  wait_word<ProcessShared>(word, old, &ts);
+  return steady_clock::now() < deadline;
+#else
+  return atomic_wait_until(futex_word(word), futex_value(word, old),
+                           deadline, ProcessShared);
 #endif
+}
 
+/** Set a bit of a lock word. On IA-32 and AMD64, this is LOCK BTS:
+GCC and clang generate it for fetch_or() of any width, and we invoke
+it explicitly on MSVC for 32-bit and 64-bit words.
+@param word  the lock word
+@param bit   the bit to set
+@return whether the bit was already set */
 template<typename T>
-void mutex_storage<T>::lock_wait() noexcept
+static inline bool bit_test_and_set(std::atomic<T> &word, unsigned bit)
+  noexcept
+{
+#if defined _MSC_VER && (defined _M_IX86 || defined _M_X64)
+  if (sizeof word == 4)
+    return _interlockedbittestandset
+      (reinterpret_cast<volatile long*>(&word), long(bit));
+# ifdef _M_X64
+  if (sizeof word == 8)
+    return _interlockedbittestandset64
+      (reinterpret_cast<volatile __int64*>(&word), __int64(bit));
+# endif
+#endif
+  const T b = T(T(1) << bit);
+  return word.fetch_or(b, std::memory_order_relaxed) & b;
+}
+
+template<typename T, typename Backoff, bool ProcessShared>
+void mutex_storage<T, Backoff, ProcessShared>::unlock_notify() noexcept
+{
+  ATOMIC_SYNC_PROBE(wake, this, PROBE_MUTEX);
+  notify_word<ProcessShared>(m, 1);
+}
+
+template<typename T, typename Backoff, bool ProcessShared>
+void mutex_storage<T, Backoff, ProcessShared>::lock_wait_registered(T lk)
+  noexcept
 {
-  T lk = WAITER + m.fetch_add(WAITER, std::memory_order_relaxed);
+  const probe_wait probe{this, PROBE_MUTEX};
   for (;;)
   {
     if (lk & HOLDER)
     {
-#if !defined _WIN32 && __cplusplus < 202002L /* Emulate the C++20 primitives */
-      this->wait(lk);
-#else
-      m.wait(lk);
-#endif
+      wait_word<ProcessShared>(m, lk);
 #if defined __i386__||defined __x86_64__||defined _M_IX86||defined _M_X64
     reload:
 #endif
@@ -60,15 +384,9 @@ void mutex_storage<T>::lock_wait() noexcept
 #if defined __i386__||defined __x86_64__||defined _M_IX86||defined _M_X64
     else
     {
-# ifdef _MSC_VER
-      static_assert(HOLDER == (1U << 0), "compatibility");
-      if (_interlockedbittestandset
-          (reinterpret_cast<volatile long*>(this), 0))
+      static_assert(HOLDER == 1, "compatibility");
+      if (bit_test_and_set(m, 0))
         goto reload;
-# else
-      if (m.fetch_or(HOLDER, std::memory_order_relaxed) & HOLDER)
-        goto reload;
-# endif
       std::atomic_thread_fence(std::memory_order_acquire);
       return;
     }
@@ -86,165 +404,1998 @@ void mutex_storage<T>::lock_wait() noexcept
   }
 }
 
-#ifdef __GNUC__
-__attribute__((noinline))
-#elif defined _MSC_VER
-__declspec(noinline)
+template<typename T, typename Backoff, bool ProcessShared>
+bool mutex_storage<T, Backoff, ProcessShared>::lock_wait_until
+  (std::chrono::steady_clock::time_point deadline,
+   bool (*cancel)(const void*), const void *ctx) noexcept
+{
+  const probe_wait probe{this, PROBE_MUTEX};
+  T lk = register_waiter();
+  for (bool timeout = false;; lk = m.load(std::memory_order_relaxed))
+  {
+    if (!(lk & HOLDER))
+    {
+      if (!(m.fetch_or(HOLDER, std::memory_order_relaxed) & HOLDER))
+      {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+      }
+    }
+    else if (timeout)
+      break;
+    else
+    {
+      if (cancel)
+      {
+        /* Order the load of lk before cancel(). If cancel() does not
+        hold yet, then lk cannot include the waiter that notify_cancel()
+        will register before waking us up. */
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (cancel(ctx))
+          break;
+      }
+      timeout = !wait_word_until<ProcessShared>(m, lk, deadline);
+    }
+  }
+
+  lk = m.fetch_sub(WAITER, std::memory_order_relaxed) - WAITER;
+  /* If the mutex was released while we were giving up, a notify_one()
+  may have been directed at us. Pass it on to the remaining waiters. */
+  if (lk && !(lk & HOLDER))
+    unlock_notify();
+  return false;
+}
+
+template<typename T, typename Backoff, bool ProcessShared>
+void mutex_storage<T, Backoff, ProcessShared>::notify_cancel() noexcept
+{
+  m.fetch_add(WAITER, std::memory_order_relaxed);
+  notify_word<ProcessShared>(m, INT_MAX);
+}
+
+template<typename T, typename Backoff, bool ProcessShared>
+void mutex_storage<T, Backoff, ProcessShared>::requeue
+  (std::atomic<uint32_t> &from, uint32_t val, uint32_t n) noexcept
+{
+  m.fetch_add(T(n * WAITER), std::memory_order_relaxed);
+#ifdef __linux__
+  /* Move all threads that are blocked on from, without waking any.
+  Those registered waiters that were not blocked yet will notice the
+  changed value of from and invoke lock_wait_registered(). Because the
+  caller is holding the mutex, its unlock() will wake up a waiter.
+  The threads cannot be moved to a 16-bit lock word, because they would
+  not be waiting for its futex_bitset(). If the syscall fails, the value
+  of from was changed by another thread. */
+  if (sizeof(T) == 4 &&
+      syscall(SYS_futex, &from, ProcessShared
+              ? FUTEX_CMP_REQUEUE : FUTEX_CMP_REQUEUE_PRIVATE,
+              0, long(INT_MAX), &futex_word(m), val) >= 0)
+    return;
+#else
+  (void) val;
 #endif
+  notify_word<ProcessShared>(from, INT_MAX);
+}
 
-/** Back off from the memory bus for a while. */
-static void spin_pause()
+bool atomic_wait_until(const std::atomic<uint32_t> &word, uint32_t old,
+                       std::chrono::steady_clock::time_point deadline,
+                       bool process_shared) noexcept
 {
-  /* Note: the optimal value may be ISA implementation dependent. */
-  for (int rounds = 5; rounds--; )
+  using namespace std::chrono;
+  auto now = steady_clock::now();
+  if (now >= deadline)
+    return false;
+#ifdef _WIN32
+  if (!process_shared)
   {
+    /* Round up to milliseconds; the C++20 std::atomic::notify_one() of
+    the Microsoft implementation invokes WakeByAddressSingle(). */
+    const auto ms = duration_cast<milliseconds>(deadline - now +
+                                                milliseconds(1) -
+                                                nanoseconds(1)).count();
+    WaitOnAddress(const_cast<std::atomic<uint32_t>*>(&word), &old,
+                  sizeof old, ms < INFINITE ? DWORD(ms) : INFINITE - 1);
+    return steady_clock::now() < deadline;
+  }
+#elif defined FUTEX_SHARED
+# ifndef USE_FUTEX
+  if (process_shared)
+# endif
+  {
+# if defined __linux__ || defined __FreeBSD__
+    const timespec ts = monotonic_timespec(deadline);
+#  ifdef __linux__
+    syscall(SYS_futex, &word, process_shared
+            ? FUTEX_WAIT_BITSET : FUTEX_WAIT_BITSET_PRIVATE,
+            old, &ts, nullptr, FUTEX_BITSET_MATCH_ANY);
+#  else
+    _umtx_time ut;
+    ut._timeout = ts;
+    ut._flags = UMTX_ABSTIME;
+    ut._clockid = CLOCK_MONOTONIC;
+    _umtx_op(const_cast<std::atomic<uint32_t>*>(&word), process_shared
+             ? UMTX_OP_WAIT_UINT : UMTX_OP_WAIT_UINT_PRIVATE, old,
+             reinterpret_cast<void*>(sizeof ut), &ut);
+#  endif
+# elif defined __OpenBSD__
+    const auto t = deadline - now;
+    const auto sec = duration_cast<seconds>(t);
+    timespec ts;
+    ts.tv_sec = time_t(sec.count());
+    ts.tv_nsec = long(duration_cast<nanoseconds>(t - sec).count());
+    futex((volatile uint32_t*) &word, FUTEX_WAIT, old, &ts, nullptr);
+# elif defined __DragonFly__
+    /* The timeout is in microseconds; 0 would mean an infinite wait. */
+    const auto us = duration_cast<microseconds>(deadline - now).count();
+    umtx_sleep((volatile int*) &word, int(old),
+               us < 1 ? 1 : us > 1000000 ? 1000000 : int(us));
+# elif defined __APPLE__
+    /* The timeout is in microseconds; 0 would mean an infinite wait. */
+    const auto us = duration_cast<microseconds>(deadline - now).count();
+    __ulock_wait(process_shared
+                 ? UL_COMPARE_AND_WAIT_SHARED : UL_COMPARE_AND_WAIT,
+                 const_cast<std::atomic<uint32_t>*>(&word), old,
+                 us < 1 ? 1 : us > UINT32_MAX ? UINT32_MAX : uint32_t(us));
+# endif
+    return steady_clock::now() < deadline;
+  }
+#endif
+  /* Poll the word with increasing intervals. std::atomic::notify_one()
+  might not wake up a thread that is blocked in the operating system
+  primitive; for example, in libstdc++ it would skip the system call if
+  the waiter was not registered in its table. Without FUTEX_SHARED,
+  there is no primitive for waiting across processes. */
+  (void) process_shared;
+  for (nanoseconds delay = microseconds(10);
+       word.load(std::memory_order_relaxed) == old;
+       delay = std::min<nanoseconds>(2 * delay, milliseconds(1)))
+  {
+    if (now >= deadline)
+      return false;
+    std::this_thread::sleep_for(std::min<nanoseconds>(delay, deadline - now));
+    now = steady_clock::now();
+  }
+  return true;
+}
+
+/** Hint to the processor that we are executing a spinloop. */
+static inline void cpu_relax()
+{
 #ifdef _WIN32
-    YieldProcessor();
+  YieldProcessor();
 #elif defined __GNUC__
 # ifdef _ARCH_PWR8
-    __builtin_ppc_get_timebase();
+  __builtin_ppc_get_timebase();
 # elif defined __i386__ || defined __x86_64__
-    __asm__ __volatile__ ("pause");
+  __asm__ __volatile__ ("pause");
+# elif defined __aarch64__
+  /* On many Arm cores, YIELD is a no-op; ISB actually takes some time. */
+  __asm__ __volatile__ ("isb" ::: "memory");
 # else
-    __asm__ __volatile__ ("":::"memory");
+  __asm__ __volatile__ ("":::"memory");
 # endif
 #endif
-  }
 }
 
-template<typename T>
-void mutex_storage<T>::spin_lock_wait(unsigned spin_rounds) noexcept
+#ifdef __GNUC__
+__attribute__((noinline))
+#elif defined _MSC_VER
+__declspec(noinline)
+#endif
+
+/** Back off from the memory bus for a while. */
+static void spin_pause()
 {
-  T lk = WAITER + m.fetch_add(WAITER, std::memory_order_relaxed);
+  /* Note: the optimal value may be ISA implementation dependent. */
+  for (int rounds = 5; rounds--; )
+    cpu_relax();
+}
 
-  /* We hope to avoid system calls when the conflict is resolved quickly. */
-  for (auto spin = spin_rounds;; spin_pause())
-  {
-    assert(~HOLDER & lk);
-    lk = m.load(std::memory_order_relaxed);
-    if (!(lk & HOLDER))
-    {
-#if defined __i386__||defined __x86_64__||defined _M_IX86||defined _M_X64
-      lk += HOLDER;
+#ifdef HAVE_WAITPKG_INTRINSICS
+/** @return whether the processor supports UMONITOR, UMWAIT, TPAUSE */
+static bool can_waitpkg()
+{
 # ifdef _MSC_VER
-      static_assert(HOLDER == (1U << 0), "compatibility");
-      if (!_interlockedbittestandset
-          (reinterpret_cast<volatile long*>(this), 0))
+  int regs[4];
+  __cpuid(regs, 0);
+  if (regs[0] < 7)
+    return false;
+  __cpuidex(regs, 7, 0);
+  return regs[2] & 1U << 5;
 # else
-      if (!(m.fetch_or(HOLDER, std::memory_order_relaxed) & HOLDER))
+  if (__get_cpuid_max(0, nullptr) < 7)
+    return false;
+  unsigned eax, ebx, ecx, edx;
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  return ecx & 1U << 5;
 # endif
-        goto acquired;
-#else
-      if (!((lk = m.fetch_or(HOLDER, std::memory_order_relaxed)) & HOLDER))
-        goto acquired;
-#endif
-    }
-    if (!--spin)
-      break;
-  }
+}
 
-  for (;;)
-  {
-    assert(~HOLDER & lk);
-    if (lk & HOLDER)
-    {
-#if !defined _WIN32 && __cplusplus < 202002L /* Emulate the C++20 primitives */
-      this->wait(lk);
-#else
-      m.wait(lk);
-#endif
-#if defined __i386__||defined __x86_64__||defined _M_IX86||defined _M_X64
-    reload:
-#endif
-      lk = m.load(std::memory_order_relaxed);
-    }
-    else
-    {
-#if defined __i386__||defined __x86_64__||defined _M_IX86||defined _M_X64
-# ifdef _MSC_VER
-      static_assert(HOLDER == (1U << 0), "compatibility");
-      if (_interlockedbittestandset
-          (reinterpret_cast<volatile long*>(this), 0))
-# else
-      if (m.fetch_or(HOLDER, std::memory_order_relaxed) & HOLDER)
-# endif
-        goto reload;
-#else
-      if ((lk = m.fetch_or(HOLDER, std::memory_order_relaxed)) & HOLDER)
-        continue;
-      else
-        assert(lk);
-#endif
-    acquired:
-      std::atomic_thread_fence(std::memory_order_acquire);
-      return;
-    }
-  }
+static const bool have_waitpkg = can_waitpkg();
+
+/** Time-stamp counter ticks for one monitor_backoff round */
+static constexpr uint64_t UMWAIT_TICKS = 2000;
+/** Time-stamp counter ticks for one exponential_backoff delay unit */
+static constexpr uint64_t TPAUSE_TICKS = 32;
+
+/** Wait in the C0.1 state (which provides a faster wake-up than C0.2)
+until a write to the cache line of the word, or for some time */
+HAVE_WAITPKG_INTRINSICS
+static void umwait(const void *word, uint32_t old) noexcept
+{
+  _umonitor(const_cast<void*>(word));
+  if (*static_cast<const volatile uint32_t*>(word) == old)
+    _umwait(1U, __rdtsc() + UMWAIT_TICKS);
 }
 
-template void mutex_storage<uint32_t>::lock_wait() noexcept;
-template void mutex_storage<uint32_t>::spin_lock_wait(unsigned) noexcept;
+/** Pause in the C0.1 state for some time */
+HAVE_WAITPKG_INTRINSICS
+static void tpause(unsigned units) noexcept
+{ _tpause(1U, __rdtsc() + units * TPAUSE_TICKS); }
+#endif
+
+template<typename T>
+void pause_backoff::operator()(const std::atomic<T> &, T) noexcept
+{ spin_pause(); }
+
+/** The maximum delay of exponential_backoff, in cpu_relax() units */
+static constexpr unsigned EXPONENTIAL_BACKOFF_MAX = 64;
 
 template<typename T>
-void shared_mutex_storage<T>::lock_inner_wait(T lk) noexcept
+void exponential_backoff::operator()(const std::atomic<T> &, T) noexcept
 {
-  assert(!(lk & X));
-  lk |= X;
+  /* A xorshift generator is good enough for desynchronizing threads. */
+  static thread_local uint32_t seed;
+  uint32_t x = seed;
+  if (!x)
+    x = uint32_t(uintptr_t(&seed)) | 1;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  seed = x;
 
-  do
+  /* Pick a random delay between delay/2 and delay. */
+  const unsigned half = delay / 2;
+  unsigned units = delay - half + x % (half + 1);
+  if (delay < EXPONENTIAL_BACKOFF_MAX)
+    delay *= 2;
+
+#ifdef HAVE_WAITPKG_INTRINSICS
+  if (have_waitpkg)
   {
-    assert(lk & X);
-#if !defined _WIN32 && __cplusplus < 202002L /* Emulate the C++20 primitives */
-    FUTEX(WAIT, &inner, lk);
-#else
-    inner.wait(lk);
-#endif
-    lk = inner.load(std::memory_order_acquire);
+    tpause(units);
+    return;
   }
-  while (lk != X);
+#endif
+  while (units--)
+    cpu_relax();
 }
 
-template
-void shared_mutex_storage<uint32_t>::lock_inner_wait(uint32_t) noexcept;
-
 template<typename T>
-void shared_mutex_storage<T>::shared_lock_wait() noexcept
+void monitor_backoff::operator()(const std::atomic<T> &word, T old) noexcept
 {
-  lock_outer();
-#ifndef NDEBUG
-  type lk =
+  static_assert(sizeof word == sizeof old, "compatibility");
+#ifdef HAVE_WAITPKG_INTRINSICS
+  if (sizeof word == 4 && have_waitpkg)
+  {
+    umwait(&word, uint32_t(old));
+    return;
+  }
+#elif defined __aarch64__ && defined __GNUC__
+  if (sizeof word == 4)
+  {
+    /* Arm the exclusive monitor on the cache line, and wait for an event.
+    A write to the cache line by another processor will clear the
+    monitor and generate an event. On Linux, the kernel enables a
+    periodic event stream, which limits the duration of the WFE. First,
+    clear any pending event by SEVL and WFE. */
+    uint32_t w;
+    __asm__ __volatile__ ("sevl\n\twfe\n\tldxr %w0, [%1]"
+                          : "=&r"(w) : "r"(&word) : "memory");
+    if (w == uint32_t(old))
+      __asm__ __volatile__ ("wfe" ::: "memory");
+    return;
+  }
 #endif
-    inner.fetch_add(WAITER, std::memory_order_acquire);
-  unlock_outer();
-  assert(!(lk & X));
+  spin_pause();
 }
 
-template
-void shared_mutex_storage<uint32_t>::shared_lock_wait() noexcept;
+/* Adaptive spinning.
 
-template<typename T>
-void shared_mutex_storage<T>::spin_shared_lock_wait(unsigned spin_rounds)
-  noexcept
+Spinning only pays off if the lock is typically released within a
+fraction of the time that a wait() and notify_one() round trip would
+take. For each lock, we keep an estimate of the number of spin_pause()
+rounds that spin_lock_wait() or spin_shared_lock_wait() needed in
+order to succeed, decaying towards 0 whenever the spinning was in vain.
+In order to not grow the 4-byte lock, the estimates are stored in a
+small table that is indexed by a hash of the lock address. Unrelated
+locks that hash to the same slot will simply share an estimate. Each
+slot occupies a cache line of its own, so that the updates of the
+estimate of one hot lock will not slow down the spinning on another.
+
+The spin budget is defined in nanoseconds and converted into
+spin_pause() rounds by a calibration on the first use, because the
+latency of the PAUSE instruction varies by an order of magnitude
+between microarchitectures. */
+
+/** Spin budget before any feedback is available, in nanoseconds */
+static constexpr unsigned SPIN_NS_DEFAULT = 1000;
+/** Maximum spin budget, in nanoseconds */
+static constexpr unsigned SPIN_NS_MAX = 10000;
+/** Minimum number of spin_pause() rounds */
+static constexpr unsigned SPIN_ROUNDS_MIN = 2;
+/** log2 of the number of slots in spin_estimate[] */
+static constexpr unsigned SPIN_SLOTS_LOG2 = 8;
+
+/** A spin estimate in a cache line of its own (the assumed size is like
+CACHE_LINE_SIZE in atomic_lock_array.h) */
+struct
+#if defined __s390x__
+alignas(256)
+#elif defined __powerpc64__ || defined __aarch64__ && defined __APPLE__
+alignas(128)
+#else
+alignas(64)
+#endif
+spin_estimate_slot
 {
-  /* We hope to avoid system calls when the conflict is resolved quickly. */
-  for (auto spin = spin_rounds;; spin_pause())
-  {
-    if (shared_lock_inner())
-      return;
-    if (--spin)
-      break;
-  }
+  /** Estimated number of needed spin rounds, multiplied by 8, plus 1;
+  0 if no feedback has been collected yet */
+  std::atomic<uint32_t> estimate;
+};
 
-  shared_lock_wait();
+/** The spin estimates of the locks that map to each slot */
+static spin_estimate_slot spin_estimate[1U << SPIN_SLOTS_LOG2];
+
+/** @return the spin_estimate[] slot of a lock */
+static std::atomic<uint32_t> &spin_slot(const void *lock) noexcept
+{
+  /* Fibonacci hashing; the 2 least significant bits are always 0. */
+  return spin_estimate[uint64_t(uintptr_t(lock) >> 2) *
+                       0x9E3779B97F4A7C15ULL >> (64 - SPIN_SLOTS_LOG2)].
+    estimate;
 }
 
-template
-void shared_mutex_storage<uint32_t>::spin_shared_lock_wait(unsigned) noexcept;
+/** @return the duration of a spin_pause() in nanoseconds (at least 1) */
+static unsigned spin_pause_ns() noexcept
+{
+  static std::atomic<unsigned> ns;
+  unsigned n = ns.load(std::memory_order_relaxed);
+  if (n)
+    return n;
 
-#if !defined _WIN32 && __cplusplus < 202002L /* Emulate the C++20 primitives */
-template<typename T>
-void shared_mutex_storage<T>::shared_unlock_inner_notify() noexcept
-{FUTEX(WAKE, &inner, 1);}
-template
-void shared_mutex_storage<uint32_t>::shared_unlock_inner_notify() noexcept;
+  /* Concurrent calibration by multiple threads is harmless. Take the
+  fastest of a few measurements so that preemption will not matter much. */
+  using namespace std::chrono;
+  constexpr unsigned ROUNDS = 256;
+  auto best = nanoseconds::max();
+  for (unsigned i = 3; i--; )
+  {
+    const auto start = steady_clock::now();
+    for (unsigned j = ROUNDS; j--; )
+      spin_pause();
+    const nanoseconds d = steady_clock::now() - start;
+    if (d < best)
+      best = d;
+  }
+  n = unsigned(best.count() / ROUNDS);
+  if (!n)
+    n = 1;
+  ns.store(n, std::memory_order_relaxed);
+  return n;
+}
+
+/** @return number of spin_pause() rounds corresponding to SPIN_NS_DEFAULT */
+static unsigned spin_rounds_default() noexcept
+{
+  const unsigned rounds = SPIN_NS_DEFAULT / spin_pause_ns();
+  return rounds > SPIN_ROUNDS_MIN ? rounds : SPIN_ROUNDS_MIN;
+}
+
+/** @return the adaptive spin budget for a lock, in spin_pause() rounds */
+static unsigned spin_budget(const void *lock) noexcept
+{
+  const uint32_t est = spin_slot(lock).load(std::memory_order_relaxed);
+  if (!est)
+    return spin_rounds_default();
+  const unsigned max_rounds = SPIN_NS_MAX / spin_pause_ns();
+  /* Allow twice the estimate, to catch most of the distribution. */
+  const unsigned rounds = 2 * ((est - 1) / 8) + SPIN_ROUNDS_MIN;
+  return rounds < max_rounds ? rounds : max_rounds;
+}
+
+/** Update the spin estimate of a lock.
+@param lock   the lock
+@param spun   number of rounds until the lock was acquired, or 0 if
+              the spinloop gave up */
+static void spin_feedback(const void *lock, unsigned spun) noexcept
+{
+  auto &slot = spin_slot(lock);
+  const uint32_t est = slot.load(std::memory_order_relaxed);
+  const unsigned max_rounds = SPIN_NS_MAX / spin_pause_ns();
+  if (spun > max_rounds)
+    spun = max_rounds;
+  /* An exponential moving average, with weight 1/8 for the new sample */
+  int32_t avg = est
+    ? int32_t(est - 1)
+    : int32_t(4 * (spin_rounds_default() - SPIN_ROUNDS_MIN));
+  avg += (int32_t(8 * spun) - avg) / 8;
+  const uint32_t new_est = uint32_t(avg) + 1;
+  /* Avoid needless writes, for other threads that spin on the lock. */
+  if (new_est != est)
+    slot.store(new_est, std::memory_order_relaxed);
+}
+
+template<typename T, typename Backoff, bool ProcessShared>
+unsigned mutex_storage<T, Backoff, ProcessShared>::default_spin_rounds()
+  const noexcept
+{ return spin_budget(this); }
+
+template<typename T, typename Backoff, bool ProcessShared>
+bool mutex_storage<T, Backoff, ProcessShared>::spin_lock_registered
+  (T &lk, unsigned spin_rounds) noexcept
+{
+  Backoff backoff;
+
+  /* We hope to avoid system calls when the conflict is resolved quickly. */
+  for (auto spin = spin_rounds; spin; spin--)
+  {
+    assert(~HOLDER & lk);
+    lk = m.load(std::memory_order_relaxed);
+    if (!(lk & HOLDER))
+    {
+#if defined __i386__||defined __x86_64__||defined _M_IX86||defined _M_X64
+      lk += HOLDER;
+      static_assert(HOLDER == 1, "compatibility");
+      if (!bit_test_and_set(m, 0))
+#else
+      if (!((lk = m.fetch_or(HOLDER, std::memory_order_relaxed)) & HOLDER))
+#endif
+      {
+        spin_feedback(this, spin_rounds - spin + 1);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+      }
+    }
+    backoff(m, lk);
+  }
+
+  ATOMIC_SYNC_PROBE(spin__fail, this, PROBE_MUTEX);
+  spin_feedback(this, 0);
+  return false;
+}
+
+/** Set the UPGRADER flag while holding a shared lock, unless an
+exclusive lock request is pending. A pending exclusive lock request is
+holding the outer lock while waiting for all shared locks to be released;
+the UPGRADER flag makes it wake up any waiters for the outer lock by
+notify_cancel().
+@param inner     the inner lock word
+@param X         the exclusive lock flag of inner
+@param UPGRADER  the flag of waiting for the upgrade
+@return whether the flag is set and X was not set */
+template<typename T>
+static bool register_upgrader(std::atomic<T> &inner, T X, T UPGRADER)
+  noexcept
+{
+  T lk = inner.load(std::memory_order_relaxed);
+  while (!(lk & UPGRADER))
+  {
+    if (lk & X)
+      return false;
+    if (inner.compare_exchange_weak(lk, T(lk | UPGRADER),
+                                    std::memory_order_relaxed,
+                                    std::memory_order_relaxed))
+      break;
+  }
+  return true;
+}
+
+/** Clear the UPGRADER flag after upgrade_outer_until() acquired the outer
+lock or gave up, unless an exclusive lock request is pending (it will
+clear the flag) or other threads may be waiting for the outer lock (any
+of them may be an upgrade that relies on the flag). A waiting upgrade
+sets the flag again in cancel_upgrade(), after registering as a waiter.
+The memory barriers ensure that at least one of us will notice the other.
+@param inner     the inner lock word
+@param X         the exclusive lock flag of inner
+@param UPGRADER  the flag of waiting for the upgrade
+@param waiting   a check whether other threads may be waiting for the
+                 outer lock, invoked after clearing the flag */
+template<typename T, typename Waiting>
+static void unregister_upgrader(std::atomic<T> &inner, T X, T UPGRADER,
+                                const Waiting &waiting) noexcept
+{
+  T lk = inner.load(std::memory_order_relaxed);
+  while ((lk & (X | UPGRADER)) == UPGRADER)
+  {
+    if (inner.compare_exchange_weak(lk, T(lk & ~UPGRADER),
+                                    std::memory_order_relaxed,
+                                    std::memory_order_relaxed))
+    {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (waiting())
+        register_upgrader(inner, X, UPGRADER);
+      return;
+    }
+  }
+}
+
+/** @return whether others than the holder may be waiting for a mutex */
+template<typename Storage>
+static bool others_waiting(const Storage &outer) noexcept
+{ return outer.is_locked_or_waiting() && !outer.is_locked_not_waiting(); }
+
+template<typename T, typename Backoff, bool ProcessShared>
+bool shared_mutex_storage<T, Backoff, ProcessShared>::cancel_upgrade
+  (const void *ctx) noexcept
+{
+  /* Pair with unregister_upgrader(): order our registration as a waiter
+  of the outer lock before the load of the UPGRADER flag. */
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  shared_mutex_storage *s = const_cast<shared_mutex_storage*>
+    (static_cast<const shared_mutex_storage*>(ctx));
+  return !register_upgrader(s->inner, X, UPGRADER);
+}
+
+template<typename T, typename Backoff, bool ProcessShared>
+bool shared_mutex_storage<T, Backoff, ProcessShared>::upgrade_outer_until
+  (std::chrono::steady_clock::time_point deadline) noexcept
+{
+  if (outer.try_lock())
+    return true;
+  if (!register_upgrader(inner, X, UPGRADER))
+    return false;
+  const bool locked = outer.try_lock_until(deadline, cancel_upgrade, this);
+  unregister_upgrader(inner, X, UPGRADER, [this]
+                      { return others_waiting(outer.get_storage()); });
+  return locked;
+}
+
+template<typename T, typename Backoff, bool ProcessShared>
+void shared_mutex_storage<T, Backoff, ProcessShared>::lock_inner_wait(T lk)
+  noexcept
+{
+  const probe_wait probe{this, PROBE_EXCLUSIVE};
+  assert(!(lk & X));
+  lk |= X;
+  const bool upgrader = lk & UPGRADER;
+  if (upgrader)
+  {
+    /* Wake up upgrade_outer_until(), which would be waiting for the
+    outer lock that we are holding. */
+    lk = inner.fetch_sub(UPGRADER, std::memory_order_acquire) - UPGRADER;
+    outer.notify_cancel();
+  }
+
+  while (lk != X)
+  {
+    assert(lk & X);
+    wait_word<ProcessShared>(inner, lk);
+    lk = inner.load(std::memory_order_acquire);
+  }
+
+  if (upgrader)
+    outer.notify_cancel_done();
+}
+
+template<typename T, typename Backoff, bool ProcessShared>
+void shared_mutex_storage<T, Backoff, ProcessShared>::shared_lock_wait()
+  noexcept
+{
+  const probe_wait probe{this, PROBE_SHARED};
+  lock_outer();
+#ifndef NDEBUG
+  type lk =
+#endif
+    inner.fetch_add(WAITER, std::memory_order_acquire);
+  unlock_outer();
+  assert(!(lk & X));
+}
+
+template<typename T, typename Backoff, bool ProcessShared>
+bool shared_mutex_storage<T, Backoff, ProcessShared>::lock_inner_wait_until
+  (T lk, std::chrono::steady_clock::time_point deadline) noexcept
+{
+  const probe_wait probe{this, PROBE_EXCLUSIVE};
+  assert(!(lk & X));
+  lk |= X;
+  const bool upgrader = lk & UPGRADER;
+  if (upgrader)
+  {
+    /* See lock_inner_wait() */
+    lk = inner.fetch_sub(UPGRADER, std::memory_order_acquire) - UPGRADER;
+    outer.notify_cancel();
+  }
+
+  bool acquired = true;
+  while (lk != X)
+  {
+    assert(lk & X);
+    if (!atomic_wait_until(inner, lk, deadline, ProcessShared))
+    {
+      if (inner.load(std::memory_order_acquire) == X)
+        break;
+      /* Withdraw the request. Any lock_shared() that is blocked by
+      it is waiting in lock_outer(), which our caller will release. */
+#ifndef NDEBUG
+      lk =
+#endif
+        inner.fetch_sub(X, std::memory_order_relaxed);
+      assert(lk & X);
+      acquired = false;
+      break;
+    }
+    lk = inner.load(std::memory_order_acquire);
+  }
+
+  if (upgrader)
+    outer.notify_cancel_done();
+  return acquired;
+}
+
+template<typename T, typename Backoff, bool ProcessShared>
+bool shared_mutex_storage<T, Backoff, ProcessShared>::shared_lock_wait_until
+  (std::chrono::steady_clock::time_point deadline) noexcept
+{
+  const probe_wait probe{this, PROBE_SHARED};
+  if (!lock_outer_until(deadline))
+    return false;
+#ifndef NDEBUG
+  type lk =
+#endif
+    inner.fetch_add(WAITER, std::memory_order_acquire);
+  unlock_outer();
+  assert(!(lk & X));
+  return true;
+}
+
+template<typename T, typename Backoff, bool ProcessShared>
+unsigned shared_mutex_storage<T, Backoff, ProcessShared>::default_spin_rounds()
+  const noexcept
+{ return spin_budget(&outer.get_storage()); }
+
+template<typename T, typename Backoff, bool ProcessShared>
+bool shared_mutex_storage<T, Backoff, ProcessShared>::spin_shared_lock_inner
+  (unsigned spin_rounds) noexcept
+{
+  Backoff backoff;
+
+  /* We hope to avoid system calls when the conflict is resolved quickly. */
+  for (auto spin = spin_rounds; spin; spin--)
+  {
+    if (shared_lock_inner())
+    {
+      spin_feedback(&outer.get_storage(), spin_rounds - spin + 1);
+      return true;
+    }
+    backoff(inner, inner.load(std::memory_order_relaxed));
+  }
+
+  ATOMIC_SYNC_PROBE(spin__fail, this, PROBE_SHARED);
+  spin_feedback(&outer.get_storage(), 0);
+  return false;
+}
+
+template<typename T, typename Backoff, bool ProcessShared>
+void shared_mutex_storage<T, Backoff, ProcessShared>::
+shared_unlock_inner_notify() noexcept
+{
+  ATOMIC_SYNC_PROBE(wake, this, PROBE_EXCLUSIVE);
+  notify_word<ProcessShared>(inner, 1);
+}
+
+/* shared_mutex_storage<uint64_t>: the outer mutex is waited on in the
+most significant half of the word, and a pending exclusive lock request
+in the least significant half. */
+
+template<typename Backoff, bool ProcessShared>
+unsigned shared_mutex_storage<uint64_t, Backoff, ProcessShared>::
+default_spin_rounds() const noexcept
+{ return spin_budget(this); }
+
+template<typename Backoff, bool ProcessShared>
+void shared_mutex_storage<uint64_t, Backoff, ProcessShared>::
+lock_outer_registered(type lk) noexcept
+{
+  std::atomic<uint32_t> &outer = half_word(word, 32);
+  const probe_wait probe{&outer, PROBE_MUTEX};
+  for (;;)
+  {
+    if (lk & HOLDER)
+      wait_word<ProcessShared>(outer, uint32_t(lk >> 32));
+    else if (!bit_test_and_set(word, 32))
+    {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return;
+    }
+    lk = word.load(std::memory_order_relaxed);
+  }
+}
+
+template<typename Backoff, bool ProcessShared>
+void shared_mutex_storage<uint64_t, Backoff, ProcessShared>::
+spin_lock_outer_wait(unsigned spin_rounds) noexcept
+{
+  type lk = word.fetch_add(OUTER_WAITER, std::memory_order_relaxed) +
+    OUTER_WAITER;
+  Backoff backoff;
+
+  /* We hope to avoid system calls when the conflict is resolved quickly. */
+  for (auto spin = spin_rounds; spin; spin--)
+  {
+    lk = word.load(std::memory_order_relaxed);
+    if (!(lk & HOLDER) && !bit_test_and_set(word, 32))
+    {
+      spin_feedback(this, spin_rounds - spin + 1);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return;
+    }
+    backoff(word, lk);
+  }
+
+  ATOMIC_SYNC_PROBE(spin__fail, &half_word(word, 32), PROBE_MUTEX);
+  spin_feedback(this, 0);
+  lock_outer_registered(lk);
+}
+
+template<typename Backoff, bool ProcessShared>
+bool shared_mutex_storage<uint64_t, Backoff, ProcessShared>::
+lock_outer_wait_until(std::chrono::steady_clock::time_point deadline,
+                      bool upgrade) noexcept
+{
+  std::atomic<uint32_t> &outer = half_word(word, 32);
+  const probe_wait probe{&outer, PROBE_MUTEX};
+  type lk = word.fetch_add(OUTER_WAITER, std::memory_order_relaxed) +
+    OUTER_WAITER;
+  for (bool timeout = false;; lk = word.load(std::memory_order_relaxed))
+  {
+    if (!(lk & HOLDER))
+    {
+      if (!bit_test_and_set(word, 32))
+      {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+      }
+    }
+    /* Before X is set, the notify_cancel() equivalent in
+    lock_inner_wait() cannot have registered in the outer half of lk. */
+    else if (timeout || (upgrade && lk & X))
+      break;
+    else if (upgrade && !(lk & UPGRADER))
+      /* Another upgrade cleared the flag after acquiring the outer half
+      or giving up; set it again, so that lock_inner_wait() will wake
+      us up. */
+      word.compare_exchange_weak(lk, lk | UPGRADER,
+                                 std::memory_order_relaxed,
+                                 std::memory_order_relaxed);
+    else
+      timeout = !wait_word_until<ProcessShared>(outer, uint32_t(lk >> 32),
+                                                deadline);
+  }
+
+  lk = word.fetch_sub(OUTER_WAITER, std::memory_order_relaxed) -
+    OUTER_WAITER;
+  /* If the mutex was released while we were giving up, a notify_one()
+  may have been directed at us. Pass it on to the remaining waiters. */
+  if (lk > INNER && !(lk & HOLDER))
+    unlock_outer_notify();
+  return false;
+}
+
+template<typename Backoff, bool ProcessShared>
+void shared_mutex_storage<uint64_t, Backoff, ProcessShared>::
+unlock_outer_notify() noexcept
+{
+  std::atomic<uint32_t> &outer = half_word(word, 32);
+  ATOMIC_SYNC_PROBE(wake, &outer, PROBE_MUTEX);
+  notify_word<ProcessShared>(outer, 1);
+}
+
+template<typename Backoff, bool ProcessShared>
+bool shared_mutex_storage<uint64_t, Backoff, ProcessShared>::
+upgrade_outer_until(std::chrono::steady_clock::time_point deadline) noexcept
+{
+  if (try_lock_outer())
+    return true;
+  if (!register_upgrader(word, X, UPGRADER))
+    return false;
+  const bool locked = lock_outer_wait_until(deadline, true);
+  /* Clear the UPGRADER flag, unless an exclusive lock request is pending
+  or others than the holder may be waiting for the outer half. A waiting
+  upgrade would set the flag again in lock_outer_wait_until(). */
+  for (type lk = word.load(std::memory_order_relaxed);
+       (lk & (X | UPGRADER)) == UPGRADER &&
+         ((lk & ~INNER) == 0 || (lk & ~INNER) == HOLDER + OUTER_WAITER); )
+    if (word.compare_exchange_weak(lk, lk - UPGRADER,
+                                   std::memory_order_relaxed,
+                                   std::memory_order_relaxed))
+      break;
+  return locked;
+}
+
+template<typename Backoff, bool ProcessShared>
+void shared_mutex_storage<uint64_t, Backoff, ProcessShared>::
+lock_inner_wait(type lk) noexcept
+{
+  const probe_wait probe{this, PROBE_EXCLUSIVE};
+  assert(!(lk & X));
+  lk |= X;
+  std::atomic<uint32_t> &inner = half_word(word, 0);
+  const bool upgrader = lk & UPGRADER;
+  if (upgrader)
+  {
+    /* Wake up upgrade_outer_until(), which would be waiting for the
+    outer half that we are holding. Registering a waiter changes the
+    outer half, so that the wake-up cannot be missed. */
+    lk = (word.fetch_add(OUTER_WAITER - UPGRADER,
+                         std::memory_order_acquire) - UPGRADER) & INNER;
+    notify_word<ProcessShared>(half_word(word, 32), INT_MAX);
+  }
+
+  while (lk != X)
+  {
+    assert(lk & X);
+    wait_word<ProcessShared>(inner, uint32_t(lk));
+    lk = word.load(std::memory_order_acquire) & INNER;
+  }
+
+  if (upgrader)
+    word.fetch_sub(OUTER_WAITER, std::memory_order_relaxed);
+}
+
+template<typename Backoff, bool ProcessShared>
+bool shared_mutex_storage<uint64_t, Backoff, ProcessShared>::
+lock_inner_wait_until(type lk, std::chrono::steady_clock::time_point deadline)
+  noexcept
+{
+  const probe_wait probe{this, PROBE_EXCLUSIVE};
+  assert(!(lk & X));
+  lk |= X;
+  std::atomic<uint32_t> &inner = half_word(word, 0);
+  const bool upgrader = lk & UPGRADER;
+  if (upgrader)
+  {
+    /* See lock_inner_wait() */
+    lk = (word.fetch_add(OUTER_WAITER - UPGRADER,
+                         std::memory_order_acquire) - UPGRADER) & INNER;
+    notify_word<ProcessShared>(half_word(word, 32), INT_MAX);
+  }
+
+  bool acquired = true;
+  while (lk != X)
+  {
+    assert(lk & X);
+    if (!atomic_wait_until(inner, uint32_t(lk), deadline, ProcessShared))
+    {
+      if ((word.load(std::memory_order_acquire) & INNER) == X)
+        break;
+      /* Withdraw the request. Any lock_shared() that is blocked by
+      it is waiting in lock_outer(), which our caller will release. */
+#ifndef NDEBUG
+      lk =
+#endif
+        word.fetch_sub(X, std::memory_order_relaxed);
+      assert(lk & X);
+      acquired = false;
+      break;
+    }
+    lk = word.load(std::memory_order_acquire) & INNER;
+  }
+
+  if (upgrader)
+    word.fetch_sub(OUTER_WAITER, std::memory_order_relaxed);
+  return acquired;
+}
+
+template<typename Backoff, bool ProcessShared>
+void shared_mutex_storage<uint64_t, Backoff, ProcessShared>::
+shared_lock_wait() noexcept
+{
+  const probe_wait probe{this, PROBE_SHARED};
+  lock_outer();
+#ifndef NDEBUG
+  type lk =
+#endif
+    word.fetch_add(WAITER, std::memory_order_acquire);
+  unlock_outer();
+  assert(!(lk & X));
+}
+
+template<typename Backoff, bool ProcessShared>
+bool shared_mutex_storage<uint64_t, Backoff, ProcessShared>::
+shared_lock_wait_until(std::chrono::steady_clock::time_point deadline)
+  noexcept
+{
+  const probe_wait probe{this, PROBE_SHARED};
+  if (!lock_outer_until(deadline))
+    return false;
+#ifndef NDEBUG
+  type lk =
+#endif
+    word.fetch_add(WAITER, std::memory_order_acquire);
+  unlock_outer();
+  assert(!(lk & X));
+  return true;
+}
+
+template<typename Backoff, bool ProcessShared>
+bool shared_mutex_storage<uint64_t, Backoff, ProcessShared>::
+spin_shared_lock_inner(unsigned spin_rounds) noexcept
+{
+  Backoff backoff;
+
+  for (auto spin = spin_rounds; spin; spin--)
+  {
+    if (shared_lock_inner())
+    {
+      spin_feedback(this, spin_rounds - spin + 1);
+      return true;
+    }
+    backoff(word, word.load(std::memory_order_relaxed));
+  }
+
+  ATOMIC_SYNC_PROBE(spin__fail, this, PROBE_SHARED);
+  spin_feedback(this, 0);
+  return false;
+}
+
+template<typename Backoff, bool ProcessShared>
+void shared_mutex_storage<uint64_t, Backoff, ProcessShared>::
+shared_unlock_inner_notify() noexcept
+{
+  ATOMIC_SYNC_PROBE(wake, this, PROBE_EXCLUSIVE);
+  notify_word<ProcessShared>(half_word(word, 0), 1);
+}
+
+template<typename T, typename Backoff, bool ProcessShared>
+void batched_shared_mutex_storage<T, Backoff, ProcessShared>::
+wake_readers_notify() noexcept
+{
+  ATOMIC_SYNC_PROBE(wake, this, PROBE_SHARED);
+  /* Only the holder of the X lock clears the WAITING flag. */
+  wake.fetch_add(WAITING, std::memory_order_relaxed);
+  notify_word<ProcessShared>(wake, INT_MAX);
+}
+
+template<typename T, typename Backoff, bool ProcessShared>
+void batched_shared_mutex_storage<T, Backoff, ProcessShared>::
+shared_lock_wait() noexcept
+{
+  const probe_wait probe{this, PROBE_SHARED};
+  for (;;)
+  {
+    /* Pair with unlock_inner(). */
+    const type w = wake.fetch_or(WAITING) | WAITING;
+    type lk = inner.load();
+    while (!(lk & X))
+      if (inner.compare_exchange_weak(lk, lk + base::WAITER,
+                                      std::memory_order_acquire,
+                                      std::memory_order_relaxed))
+        return;
+    wait_word<ProcessShared>(wake, w);
+  }
+}
+
+template<typename T, typename Backoff, bool ProcessShared>
+bool batched_shared_mutex_storage<T, Backoff, ProcessShared>::
+shared_lock_wait_until(std::chrono::steady_clock::time_point deadline)
+  noexcept
+{
+  const probe_wait probe{this, PROBE_SHARED};
+  for (;;)
+  {
+    const type w = wake.fetch_or(WAITING) | WAITING;
+    type lk = inner.load();
+    while (!(lk & X))
+      if (inner.compare_exchange_weak(lk, lk + base::WAITER,
+                                      std::memory_order_acquire,
+                                      std::memory_order_relaxed))
+        return true;
+    if (!atomic_wait_until(wake, w, deadline, ProcessShared))
+      return base::shared_lock_inner();
+  }
+}
+
+template<typename Backoff>
+unsigned queued_mutex_storage<Backoff>::default_spin_rounds() const noexcept
+{ return spin_budget(this); }
+
+template<typename Backoff>
+bool queued_mutex_storage<Backoff>::enqueue(waiter &w) noexcept
+{
+  w.next.store(nullptr, std::memory_order_relaxed);
+  w.state.store(waiter::WAITING, std::memory_order_relaxed);
+  link *prev = tail.exchange(&w, std::memory_order_acq_rel);
+  if (!prev)
+    return true;
+  prev->next.store(&w, std::memory_order_release);
+  return false;
+}
+
+template<typename Backoff>
+void queued_mutex_storage<Backoff>::dequeue(waiter &w) noexcept
+{
+  link *next = w.next.load(std::memory_order_acquire);
+  if (!next)
+  {
+    head.next.store(nullptr, std::memory_order_relaxed);
+    link *t = &w;
+    /* Pair with the exchange() in enqueue(), so that a subsequent waiter
+    will write head.next after us. */
+    if (tail.compare_exchange_strong(t, &head, std::memory_order_release,
+                                     std::memory_order_relaxed))
+      return;
+    /* A waiter is being appended after us. */
+    while (!(next = w.next.load(std::memory_order_acquire)))
+      spin_pause();
+  }
+  head.next.store(next, std::memory_order_relaxed);
+}
+
+template<typename Backoff>
+void queued_mutex_storage<Backoff>::wait(waiter &w) noexcept
+{
+  uint32_t state = waiter::WAITING;
+  if (w.state.compare_exchange_strong(state, waiter::SLEEPING,
+                                      std::memory_order_acquire))
+  {
+    for (state = waiter::SLEEPING; state != waiter::GRANTED;
+         state = w.state.load(std::memory_order_acquire))
+    {
+      private_wait(w.state, waiter::SLEEPING);
+    }
+  }
+  assert(state == waiter::GRANTED);
+}
+
+template<typename Backoff>
+void queued_mutex_storage<Backoff>::lock_wait() noexcept
+{
+  const probe_wait probe{this, PROBE_MUTEX};
+  waiter w;
+  if (!enqueue(w))
+    wait(w);
+  dequeue(w);
+}
+
+template<typename Backoff>
+void queued_mutex_storage<Backoff>::spin_lock_wait(unsigned spin_rounds)
+  noexcept
+{
+  const probe_wait probe{this, PROBE_MUTEX};
+  waiter w;
+  if (!enqueue(w))
+  {
+    Backoff backoff;
+    /* Spin on our own cache line until the mutex is handed over. */
+    for (auto spin = spin_rounds;; spin--)
+    {
+      if (!spin)
+      {
+        ATOMIC_SYNC_PROBE(spin__fail, this, PROBE_MUTEX);
+        spin_feedback(this, 0);
+        wait(w);
+        break;
+      }
+      if (w.state.load(std::memory_order_acquire) == waiter::GRANTED)
+      {
+        spin_feedback(this, spin_rounds - spin + 1);
+        break;
+      }
+      backoff(w.state, uint32_t{waiter::WAITING});
+    }
+  }
+  dequeue(w);
+}
+
+template<typename Backoff>
+bool queued_mutex_storage<Backoff>::lock_wait_until
+  (std::chrono::steady_clock::time_point deadline) noexcept
+{
+  const probe_wait probe{this, PROBE_MUTEX};
+  using namespace std::chrono;
+  for (nanoseconds delay = microseconds(10);;
+       delay = std::min<nanoseconds>(2 * delay, milliseconds(1)))
+  {
+    const auto now = steady_clock::now();
+    if (now >= deadline)
+      return false;
+    std::this_thread::sleep_for(std::min<nanoseconds>(delay, deadline - now));
+    if (lock_impl())
+      return true;
+  }
+}
+
+template<typename Backoff>
+void queued_mutex_storage<Backoff>::requeue(std::atomic<uint32_t> &from,
+                                            uint32_t, uint32_t) noexcept
+{
+  private_notify(from, INT_MAX);
+}
+
+template<typename Backoff>
+void queued_mutex_storage<Backoff>::unlock_notify() noexcept
+{
+  ATOMIC_SYNC_PROBE(wake, this, PROBE_MUTEX);
+  link *next;
+  /* A waiter is being appended after us. */
+  while (!(next = head.next.load(std::memory_order_acquire)))
+    spin_pause();
+  waiter &w = static_cast<waiter&>(*next);
+  if (w.state.exchange(waiter::GRANTED, std::memory_order_release) ==
+      waiter::SLEEPING)
+  {
+    /* The waiter may already have returned from lock(), so that w
+    is no longer valid. The system calls that wake up waiters by address
+    are not affected by that, and neither is std::atomic::notify_one()
+    in the known implementations, because they do not access the word. */
+    private_notify(w.state, 1);
+  }
+}
+
+template<typename T>
+void bit_lock_wait(std::atomic<T> &word, unsigned bit) noexcept
+{
+  const T lock_bits = T(3) << bit;
+  std::atomic<uint32_t> &half = half_word(word, bit);
+  const unsigned shift = bit & ~31U;
+
+  /* Acquire the mutex with the WAITER bit set, because other threads may
+  be waiting and there is no count of them. */
+  for (T w; (w = word.fetch_or(lock_bits, std::memory_order_acquire)) &
+         (T(1) << bit); )
+    private_wait(half, uint32_t((w | lock_bits) >> shift));
+}
+
+template<typename T>
+void bit_lock_notify(std::atomic<T> &word, unsigned bit) noexcept
+{ private_notify(half_word(word, bit), 1); }
+
+/* The parking lot */
+
+/** A thread that is waiting in parking_lot_park() */
+struct parked_thread
+{
+  /** the address that the thread is parked on */
+  const void *addr;
+  /** the next thread in the same bucket */
+  parked_thread *next;
+  /** 0 while the thread is in the queue; 1 after it was unparked */
+  std::atomic<uint32_t> unparked;
+};
+
+/** A hash table bucket of the parking lot */
+struct parking_bucket
+{
+  /** protects the queue: 0 if unlocked, 1 if locked, 2 if also waited for.
+  This is not an atomic_mutex, because parking_table_grow() holds all
+  bucket locks, which would exceed the lock tracking of ThreadSanitizer. */
+  std::atomic<uint32_t> mutex;
+  /** the first parked thread, or nullptr */
+  parked_thread *head;
+  /** the last parked thread, or nullptr */
+  parked_thread *tail;
+
+  void lock() noexcept
+  {
+    uint32_t lk = 0;
+    if (!mutex.compare_exchange_strong(lk, 1, std::memory_order_acquire,
+                                       std::memory_order_relaxed))
+      while (mutex.exchange(2, std::memory_order_acquire))
+        private_wait(mutex, 2);
+  }
+
+  void unlock() noexcept
+  {
+    if (mutex.exchange(0, std::memory_order_release) == 2)
+      private_notify(mutex, 1);
+  }
+
+  /** Append a thread to the queue */
+  void append(parked_thread *t) noexcept
+  {
+    t->next = nullptr;
+    if (tail)
+      tail->next = t;
+    else
+      head = t;
+    tail = t;
+  }
+
+  /** Remove a thread from the queue
+  @param prev  the predecessor of t, or nullptr
+  @param t     the thread to remove */
+  void remove(parked_thread *prev, parked_thread *t) noexcept
+  {
+    assert(prev ? prev->next == t : head == t);
+    (prev ? prev->next : head) = t->next;
+    if (tail == t)
+      tail = prev;
+  }
+
+  /** Remove a thread from the queue, if it is there
+  @return whether t was found */
+  bool remove(parked_thread *t) noexcept
+  {
+    for (parked_thread *prev = nullptr, *p = head; p; prev = p, p = p->next)
+    {
+      if (p == t)
+      {
+        remove(prev, t);
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+/** A hash table of the parking lot */
+struct parking_table
+{
+  /** log2 of the number of buckets */
+  unsigned log2;
+  /** the buckets */
+  parking_bucket *buckets;
+  /** the table that this was resized from, or nullptr */
+  parking_table *prev;
+
+  /** @return the bucket of an address */
+  parking_bucket &bucket(const void *addr) const noexcept
+  {
+    /* Fibonacci hashing; adjacent byte addresses are distinct keys. */
+    return buckets[uint64_t(uintptr_t(addr)) *
+                   0x9E3779B97F4A7C15ULL >> (64 - log2)];
+  }
+};
+
+/** log2 of the minimum number of buckets */
+static constexpr unsigned PARKING_LOG2_MIN = 4;
+/** Minimum number of buckets per thread that has parked */
+static constexpr size_t PARKING_LOAD_FACTOR = 3;
+
+/** The current parking lot hash table, or nullptr before the first use.
+The tables that were resized from are never freed, because other threads
+may be about to lock a bucket in them. */
+static std::atomic<parking_table*> parking_lot;
+/** Number of threads that have invoked parking_lot_park() */
+static std::atomic<size_t> parking_threads;
+
+/** @return a new parking lot hash table
+@param log2  log2 of the number of buckets
+@param prev  the table that is being resized from, or nullptr */
+static parking_table *parking_table_create(unsigned log2, parking_table *prev)
+{
+  return new parking_table{log2, new parking_bucket[size_t{1} << log2](),
+                           prev};
+}
+
+/** @return the current parking lot hash table */
+static parking_table *parking_table_get() noexcept
+{
+  parking_table *t = parking_lot.load(std::memory_order_acquire);
+  if (t)
+    return t;
+  parking_table *n = parking_table_create(PARKING_LOG2_MIN, nullptr);
+  if (parking_lot.compare_exchange_strong(t, n, std::memory_order_acq_rel,
+                                          std::memory_order_acquire))
+    return n;
+  delete[] n->buckets;
+  delete n;
+  return t;
+}
+
+/** Resize the parking lot hash table, if needed.
+@param threads  number of threads that have invoked parking_lot_park() */
+static void parking_table_grow(size_t threads) noexcept
+{
+  unsigned log2 = PARKING_LOG2_MIN;
+  while (size_t{1} << log2 < threads * PARKING_LOAD_FACTOR)
+    log2++;
+
+  for (;;)
+  {
+    parking_table *t = parking_table_get();
+    if (t->log2 >= log2)
+      return;
+    /* Threads lock at most one bucket at a time, so locking all buckets
+    in ascending order cannot deadlock. */
+    const size_t n = size_t{1} << t->log2;
+    for (size_t i = 0; i < n; i++)
+      t->buckets[i].lock();
+    const bool current = t == parking_lot.load(std::memory_order_relaxed);
+    if (current)
+    {
+      parking_table *g = parking_table_create(log2, t);
+      /* Threads that are parked on the same address are in the same bucket,
+      and they will remain in FIFO order. */
+      for (size_t i = 0; i < n; i++)
+      {
+        parking_bucket &b = t->buckets[i];
+        for (parked_thread *p = b.head, *next; p; p = next)
+        {
+          next = p->next;
+          g->bucket(p->addr).append(p);
+        }
+        b.head = b.tail = nullptr;
+      }
+      parking_lot.store(g, std::memory_order_release);
+    }
+    for (size_t i = 0; i < n; i++)
+      t->buckets[i].unlock();
+    if (current)
+      return;
+  }
+}
+
+/** Lock the parking lot bucket of an address.
+@return the locked bucket */
+static parking_bucket &parking_lot_lock(const void *addr) noexcept
+{
+  for (;;)
+  {
+    parking_table *t = parking_table_get();
+    parking_bucket &b = t->bucket(addr);
+    b.lock();
+    /* If the table was resized while we were waiting, retry. */
+    if (t == parking_lot.load(std::memory_order_relaxed))
+      return b;
+    b.unlock();
+  }
+}
+
+/** Wait until a thread has been unparked */
+static void parking_lot_wait(const parked_thread &self) noexcept
+{
+  while (!self.unparked.load(std::memory_order_acquire))
+    private_wait(self.unparked, 0);
+}
+
+/** Wake up a thread after it was removed from the queue */
+static void parking_lot_wake(parked_thread *t) noexcept
+{
+  t->unparked.store(1, std::memory_order_release);
+  /* The thread may already have returned from parking_lot_park(); see
+  queued_mutex_storage::unlock_notify(). */
+  private_notify(t->unparked, 1);
+}
+
+bool parking_lot_park(const void *addr, bool (*validate)(const void*),
+                      const void *ctx,
+                      std::chrono::steady_clock::time_point deadline)
+  noexcept
+{
+  static thread_local bool registered;
+  if (!registered)
+  {
+    registered = true;
+    parking_table_grow(parking_threads.fetch_add(1, std::memory_order_relaxed)
+                       + 1);
+  }
+
+  parked_thread self;
+  self.addr = addr;
+  self.unparked.store(0, std::memory_order_relaxed);
+  {
+    parking_bucket &b = parking_lot_lock(addr);
+    const bool park = validate(ctx);
+    if (park)
+      b.append(&self);
+    b.unlock();
+    if (!park)
+      return false;
+  }
+
+  if (deadline == std::chrono::steady_clock::time_point::max())
+  {
+    parking_lot_wait(self);
+    return true;
+  }
+
+  while (!self.unparked.load(std::memory_order_acquire))
+  {
+    if (!atomic_wait_until(self.unparked, 0, deadline))
+    {
+      /* Withdraw from the queue, unless we were unparked concurrently. */
+      parking_bucket &b = parking_lot_lock(addr);
+      const bool removed = b.remove(&self);
+      b.unlock();
+      if (removed)
+        return false;
+      parking_lot_wait(self);
+      break;
+    }
+  }
+  return true;
+}
+
+bool parking_lot_unpark_one(const void *addr,
+                            void (*callback)(void*, bool), void *ctx)
+  noexcept
+{
+  parking_bucket &b = parking_lot_lock(addr);
+  parked_thread *prev = nullptr, *t = b.head;
+  while (t && t->addr != addr)
+    prev = t, t = t->next;
+  bool more = false;
+  if (t)
+  {
+    b.remove(prev, t);
+    for (const parked_thread *p = t->next; p && !more; p = p->next)
+      more = p->addr == addr;
+  }
+  if (callback)
+    callback(ctx, more);
+  b.unlock();
+  if (!t)
+    return false;
+  parking_lot_wake(t);
+  return true;
+}
+
+bool parking_lot_parked(const void *addr) noexcept
+{
+  parking_bucket &b = parking_lot_lock(addr);
+  const parked_thread *p = b.head;
+  while (p && p->addr != addr)
+    p = p->next;
+  b.unlock();
+  return p;
+}
+
+size_t parking_lot_unpark_all(const void *addr) noexcept
+{
+  parked_thread *list = nullptr;
+  size_t n = 0;
+  {
+    parking_bucket &b = parking_lot_lock(addr);
+    for (parked_thread *prev = nullptr, *p = b.head, *next; p; p = next)
+    {
+      next = p->next;
+      if (p->addr != addr)
+      {
+        prev = p;
+        continue;
+      }
+      b.remove(prev, p);
+      p->next = list;
+      list = p;
+      n++;
+    }
+    b.unlock();
+  }
+  while (parked_thread *t = list)
+  {
+    list = t->next;
+    parking_lot_wake(t);
+  }
+  return n;
+}
+
+template<typename T, typename Backoff>
+unsigned parked_mutex_storage<T, Backoff>::default_spin_rounds()
+  const noexcept
+{ return spin_budget(this); }
+
+template<typename T, typename Backoff>
+void parked_mutex_storage<T, Backoff>::lock_wait() noexcept
+{
+  const probe_wait probe{this, PROBE_MUTEX};
+  for (;;)
+  {
+    type lk = m.load(std::memory_order_relaxed);
+    if (!(lk & HOLDER))
+    {
+      if (m.compare_exchange_weak(lk, type(lk | HOLDER),
+                                  std::memory_order_acquire,
+                                  std::memory_order_relaxed))
+        return;
+    }
+    else if (lk & PARKED ||
+             m.compare_exchange_weak(lk, type(lk | PARKED),
+                                     std::memory_order_relaxed,
+                                     std::memory_order_relaxed))
+      parking_lot_park(&m, must_park, this);
+  }
+}
+
+template<typename T, typename Backoff>
+void parked_mutex_storage<T, Backoff>::spin_lock_wait(unsigned spin_rounds)
+  noexcept
+{
+  Backoff backoff;
+
+  /* We hope to avoid parking when the conflict is resolved quickly. */
+  for (auto spin = spin_rounds; spin; spin--)
+  {
+    type lk = m.load(std::memory_order_relaxed);
+    if (!(lk & HOLDER) &&
+        m.compare_exchange_weak(lk, type(lk | HOLDER),
+                                std::memory_order_acquire,
+                                std::memory_order_relaxed))
+    {
+      spin_feedback(this, spin_rounds - spin + 1);
+      return;
+    }
+    backoff(m, lk);
+  }
+
+  ATOMIC_SYNC_PROBE(spin__fail, this, PROBE_MUTEX);
+  spin_feedback(this, 0);
+  lock_wait();
+}
+
+/** The validate() argument of parking_lot_park() for
+parked_mutex_storage::lock_wait_until() with a cancel() condition */
+struct park_unless
+{
+  bool (*must_park)(const void *ctx);
+  const void *storage;
+  bool (*cancel)(const void *ctx);
+  const void *ctx;
+
+  static bool validate(const void *ctx) noexcept
+  {
+    const park_unless *p = static_cast<const park_unless*>(ctx);
+    return p->must_park(p->storage) && !p->cancel(p->ctx);
+  }
+};
+
+template<typename T, typename Backoff>
+bool parked_mutex_storage<T, Backoff>::lock_wait_until
+  (std::chrono::steady_clock::time_point deadline,
+   bool (*cancel)(const void*), const void *ctx) noexcept
+{
+  const probe_wait probe{this, PROBE_MUTEX};
+  const park_unless unless{must_park, this, cancel, ctx};
+  for (;;)
+  {
+    type lk = m.load(std::memory_order_relaxed);
+    if (!(lk & HOLDER))
+    {
+      if (m.compare_exchange_weak(lk, type(lk | HOLDER),
+                                  std::memory_order_acquire,
+                                  std::memory_order_relaxed))
+        return true;
+    }
+    else if (cancel && cancel(ctx))
+      return false;
+    else if (lk & PARKED ||
+             m.compare_exchange_weak(lk, type(lk | PARKED),
+                                     std::memory_order_relaxed,
+                                     std::memory_order_relaxed))
+    {
+      /* A stale PARKED flag will be cleared by the next unlock(). */
+      if (!(cancel
+            ? parking_lot_park(&m, park_unless::validate, &unless, deadline)
+            : parking_lot_park(&m, must_park, this, deadline)) &&
+          std::chrono::steady_clock::now() >= deadline)
+        return lock_impl();
+    }
+  }
+}
+
+template<typename T, typename Backoff>
+void parked_mutex_storage<T, Backoff>::notify_cancel() noexcept
+{
+  /* The unparked threads that are not giving up will park again. */
+  parking_lot_unpark_all(&m);
+}
+
+template<typename T, typename Backoff>
+void parked_mutex_storage<T, Backoff>::requeue(std::atomic<uint32_t> &from,
+                                               uint32_t, uint32_t) noexcept
+{
+  private_notify(from, INT_MAX);
+}
+
+template<typename T, typename Backoff>
+void parked_mutex_storage<T, Backoff>::unlock_notify() noexcept
+{
+  ATOMIC_SYNC_PROBE(wake, this, PROBE_MUTEX);
+  /* While the bucket is locked, no thread can be parked on us, because
+  must_park() would observe the PARKED flag that we clear here. */
+  parking_lot_unpark_one(&m, [](void *ctx, bool more) {
+    static_cast<parked_mutex_storage*>(ctx)->m.store(more ? PARKED : 0,
+                                                     std::memory_order_release);
+  }, this);
+}
+
+template<typename T, typename Backoff>
+unsigned parked_shared_mutex_storage<T, Backoff>::default_spin_rounds()
+  const noexcept
+{ return spin_budget(&outer.get_storage()); }
+
+template<typename T, typename Backoff>
+bool parked_shared_mutex_storage<T, Backoff>::cancel_upgrade
+  (const void *ctx) noexcept
+{
+  /* Before parking, this is invoked while the wait queue is locked, so
+  that unregister_upgrader() will either find us parked or have cleared
+  the UPGRADER flag. */
+  parked_shared_mutex_storage *s = const_cast<parked_shared_mutex_storage*>
+    (static_cast<const parked_shared_mutex_storage*>(ctx));
+  return !register_upgrader(s->inner, X, UPGRADER);
+}
+
+template<typename T, typename Backoff>
+bool parked_shared_mutex_storage<T, Backoff>::upgrade_outer_until
+  (std::chrono::steady_clock::time_point deadline) noexcept
+{
+  if (outer.try_lock())
+    return true;
+  if (!register_upgrader(inner, X, UPGRADER))
+    return false;
+  const bool locked = outer.try_lock_until(deadline, cancel_upgrade, this);
+  /* The PARKED flag may be stale. */
+  unregister_upgrader(inner, X, UPGRADER, [this]
+                      { return outer.get_storage().is_parked(); });
+  return locked;
+}
+
+template<typename T, typename Backoff>
+void parked_shared_mutex_storage<T, Backoff>::lock_inner_wait(T lk) noexcept
+{
+  const probe_wait probe{this, PROBE_EXCLUSIVE};
+  assert(!(lk & X));
+  if (lk & UPGRADER)
+  {
+    /* Unpark upgrade_outer_until(), which would be waiting for the
+    outer lock that we are holding. */
+    inner.fetch_sub(UPGRADER, std::memory_order_acquire);
+    outer.notify_cancel();
+  }
+  while (inner.load(std::memory_order_acquire) != X)
+    parking_lot_park(&inner, must_park, this);
+}
+
+template<typename T, typename Backoff>
+bool parked_shared_mutex_storage<T, Backoff>::lock_inner_wait_until
+  (T lk, std::chrono::steady_clock::time_point deadline) noexcept
+{
+  const probe_wait probe{this, PROBE_EXCLUSIVE};
+  assert(!(lk & X));
+  if (lk & UPGRADER)
+  {
+    /* See lock_inner_wait() */
+    inner.fetch_sub(UPGRADER, std::memory_order_acquire);
+    outer.notify_cancel();
+  }
+  while (inner.load(std::memory_order_acquire) != X)
+  {
+    if (!parking_lot_park(&inner, must_park, this, deadline) &&
+        std::chrono::steady_clock::now() >= deadline)
+    {
+      if (inner.load(std::memory_order_acquire) == X)
+        break;
+      /* Withdraw the request. Any lock_shared() that is blocked by
+      it is waiting in lock_outer(), which our caller will release. */
+#ifndef NDEBUG
+      lk =
+#endif
+        inner.fetch_sub(X, std::memory_order_relaxed);
+      assert(lk & X);
+      return false;
+    }
+  }
+  return true;
+}
+
+template<typename T, typename Backoff>
+void parked_shared_mutex_storage<T, Backoff>::shared_lock_wait() noexcept
+{
+  const probe_wait probe{this, PROBE_SHARED};
+  lock_outer();
+#ifndef NDEBUG
+  type lk =
+#endif
+    inner.fetch_add(WAITER, std::memory_order_acquire);
+  unlock_outer();
+  assert(!(lk & X));
+}
+
+template<typename T, typename Backoff>
+bool parked_shared_mutex_storage<T, Backoff>::shared_lock_wait_until
+  (std::chrono::steady_clock::time_point deadline) noexcept
+{
+  const probe_wait probe{this, PROBE_SHARED};
+  if (!lock_outer_until(deadline))
+    return false;
+#ifndef NDEBUG
+  type lk =
+#endif
+    inner.fetch_add(WAITER, std::memory_order_acquire);
+  unlock_outer();
+  assert(!(lk & X));
+  return true;
+}
+
+template<typename T, typename Backoff>
+bool parked_shared_mutex_storage<T, Backoff>::spin_shared_lock_inner
+  (unsigned spin_rounds) noexcept
+{
+  Backoff backoff;
+
+  for (auto spin = spin_rounds; spin; spin--)
+  {
+    if (shared_lock_inner())
+    {
+      spin_feedback(&outer.get_storage(), spin_rounds - spin + 1);
+      return true;
+    }
+    backoff(inner, inner.load(std::memory_order_relaxed));
+  }
+
+  ATOMIC_SYNC_PROBE(spin__fail, this, PROBE_SHARED);
+  spin_feedback(&outer.get_storage(), 0);
+  return false;
+}
+
+template<typename T, typename Backoff>
+void parked_shared_mutex_storage<T, Backoff>::shared_unlock_inner_notify()
+  noexcept
+{
+  ATOMIC_SYNC_PROBE(wake, this, PROBE_EXCLUSIVE);
+  parking_lot_unpark_one(&inner);
+}
+
+#ifdef __linux__
+/** The cached TID of the current thread, or 0 */
+static thread_local uint32_t thread_id;
+
+/** Invalidate thread_id in the child process of fork() */
+static void reset_thread_id() noexcept { thread_id = 0; }
+
+template<typename Backoff>
+uint32_t pi_mutex_storage<Backoff>::tid() noexcept
+{
+  if (const uint32_t id = thread_id)
+    return id;
+  /* The only thread of the child process will have a different TID. */
+  static const int at_fork = pthread_atfork(nullptr, nullptr,
+                                            reset_thread_id);
+  (void) at_fork;
+  return thread_id = uint32_t(syscall(SYS_gettid));
+}
+
+template<typename Backoff>
+unsigned pi_mutex_storage<Backoff>::default_spin_rounds() const noexcept
+{ return spin_budget(this); }
+
+/** Whether the kernel does not support priority-inheritance futexes
+(ENOSYS), so that pi_mutex_storage must use FUTEX_WAIT and FUTEX_WAKE */
+static std::atomic<bool> no_pi_futex;
+
+/** Report an unexpected failure of a futex operation of pi_mutex_storage,
+and abort the process
+@param op  the name of the operation */
+[[noreturn]] static void pi_futex_failed(const char *op) noexcept
+{
+  fprintf(stderr, "pi_mutex_storage: %s failed: %s\n", op, strerror(errno));
+  abort();
+}
+
+template<typename Backoff>
+bool pi_mutex_storage<Backoff>::lock_wait_no_pi
+  (std::chrono::steady_clock::time_point deadline) noexcept
+{
+  const bool timed = deadline != std::chrono::steady_clock::time_point::max();
+  const timespec ts = monotonic_timespec(deadline);
+  const uint32_t id = tid();
+
+  for (uint32_t lk = m.load(std::memory_order_relaxed);;)
+  {
+    if (!lk)
+    {
+      /* Other threads may be waiting; let our unlock() wake up one. */
+      if (m.compare_exchange_weak(lk, id | WAITERS, std::memory_order_acquire,
+                                  std::memory_order_relaxed))
+        return true;
+    }
+    else if ((lk & WAITERS) ||
+             m.compare_exchange_weak(lk, lk | WAITERS,
+                                     std::memory_order_relaxed))
+    {
+      if (syscall(SYS_futex, &m, FUTEX_WAIT_BITSET_PRIVATE, lk | WAITERS,
+                  timed ? &ts : nullptr, nullptr, FUTEX_BITSET_MATCH_ANY) &&
+          errno == ETIMEDOUT)
+        return false;
+      lk = m.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+template<typename Backoff>
+void pi_mutex_storage<Backoff>::lock_wait() noexcept
+{
+  const probe_wait probe{this, PROBE_MUTEX};
+  /* The kernel will either acquire the mutex for us, or set WAITERS
+  and block us, boosting the priority of the holder. */
+  while (!no_pi_futex.load(std::memory_order_relaxed))
+  {
+    if (!syscall(SYS_futex, &m, FUTEX_LOCK_PI_PRIVATE, 0, nullptr,
+                 nullptr, 0))
+    {
+      assert((m.load(std::memory_order_relaxed) & TID_MASK) == tid());
+      return;
+    }
+    switch (errno) {
+    case EAGAIN: /* the holder is exiting; retry */
+    case EINTR:
+      continue;
+    case ENOSYS:
+      no_pi_futex.store(true, std::memory_order_relaxed);
+      break;
+    default:
+      pi_futex_failed("FUTEX_LOCK_PI");
+    }
+  }
+  lock_wait_no_pi(std::chrono::steady_clock::time_point::max());
+}
+
+template<typename Backoff>
+void pi_mutex_storage<Backoff>::spin_lock_wait(unsigned spin_rounds)
+  noexcept
+{
+  Backoff backoff;
+
+  for (auto spin = spin_rounds; spin; spin--)
+  {
+    uint32_t lk = m.load(std::memory_order_relaxed);
+    if (lk & WAITERS)
+      /* The ownership will be handed over to a waiter in the kernel. */
+      break;
+    if (!lk && m.compare_exchange_weak(lk, tid(), std::memory_order_acquire,
+                                       std::memory_order_relaxed))
+    {
+      spin_feedback(this, spin_rounds - spin + 1);
+      return;
+    }
+    backoff(m, lk);
+  }
+
+  ATOMIC_SYNC_PROBE(spin__fail, this, PROBE_MUTEX);
+  spin_feedback(this, 0);
+  lock_wait();
+}
+
+template<typename Backoff>
+bool pi_mutex_storage<Backoff>::lock_wait_until
+  (std::chrono::steady_clock::time_point deadline) noexcept
+{
+  const probe_wait probe{this, PROBE_MUTEX};
+  using namespace std::chrono;
+  if (!no_pi_futex.load(std::memory_order_relaxed))
+  {
+    long r;
+# ifdef FUTEX_LOCK_PI2
+    /* FUTEX_LOCK_PI2 (Linux 5.14) waits until an absolute time of
+    CLOCK_MONOTONIC, which is what std::chrono::steady_clock is based on. */
+    const timespec mono = monotonic_timespec(deadline);
+    do
+      r = syscall(SYS_futex, &m, FUTEX_LOCK_PI2_PRIVATE, 0, &mono,
+                  nullptr, 0);
+    while (r && (errno == EAGAIN || errno == EINTR));
+    if (r && errno == ENOSYS)
+# endif
+    {
+      /* FUTEX_LOCK_PI waits until an absolute time of CLOCK_REALTIME. */
+      const auto t = (system_clock::now() +
+                      duration_cast<system_clock::duration>
+                      (deadline - steady_clock::now())).time_since_epoch();
+      const auto sec = duration_cast<seconds>(t);
+      timespec ts;
+      ts.tv_sec = time_t(sec.count());
+      ts.tv_nsec = long(duration_cast<nanoseconds>(t - sec).count());
+      do
+        r = syscall(SYS_futex, &m, FUTEX_LOCK_PI_PRIVATE, 0, &ts,
+                    nullptr, 0);
+      while (r && (errno == EAGAIN || errno == EINTR));
+    }
+    if (!r)
+    {
+      assert((m.load(std::memory_order_relaxed) & TID_MASK) == tid());
+      return true;
+    }
+    if (errno == ETIMEDOUT)
+      return false;
+    if (errno != ENOSYS)
+      pi_futex_failed("FUTEX_LOCK_PI");
+    no_pi_futex.store(true, std::memory_order_relaxed);
+  }
+  return lock_wait_no_pi(deadline);
+}
+
+template<typename Backoff>
+void pi_mutex_storage<Backoff>::requeue(std::atomic<uint32_t> &from,
+                                        uint32_t, uint32_t) noexcept
+{
+  /* FUTEX_CMP_REQUEUE_PI would require the waiters of the condition
+  variable to use FUTEX_WAIT_REQUEUE_PI. */
+  private_notify(from, INT_MAX);
+}
+
+template<typename Backoff>
+void pi_mutex_storage<Backoff>::unlock_notify() noexcept
+{
+  ATOMIC_SYNC_PROBE(wake, this, PROBE_MUTEX);
+  if (!no_pi_futex.load(std::memory_order_relaxed))
+  {
+    /* The kernel will hand over the mutex to the waiter with the highest
+    priority, or release it if there are no waiters. */
+    if (!syscall(SYS_futex, &m, FUTEX_UNLOCK_PI_PRIVATE, 0, nullptr,
+                 nullptr, 0))
+      return;
+    if (errno != ENOSYS)
+      pi_futex_failed("FUTEX_UNLOCK_PI");
+    no_pi_futex.store(true, std::memory_order_relaxed);
+  }
+  /* No thread can be blocked in FUTEX_LOCK_PI. Wake up one that is
+  blocked in lock_wait_no_pi(). */
+  m.store(0, std::memory_order_release);
+  syscall(SYS_futex, &m, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+#endif
+
+/* Instantiate the storage for each back-off policy, both private and
+process-shared. A user-defined policy would require a similar explicit
+instantiation. */
+template class mutex_storage<uint32_t, pause_backoff>;
+template class mutex_storage<uint32_t, exponential_backoff>;
+template class mutex_storage<uint32_t, monitor_backoff>;
+template class shared_mutex_storage<uint32_t, pause_backoff>;
+template class shared_mutex_storage<uint32_t, exponential_backoff>;
+template class shared_mutex_storage<uint32_t, monitor_backoff>;
+template class batched_shared_mutex_storage<uint32_t, pause_backoff>;
+template class batched_shared_mutex_storage<uint32_t, exponential_backoff>;
+template class batched_shared_mutex_storage<uint32_t, monitor_backoff>;
+template class mutex_storage<uint16_t, pause_backoff>;
+template class mutex_storage<uint16_t, exponential_backoff>;
+template class mutex_storage<uint16_t, monitor_backoff>;
+template class shared_mutex_storage<uint64_t, pause_backoff>;
+template class shared_mutex_storage<uint64_t, exponential_backoff>;
+template class shared_mutex_storage<uint64_t, monitor_backoff>;
+template class mutex_storage<uint32_t, pause_backoff, true>;
+template class mutex_storage<uint32_t, exponential_backoff, true>;
+template class mutex_storage<uint32_t, monitor_backoff, true>;
+template class shared_mutex_storage<uint32_t, pause_backoff, true>;
+template class shared_mutex_storage<uint32_t, exponential_backoff, true>;
+template class shared_mutex_storage<uint32_t, monitor_backoff, true>;
+template class batched_shared_mutex_storage<uint32_t, pause_backoff, true>;
+template class batched_shared_mutex_storage<uint32_t, exponential_backoff,
+                                            true>;
+template class batched_shared_mutex_storage<uint32_t, monitor_backoff, true>;
+template class mutex_storage<uint16_t, pause_backoff, true>;
+template class mutex_storage<uint16_t, exponential_backoff, true>;
+template class mutex_storage<uint16_t, monitor_backoff, true>;
+template class shared_mutex_storage<uint64_t, pause_backoff, true>;
+template class shared_mutex_storage<uint64_t, exponential_backoff, true>;
+template class shared_mutex_storage<uint64_t, monitor_backoff, true>;
+template class queued_mutex_storage<pause_backoff>;
+template class queued_mutex_storage<exponential_backoff>;
+template class queued_mutex_storage<monitor_backoff>;
+template void bit_lock_wait(std::atomic<unsigned>&, unsigned) noexcept;
+template void bit_lock_wait(std::atomic<unsigned long>&, unsigned) noexcept;
+template void bit_lock_wait(std::atomic<unsigned long long>&, unsigned)
+  noexcept;
+template void bit_lock_notify(std::atomic<unsigned>&, unsigned) noexcept;
+template void bit_lock_notify(std::atomic<unsigned long>&, unsigned) noexcept;
+template void bit_lock_notify(std::atomic<unsigned long long>&, unsigned)
+  noexcept;
+template class parked_mutex_storage<uint8_t, pause_backoff>;
+template class parked_mutex_storage<uint8_t, exponential_backoff>;
+template class parked_mutex_storage<uint8_t, monitor_backoff>;
+template class parked_shared_mutex_storage<uint16_t, pause_backoff>;
+template class parked_shared_mutex_storage<uint16_t, exponential_backoff>;
+template class parked_shared_mutex_storage<uint16_t, monitor_backoff>;
+template void pause_backoff::operator()(const std::atomic<uint32_t>&,
+                                        uint32_t) noexcept;
+template void exponential_backoff::operator()(const std::atomic<uint32_t>&,
+                                              uint32_t) noexcept;
+template void monitor_backoff::operator()(const std::atomic<uint32_t>&,
+                                          uint32_t) noexcept;
+#ifdef __linux__
+template class pi_mutex_storage<pause_backoff>;
+template class pi_mutex_storage<exponential_backoff>;
+template class pi_mutex_storage<monitor_backoff>;
 #endif
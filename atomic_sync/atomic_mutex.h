@@ -1,11 +1,77 @@
 #pragma once
 #include <atomic>
 #include <cassert>
+#include "atomic_wait.h"
 #include "tsan.h"
 
 template<typename Storage> class atomic_mutex;
+template<typename Inner> class profiled_mutex_storage;
 
-template<typename T = uint32_t>
+/* Back-off policies for the spinloops of spin_lock() and friends.
+
+A policy object is constructed at the start of a spinloop, and it is
+invoked between attempts to acquire the lock. The arguments identify the
+lock word and the value that was observed in it, so that a policy may
+wait until the cache line has been modified. Each invocation counts as
+one of the spin_rounds.
+
+The policies are implemented in atomic_mutex.cc, which instantiates
+the storage classes for each of them, as well as the policies themselves
+for 32-bit words that other spinloops may wait on. */
+
+/** The default: a short burst of PAUSE or equivalent instructions */
+struct pause_backoff
+{
+  template<typename T>
+  void operator()(const std::atomic<T> &word, T old) noexcept;
+};
+
+/** Randomized exponential back-off: the delay starts at one PAUSE and
+is doubled in each round, up to a limit. On IA-32 and AMD64 processors
+that support WAITPKG, the delay is implemented by TPAUSE, which lets a
+sibling hardware thread use the execution resources. */
+class exponential_backoff
+{
+  unsigned delay = 1;
+public:
+  template<typename T>
+  void operator()(const std::atomic<T> &word, T old) noexcept;
+};
+
+/** Wait until the cache line of the lock word may have been modified:
+UMONITOR and UMWAIT on IA-32 and AMD64 processors that support WAITPKG,
+or WFE on ARMv8. Elsewhere, this is equivalent to pause_backoff. */
+struct monitor_backoff
+{
+  template<typename T>
+  void operator()(const std::atomic<T> &word, T old) noexcept;
+};
+
+/** The lock word of atomic_mutex (4 bytes).
+
+With T = uint16_t, the mutex occupies 2 bytes, and it can count up to
+32767 pending requests. A blocked lock() waits on the aligned 32-bit
+word that contains the lock word. The other 16 bits must be unused, or
+only be accessed as std::atomic<uint16_t>, such as by another lock. On
+Linux, the waiters of each half are told apart by FUTEX_WAIT_BITSET, so
+that a contended unlock() wakes up one of them. Elsewhere, the halves
+share a wait queue, and a contended unlock() will wake up all waiting
+threads. The broadcast() of atomic_condition_variable will wake up all
+its waiters, because they cannot be moved to the 16-bit lock word.
+
+If ProcessShared is set, the object may reside in memory that is shared
+between processes (such as a MAP_SHARED mapping), and the waiting and
+waking will use the process-shared operating system primitives: FUTEX_WAIT
+instead of FUTEX_WAIT_PRIVATE on Linux, UMTX_OP_WAIT_UINT on FreeBSD,
+UL_COMPARE_AND_WAIT_SHARED on macOS. Where no such primitive exists,
+such as on Microsoft Windows, blocked threads will poll the lock word.
+The same mutex must not be accessed as both private and process-shared.
+
+@tparam T              the type of the lock word
+@tparam Backoff        the back-off policy of spin_lock()
+@tparam ProcessShared  whether the mutex may be shared between processes */
+template<typename T = uint32_t, typename Backoff = pause_backoff,
+         bool ProcessShared = false>
 class mutex_storage
 {
   using type = T;
@@ -21,13 +87,15 @@ public:
   constexpr bool is_locked_or_waiting() const noexcept
   { return m.load(std::memory_order_acquire) != 0; }
   constexpr bool is_locked_not_waiting() const noexcept
-  { return m.load(std::memory_order_acquire) == HOLDER; }
+  { return m.load(std::memory_order_acquire) == HOLDER + WAITER; }
 
 private:
   friend class atomic_mutex<mutex_storage>;
+  template<typename Inner> friend class profiled_mutex_storage;
 
-  /** @return default argument for spin_lock_wait() */
-  unsigned default_spin_rounds();
+  /** @return default argument for spin_lock_wait(),
+  adapted to the recent success rate of spinning on this mutex */
+  unsigned default_spin_rounds() const noexcept;
 
   /** Try to acquire a mutex
   @return whether the mutex was acquired */
@@ -38,8 +106,73 @@ private:
                                      std::memory_order_acquire,
                                      std::memory_order_relaxed);
   }
-  void lock_wait() noexcept;
-  void spin_lock_wait(unsigned spin_rounds) noexcept;
+  /** Register as a waiter
+  @return the current value of the lock word */
+  T register_waiter() noexcept
+  { return WAITER + m.fetch_add(WAITER, std::memory_order_relaxed); }
+  /** Wait for the mutex after register_waiter()
+  @param lk  the current value of the lock word */
+  void lock_wait_registered(T lk) noexcept;
+  /** Wait for the mutex after having been registered by requeue() */
+  void lock_requeued() noexcept
+  { lock_wait_registered(m.load(std::memory_order_relaxed)); }
+  /** Try to acquire the mutex in a spinloop after register_waiter()
+  @param lk           the current value of the lock word
+  @param spin_rounds  number of attempts
+  @return whether the mutex was acquired; if not, lock_wait_registered(lk)
+  must be invoked */
+  bool spin_lock_registered(T &lk, unsigned spin_rounds) noexcept;
+  void lock_wait() noexcept { lock_wait_registered(register_waiter()); }
+  void spin_lock_wait(unsigned spin_rounds) noexcept
+  {
+    T lk = register_waiter();
+    if (!spin_lock_registered(lk, spin_rounds))
+      lock_wait_registered(lk);
+  }
+  /** Wait for the mutex to be acquired, or for a deadline
+  @param deadline  the time until which to wait
+  @param cancel    nullptr, or a condition for giving up while the mutex
+                   is being held by another thread; see notify_cancel()
+  @param ctx       the argument of cancel()
+  @return whether the mutex was acquired */
+  bool lock_wait_until(std::chrono::steady_clock::time_point deadline,
+                       bool (*cancel)(const void *ctx) = nullptr,
+                       const void *ctx = nullptr) noexcept;
+  /** Wake up all waiters after making the cancel() condition of
+  lock_wait_until() hold while holding the mutex. A waiter is registered
+  on our behalf, so that no waiter can miss the wake-up by waiting for
+  the previous value of the lock word; notify_cancel_done() must be
+  invoked before unlock(). */
+  void notify_cancel() noexcept;
+  /** Deregister the waiter that notify_cancel() registered */
+  void notify_cancel_done() noexcept
+  { m.fetch_sub(WAITER, std::memory_order_relaxed); }
+
+  /** Register waiters of a condition variable as waiters of the mutex,
+  and move them if possible.
+  @param from  the condition variable word
+  @param val   the expected value of from
+  @param n     number of waiters to register */
+  void requeue(std::atomic<uint32_t> &from, uint32_t val, uint32_t n)
+    noexcept;
+
+  /** Register waiters that will not wait for the lock word
+  @param n  number of waiters to register */
+  void register_waiters(uint32_t n) noexcept
+  { m.fetch_add(type(n * WAITER), std::memory_order_relaxed); }
+  /** Try to acquire the mutex on behalf of a registered waiter
+  @return whether the mutex was acquired */
+  bool try_lock_registered() noexcept
+  { return !(m.fetch_or(HOLDER, std::memory_order_acq_rel) & HOLDER); }
+  /** Release a mutex that try_lock_registered() acquired, when there
+  was no registered waiter to grant it to
+  @return whether the lock is being waited for */
+  bool unlock_unregistered() noexcept
+  {
+    T lk= m.fetch_sub(HOLDER, std::memory_order_release);
+    assert(lk & HOLDER);
+    return lk != HOLDER;
+  }
 
   /** Release a mutex
   @return whether the lock is being waited for */
@@ -49,16 +182,215 @@ private:
     assert(lk & HOLDER);
     return lk != HOLDER + WAITER;
   }
-#if !defined _WIN32 && __cplusplus < 202002L /* Emulate the C++20 primitives */
-  void notify_one() noexcept;
-  inline void wait(T old) const noexcept;
   /** Notify waiters after unlock_impl() returned true */
-  void unlock_notify() noexcept { this->notify_one(); }
-#else
-  /** Notify waiters after unlock_impl() returned true */
-  void unlock_notify() noexcept { m.notify_one(); }
-#endif
+  void unlock_notify() noexcept;
+};
+
+/** A fair alternative to mutex_storage, based on the MCS queue lock by
+John Mellor-Crummey and Michael Scott, in the variant where the lock
+holder does not need a queue node (attributed to the K42 project).
+
+Each blocking lock() request appends a node on its own stack to a queue,
+and it waits on a word in that node, so that the waiting threads do not
+poll a shared cache line. The unlock() hands over the ownership directly
+to the first waiter, in FIFO order. A lock() or try_lock() can only
+succeed immediately if nobody is holding or waiting for the mutex.
+The spin_lock() spins on the word of the queued node.
+
+Timed requests (try_lock_until(), try_lock_for()) are not queued: they
+will poll the lock with increasing intervals, and they can only succeed
+when the queue is empty.
+
+The mutex is compatible with atomic_condition_variable, but broadcast()
+will wake up all waiters, because they cannot be requeued. (16 bytes) */
+template<typename Backoff = pause_backoff>
+class queued_mutex_storage
+{
+  /** a link in the queue */
+  struct link
+  {
+    /** the next waiter, or nullptr */
+    std::atomic<link*> next;
+  };
+  /** a waiting lock() request */
+  struct waiter : link
+  {
+    /** the request is being spun on */
+    static constexpr uint32_t WAITING = 0;
+    /** the thread is waiting for a notification */
+    static constexpr uint32_t SLEEPING = 1;
+    /** the mutex was handed over to this waiter */
+    static constexpr uint32_t GRANTED = 2;
+    /** WAITING, SLEEPING or GRANTED */
+    std::atomic<uint32_t> state;
+  };
+
+  // exposition only
+  /** nullptr if the mutex is not locked; &head if there are no waiters;
+  otherwise, the last waiter */
+  std::atomic<link*> tail;
+  /** the first waiter, protected by the mutex */
+  link head;
+
+public:
+  bool is_locked() const noexcept
+  { return tail.load(std::memory_order_acquire) != nullptr; }
+  bool is_locked_or_waiting() const noexcept { return is_locked(); }
+  bool is_locked_not_waiting() const noexcept
+  { return tail.load(std::memory_order_acquire) == &head; }
+
+private:
+  friend class atomic_mutex<queued_mutex_storage>;
+
+  /** @return default argument for spin_lock_wait(),
+  adapted to the recent success rate of spinning on this mutex */
+  unsigned default_spin_rounds() const noexcept;
+
+  /** Try to acquire a mutex
+  @return whether the mutex was acquired */
+  bool lock_impl() noexcept
+  {
+    link *t = nullptr;
+    return tail.compare_exchange_strong(t, &head, std::memory_order_acquire,
+                                        std::memory_order_relaxed);
+  }
+  /** Append a waiter to the queue
+  @return whether the mutex was acquired */
+  bool enqueue(waiter &w) noexcept;
+  /** Remove the owner from the queue after the mutex was acquired */
+  void dequeue(waiter &w) noexcept;
+  /** Wait for the mutex to be handed over after enqueue() */
+  static void wait(waiter &w) noexcept;
+  void lock_wait() noexcept;
+  void spin_lock_wait(unsigned spin_rounds) noexcept;
+  /** Wait for the mutex to be acquired, or for a deadline
+  @return whether the mutex was acquired */
+  bool lock_wait_until(std::chrono::steady_clock::time_point deadline)
+    noexcept;
+
+  /** Wake up the waiters of a condition variable, which will invoke
+  lock_requeued()
+  @param from  the condition variable word */
+  void requeue(std::atomic<uint32_t> &from, uint32_t, uint32_t) noexcept;
+  /** Wait for the mutex to be acquired after requeue() */
+  void lock_requeued() noexcept { lock_wait(); }
+
+  /** Release a mutex, unless there are waiters
+  @return whether the mutex must be handed over by unlock_notify() */
+  bool unlock_impl() noexcept
+  {
+    assert(is_locked());
+    if (head.next.load(std::memory_order_relaxed))
+      return true;
+    link *t = &head;
+    return !tail.compare_exchange_strong(t, nullptr,
+                                         std::memory_order_release,
+                                         std::memory_order_relaxed);
+  }
+  /** Hand over the mutex to the first waiter after unlock_impl()
+  returned true */
+  void unlock_notify() noexcept;
+};
+
+#ifdef __linux__
+/** A priority-inheritance alternative to mutex_storage (4 bytes, Linux).
+
+The lock word holds the thread identifier (TID) of the holder. A lock()
+that has to wait will invoke FUTEX_LOCK_PI, so that the kernel will
+boost the priority of the holder until it releases the mutex by
+FUTEX_UNLOCK_PI, which hands over the ownership to the waiter with the
+highest priority. The uncontended lock() and unlock() are a single
+compare-and-swap. Timed requests use FUTEX_LOCK_PI2 (CLOCK_MONOTONIC)
+if the kernel supports it.
+
+The mutex must be released by the thread that acquired it. Because the
+waiters are managed by the kernel, broadcast(m) of
+atomic_condition_variable will wake up all waiters.
+
+If the kernel does not support priority-inheritance futexes (ENOSYS),
+blocked threads will fall back to FUTEX_WAIT and FUTEX_WAKE, without
+priority inheritance. Any other failure of FUTEX_LOCK_PI or
+FUTEX_UNLOCK_PI will abort the process with a diagnostic message. */
+template<typename Backoff = pause_backoff>
+class pi_mutex_storage
+{
+  // exposition only
+  /** 0 if the mutex is not locked; otherwise the TID of the holder,
+  with WAITERS if threads may be blocked in FUTEX_LOCK_PI */
+  std::atomic<uint32_t> m;
+
+  /** flag of m: the kernel is keeping track of waiters (FUTEX_WAITERS) */
+  static constexpr uint32_t WAITERS = 0x80000000;
+  /** mask of the TID in m (FUTEX_TID_MASK) */
+  static constexpr uint32_t TID_MASK = 0x3fffffff;
+
+  /** @return the TID of the current thread */
+  static uint32_t tid() noexcept;
+
+public:
+  bool is_locked() const noexcept
+  { return m.load(std::memory_order_acquire) & TID_MASK; }
+  bool is_locked_or_waiting() const noexcept
+  { return m.load(std::memory_order_acquire) != 0; }
+  bool is_locked_not_waiting() const noexcept
+  {
+    const uint32_t lk = m.load(std::memory_order_acquire);
+    return lk && !(lk & WAITERS);
+  }
+
+private:
+  friend class atomic_mutex<pi_mutex_storage>;
+
+  /** @return default argument for spin_lock_wait(),
+  adapted to the recent success rate of spinning on this mutex */
+  unsigned default_spin_rounds() const noexcept;
+
+  /** Try to acquire a mutex
+  @return whether the mutex was acquired */
+  bool lock_impl() noexcept
+  {
+    uint32_t lk = 0;
+    return m.compare_exchange_strong(lk, tid(), std::memory_order_acquire,
+                                     std::memory_order_relaxed);
+  }
+  void lock_wait() noexcept;
+  void spin_lock_wait(unsigned spin_rounds) noexcept;
+  /** Wait for the mutex to be acquired, or for a deadline
+  @return whether the mutex was acquired */
+  bool lock_wait_until(std::chrono::steady_clock::time_point deadline)
+    noexcept;
+  /** Wait for the mutex by FUTEX_WAIT, when the kernel does not support
+  FUTEX_LOCK_PI
+  @param deadline  the time until which to wait, or time_point::max()
+  @return whether the mutex was acquired */
+  bool lock_wait_no_pi(std::chrono::steady_clock::time_point deadline)
+    noexcept;
+
+  /** Wake up the waiters of a condition variable, which will invoke
+  lock_requeued()
+  @param from  the condition variable word */
+  void requeue(std::atomic<uint32_t> &from, uint32_t, uint32_t) noexcept;
+  /** Acquire the mutex after requeue() */
+  void lock_requeued() noexcept
+  {
+    if (!lock_impl())
+      lock_wait();
+  }
+
+  /** Release a mutex, unless there are waiters
+  @return whether the mutex must be released by unlock_notify() */
+  bool unlock_impl() noexcept
+  {
+    uint32_t lk = tid();
+    assert((m.load(std::memory_order_relaxed) & TID_MASK) == lk);
+    return !m.compare_exchange_strong(lk, 0, std::memory_order_release,
+                                      std::memory_order_relaxed);
+  }
+  /** Release the mutex by FUTEX_UNLOCK_PI after unlock_impl()
+  returned true */
+  void unlock_notify() noexcept;
 };
+#endif
 
 /** Tiny, non-recursive mutex that keeps a count of waiters.
 
@@ -66,6 +398,12 @@ The interface intentionally resembles std::mutex.
 The counterpart of get_storage() is std::mutex::native_handle().
 
 We define spin_lock(), which is like lock(), but with an initial spinloop.
+If no spin_rounds are specified, an adaptive default will be used.
+
+Like std::timed_mutex, we define try_lock_for() and try_lock_until().
+
+For atomic_condition_variable::broadcast(), we define requeue() and
+lock_requeued(), which hand over waiters from a condition variable.
 
 The implementation counts pending lock() requests, so that unlock()
 will only invoke notify_one() when pending requests exist. */
@@ -116,7 +454,136 @@ public:
     __tsan_mutex_post_lock(&storage, 0, 0);
   }
   void spin_lock() noexcept
-  { return spin_lock(storage.default_spin_rounds()); }
+  {
+    __tsan_mutex_pre_lock(&storage, 0);
+    if (!storage.lock_impl())
+      storage.spin_lock_wait(storage.default_spin_rounds());
+    __tsan_mutex_post_lock(&storage, 0, 0);
+  }
+  /** Try to acquire the mutex until a deadline.
+  @return whether the mutex was acquired */
+  template<class Clock, class Duration>
+  bool try_lock_until(const std::chrono::time_point<Clock, Duration> &t)
+    noexcept
+  {
+    __tsan_mutex_pre_lock(&storage, __tsan_mutex_try_lock);
+    bool locked = storage.lock_impl() ||
+      storage.lock_wait_until(to_steady_clock(t));
+    __tsan_mutex_post_lock(&storage, locked
+                           ? __tsan_mutex_try_lock
+                           : __tsan_mutex_try_lock_failed, 0);
+    return locked;
+  }
+  /** Try to acquire the mutex for a limited time.
+  @return whether the mutex was acquired */
+  template<class Rep, class Period>
+  bool try_lock_for(const std::chrono::duration<Rep, Period> &d) noexcept
+  { return try_lock_until(std::chrono::steady_clock::now() + d); }
+
+  /** Try to acquire the mutex until a deadline, unless a condition holds
+  while the mutex is being held by another thread. A holder that makes
+  cancel(ctx) hold must invoke notify_cancel(). This is used by
+  atomic_shared_mutex::shared_lock_upgrade().
+  @param deadline  the time until which to wait
+  @param cancel    the condition for giving up
+  @param ctx       the argument of cancel()
+  @return whether the mutex was acquired */
+  bool try_lock_until(std::chrono::steady_clock::time_point deadline,
+                      bool (*cancel)(const void *ctx), const void *ctx)
+    noexcept
+  {
+    __tsan_mutex_pre_lock(&storage, __tsan_mutex_try_lock);
+    bool locked = storage.lock_impl() ||
+      storage.lock_wait_until(deadline, cancel, ctx);
+    __tsan_mutex_post_lock(&storage, locked
+                           ? __tsan_mutex_try_lock
+                           : __tsan_mutex_try_lock_failed, 0);
+    return locked;
+  }
+  /** Wake up all try_lock_until() that are waiting with a cancel()
+  condition, after making it hold. The caller must hold the mutex,
+  and it must invoke notify_cancel_done() before unlock(). */
+  void notify_cancel() noexcept
+  {
+    assert(storage.is_locked());
+    __tsan_mutex_pre_signal(&storage, 0);
+    storage.notify_cancel();
+    __tsan_mutex_post_signal(&storage, 0);
+  }
+  /** Conclude notify_cancel(), after the cancel() condition no longer
+  matters to any waiter */
+  void notify_cancel_done() noexcept { storage.notify_cancel_done(); }
+
+  /** Acquire the mutex on behalf of a thread that was registered as a
+  waiter by requeue(), such as in atomic_condition_variable::wait(). */
+  void lock_requeued() noexcept
+  {
+    __tsan_mutex_pre_lock(&storage, 0);
+    storage.lock_requeued();
+    __tsan_mutex_post_lock(&storage, 0, 0);
+  }
+  /** Register waiters of a condition variable as waiters of this mutex,
+  and move any blocked threads from the condition variable if possible;
+  otherwise, wake them up. Each thread must invoke lock_requeued().
+  The caller must hold the mutex.
+  @param from  the condition variable word
+  @param val   the expected value of from
+  @param n     number of waiters to register */
+  void requeue(std::atomic<uint32_t> &from, uint32_t val, uint32_t n)
+    noexcept
+  {
+    assert(storage.is_locked());
+    __tsan_mutex_pre_signal(&storage, 0);
+    storage.requeue(from, val, n);
+    __tsan_mutex_post_signal(&storage, 0);
+  }
+
+  /** Register waiters that do not block a thread, such as the suspended
+  coroutines of atomic_async_mutex. Until each of them has been granted
+  the mutex by try_lock_registered(), unlock_no_notify() will return true.
+  The Storage must be mutex_storage.
+  @param n  number of waiters to register */
+  void register_waiters(uint32_t n) noexcept { storage.register_waiters(n); }
+  /** Try to acquire the mutex on behalf of the next waiter that was
+  registered by register_waiters(). If there turns out to be no such
+  waiter, the mutex must be released by unlock_unregistered().
+  @return whether the mutex was acquired */
+  bool try_lock_registered() noexcept
+  {
+    __tsan_mutex_pre_lock(&storage, __tsan_mutex_try_lock);
+    bool locked = storage.try_lock_registered();
+    __tsan_mutex_post_lock(&storage, locked
+                           ? __tsan_mutex_try_lock
+                           : __tsan_mutex_try_lock_failed, 0);
+    return locked;
+  }
+  /** Release the mutex after try_lock_registered() found no waiter.
+  @return whether the mutex is being waited for; see unlock_no_notify() */
+  bool unlock_unregistered() noexcept
+  {
+    __tsan_mutex_pre_unlock(&storage, 0);
+    bool notify= storage.unlock_unregistered();
+    __tsan_mutex_post_unlock(&storage, 0);
+    return notify;
+  }
+  /** Release the mutex without waking up any waiter.
+  @return whether the mutex is being waited for; if so, it must be
+  granted by try_lock_registered() or unlock_notify() */
+  bool unlock_no_notify() noexcept
+  {
+    __tsan_mutex_pre_unlock(&storage, 0);
+    bool notify= storage.unlock_impl();
+    __tsan_mutex_post_unlock(&storage, 0);
+    return notify;
+  }
+  /** Wake up a blocked thread after unlock_no_notify() returned true */
+  void unlock_notify() noexcept
+  {
+    __tsan_mutex_pre_signal(&storage, 0);
+    storage.unlock_notify();
+    __tsan_mutex_post_signal(&storage, 0);
+  }
+
   void unlock() noexcept
   {
     __tsan_mutex_pre_unlock(&storage, 0);
@@ -2,15 +2,29 @@
 #include "atomic_mutex.h"
 
 template<typename Storage> class atomic_shared_mutex;
-
-template<typename T = uint32_t>
+template<typename Inner> class profiled_shared_mutex_storage;
+template<typename Inner> class sharded_shared_mutex_storage;
+template<typename Storage> class atomic_async_shared_mutex;
+
+/** The lock words of atomic_shared_mutex (8 bytes).
+@tparam T              the type of the lock words
+@tparam Backoff        the back-off policy of spin_lock() and friends
+@tparam ProcessShared  whether the mutex may be shared between processes;
+                       see mutex_storage */
+template<typename T = uint32_t, typename Backoff = pause_backoff,
+         bool ProcessShared = false>
 class shared_mutex_storage
 {
+protected:
   // exposition only
   std::atomic<T> inner;
-  atomic_mutex<mutex_storage<T>> outer;
+  atomic_mutex<mutex_storage<T, Backoff, ProcessShared>> outer;
   using type = T;
   static constexpr type X = type(~(type(~type(0)) >> 1));
+  /** flag of upgrade_outer_until() waiting for the outer lock;
+  cleared by lock_inner_wait() or lock_inner_wait_until(), or by
+  upgrade_outer_until() when no other thread may be waiting */
+  static constexpr type UPGRADER = X >> 1;
   static constexpr type WAITER = 1;
 
 public:
@@ -18,23 +32,60 @@ public:
   { return inner.load(std::memory_order_acquire) == X; }
   constexpr bool is_locked_or_waiting() const noexcept
   { return outer.get_storage().is_locked_or_waiting() || is_locked(); }
-private:
+  /** @return whether an upgrade may be waiting for the outer lock */
+  bool is_upgrade_pending() const noexcept
+  { return inner.load(std::memory_order_acquire) & UPGRADER; }
+protected:
   friend class atomic_shared_mutex<shared_mutex_storage>;
-  /** @return default argument for spin_lock_outer() */
-  static unsigned default_spin_rounds();
+  template<typename Inner> friend class profiled_shared_mutex_storage;
+  template<typename Inner> friend class sharded_shared_mutex_storage;
+  friend class atomic_async_shared_mutex<shared_mutex_storage>;
+  /** @return default argument for spin_shared_lock_wait(),
+  adapted to the recent success rate of spinning on this mutex */
+  unsigned default_spin_rounds() const noexcept;
 
   bool try_lock_outer() noexcept { return outer.try_lock(); }
   void lock_outer() noexcept { outer.lock(); }
   void spin_lock_outer(unsigned spin_rounds) noexcept
   { outer.spin_lock(spin_rounds); }
+  void spin_lock_outer() noexcept { outer.spin_lock(); }
+  bool lock_outer_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  { return outer.try_lock_until(deadline); }
   void unlock_outer() noexcept { outer.unlock(); }
+  /** Acquire the outer lock while holding a shared lock, unless an
+  exclusive lock request is pending (it would be waiting for our shared
+  lock while holding the outer lock) or the deadline is reached.
+  While waiting, the UPGRADER flag will be set, so that a subsequent
+  exclusive lock request will wake us up. The flag will be cleared
+  afterwards, unless other threads may be waiting for the outer lock.
+  @return whether the outer lock was acquired */
+  bool upgrade_outer_until(std::chrono::steady_clock::time_point deadline)
+    noexcept;
+  /** The cancel() condition of upgrade_outer_until(): set the UPGRADER
+  flag again if it was cleared by another upgrade that acquired the outer
+  lock or gave up, unless an exclusive lock request is pending.
+  @return whether an exclusive lock request is pending */
+  static bool cancel_upgrade(const void *ctx) noexcept;
 
   /** Wait for a shared lock to be granted (any X lock to be released) */
   void shared_lock_wait() noexcept;
-
+  /** Wait for a shared lock to be granted, or for a deadline
+  @return whether the shared lock was acquired */
+  bool shared_lock_wait_until(std::chrono::steady_clock::time_point deadline)
+    noexcept;
+
+  /** Try to acquire a shared lock in a spinloop
+  @param spin_rounds  number of attempts
+  @return whether the shared lock was acquired */
+  bool spin_shared_lock_inner(unsigned spin_rounds) noexcept;
   /** Wait for a shared lock to be granted (any X lock to be released),
   with initial spinloop. */
-  void spin_shared_lock_wait(unsigned spin_rounds) noexcept;
+  void spin_shared_lock_wait(unsigned spin_rounds) noexcept
+  {
+    if (!spin_shared_lock_inner(spin_rounds))
+      shared_lock_wait();
+  }
 
   /** Try to acquire a shared mutex
   @return whether the shared mutex was acquired */
@@ -63,7 +114,6 @@ private:
   type lock_inner() noexcept
   {
 #if defined __i386__||defined __x86_64__||defined _M_IX86||defined _M_X64
-    static_assert(X == 1U << 31, "compatibility");
     /* On IA-32 and AMD64, a fetch_XXX() that needs to return the
     previous value of the word state can only be implemented
     efficiently for fetch_add() or fetch_sub(), both of which
@@ -80,6 +130,14 @@ private:
   /** Wait for an exclusive lock to be granted (any S locks to be released)
   @param lk  recent number of conflicting S lock holders */
   void lock_inner_wait(type lk) noexcept;
+  /** Wait for an exclusive lock to be granted, or for a deadline.
+  On timeout, the exclusive lock request will be withdrawn.
+  @param lk        recent number of conflicting S lock holders
+  @param deadline  the time until which to wait
+  @return whether the exclusive lock was acquired */
+  bool lock_inner_wait_until(type lk,
+                             std::chrono::steady_clock::time_point deadline)
+    noexcept;
 
   /** Release an exclusive lock of an atomic_shared_mutex */
   void unlock_inner() noexcept
@@ -88,12 +146,274 @@ private:
     inner.store(0, std::memory_order_release);
   }
 
-#if !defined _WIN32 && __cplusplus < 202002L /* Emulate the C++20 primitives */
-  void shared_unlock_inner_notify() noexcept;
-#else
   /** Notify waiters after shared_unlock_inner() returned true */
-  void shared_unlock_inner_notify() noexcept { inner.notify_one(); }
+  void shared_unlock_inner_notify() noexcept;
+};
+
+/** A shared_mutex_storage whose outer mutex and inner lock word are
+packed into a single 64-bit word (8 bytes). The least significant 32 bits
+hold X and the number of S locks, like the inner word of
+shared_mutex_storage<uint32_t>, and the most significant 32 bits hold
+the HOLDER flag and the number of pending U or X requests, like
+mutex_storage<uint32_t>. Each half is waited on separately, by futex or
+equivalent.
+
+All S, U and X lock acquisitions operate on the same word, and
+is_locked_or_waiting() is a single load. The lock_shared() is a
+compare-and-swap of the entire word, which will be retried if a
+concurrent lock_update() or unlock_update() modified the outer half.
+@tparam Backoff        the back-off policy of spin_lock() and friends
+@tparam ProcessShared  whether the mutex may be shared between processes;
+                       see mutex_storage */
+template<typename Backoff, bool ProcessShared>
+class shared_mutex_storage<uint64_t, Backoff, ProcessShared>
+{
+protected:
+  // exposition only
+  std::atomic<uint64_t> word;
+  using type = uint64_t;
+  static constexpr type X = type(1) << 31;
+  /** flag of upgrade_outer_until() waiting for the outer lock */
+  static constexpr type UPGRADER = X >> 1;
+  static constexpr type WAITER = 1;
+  /** mask of the inner lock: X and the number of S locks */
+  static constexpr type INNER = (type(1) << 32) - 1;
+  /** flag of the outer mutex being held */
+  static constexpr type HOLDER = type(1) << 32;
+  /** a pending or granted request of the outer mutex */
+  static constexpr type OUTER_WAITER = type(2) << 32;
+
+public:
+  constexpr bool is_locked() const noexcept
+  { return (word.load(std::memory_order_acquire) & INNER) == X; }
+  /* X can only be set while the outer mutex is being held. */
+  constexpr bool is_locked_or_waiting() const noexcept
+  { return word.load(std::memory_order_acquire) > INNER; }
+  /** @return whether an upgrade may be waiting for the outer lock */
+  bool is_upgrade_pending() const noexcept
+  { return word.load(std::memory_order_acquire) & UPGRADER; }
+protected:
+  friend class atomic_shared_mutex<shared_mutex_storage>;
+  template<typename Inner> friend class profiled_shared_mutex_storage;
+  template<typename Inner> friend class sharded_shared_mutex_storage;
+  /** @return default argument for spin_shared_lock_wait(),
+  adapted to the recent success rate of spinning on this mutex */
+  unsigned default_spin_rounds() const noexcept;
+
+  bool try_lock_outer() noexcept
+  {
+    type lk = word.load(std::memory_order_relaxed);
+    while (lk <= INNER)
+      if (word.compare_exchange_weak(lk, lk + HOLDER + OUTER_WAITER,
+                                     std::memory_order_acquire,
+                                     std::memory_order_relaxed))
+        return true;
+    return false;
+  }
+  void lock_outer() noexcept
+  {
+    if (!try_lock_outer())
+      lock_outer_registered(word.fetch_add(OUTER_WAITER,
+                                           std::memory_order_relaxed) +
+                            OUTER_WAITER);
+  }
+  void spin_lock_outer(unsigned spin_rounds) noexcept
+  {
+    if (!try_lock_outer())
+      spin_lock_outer_wait(spin_rounds);
+  }
+  void spin_lock_outer() noexcept { spin_lock_outer(default_spin_rounds()); }
+  bool lock_outer_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  { return try_lock_outer() || lock_outer_wait_until(deadline); }
+  void unlock_outer() noexcept
+  {
+    const type lk = word.fetch_sub(HOLDER + OUTER_WAITER,
+                                   std::memory_order_release);
+    assert(lk & HOLDER);
+    if ((lk & ~INNER) != HOLDER + OUTER_WAITER)
+      unlock_outer_notify();
+  }
+  /** Acquire the outer lock while holding a shared lock, unless an
+  exclusive lock request is pending or the deadline is reached.
+  See shared_mutex_storage::upgrade_outer_until().
+  @return whether the outer lock was acquired */
+  bool upgrade_outer_until(std::chrono::steady_clock::time_point deadline)
+    noexcept;
+
+  /** Wait for a shared lock to be granted (any X lock to be released) */
+  void shared_lock_wait() noexcept;
+  /** Wait for a shared lock to be granted, or for a deadline
+  @return whether the shared lock was acquired */
+  bool shared_lock_wait_until(std::chrono::steady_clock::time_point deadline)
+    noexcept;
+
+  /** Try to acquire a shared lock in a spinloop
+  @param spin_rounds  number of attempts
+  @return whether the shared lock was acquired */
+  bool spin_shared_lock_inner(unsigned spin_rounds) noexcept;
+  /** Wait for a shared lock to be granted (any X lock to be released),
+  with initial spinloop. */
+  void spin_shared_lock_wait(unsigned spin_rounds) noexcept
+  {
+    if (!spin_shared_lock_inner(spin_rounds))
+      shared_lock_wait();
+  }
+
+  /** Try to acquire a shared mutex
+  @return whether the shared mutex was acquired */
+  bool shared_lock_inner() noexcept
+  {
+    type lk = 0;
+    while (!word.compare_exchange_weak(lk, lk + WAITER,
+                                       std::memory_order_acquire,
+                                       std::memory_order_relaxed))
+      if (lk & X)
+        return false;
+    return true;
+  }
+  /** Release a shared mutex
+  @return whether an exclusive mutex is being waited for */
+  bool shared_unlock_inner() noexcept
+  {
+    type lk = word.fetch_sub(WAITER, std::memory_order_release);
+    assert(~X & lk & INNER);
+    return (lk & INNER) == X + WAITER;
+  }
+
+  /** For atomic_shared_mutex::lock()
+  @return inner lock word to be passed to lock_inner_wait()
+  @retval 0 if the exclusive lock was granted */
+  type lock_inner() noexcept
+  {
+#if defined __i386__||defined __x86_64__||defined _M_IX86||defined _M_X64
+    /* See shared_mutex_storage::lock_inner(). X is not the most
+    significant bit, but it is known to be clear, because we are
+    holding the outer mutex. */
+    return word.fetch_add(X, std::memory_order_acquire) & INNER;
 #endif
+    return word.fetch_or(X, std::memory_order_acquire) & INNER;
+  }
+
+  /** Wait for an exclusive lock to be granted (any S locks to be released)
+  @param lk  recent number of conflicting S lock holders */
+  void lock_inner_wait(type lk) noexcept;
+  /** Wait for an exclusive lock to be granted, or for a deadline.
+  On timeout, the exclusive lock request will be withdrawn.
+  @param lk        recent number of conflicting S lock holders
+  @param deadline  the time until which to wait
+  @return whether the exclusive lock was acquired */
+  bool lock_inner_wait_until(type lk,
+                             std::chrono::steady_clock::time_point deadline)
+    noexcept;
+
+  /** Release an exclusive lock of an atomic_shared_mutex */
+  void unlock_inner() noexcept
+  {
+    assert(this->is_locked());
+    /* Concurrent lock_outer() may be registering in the outer half. */
+    word.fetch_sub(X, std::memory_order_release);
+  }
+
+  /** Notify waiters after shared_unlock_inner() returned true */
+  void shared_unlock_inner_notify() noexcept;
+
+private:
+  /** Wait for the outer mutex after registering a request
+  @param lk  the current value of the word */
+  void lock_outer_registered(type lk) noexcept;
+  /** Register a request of the outer mutex, and spin before waiting
+  @param spin_rounds  number of attempts */
+  void spin_lock_outer_wait(unsigned spin_rounds) noexcept;
+  /** Wait for the outer mutex, or for a deadline
+  @param deadline  the time until which to wait
+  @param upgrade   whether to give up when an exclusive lock request
+                   is pending; see upgrade_outer_until()
+  @return whether the outer mutex was acquired */
+  bool lock_outer_wait_until(std::chrono::steady_clock::time_point deadline,
+                             bool upgrade = false) noexcept;
+  /** Wake up a waiter after unlock_outer() */
+  void unlock_outer_notify() noexcept;
+};
+
+/** A shared_mutex_storage where the lock_shared() requests that are
+blocked by an exclusive lock (or a pending exclusive lock request) wait
+on a separate word, and they are woken up all at once when the exclusive
+lock is released. In shared_mutex_storage, such requests would acquire
+and release the outer mutex one at a time. Like in shared_mutex_storage,
+a pending exclusive lock request will block any new shared lock requests.
+
+The release of an exclusive lock will involve a full memory barrier,
+and a system call if any shared lock requests are waiting. (12 bytes) */
+template<typename T = uint32_t, typename Backoff = pause_backoff,
+         bool ProcessShared = false>
+class batched_shared_mutex_storage
+  : public shared_mutex_storage<T, Backoff, ProcessShared>
+{
+  using base = shared_mutex_storage<T, Backoff, ProcessShared>;
+  using type = T;
+  using base::X;
+  using base::inner;
+  /** flag of wake: shared lock requests may be waiting */
+  static constexpr type WAITING = 1;
+
+  // exposition only
+  /** number of wake-ups, multiplied by 2; plus WAITING */
+  std::atomic<T> wake;
+
+  friend class atomic_shared_mutex<batched_shared_mutex_storage>;
+  template<typename Inner> friend class profiled_shared_mutex_storage;
+  template<typename Inner> friend class sharded_shared_mutex_storage;
+
+  /** Wake up all waiting shared lock requests, after the X flag of
+  inner was cleared */
+  void wake_readers() noexcept
+  {
+    if (wake.load() & WAITING)
+      wake_readers_notify();
+  }
+  /** Wake up all waiting shared lock requests */
+  void wake_readers_notify() noexcept;
+
+  /** Wait for a shared lock to be granted (any X lock to be released) */
+  void shared_lock_wait() noexcept;
+  /** Wait for a shared lock to be granted, or for a deadline
+  @return whether the shared lock was acquired */
+  bool shared_lock_wait_until(std::chrono::steady_clock::time_point deadline)
+    noexcept;
+  /** Wait for a shared lock to be granted (any X lock to be released),
+  with initial spinloop. */
+  void spin_shared_lock_wait(unsigned spin_rounds) noexcept
+  {
+    if (!base::spin_shared_lock_inner(spin_rounds))
+      shared_lock_wait();
+  }
+
+  /** Wait for an exclusive lock to be granted, or for a deadline.
+  On timeout, the exclusive lock request will be withdrawn.
+  @param lk        recent number of conflicting S lock holders
+  @param deadline  the time until which to wait
+  @return whether the exclusive lock was acquired */
+  bool lock_inner_wait_until(type lk,
+                             std::chrono::steady_clock::time_point deadline)
+    noexcept
+  {
+    if (base::lock_inner_wait_until(lk, deadline))
+      return true;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    wake_readers();
+    return false;
+  }
+
+  /** Release an exclusive lock of an atomic_shared_mutex */
+  void unlock_inner() noexcept
+  {
+    assert(this->is_locked());
+    /* Pair with the fetch_or() in shared_lock_wait(): either the
+    request will observe that X was cleared, or we will observe WAITING. */
+    inner.store(0, std::memory_order_seq_cst);
+    wake_readers();
+  }
 };
 
 /** Slim Shared/Update/Exclusive lock without recursion (re-entrancy).
@@ -124,9 +444,22 @@ We also define the operations try_lock_update(), unlock_update().
 For conversions between update locks and exclusive locks, we define
 update_lock_upgrade(), lock_update_downgrade().
 
+Like std::shared_timed_mutex, we define try_lock_for(), try_lock_until(),
+try_lock_shared_for(), try_lock_shared_until(), and similarly
+try_lock_update_for() and try_lock_update_until().
+
+A shared lock can be upgraded to an update lock while waiting for any
+conflicting update or exclusive lock to be released, by the blocking
+shared_lock_upgrade() or shared_lock_upgrade_until(), or without waiting
+by shared_lock_upgrade_try(). Because a pending exclusive lock request
+waits for the shared lock to be released, the upgrade has to give up when
+one is pending, for example when two threads invoke shared_lock_upgrade()
+and the winner continues with update_lock_upgrade().
+
 We define spin_lock(), spin_lock_shared(), and spin_lock_update(),
 which are like lock(), lock_shared(), lock_update(), but with an
-initial spinloop.
+initial spinloop. If no spin_rounds are specified, an adaptive default
+will be used.
 
 For efficiency, we rely on two wait queues that are provided by the
 runtime system or the operating system kernel: the one in the mutex for
@@ -138,6 +471,19 @@ class atomic_shared_mutex
 {
   Storage storage;
 
+  /** Release a shared lock after the update lock was acquired.
+  For ThreadSanitizer, both are read locks of the storage: the shared
+  lock becomes the update lock. */
+  void shared_unlock_upgraded() noexcept
+  {
+    if (storage.shared_unlock_inner())
+    {
+      __tsan_mutex_pre_signal(&storage, 0);
+      storage.shared_unlock_inner_notify();
+      __tsan_mutex_post_signal(&storage, 0);
+    }
+  }
+
   /** Acquire an exclusive lock while holding lock_outer() */
   void lock_inner() noexcept
   {
@@ -175,35 +521,87 @@ public:
     __tsan_mutex_pre_lock(&storage, __tsan_mutex_try_read_lock);
     bool acquired = storage.shared_lock_inner();
     __tsan_mutex_post_lock(&storage, acquired
-                           ? __tsan_mutex_try_read_lock_failed
-                           : __tsan_mutex_try_read_lock, 0);
+                           ? __tsan_mutex_try_read_lock
+                           : __tsan_mutex_try_read_lock_failed, 0);
     return acquired;
   }
 
-  /** Try to acquire an Update lock (which conflicts with other U or X lock).
-  @return whether the U lock was acquired */
-  bool try_lock_update() noexcept
+  /** Try to acquire a shared lock until a deadline.
+  @return whether the S lock was acquired */
+  template<class Clock, class Duration>
+  bool
+  try_lock_shared_until(const std::chrono::time_point<Clock, Duration> &t)
+    noexcept
   {
-    if (!storage.outer.try_lock())
-      return false;
-    __tsan_mutex_pre_lock(&storage, __tsan_mutex_read_lock);
-    storage.update_lock_inner();
-    __tsan_mutex_post_lock(&storage, __tsan_mutex_read_lock, 0);
-    return true;
+    __tsan_mutex_pre_lock(&storage, __tsan_mutex_try_read_lock);
+    bool acquired = storage.shared_lock_inner() ||
+      storage.shared_lock_wait_until(to_steady_clock(t));
+    __tsan_mutex_post_lock(&storage, acquired
+                           ? __tsan_mutex_try_read_lock
+                           : __tsan_mutex_try_read_lock_failed, 0);
+    return acquired;
   }
+  /** Try to acquire a shared lock for a limited time.
+  @return whether the S lock was acquired */
+  template<class Rep, class Period>
+  bool try_lock_shared_for(const std::chrono::duration<Rep, Period> &d)
+    noexcept
+  { return try_lock_shared_until(std::chrono::steady_clock::now() + d); }
+
+  /** Try to acquire an Update lock (which conflicts with other U or X lock).
+  @return whether the U lock was acquired */
+  bool try_lock_update() noexcept { return storage.try_lock_outer(); }
+
+  /** Try to acquire an Update lock until a deadline.
+  @return whether the U lock was acquired */
+  template<class Clock, class Duration>
+  bool
+  try_lock_update_until(const std::chrono::time_point<Clock, Duration> &t)
+    noexcept
+  { return storage.lock_outer_until(to_steady_clock(t)); }
+  /** Try to acquire an Update lock for a limited time.
+  @return whether the U lock was acquired */
+  template<class Rep, class Period>
+  bool try_lock_update_for(const std::chrono::duration<Rep, Period> &d)
+    noexcept
+  { return try_lock_update_until(std::chrono::steady_clock::now() + d); }
 
   /** Try to acquire an exclusive lock.
   @return whether the X lock was acquired */
   bool try_lock() noexcept
   {
-    if (!storage.outer.try_lock())
+    if (!storage.try_lock_outer())
       return false;
-    __tsan_mutex_pre_lock(&storage, 0);
     lock_inner();
-    __tsan_mutex_post_lock(&storage, 0, 0);
     return true;
   }
 
+  /** Try to acquire an exclusive lock until a deadline.
+  @return whether the X lock was acquired */
+  template<class Clock, class Duration>
+  bool try_lock_until(const std::chrono::time_point<Clock, Duration> &t)
+    noexcept
+  {
+    const auto deadline = to_steady_clock(t);
+    if (!storage.lock_outer_until(deadline))
+      return false;
+    __tsan_mutex_pre_lock(&storage, __tsan_mutex_try_lock);
+    bool acquired = true;
+    if (auto lk = storage.lock_inner())
+      acquired = storage.lock_inner_wait_until(lk, deadline);
+    __tsan_mutex_post_lock(&storage, acquired
+                           ? __tsan_mutex_try_lock
+                           : __tsan_mutex_try_lock_failed, 0);
+    if (!acquired)
+      storage.unlock_outer();
+    return acquired;
+  }
+  /** Try to acquire an exclusive lock for a limited time.
+  @return whether the X lock was acquired */
+  template<class Rep, class Period>
+  bool try_lock_for(const std::chrono::duration<Rep, Period> &d) noexcept
+  { return try_lock_until(std::chrono::steady_clock::now() + d); }
+
   /** Acquire a shared lock (which can coexist with S or U locks). */
   void lock_shared() noexcept
   {
@@ -220,21 +618,24 @@ public:
     __tsan_mutex_post_lock(&storage, __tsan_mutex_read_lock, 0);
   }
   void spin_lock_shared() noexcept
-  { return spin_lock_shared(storage.default_spin_rounds()); }
+  {
+    __tsan_mutex_pre_lock(&storage, __tsan_mutex_read_lock);
+    if (!storage.shared_lock_inner())
+      storage.spin_shared_lock_wait(storage.default_spin_rounds());
+    __tsan_mutex_post_lock(&storage, __tsan_mutex_read_lock, 0);
+  }
 
   /** Acquire an update lock (which can coexist with S locks). */
   void lock_update() noexcept { storage.lock_outer(); }
   void spin_lock_update(unsigned spin_rounds) noexcept
   { storage.spin_lock_outer(spin_rounds); }
-  void spin_lock_update() noexcept
-  { return spin_lock_update(storage.default_spin_rounds()); }
+  void spin_lock_update() noexcept { storage.spin_lock_outer(); }
 
   /** Acquire an exclusive lock. */
   void lock() noexcept { storage.lock_outer(); lock_inner(); }
   void spin_lock(unsigned spin_rounds) noexcept
   { storage.spin_lock_outer(spin_rounds); lock_inner(); }
-  void spin_lock() noexcept
-  { return spin_lock(storage.default_spin_rounds()); }
+  void spin_lock() noexcept { storage.spin_lock_outer(); lock_inner(); }
 
   /** Try to upgrade a shared lock to update.
   @return whether the upgrade succeeded */
@@ -242,9 +643,48 @@ public:
   {
     if (!storage.try_lock_outer())
       return false;
-    unlock_shared();
+    shared_unlock_upgraded();
     return true;
   }
+  /** Try to upgrade a shared lock to update until a deadline, while
+  holding the shared lock. This will fail if an exclusive lock request
+  is pending, because it would be waiting for our shared lock.
+  @return whether the upgrade succeeded
+  @retval false if the deadline was reached or an exclusive lock request
+  was pending; the shared lock is still being held, and it should be
+  released without delay */
+  template<class Clock, class Duration>
+  bool
+  shared_lock_upgrade_until(const std::chrono::time_point<Clock, Duration> &t)
+    noexcept
+  {
+    if (!storage.upgrade_outer_until(to_steady_clock(t)))
+      return false;
+    shared_unlock_upgraded();
+    return true;
+  }
+  /** Try to upgrade a shared lock to update for a limited time.
+  @return whether the upgrade succeeded; see shared_lock_upgrade_until() */
+  template<class Rep, class Period>
+  bool shared_lock_upgrade_for(const std::chrono::duration<Rep, Period> &d)
+    noexcept
+  { return shared_lock_upgrade_until(std::chrono::steady_clock::now() + d); }
+  /** Upgrade a shared lock to update. The shared lock will be held while
+  waiting, unless an exclusive lock request is pending; in that case,
+  the shared lock will be released, and the update lock will be acquired
+  after the exclusive lock was released.
+  @return whether the shared lock was held until the upgrade
+  @retval false if anything that was read under the shared lock must be
+  read again (an exclusive lock may have been granted in between) */
+  bool shared_lock_upgrade() noexcept
+  {
+    if (shared_lock_upgrade_until(std::chrono::steady_clock::time_point::
+                                  max()))
+      return true;
+    unlock_shared();
+    lock_update();
+    return false;
+  }
   /** Downgrade an update lock to shared. */
   void shared_lock_downgrade() noexcept { lock_shared(); unlock_update(); }
 
@@ -0,0 +1,98 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/* USE_FUTEX: Invoke the operating system primitives (futex or equivalent)
+directly, instead of std::atomic::wait() and std::atomic::notify_one().
+This emulates the C++20 primitives in earlier versions of the standard.
+Where a primitive with a timeout is known (Linux, FreeBSD, OpenBSD,
+DragonFly BSD, macOS), this is always enabled, so that the timed waits
+can block in the primitive until the deadline: a waiter that is blocked
+in it might not be woken up by std::atomic::notify_one(). This also avoids
+the bookkeeping of the standard library, which is redundant because we
+keep our own count of waiters.
+
+On Microsoft Windows, std::atomic::notify_one() invokes
+WakeByAddressSingle(), so the timed waits invoke WaitOnAddress() in any
+case; the build option WITH_NATIVE_FUTEX makes also the other waits and
+wake-ups of a C++20 build invoke it directly. On any other platform, a
+C++20 build uses std::atomic::wait(), and the timed waits will poll. */
+#if defined WITH_NATIVE_FUTEX || !defined _WIN32 && __cplusplus < 202002L || \
+  defined __linux__ || defined __FreeBSD__ || defined __OpenBSD__ || \
+  defined __DragonFly__ || defined __APPLE__
+# define USE_FUTEX
+#endif
+
+/** Wait until a 32-bit word may have changed from old, like
+std::atomic::wait(), but at most until a deadline.
+
+The operating system primitive is invoked directly: FUTEX_WAIT_BITSET on
+Linux, _umtx_op() on FreeBSD, futex() on OpenBSD, umtx_sleep() on
+DragonFly BSD, __ulock_wait() on macOS, or WaitOnAddress() on Microsoft
+Windows. The waiter will be woken up by the notify_one() of atomic_mutex
+or atomic_condition_variable.
+
+If no operating system primitive is known (on a C++20 build for a
+platform other than those listed above), the word will be polled with
+increasing intervals.
+
+For a word in memory that is shared between processes, the primitive
+will be invoked without any "private" flag, and the waiter must be
+woken up by process_shared_notify(). Where no such primitive exists
+(on Microsoft Windows, WaitOnAddress() only works within a process),
+the word will be polled.
+
+Spurious wake-ups are possible.
+@param word            the word to wait on
+@param old             the expected current value of word
+@param deadline        the time until which to wait
+@param process_shared  whether word may be shared between processes
+@return whether the deadline had not been reached */
+bool atomic_wait_until(const std::atomic<uint32_t> &word, uint32_t old,
+                       std::chrono::steady_clock::time_point deadline,
+                       bool process_shared = false) noexcept;
+
+/** Wait until a 32-bit word that may be shared between processes may have
+changed from old, like std::atomic::wait(). Spurious wake-ups are possible.
+@param word  the word to wait on
+@param old   the expected current value of word */
+void process_shared_wait(const std::atomic<uint32_t> &word, uint32_t old)
+  noexcept;
+
+/** Wake up process_shared_wait() or atomic_wait_until(..., true).
+@param word  the word that is being waited on
+@param n     maximum number of waiters to wake up (1 or INT_MAX) */
+void process_shared_notify(std::atomic<uint32_t> &word, uint32_t n) noexcept;
+
+/** Wait until a 32-bit word may have changed from old, like
+std::atomic::wait(), by the same primitive that atomic_mutex uses.
+Spurious wake-ups are possible.
+@param word  the word to wait on
+@param old   the expected current value of word */
+void atomic_word_wait(const std::atomic<uint32_t> &word, uint32_t old)
+  noexcept;
+
+/** Wake up atomic_word_wait() or atomic_wait_until().
+@param word  the word that is being waited on
+@param n     maximum number of waiters to wake up (1 or INT_MAX) */
+void atomic_word_notify(std::atomic<uint32_t> &word, uint32_t n) noexcept;
+
+/** @return a deadline for atomic_wait_until() */
+template<class Duration>
+inline std::chrono::steady_clock::time_point
+to_steady_clock(const std::chrono::time_point<std::chrono::steady_clock,
+                Duration> &t) noexcept
+{
+  return std::chrono::time_point_cast<std::chrono::steady_clock::duration>(t);
+}
+
+/** @return a deadline for atomic_wait_until() */
+template<class Clock, class Duration>
+inline std::chrono::steady_clock::time_point
+to_steady_clock(const std::chrono::time_point<Clock, Duration> &t) noexcept
+{
+  return std::chrono::steady_clock::now() +
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>
+    (t - Clock::now());
+}
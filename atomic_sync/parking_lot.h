@@ -0,0 +1,274 @@
+#pragma once
+#include "atomic_shared_mutex.h"
+
+/* The parking lot: a global hash table of wait queues, keyed by address,
+for locks that are too small to be waited on by futex or equivalent.
+
+Each hash table bucket is protected by a mutex, and it holds a FIFO queue
+of the threads that are parked on any address that hashes to the bucket.
+Each parked thread waits on a word in its own stack frame. The table is
+resized when the number of threads that have ever parked grows, so that
+there will be a few buckets per thread. */
+
+/** Park the current thread on an address, unless validate() fails.
+@param addr      the address to park on
+@param validate  invoked while the wait queue of addr is locked;
+                 the thread will not be parked if this returns false
+@param ctx       the argument of validate()
+@param deadline  the time until which to wait
+@return whether the thread was unparked by parking_lot_unpark_one() or
+parking_lot_unpark_all()
+@retval false if validate() failed or the deadline was reached */
+bool parking_lot_park(const void *addr, bool (*validate)(const void *ctx),
+                      const void *ctx,
+                      std::chrono::steady_clock::time_point deadline =
+                      std::chrono::steady_clock::time_point::max())
+  noexcept;
+
+/** Unpark the thread that was parked first on an address.
+@param addr      the address
+@param callback  nullptr, or invoked while the wait queue of addr is locked,
+                 with whether any threads remain parked on addr
+@param ctx       the first argument of callback()
+@return whether a thread was unparked */
+bool parking_lot_unpark_one(const void *addr,
+                            void (*callback)(void *ctx, bool more) = nullptr,
+                            void *ctx = nullptr) noexcept;
+
+/** @return whether any thread is parked on an address
+@param addr  the address */
+bool parking_lot_parked(const void *addr) noexcept;
+
+/** Unpark all threads that are parked on an address.
+@param addr      the address
+@return the number of unparked threads */
+size_t parking_lot_unpark_all(const void *addr) noexcept;
+
+/** An alternative to mutex_storage that occupies as little as one byte,
+for packing a lock into spare padding bytes of an existing structure.
+
+The lock word only holds a HOLDER flag and a PARKED flag, which is set
+while threads may be parked on the mutex in the parking lot. The
+uncontended lock() and unlock() are a single compare-and-swap. The
+unlock() of a mutex whose PARKED flag is set will release the mutex and
+unpark the thread that was parked first; other threads may acquire the
+mutex before the unparked thread does.
+
+Timed requests (try_lock_until(), try_lock_for()) are parked with a
+deadline. The mutex is compatible with atomic_condition_variable, but
+broadcast() will wake up all waiters, because they cannot be requeued.
+@tparam T        the type of the lock word
+@tparam Backoff  the back-off policy of spin_lock() */
+template<typename T = uint8_t, typename Backoff = pause_backoff>
+class parked_mutex_storage
+{
+  using type = T;
+  // exposition only
+  std::atomic<type> m;
+
+  static constexpr type HOLDER = 1;
+  static constexpr type PARKED = 2;
+
+public:
+  constexpr bool is_locked() const noexcept
+  { return m.load(std::memory_order_acquire) & HOLDER; }
+  constexpr bool is_locked_or_waiting() const noexcept
+  { return m.load(std::memory_order_acquire) != 0; }
+  constexpr bool is_locked_not_waiting() const noexcept
+  { return m.load(std::memory_order_acquire) == HOLDER; }
+  /** @return whether any thread is parked on the mutex; unlike the
+  PARKED flag, this is never stale */
+  bool is_parked() const noexcept { return parking_lot_parked(&m); }
+
+private:
+  friend class atomic_mutex<parked_mutex_storage>;
+
+  /** @return default argument for spin_lock_wait(),
+  adapted to the recent success rate of spinning on this mutex */
+  unsigned default_spin_rounds() const noexcept;
+
+  /** Try to acquire a mutex
+  @return whether the mutex was acquired */
+  bool lock_impl() noexcept
+  {
+    type lk = 0;
+    return m.compare_exchange_strong(lk, HOLDER, std::memory_order_acquire,
+                                     std::memory_order_relaxed);
+  }
+  /** @return whether a thread that set PARKED should be parked */
+  static bool must_park(const void *ctx) noexcept
+  {
+    return static_cast<const parked_mutex_storage*>(ctx)->
+      m.load(std::memory_order_relaxed) == HOLDER + PARKED;
+  }
+  void lock_wait() noexcept;
+  void spin_lock_wait(unsigned spin_rounds) noexcept;
+  /** Wait for the mutex to be acquired, or for a deadline
+  @param deadline  the time until which to wait
+  @param cancel    nullptr, or a condition for giving up while the mutex
+                   is being held by another thread; see notify_cancel()
+  @param ctx       the argument of cancel()
+  @return whether the mutex was acquired */
+  bool lock_wait_until(std::chrono::steady_clock::time_point deadline,
+                       bool (*cancel)(const void *ctx) = nullptr,
+                       const void *ctx = nullptr) noexcept;
+  /** Unpark all threads after making the cancel() condition of
+  lock_wait_until() hold while holding the mutex. The parked threads
+  validate cancel() while the wait queue is locked, so they cannot miss
+  the wake-up. */
+  void notify_cancel() noexcept;
+  void notify_cancel_done() noexcept {}
+
+  /** Wake up the waiters of a condition variable, which will invoke
+  lock_requeued()
+  @param from  the condition variable word */
+  void requeue(std::atomic<uint32_t> &from, uint32_t, uint32_t) noexcept;
+  /** Wait for the mutex to be acquired after requeue() */
+  void lock_requeued() noexcept { if (!lock_impl()) lock_wait(); }
+
+  /** Release a mutex, unless threads may be parked on it
+  @return whether unlock_notify() must be invoked */
+  bool unlock_impl() noexcept
+  {
+    type lk = HOLDER;
+    if (m.compare_exchange_strong(lk, 0, std::memory_order_release,
+                                  std::memory_order_relaxed))
+      return false;
+    assert(lk == HOLDER + PARKED);
+    return true;
+  }
+  /** Release the mutex and unpark a thread after unlock_impl()
+  returned true */
+  void unlock_notify() noexcept;
+};
+
+/** An alternative to shared_mutex_storage (4 bytes by default), where the
+outer mutex is a parked_mutex_storage<uint8_t>, and a pending exclusive
+lock request waits in the parking lot for the shared locks to be released.
+@tparam T        the type of the inner lock word
+@tparam Backoff  the back-off policy of spin_lock() and friends */
+template<typename T = uint16_t, typename Backoff = pause_backoff>
+class parked_shared_mutex_storage
+{
+  // exposition only
+  std::atomic<T> inner;
+  atomic_mutex<parked_mutex_storage<uint8_t, Backoff>> outer;
+  using type = T;
+  static constexpr type X = type(~(type(~type(0)) >> 1));
+  /** flag of upgrade_outer_until() waiting for the outer lock */
+  static constexpr type UPGRADER = X >> 1;
+  static constexpr type WAITER = 1;
+
+public:
+  constexpr bool is_locked() const noexcept
+  { return inner.load(std::memory_order_acquire) == X; }
+  constexpr bool is_locked_or_waiting() const noexcept
+  { return outer.get_storage().is_locked_or_waiting() || is_locked(); }
+  /** @return whether an upgrade may be waiting for the outer lock */
+  bool is_upgrade_pending() const noexcept
+  { return inner.load(std::memory_order_acquire) & UPGRADER; }
+private:
+  friend class atomic_shared_mutex<parked_shared_mutex_storage>;
+  /** @return default argument for spin_shared_lock_wait(),
+  adapted to the recent success rate of spinning on this mutex */
+  unsigned default_spin_rounds() const noexcept;
+
+  bool try_lock_outer() noexcept { return outer.try_lock(); }
+  void lock_outer() noexcept { outer.lock(); }
+  void spin_lock_outer(unsigned spin_rounds) noexcept
+  { outer.spin_lock(spin_rounds); }
+  void spin_lock_outer() noexcept { outer.spin_lock(); }
+  bool lock_outer_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  { return outer.try_lock_until(deadline); }
+  void unlock_outer() noexcept { outer.unlock(); }
+  /** Acquire the outer lock while holding a shared lock, unless an
+  exclusive lock request is pending or the deadline is reached.
+  See shared_mutex_storage::upgrade_outer_until().
+  @return whether the outer lock was acquired */
+  bool upgrade_outer_until(std::chrono::steady_clock::time_point deadline)
+    noexcept;
+  /** See shared_mutex_storage::cancel_upgrade() */
+  static bool cancel_upgrade(const void *ctx) noexcept;
+
+  /** Wait for a shared lock to be granted (any X lock to be released) */
+  void shared_lock_wait() noexcept;
+  /** Wait for a shared lock to be granted, or for a deadline
+  @return whether the shared lock was acquired */
+  bool shared_lock_wait_until(std::chrono::steady_clock::time_point deadline)
+    noexcept;
+
+  /** Try to acquire a shared lock in a spinloop
+  @param spin_rounds  number of attempts
+  @return whether the shared lock was acquired */
+  bool spin_shared_lock_inner(unsigned spin_rounds) noexcept;
+  /** Wait for a shared lock to be granted (any X lock to be released),
+  with initial spinloop. */
+  void spin_shared_lock_wait(unsigned spin_rounds) noexcept
+  {
+    if (!spin_shared_lock_inner(spin_rounds))
+      shared_lock_wait();
+  }
+
+  /** Try to acquire a shared mutex
+  @return whether the shared mutex was acquired */
+  bool shared_lock_inner() noexcept
+  {
+    type lk = 0;
+    while (!inner.compare_exchange_weak(lk, type(lk + WAITER),
+                                        std::memory_order_acquire,
+                                        std::memory_order_relaxed))
+      if (lk & X)
+        return false;
+    return true;
+  }
+  /** Release a shared mutex
+  @return whether an exclusive mutex is being waited for */
+  bool shared_unlock_inner() noexcept
+  {
+    type lk = inner.fetch_sub(WAITER, std::memory_order_release);
+    assert(~X & lk);
+    return lk == X + WAITER;
+  }
+
+  /** For atomic_shared_mutex::lock()
+  @return lock word to be passed to lock_inner_wait()
+  @retval 0 if the exclusive lock was granted */
+  type lock_inner() noexcept
+  {
+#if defined __i386__||defined __x86_64__||defined _M_IX86||defined _M_X64
+    /* See shared_mutex_storage::lock_inner(). */
+    return inner.fetch_add(X, std::memory_order_acquire);
+#endif
+    return inner.fetch_or(X, std::memory_order_acquire);
+  }
+  /** @return whether a pending exclusive lock request should be parked */
+  static bool must_park(const void *ctx) noexcept
+  {
+    return static_cast<const parked_shared_mutex_storage*>(ctx)->
+      inner.load(std::memory_order_relaxed) != X;
+  }
+
+  /** Wait for an exclusive lock to be granted (any S locks to be released)
+  @param lk  recent number of conflicting S lock holders */
+  void lock_inner_wait(type lk) noexcept;
+  /** Wait for an exclusive lock to be granted, or for a deadline.
+  On timeout, the exclusive lock request will be withdrawn.
+  @param lk        recent number of conflicting S lock holders
+  @param deadline  the time until which to wait
+  @return whether the exclusive lock was acquired */
+  bool lock_inner_wait_until(type lk,
+                             std::chrono::steady_clock::time_point deadline)
+    noexcept;
+
+  /** Release an exclusive lock of an atomic_shared_mutex */
+  void unlock_inner() noexcept
+  {
+    assert(is_locked());
+    inner.store(0, std::memory_order_release);
+  }
+
+  /** Unpark the exclusive lock request after shared_unlock_inner()
+  returned true */
+  void shared_unlock_inner_notify() noexcept;
+};
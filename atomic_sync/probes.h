@@ -0,0 +1,60 @@
+#pragma once
+
+/* Optional static tracepoints on the slow paths of the locks, for the
+build option WITH_PROBES. They are defined by <sys/sdt.h> of SystemTap,
+which can be traced by bpftrace, perf or SystemTap, for example:
+
+  bpftrace -e 'usdt:./program:atomic_sync:wait__start { @[arg1] = count(); }'
+
+Each probe of the provider atomic_sync has two arguments: arg0 is the
+address of the lock storage, and arg1 is one of the probe_mode. The
+outer lock of shared_mutex_storage is reported as a separate mutex, at
+an offset from the shared_mutex_storage.
+
+wait__start, wait__done: a thread starts or stops waiting for a lock
+(lock_wait(), spin_lock_wait() after the spinloop, lock_inner_wait(),
+shared_lock_wait(), or their timed variants); the duration between them
+is the waiting time, which may include spinning and blocking.
+spin__fail: spin_lock_wait() or similar gave up spinning.
+wake: unlock_notify() or similar is waking up waiters.
+
+Only the slow paths that are not inlined in the headers are covered,
+so that there is no overhead on the uncontended path. When WITH_PROBES
+is not defined, the probes expand to nothing. */
+
+/** The kinds of lock requests, reported as arg1 of the probes */
+enum probe_mode
+{
+  /** atomic_mutex, or the outer lock of atomic_shared_mutex (U, X) */
+  PROBE_MUTEX = 0,
+  /** an X request of atomic_shared_mutex waiting for S to be released */
+  PROBE_EXCLUSIVE = 1,
+  /** an S request of atomic_shared_mutex */
+  PROBE_SHARED = 2
+};
+
+#ifdef WITH_PROBES
+# include <sys/sdt.h>
+# define ATOMIC_SYNC_PROBE(name, lock, mode) \
+  DTRACE_PROBE2(atomic_sync, name, lock, int(mode))
+#else
+# define ATOMIC_SYNC_PROBE(name, lock, mode) do {} while (0)
+#endif
+
+/** Fire the probes wait__start and wait__done for a scope */
+class probe_wait
+{
+#ifdef WITH_PROBES
+  const void *const lock;
+  const probe_mode mode;
+public:
+  probe_wait(const void *lock, probe_mode mode) noexcept :
+    lock(lock), mode(mode)
+  { ATOMIC_SYNC_PROBE(wait__start, lock, mode); }
+  ~probe_wait() noexcept { ATOMIC_SYNC_PROBE(wait__done, lock, mode); }
+#else
+public:
+  probe_wait(const void *, probe_mode) noexcept {}
+#endif
+  probe_wait(const probe_wait&) = delete;
+};
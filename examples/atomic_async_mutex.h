@@ -0,0 +1,669 @@
+#pragma once
+#if __cplusplus < 202002L || !defined __cpp_impl_coroutine
+# error "atomic_async_mutex.h requires C++20 coroutines"
+#endif
+#include <coroutine>
+#include "atomic_shared_mutex.h"
+
+/* Front-ends of atomic_mutex and atomic_shared_mutex for C++20 coroutines.
+A coroutine that executes co_await m.lock_async() will not block the
+thread when the lock is not available. Instead, it will be suspended in a
+lock-free list of waiters, and it will be resumed after the lock has been
+granted to it by an unlock(), either directly in the thread that executed
+unlock(), or by posting it to an executor.
+
+Threads that use lock() are waiting for the lock word like before, so
+that one lock may be shared between threads and coroutines. The
+acquisition in co_await is attempted by try_lock() first. Before being
+suspended, a coroutine registers itself as a waiter in the lock word (in
+the outer mutex of atomic_shared_mutex), just like a blocking lock()
+would do. Like in atomic_mutex, an unlock() that finds no waiters is a
+single atomic read-modify-write; the list of suspended coroutines is only
+checked when waiters were registered. Suspended coroutines are granted
+the lock before any blocked thread is woken up. */
+
+/** A coroutine that is suspended in co_await, waiting for a lock */
+struct async_lock_waiter
+{
+  /** lock modes */
+  enum mode { EXCLUSIVE, SHARED, UPDATE };
+
+  /** the waiter that was enqueued before this one */
+  async_lock_waiter *next;
+  /** the suspended coroutine */
+  std::coroutine_handle<> handle;
+  /** nullptr, or the executor that will resume the coroutine */
+  void *executor;
+  /** submit the coroutine to the executor */
+  void (*post)(void *executor, std::coroutine_handle<> handle);
+  /** the requested lock mode */
+  mode wanted;
+
+  async_lock_waiter(mode wanted) noexcept :
+    executor(nullptr), post(nullptr), wanted(wanted) {}
+  template<class Executor>
+  async_lock_waiter(mode wanted, Executor &ex) noexcept :
+    executor(&ex), post(post_to<Executor>), wanted(wanted) {}
+
+  /** Resume the coroutine after the lock was granted to it.
+  The coroutine may free this object. */
+  void resume() noexcept
+  {
+    const std::coroutine_handle<> h{handle};
+    if (executor)
+      post(executor, h);
+    else
+      h.resume();
+  }
+
+private:
+  /** Submit a coroutine to an executor.
+  @tparam Executor  a class that defines post(std::coroutine_handle<>) */
+  template<class Executor>
+  static void post_to(void *executor, std::coroutine_handle<> handle)
+  { static_cast<Executor*>(executor)->post(handle); }
+};
+
+/** The coroutines that are waiting for a lock: a lock-free stack of
+recently enqueued waiters, and a queue of older waiters that is
+protected by the lock */
+class async_waiter_list
+{
+  /** the most recently enqueued waiter */
+  std::atomic<async_lock_waiter*> head;
+  /** the waiter that was enqueued first; protected by the lock */
+  std::atomic<async_lock_waiter*> queue;
+
+public:
+  /** @return whether no coroutines are waiting */
+  bool empty() const noexcept
+  {
+    return !head.load(std::memory_order_relaxed) &&
+      !queue.load(std::memory_order_relaxed);
+  }
+
+  /** Push waiters to the stack. Once pushed, the waiters may be
+  resumed and freed by the holder of the lock.
+  @param first  the most recently enqueued waiter
+  @param last   the waiter that was enqueued first */
+  void push(async_lock_waiter &first, async_lock_waiter &last) noexcept
+  {
+    async_lock_waiter *h = head.load(std::memory_order_relaxed);
+    do
+      last.next = h;
+    while (!head.compare_exchange_weak(h, &first, std::memory_order_release,
+                                       std::memory_order_relaxed));
+  }
+
+  /** Remove the waiter that was enqueued first.
+  The caller must be holding the lock.
+  @return the longest waiting coroutine
+  @retval nullptr if no coroutines are waiting */
+  async_lock_waiter *pop() noexcept
+  {
+    async_lock_waiter *w = queue.load(std::memory_order_relaxed);
+    if (!w)
+    {
+      w = head.exchange(nullptr, std::memory_order_acquire);
+      if (!w)
+        return nullptr;
+      w = reverse(w);
+    }
+    queue.store(w->next, std::memory_order_relaxed);
+    return w;
+  }
+
+private:
+  /** Reverse a list that is terminated by nullptr.
+  @return the new first element */
+  static async_lock_waiter *reverse(async_lock_waiter *w) noexcept
+  {
+    async_lock_waiter *r = nullptr;
+    do
+    {
+      async_lock_waiter *next = w->next;
+      w->next = r;
+      r = w;
+      w = next;
+    }
+    while (w);
+    return r;
+  }
+};
+
+/** The result of lock_async() and similar.
+@tparam Lock  atomic_async_mutex or atomic_async_shared_mutex
+@tparam M     the lock mode */
+template<class Lock, async_lock_waiter::mode M>
+class async_lock_awaiter : async_lock_waiter
+{
+  Lock &lock;
+
+public:
+  async_lock_awaiter(Lock &lock) noexcept :
+    async_lock_waiter(M), lock(lock) {}
+  template<class Executor>
+  async_lock_awaiter(Lock &lock, Executor &ex) noexcept :
+    async_lock_waiter(M, ex), lock(lock) {}
+
+  bool await_ready() noexcept { return lock.try_acquire(M); }
+  void await_suspend(std::coroutine_handle<> h) noexcept
+  {
+    handle = h;
+    /* Once enqueued, this may be resumed and freed. */
+    Lock &l = lock;
+    l.enqueue(*this);
+  }
+  void await_resume() const noexcept
+  { if (handle && executor) lock.take_over(M); }
+};
+
+/** An atomic_mutex that can be acquired by co_await lock_async().
+There is no explicit constructor or destructor.
+The object is expected to be zero-initialized.
+@tparam Storage  the storage of the atomic_mutex; must be mutex_storage */
+template<typename Storage = mutex_storage<>>
+class atomic_async_mutex
+{
+  atomic_mutex<Storage> m;
+  /** the suspended coroutines */
+  async_waiter_list waiters;
+
+  template<class, async_lock_waiter::mode> friend class async_lock_awaiter;
+  template<class> friend class atomic_async_condition_variable;
+
+  bool try_acquire(async_lock_waiter::mode) noexcept { return m.try_lock(); }
+
+  /** Register and enqueue a coroutine that is being suspended,
+  and grant the mutex if it was released meanwhile.
+  @param w  the waiter */
+  void enqueue(async_lock_waiter &w) noexcept
+  {
+    m.register_waiters(1);
+    waiters.push(w, w);
+    if (m.try_lock_registered())
+      grant(true);
+  }
+  /** Register and enqueue coroutines while holding the mutex.
+  @param first  the most recently enqueued waiter
+  @param last   the waiter that was enqueued first
+  @param n      the number of waiters */
+  void requeue(async_lock_waiter &first, async_lock_waiter &last,
+               uint32_t n) noexcept
+  {
+    m.register_waiters(n);
+    waiters.push(first, last);
+  }
+
+  /** Grant the mutex to the longest waiting coroutine.
+  @param acquired  whether try_lock_registered() succeeded; false if
+                   unlock_no_notify() found the mutex being waited for */
+  void grant(bool acquired) noexcept
+  {
+    for (;; acquired = false)
+    {
+      if (!acquired)
+      {
+        /* Pair with try_lock_registered() in enqueue(): either it will
+        acquire the mutex, or we will observe the enqueued waiter. */
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (waiters.empty())
+        {
+          m.unlock_notify();
+          return;
+        }
+        if (!m.try_lock_registered())
+          return;
+      }
+      if (async_lock_waiter *w = waiters.pop())
+      {
+        if (w->executor)
+          hand_over(w->wanted);
+        w->resume();
+        return;
+      }
+      /* Another thread granted the mutex to the waiter that we saw. */
+      if (!m.unlock_unregistered())
+        return;
+    }
+  }
+
+#ifdef __SANITIZE_THREAD__
+  /** Tell ThreadSanitizer that the mutex that was acquired for a
+  coroutine may be released by the thread of an executor */
+  void hand_over(async_lock_waiter::mode) noexcept
+  {
+    __tsan_mutex_pre_unlock(const_cast<Storage*>(&m.get_storage()), 0);
+    __tsan_mutex_post_unlock(const_cast<Storage*>(&m.get_storage()), 0);
+  }
+  /** Tell ThreadSanitizer that a coroutine that was resumed
+  by an executor holds the mutex */
+  void take_over(async_lock_waiter::mode) noexcept
+  {
+    __tsan_mutex_pre_lock(const_cast<Storage*>(&m.get_storage()), 0);
+    __tsan_mutex_post_lock(const_cast<Storage*>(&m.get_storage()), 0, 0);
+  }
+#else
+  void hand_over(async_lock_waiter::mode) noexcept {}
+  void take_over(async_lock_waiter::mode) noexcept {}
+#endif
+
+public:
+  using awaiter = async_lock_awaiter<atomic_async_mutex,
+                                     async_lock_waiter::EXCLUSIVE>;
+
+  constexpr const Storage& get_storage() const { return m.get_storage(); }
+  /** @return whether coroutines are waiting for the mutex */
+  bool is_async_waiting() const noexcept { return !waiters.empty(); }
+
+  /** @return whether the mutex was acquired */
+  bool try_lock() noexcept { return m.try_lock(); }
+  /** Acquire the mutex, blocking the thread */
+  void lock() noexcept { m.lock(); }
+  /** Acquire the mutex, with initial spinloop */
+  void spin_lock() noexcept { m.spin_lock(); }
+  /** Release the mutex, and grant it to a waiting coroutine or thread */
+  void unlock() noexcept { if (m.unlock_no_notify()) grant(false); }
+
+  /** Acquire the mutex in co_await. A suspended coroutine will be
+  resumed in unlock(). */
+  awaiter lock_async() noexcept { return awaiter{*this}; }
+  /** Acquire the mutex in co_await.
+  @param ex  the executor that will resume a suspended coroutine
+  (by ex.post(std::coroutine_handle<>)) */
+  template<class Executor>
+  awaiter lock_async(Executor &ex) noexcept { return awaiter{*this, ex}; }
+};
+
+/** An atomic_shared_mutex that can be acquired by co_await lock_async(),
+lock_shared_async() or lock_update_async(). The suspended coroutines are
+registered as waiters of the outer mutex, which is what any blocked
+request would be waiting for, except for an exclusive lock that is
+waiting for shared locks to be released. That request is resumed by the
+last unlock_shared().
+There is no explicit constructor or destructor.
+The object is expected to be zero-initialized.
+@tparam Storage  the storage of the atomic_shared_mutex; must be
+                 shared_mutex_storage<uint32_t> or similar */
+template<typename Storage = shared_mutex_storage<>>
+class atomic_async_shared_mutex
+{
+  atomic_shared_mutex<Storage> m;
+  /** the suspended coroutines */
+  async_waiter_list waiters;
+  /** a coroutine that holds the outer lock and is waiting for the
+  shared locks to be released, so that it can be granted an exclusive
+  lock by unlock_shared() */
+  std::atomic<async_lock_waiter*> exclusive;
+
+  template<class, async_lock_waiter::mode> friend class async_lock_awaiter;
+  template<class> friend class atomic_async_condition_variable;
+
+  Storage &storage() noexcept { return const_cast<Storage&>(m.get_storage()); }
+
+  bool try_acquire(async_lock_waiter::mode mode) noexcept
+  {
+    switch (mode) {
+    case async_lock_waiter::SHARED:
+      return m.try_lock_shared();
+    case async_lock_waiter::UPDATE:
+      return m.try_lock_update();
+    default:
+      return m.try_lock();
+    }
+  }
+
+  /** Register and enqueue a coroutine that is being suspended,
+  and grant the outer lock if it was released meanwhile.
+  @param w  the waiter */
+  void enqueue(async_lock_waiter &w) noexcept
+  {
+    storage().outer.register_waiters(1);
+    waiters.push(w, w);
+    if (storage().outer.try_lock_registered())
+      grant(true);
+  }
+  /** Register and enqueue coroutines while holding an exclusive lock.
+  @param first  the most recently enqueued waiter
+  @param last   the waiter that was enqueued first
+  @param n      the number of waiters */
+  void requeue(async_lock_waiter &first, async_lock_waiter &last,
+               uint32_t n) noexcept
+  {
+    storage().outer.register_waiters(n);
+    waiters.push(first, last);
+  }
+
+  /** Release the outer lock, and grant it to a waiting coroutine
+  or thread */
+  void unlock_outer() noexcept
+  { if (storage().outer.unlock_no_notify()) grant(false); }
+
+  /** Acquire the exclusive lock on behalf of a coroutine, while holding
+  the outer lock for it.
+  @param w  the waiter
+  @return whether the exclusive lock was granted; if not, w will be
+  resumed by the last unlock_shared() */
+  bool lock_inner(async_lock_waiter &w) noexcept
+  {
+    exclusive.store(&w, std::memory_order_relaxed);
+    hand_over(async_lock_waiter::UPDATE);
+    /* Pair with unlock_shared() */
+    std::atomic_thread_fence(std::memory_order_release);
+    if (storage().lock_inner())
+      return false;
+    exclusive.store(nullptr, std::memory_order_relaxed);
+    take_over(async_lock_waiter::EXCLUSIVE);
+    return true;
+  }
+
+  /** Grant the outer lock to the longest waiting coroutines. Shared lock
+  requests will be granted until another request is found.
+  @param acquired  whether try_lock_registered() succeeded; false if
+                   unlock_no_notify() found the outer lock being waited for */
+  void grant(bool acquired) noexcept
+  {
+    auto &outer = storage().outer;
+    /* The coroutines will be resumed after we have stopped acting on
+    behalf of them, in the order they were enqueued. */
+    async_lock_waiter *ready = nullptr, **tail = &ready;
+
+    for (;; acquired = false)
+    {
+      if (!acquired)
+      {
+        /* See atomic_async_mutex::grant() */
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (waiters.empty())
+        {
+          outer.unlock_notify();
+          break;
+        }
+        if (!outer.try_lock_registered())
+          break;
+      }
+      async_lock_waiter *w = waiters.pop();
+      if (!w)
+      {
+        if (outer.unlock_unregistered())
+          continue;
+        break;
+      }
+      switch (w->wanted) {
+      case async_lock_waiter::SHARED:
+        /* No exclusive lock can be held while we hold the outer lock. */
+        __tsan_mutex_pre_lock(&storage(), __tsan_mutex_read_lock);
+        storage().inner.fetch_add(Storage::WAITER,
+                                  std::memory_order_acquire);
+        __tsan_mutex_post_lock(&storage(), __tsan_mutex_read_lock, 0);
+        *tail = w;
+        tail = &w->next;
+        if (outer.unlock_no_notify())
+          continue;
+        break;
+      case async_lock_waiter::EXCLUSIVE:
+        if (!lock_inner(*w))
+          break;
+        /* fall through */
+      case async_lock_waiter::UPDATE:
+        *tail = w;
+        tail = &w->next;
+      }
+      break;
+    }
+
+    *tail = nullptr;
+    while (async_lock_waiter *w = ready)
+    {
+      ready = w->next;
+      if (w->executor)
+        hand_over(w->wanted);
+      w->resume();
+    }
+  }
+
+#ifdef __SANITIZE_THREAD__
+  /** Tell ThreadSanitizer that the lock that was acquired for a
+  coroutine may be released by another thread */
+  void hand_over(async_lock_waiter::mode mode) noexcept
+  {
+    Storage *s = &storage();
+    if (mode != async_lock_waiter::SHARED)
+    {
+      void *outer = const_cast<void*>(static_cast<const void*>
+                                      (&s->outer.get_storage()));
+      __tsan_mutex_pre_unlock(outer, 0);
+      __tsan_mutex_post_unlock(outer, 0);
+    }
+    if (mode != async_lock_waiter::UPDATE)
+    {
+      const unsigned flags = mode == async_lock_waiter::EXCLUSIVE
+        ? 0 : __tsan_mutex_read_lock;
+      __tsan_mutex_pre_unlock(s, flags);
+      __tsan_mutex_post_unlock(s, flags);
+    }
+  }
+  /** Tell ThreadSanitizer that a coroutine that was resumed
+  by another thread holds the lock */
+  void take_over(async_lock_waiter::mode mode) noexcept
+  {
+    Storage *s = &storage();
+    if (mode != async_lock_waiter::SHARED)
+    {
+      void *outer = const_cast<void*>(static_cast<const void*>
+                                      (&s->outer.get_storage()));
+      __tsan_mutex_pre_lock(outer, 0);
+      __tsan_mutex_post_lock(outer, 0, 0);
+    }
+    if (mode != async_lock_waiter::UPDATE)
+    {
+      const unsigned flags = mode == async_lock_waiter::EXCLUSIVE
+        ? 0 : __tsan_mutex_read_lock;
+      __tsan_mutex_pre_lock(s, flags);
+      __tsan_mutex_post_lock(s, flags, 0);
+    }
+  }
+#else
+  void hand_over(async_lock_waiter::mode) noexcept {}
+  void take_over(async_lock_waiter::mode) noexcept {}
+#endif
+
+public:
+  template<async_lock_waiter::mode M>
+  using awaiter = async_lock_awaiter<atomic_async_shared_mutex, M>;
+
+  constexpr const Storage& get_storage() const { return m.get_storage(); }
+  /** @return whether coroutines are waiting for the mutex */
+  bool is_async_waiting() const noexcept
+  { return !waiters.empty() || exclusive.load(std::memory_order_relaxed); }
+
+  /** @return whether an exclusive lock was acquired */
+  bool try_lock() noexcept { return m.try_lock(); }
+  /** Acquire an exclusive lock, blocking the thread */
+  void lock() noexcept { m.lock(); }
+  /** Release an exclusive lock */
+  void unlock() noexcept
+  {
+    __tsan_mutex_pre_unlock(&storage(), 0);
+    storage().unlock_inner();
+    __tsan_mutex_post_unlock(&storage(), 0);
+    unlock_outer();
+  }
+
+  /** @return whether a shared lock was acquired */
+  bool try_lock_shared() noexcept { return m.try_lock_shared(); }
+  /** Acquire a shared lock, blocking the thread */
+  void lock_shared() noexcept
+  {
+    Storage &s = storage();
+    bool notify = false;
+    __tsan_mutex_pre_lock(&s, __tsan_mutex_read_lock);
+    if (!s.shared_lock_inner())
+    {
+      /* Like shared_mutex_storage::shared_lock_wait(), but the
+      outer lock may have to be granted to a coroutine */
+      s.lock_outer();
+      s.inner.fetch_add(Storage::WAITER, std::memory_order_acquire);
+      notify = s.outer.unlock_no_notify();
+    }
+    __tsan_mutex_post_lock(&s, __tsan_mutex_read_lock, 0);
+    if (notify)
+      grant(false);
+  }
+  /** Release a shared lock, and resume an exclusive lock request
+  of a coroutine that was waiting for it */
+  void unlock_shared() noexcept
+  {
+    Storage &s = storage();
+    __tsan_mutex_pre_unlock(&s, __tsan_mutex_read_lock);
+    bool notify = s.shared_unlock_inner();
+    __tsan_mutex_post_unlock(&s, __tsan_mutex_read_lock);
+    if (!notify)
+      return;
+    /* Pair with lock_inner(async_lock_waiter&) */
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (async_lock_waiter *w =
+        exclusive.exchange(nullptr, std::memory_order_relaxed))
+    {
+      take_over(async_lock_waiter::EXCLUSIVE);
+      if (w->executor)
+        hand_over(async_lock_waiter::EXCLUSIVE);
+      w->resume();
+    }
+    else
+    {
+      __tsan_mutex_pre_signal(&s, 0);
+      s.shared_unlock_inner_notify();
+      __tsan_mutex_post_signal(&s, 0);
+    }
+  }
+
+  /** @return whether an Update lock was acquired */
+  bool try_lock_update() noexcept { return m.try_lock_update(); }
+  /** Acquire an Update lock, blocking the thread */
+  void lock_update() noexcept { m.lock_update(); }
+  /** Release an Update lock */
+  void unlock_update() noexcept
+  {
+    __tsan_mutex_pre_unlock(&storage(), __tsan_mutex_read_lock);
+    bool notify = storage().outer.unlock_no_notify();
+    __tsan_mutex_post_unlock(&storage(), __tsan_mutex_read_lock);
+    if (notify)
+      grant(false);
+  }
+
+  /** Acquire an exclusive lock in co_await */
+  awaiter<async_lock_waiter::EXCLUSIVE> lock_async() noexcept
+  { return {*this}; }
+  /** Acquire an exclusive lock in co_await, resuming on an executor */
+  template<class Executor>
+  awaiter<async_lock_waiter::EXCLUSIVE> lock_async(Executor &ex) noexcept
+  { return {*this, ex}; }
+  /** Acquire a shared lock in co_await */
+  awaiter<async_lock_waiter::SHARED> lock_shared_async() noexcept
+  { return {*this}; }
+  /** Acquire a shared lock in co_await, resuming on an executor */
+  template<class Executor>
+  awaiter<async_lock_waiter::SHARED> lock_shared_async(Executor &ex)
+    noexcept
+  { return {*this, ex}; }
+  /** Acquire an Update lock in co_await */
+  awaiter<async_lock_waiter::UPDATE> lock_update_async() noexcept
+  { return {*this}; }
+  /** Acquire an Update lock in co_await, resuming on an executor */
+  template<class Executor>
+  awaiter<async_lock_waiter::UPDATE> lock_update_async(Executor &ex)
+    noexcept
+  { return {*this, ex}; }
+};
+
+/** A condition variable for coroutines that hold an exclusive lock on
+atomic_async_mutex or atomic_async_shared_mutex. Like broadcast(m) of
+atomic_condition_variable, notify_one(m) and notify_all(m) register the
+waiters in the lock word and move them to the mutex, which the caller
+must hold; they will be resumed one by one in unlock().
+There is no explicit constructor or destructor.
+The object is expected to be zero-initialized.
+@tparam Mutex  atomic_async_mutex or atomic_async_shared_mutex */
+template<class Mutex = atomic_async_mutex<>>
+class atomic_async_condition_variable
+{
+  /** the most recently suspended waiter; protected by the mutex */
+  std::atomic<async_lock_waiter*> waiters;
+
+  /** The result of wait_async() */
+  class awaiter : async_lock_waiter
+  {
+    atomic_async_condition_variable &cv;
+    Mutex &m;
+  public:
+    awaiter(atomic_async_condition_variable &cv, Mutex &m) noexcept :
+      async_lock_waiter(EXCLUSIVE), cv(cv), m(m) {}
+    template<class Executor>
+    awaiter(atomic_async_condition_variable &cv, Mutex &m, Executor &ex)
+      noexcept : async_lock_waiter(EXCLUSIVE, ex), cv(cv), m(m) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) noexcept
+    {
+      handle = h;
+      next = cv.waiters.load(std::memory_order_relaxed);
+      cv.waiters.store(this, std::memory_order_relaxed);
+      /* Once the mutex is released, this may be resumed and freed. */
+      m.unlock();
+    }
+    void await_resume() const noexcept
+    { if (handle && executor) m.take_over(EXCLUSIVE); }
+  };
+
+public:
+  /** @return whether any coroutines are waiting */
+  bool is_waiting() const noexcept
+  { return waiters.load(std::memory_order_relaxed); }
+
+  /** Release the mutex and wait in co_await for notify_one(m) or
+  notify_all(m), and for the mutex to be reacquired.
+  @param m  the mutex, on which an exclusive lock is being held */
+  awaiter wait_async(Mutex &m) noexcept { return {*this, m}; }
+  /** Release the mutex and wait in co_await, resuming on an executor.
+  @param m   the mutex, on which an exclusive lock is being held
+  @param ex  the executor that will resume the coroutine */
+  template<class Executor>
+  awaiter wait_async(Mutex &m, Executor &ex) noexcept
+  { return {*this, m, ex}; }
+
+  /** Move the longest waiting coroutine to the mutex.
+  @param m  the mutex, on which an exclusive lock is being held */
+  void notify_one(Mutex &m) noexcept
+  {
+    async_lock_waiter *w = waiters.load(std::memory_order_relaxed);
+    if (!w)
+      return;
+    if (!w->next)
+      waiters.store(nullptr, std::memory_order_relaxed);
+    else
+    {
+      async_lock_waiter *prev;
+      do
+        prev = w, w = w->next;
+      while (w->next);
+      prev->next = nullptr;
+    }
+    m.requeue(*w, *w, 1);
+  }
+
+  /** Move all waiting coroutines to the mutex.
+  @param m  the mutex, on which an exclusive lock is being held */
+  void notify_all(Mutex &m) noexcept
+  {
+    async_lock_waiter *first = waiters.load(std::memory_order_relaxed);
+    if (!first)
+      return;
+    waiters.store(nullptr, std::memory_order_relaxed);
+    async_lock_waiter *last = first;
+    uint32_t n = 1;
+    for (; last->next; n++)
+      last = last->next;
+    m.requeue(*first, *last, n);
+  }
+};
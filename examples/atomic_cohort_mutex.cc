@@ -0,0 +1,31 @@
+#include "atomic_cohort_mutex.h"
+
+#ifdef _WIN32
+# include <windows.h>
+#elif defined __linux__
+# include <sched.h>
+# include <unistd.h>
+# include <sys/syscall.h>
+#endif
+
+unsigned current_numa_node() noexcept
+{
+#ifdef _WIN32
+  PROCESSOR_NUMBER p;
+  GetCurrentProcessorNumberEx(&p);
+  USHORT node;
+  if (GetNumaProcessorNodeEx(&p, &node))
+    return node;
+#elif defined __linux__
+  unsigned cpu, node;
+# if defined __GLIBC__ && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 29)
+  /* This may be implemented in the vDSO, without a system call. */
+  if (!getcpu(&cpu, &node))
+    return node;
+# else
+  if (!syscall(SYS_getcpu, &cpu, &node, nullptr))
+    return node;
+# endif
+#endif
+  return 0;
+}
@@ -0,0 +1,167 @@
+#pragma once
+#include "atomic_lock_array.h"
+
+/** @return the NUMA node that the current thread is running on,
+or 0 if it cannot be determined */
+unsigned current_numa_node() noexcept;
+
+/** A NUMA-aware cohort lock, based on "Lock Cohorting: A General
+Technique for Designing NUMA Locks" by Dave Dice, Virendra J. Marathe
+and Nir Shavit.
+
+The lock consists of a global atomic_mutex and one local atomic_mutex
+per NUMA node, in separate cache lines. A thread will first acquire the
+local mutex of its node, and then the global one. When the lock is
+released while other threads of the same node are waiting for the local
+mutex, the global mutex will be passed to them without releasing it,
+for at most MAX_HANDOFFS consecutive times. In this way, the lock and
+the data that it protects will tend to stay in the caches of one node.
+
+If there are more NUMA nodes than N_NODES, some nodes will share a local
+mutex. The ownership may be transferred to a different thread
+(unlock() in a different thread than lock()). Timed requests will not
+be counted as waiters, so that the global mutex will not be passed to a
+request that might time out.
+
+For lock elision, get_storage() returns the storage of the global mutex,
+which is held while any thread is holding the lock.
+
+There is no explicit constructor or destructor. Like atomic_mutex,
+the object is expected to be zero-initialized.
+
+@tparam N_NODES       number of local mutexes
+@tparam Storage       the mutex_storage of the local and global mutexes
+@tparam MAX_HANDOFFS  maximum number of consecutive local handoffs */
+template<unsigned N_NODES = 4, typename Storage = mutex_storage<>,
+         unsigned MAX_HANDOFFS = 64>
+class atomic_cohort_mutex
+{
+  static_assert(N_NODES > 0, "N_NODES must be positive");
+
+  /** The lock of a NUMA node */
+  struct alignas(CACHE_LINE_SIZE) cohort
+  {
+    /** the local mutex */
+    atomic_mutex<Storage> local;
+    /** number of lock() requests that are waiting for local */
+    std::atomic<unsigned> waiting;
+    /** whether the global mutex was passed to the next holder of local;
+    protected by local */
+    bool passed;
+    /** number of consecutive handoffs of the global mutex;
+    protected by local */
+    unsigned handoffs;
+  };
+
+  /** the global mutex */
+  alignas(CACHE_LINE_SIZE) atomic_mutex<Storage> global;
+  /** the cohort of the lock holder; protected by global */
+  unsigned owner;
+  /** the local mutexes */
+  cohort cohorts[N_NODES];
+
+  /** @return the cohort of the current thread */
+  static unsigned current() noexcept
+  { return current_numa_node() % N_NODES; }
+
+  /** Pass the global mutex to the next holder of a local mutex
+  @param c  the cohort whose local mutex we are holding */
+  void pass(cohort &c) noexcept
+  {
+    /* For ThreadSanitizer, this is global.unlock(); the address of
+    global is that of its storage. */
+    __tsan_mutex_pre_unlock(&global, 0);
+    c.handoffs++;
+    c.passed = true;
+    __tsan_mutex_post_unlock(&global, 0);
+  }
+  /** Inherit the global mutex if it was passed
+  @param c  the cohort whose local mutex we are holding
+  @return whether the global mutex was passed to us */
+  bool inherit(cohort &c) noexcept
+  {
+    if (!c.passed)
+      return false;
+    /* For ThreadSanitizer, this is global.lock(). */
+    __tsan_mutex_pre_lock(&global, 0);
+    c.passed = false;
+    __tsan_mutex_post_lock(&global, 0, 0);
+    return true;
+  }
+
+public:
+  constexpr const Storage &get_storage() const noexcept
+  { return global.get_storage(); }
+
+  /** @return whether the lock was acquired */
+  bool try_lock() noexcept
+  {
+    const unsigned n = current();
+    cohort &c = cohorts[n];
+    if (!c.local.try_lock())
+      return false;
+    if (!inherit(c) && !global.try_lock())
+    {
+      c.local.unlock();
+      return false;
+    }
+    owner = n;
+    return true;
+  }
+
+  void lock() noexcept
+  {
+    const unsigned n = current();
+    cohort &c = cohorts[n];
+    if (!c.local.try_lock())
+    {
+      c.waiting.fetch_add(1, std::memory_order_relaxed);
+      c.local.lock();
+      c.waiting.fetch_sub(1, std::memory_order_relaxed);
+    }
+    if (!inherit(c))
+      global.lock();
+    owner = n;
+  }
+
+  /** Try to acquire the lock until a deadline.
+  @return whether the lock was acquired */
+  template<class Clock, class Duration>
+  bool try_lock_until(const std::chrono::time_point<Clock, Duration> &t)
+    noexcept
+  {
+    const unsigned n = current();
+    cohort &c = cohorts[n];
+    if (!c.local.try_lock_until(t))
+      return false;
+    if (!inherit(c) && !global.try_lock_until(t))
+    {
+      c.local.unlock();
+      return false;
+    }
+    owner = n;
+    return true;
+  }
+  /** Try to acquire the lock for a limited time.
+  @return whether the lock was acquired */
+  template<class Rep, class Period>
+  bool try_lock_for(const std::chrono::duration<Rep, Period> &d) noexcept
+  { return try_lock_until(std::chrono::steady_clock::now() + d); }
+
+  void unlock() noexcept
+  {
+    cohort &c = cohorts[owner];
+    assert(!c.passed);
+    if (c.handoffs < MAX_HANDOFFS &&
+        c.waiting.load(std::memory_order_relaxed))
+      /* A waiting lock() will acquire the local mutex, and it will
+      inherit the global mutex. */
+      pass(c);
+    else
+    {
+      c.handoffs = 0;
+      global.unlock();
+    }
+    c.local.unlock();
+  }
+};
@@ -0,0 +1,177 @@
+#pragma once
+#include <memory>
+#include <type_traits>
+#include "atomic_lock_array.h"
+
+/** A flat combining lock, based on "Flat Combining and the
+Synchronization-Parallelism Tradeoff" by Danny Hendler, Itai Incze,
+Nir Shavit and Moran Tzafrir.
+
+A critical section is submitted as a closure to execute(), instead of
+being enclosed in lock() and unlock():
+
+  m.execute([&]{ stats.count++; stats.sum += x; });
+
+If the mutex is contended, the closure is published in a slot of the
+current thread, and the thread that is holding the mutex will execute
+a batch of the published closures before releasing it. In this way,
+the protected data will tend to stay in the cache of the combining
+thread. The publishing thread spins on its own slot for a while, trying
+to acquire the mutex and to become the combiner if it is released;
+after spin_rounds, it will wait for the mutex by atomic_mutex::lock(),
+and execute any pending closures itself.
+
+The closures must not throw exceptions, and they must not wait for
+anything that a pending execute() request of another thread could be
+holding. The closure of another thread may be executed in any thread,
+so thread_local variables must not be relied on. Results can be
+reported by modifying variables that were captured by reference.
+
+A thread is assigned a slot by a per-thread counter modulo N_SLOTS.
+If the slot is being used by another thread, execute() will fall back
+to acquiring the mutex. The lock(), try_lock() and unlock() of the
+std::mutex interface are also available; unlock() will execute the
+pending closures before releasing the mutex.
+
+There is no explicit constructor or destructor. Like atomic_mutex,
+the object is expected to be zero-initialized.
+
+@tparam N_SLOTS  number of publication slots (at most 32)
+@tparam Storage  the mutex_storage of the mutex
+@tparam Backoff  the back-off policy of spinning on a slot */
+template<unsigned N_SLOTS = 32, typename Storage = mutex_storage<>,
+         typename Backoff = pause_backoff>
+class atomic_combining_mutex
+{
+  static_assert(N_SLOTS > 0 && N_SLOTS <= 32, "N_SLOTS must be 1 to 32");
+
+  /** The publication slot of a thread */
+  struct alignas(CACHE_LINE_SIZE) slot
+  {
+    /** FREE, CLAIMED or DONE */
+    std::atomic<uint32_t> state;
+    /** the closure invoker; protected by state */
+    void (*invoke)(void *closure);
+    /** the closure; protected by state */
+    void *closure;
+  };
+
+  /** state of an unused slot */
+  static constexpr uint32_t FREE = 0;
+  /** state of a slot that is owned by a thread in execute() */
+  static constexpr uint32_t CLAIMED = 1;
+  /** state of a slot whose closure has been executed */
+  static constexpr uint32_t DONE = 2;
+
+  /** the mutex */
+  alignas(CACHE_LINE_SIZE) atomic_mutex<Storage> m;
+  /** bitmap of the slots whose closures are waiting to be executed */
+  std::atomic<uint32_t> pending;
+  /** the publication slots */
+  slot slots[N_SLOTS];
+
+  /** @return the slot number of the current thread */
+  static unsigned current() noexcept
+  {
+    static std::atomic<unsigned> threads;
+    static thread_local unsigned id =
+      threads.fetch_add(1, std::memory_order_relaxed);
+    return id % N_SLOTS;
+  }
+
+  template<class F> static void invoke_closure(void *closure)
+  { (*static_cast<F*>(closure))(); }
+
+  /** Execute the published closures; the mutex must be held */
+  void combine() noexcept
+  {
+    if (!pending.load(std::memory_order_relaxed))
+      return;
+    for (uint32_t p = pending.exchange(0, std::memory_order_acquire); p;
+         p &= p - 1)
+    {
+      unsigned i = 0;
+      while (!(p & (1U << i)))
+        i++;
+      slot &s = slots[i];
+      assert(s.state.load(std::memory_order_relaxed) == CLAIMED);
+      s.invoke(s.closure);
+      s.state.store(DONE, std::memory_order_release);
+    }
+  }
+
+  /** Publish a closure and wait for it to be executed.
+  @param invoke       the closure invoker
+  @param closure      the closure
+  @param spin_rounds  number of times to check for the completion
+                      before waiting for the mutex
+  @return whether the closure was executed
+  @retval false if the slot is in use; the mutex should be acquired */
+  bool delegate(void (*invoke)(void*), void *closure, unsigned spin_rounds)
+    noexcept
+  {
+    const unsigned i = current();
+    slot &s = slots[i];
+    uint32_t state = FREE;
+    if (!s.state.compare_exchange_strong(state, CLAIMED,
+                                         std::memory_order_relaxed,
+                                         std::memory_order_relaxed))
+      return false;
+
+    s.invoke = invoke;
+    s.closure = closure;
+    pending.fetch_or(1U << i, std::memory_order_release);
+
+    for (Backoff backoff;; backoff(s.state, CLAIMED))
+    {
+      if (s.state.load(std::memory_order_acquire) == DONE)
+        break;
+      if (!spin_rounds--)
+        m.lock();
+      else if (m.get_storage().is_locked() || !m.try_lock())
+        continue;
+      /* Our closure may have been executed before we acquired the mutex.
+      If not, unlock() will execute it. */
+      unlock();
+      break;
+    }
+
+    assert(s.state.load(std::memory_order_relaxed) == DONE);
+    s.state.store(FREE, std::memory_order_relaxed);
+    return true;
+  }
+
+public:
+  constexpr const Storage &get_storage() const noexcept
+  { return m.get_storage(); }
+
+  /** @return whether the mutex was acquired */
+  bool try_lock() noexcept { return m.try_lock(); }
+  void lock() noexcept { m.lock(); }
+  /** Execute any published closures, and release the mutex */
+  void unlock() noexcept
+  {
+    combine();
+    m.unlock();
+  }
+
+  /** Execute a critical section, possibly in another thread.
+  @param f            the critical section
+  @param spin_rounds  number of times to check for the completion of f
+                      before waiting for the mutex */
+  template<class F> void execute(F &&f, unsigned spin_rounds = 100)
+    noexcept
+  {
+    if (!m.try_lock())
+    {
+      if (delegate(invoke_closure<typename std::remove_reference<F>::type>,
+                   const_cast<void*>(static_cast<const void*>
+                                     (std::addressof(f))),
+                   spin_rounds))
+        return;
+      m.lock();
+    }
+    f();
+    unlock();
+  }
+};
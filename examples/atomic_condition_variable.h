@@ -1,6 +1,7 @@
 #pragma once
 #include <atomic>
 #include <cassert>
+#include "atomic_mutex.h"
 
 /** Tiny condition variable that keeps a count of waiters.
 
@@ -9,108 +10,317 @@ The interface intentionally resembles std::condition_variable.
 In addition to wait(), we also define wait_shared() and wait_update(),
 to go with atomic_shared_mutex.
 
-A straightforward implementation of wait_until() would require the
-existence of std::atomic::wait_until().
+We define wait_until() and wait_for() (as well as wait_shared_until(),
+wait_shared_for(), wait_update_until(), wait_update_for()) by invoking
+atomic_wait_until(), because std::atomic::wait_until() does not exist.
 
 We define the predicate is_waiting().
 
+For atomic_mutex, we define broadcast(m), which avoids a thundering herd
+by registering all waiters in the mutex. On Linux, the blocked threads
+will be moved to the mutex by FUTEX_CMP_REQUEUE, to be woken up one by
+one by atomic_mutex::unlock(). The caller must hold the mutex, and all
+waiters must use wait(m) or wait_until(m) with the same mutex.
+The waiting threads cannot be told apart, so there is no signal(m).
+
+The object consists of one 64-bit word: a 16-bit count of waiters, a
+16-bit generation that is incremented by broadcast(m), and a 32-bit
+counter of events in the other half of the word, which the waiters
+wait on. A waiter compares the generation in order to determine whether
+broadcast(m) registered it in the mutex. (8 bytes)
+
 There is no explicit constructor or destructor.
 The object is expected to be zero-initialized, so that
 !is_waiting() will hold.
 
 The implementation counts pending wait() requests, so that signal()
 and broadcast() will only invoke notify_one() or notify_all() when
-pending requests exist. */
+pending requests exist.
 
-#ifdef _WIN32
-#elif __cplusplus >= 202002L
-#else /* Emulate the C++20 primitives */
-# include <climits>
+For memory that is shared between processes, there is
+atomic_process_shared_condition_variable, which is to be used with
+process-shared mutexes, such as atomic_mutex<mutex_storage<uint32_t,
+pause_backoff, true>>. It waits by process_shared_wait(). */
+
+#include <climits>
+#ifdef USE_FUTEX
 # if defined __linux__
 #  include <linux/futex.h>
 #  include <unistd.h>
 #  include <sys/syscall.h>
 #  define FUTEX(op,n) \
-   syscall(SYS_futex, this, FUTEX_ ## op ## _PRIVATE, n, nullptr, nullptr, 0)
+   syscall(SYS_futex, &seq(), FUTEX_ ## op ## _PRIVATE, n, nullptr, nullptr, \
+           0)
 # elif defined __OpenBSD__
 #  include <sys/time.h>
 #  include <sys/futex.h>
 #  define FUTEX(op,n) \
-   futex((volatile uint32_t*) this, FUTEX_ ## op, n, nullptr, nullptr)
+   futex((volatile uint32_t*) &seq(), FUTEX_ ## op, n, nullptr, nullptr)
 # elif defined __FreeBSD__
 #   include <sys/types.h>
 #   include <sys/umtx.h>
 #   define FUTEX_WAKE UMTX_OP_WAKE_PRIVATE
 #   define FUTEX_WAIT UMTX_OP_WAIT_UINT_PRIVATE
-#   define FUTEX(op,n) _umtx_op(this, FUTEX_ ## op, n, nullptr, nullptr)
+#   define FUTEX(op,n) _umtx_op(&seq(), FUTEX_ ## op, n, nullptr, nullptr)
 # elif defined __DragonFly__
 #   include <unistd.h>
 #   define FUTEX_WAKE(a,n) umtx_wakeup(a,n)
 #   define FUTEX_WAIT(a,n) umtx_sleep(a,n,0)
-#   define FUTEX(op,n) FUTEX_ ## op((volatile int*) this, int(n))
+#   define FUTEX(op,n) FUTEX_ ## op((volatile int*) &seq(), int(n))
+# elif defined __APPLE__
+extern "C" int __ulock_wait(uint32_t op, void *addr, uint64_t value,
+                            uint32_t timeout_us);
+extern "C" int __ulock_wake(uint32_t op, void *addr, uint64_t wake_value);
+/* UL_COMPARE_AND_WAIT = 1, ULF_WAKE_ALL = 0x100 */
+#   define FUTEX_WAKE(a,n) __ulock_wake(1 | (n == 1 ? 0 : 0x100), a, 0)
+#   define FUTEX_WAIT(a,n) __ulock_wait(1, a, n, 0)
+#   define FUTEX(op,n) FUTEX_ ## op((void*) &seq(), n)
+# elif defined _WIN32
+#   include <windows.h>
+#   define FUTEX_WAKE(a,n) \
+    (n == 1 ? WakeByAddressSingle(a) : WakeByAddressAll(a))
+#   define FUTEX_WAIT(a,n) \
+    do { uint32_t old = n; WaitOnAddress(a, &old, sizeof old, INFINITE); } \
+    while (false)
+#   define FUTEX(op,n) FUTEX_ ## op((void*) &seq(), n)
 # else
 #  error "no C++20 nor futex support"
 # endif
 #endif
 
-class atomic_condition_variable : private std::atomic<uint32_t>
+/** The condition variable
+@tparam ProcessShared  whether the object may be shared between processes */
+template<bool ProcessShared>
+class basic_atomic_condition_variable : private std::atomic<uint64_t>
 {
-#if defined _WIN32 || __cplusplus >= 202002L
-  void wait(uint32_t old) const noexcept { atomic::wait(old); }
-#else /* Emulate the C++20 primitives */
-  void notify_one() noexcept { FUTEX(WAKE, 1); }
-  void notify_all() noexcept { FUTEX(WAKE, INT_MAX); }
-  void wait(uint32_t old) const noexcept { FUTEX(WAIT, old); }
+  /** Mask of the number of waiters */
+  static constexpr uint64_t WAITERS = (1U << 16) - 1;
+  /** Counter of broadcast(m), which resets the number of waiters */
+  static constexpr uint64_t GENERATION = 1U << 16;
+  /** Counter of signal(), broadcast() and broadcast(m), in the 32-bit
+  half of the word that the waiters wait on */
+  static constexpr uint64_t EVENT = uint64_t{1} << 32;
+
+  /** @return the EVENT counter, which the waiters wait on */
+  std::atomic<uint32_t> &seq() noexcept
+  {
+    static_assert(sizeof(std::atomic<uint64_t>) == 8, "compatibility");
+    static_assert(sizeof(std::atomic<uint32_t>) == 4, "compatibility");
+    return reinterpret_cast<std::atomic<uint32_t>*>
+      (static_cast<std::atomic<uint64_t>*>(this))
+#if defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      [0];
+#else
+      [1];
 #endif
-  static constexpr uint32_t EVENT = 1U << 16;
+  }
+  const std::atomic<uint32_t> &seq() const noexcept
+  { return const_cast<basic_atomic_condition_variable*>(this)->seq(); }
+
+#ifndef USE_FUTEX
+  void private_notify_one() noexcept { seq().notify_one(); }
+  void private_notify_all() noexcept { seq().notify_all(); }
+  void private_wait(uint32_t old) const noexcept { seq().wait(old); }
+#else
+  void private_notify_one() noexcept { FUTEX(WAKE, 1); }
+  void private_notify_all() noexcept { FUTEX(WAKE, INT_MAX); }
+  void private_wait(uint32_t old) const noexcept { FUTEX(WAIT, old); }
+#endif
+  void notify_one() noexcept
+  {
+    if (ProcessShared)
+      process_shared_notify(seq(), 1);
+    else
+      private_notify_one();
+  }
+  void notify_all() noexcept
+  {
+    if (ProcessShared)
+      process_shared_notify(seq(), INT_MAX);
+    else
+      private_notify_all();
+  }
+  /** Wait for the EVENT counter to change.
+  @param val  the value of the word when the waiter was registered */
+  void wait_event(uint64_t val) const noexcept
+  {
+    if (ProcessShared)
+      process_shared_wait(seq(), uint32_t(val >> 32));
+    else
+      private_wait(uint32_t(val >> 32));
+  }
+  /** Wait for the EVENT counter to change, or for a deadline.
+  @param val  the value of the word when the waiter was registered
+  @return false if the deadline was reached */
+  bool wait_event_until(uint64_t val,
+                        std::chrono::steady_clock::time_point t)
+    const noexcept
+  { return atomic_wait_until(seq(), uint32_t(val >> 32), t, ProcessShared); }
+
+  /** Deregister a waiter.
+  @param val  the value of the word before the waiter was registered
+  @return whether broadcast(m) had registered the waiter in the mutex */
+  bool deregister(uint64_t val) noexcept
+  {
+    uint64_t v = load(std::memory_order_relaxed);
+    do
+      if ((v ^ val) & (EVENT - GENERATION))
+        return true;
+    while (!compare_exchange_weak(v, v - 1, std::memory_order_relaxed));
+    return false;
+  }
 public:
   /** Default constructor */
-  constexpr atomic_condition_variable() : std::atomic<uint32_t>(0) {}
+  constexpr basic_atomic_condition_variable() : std::atomic<uint64_t>(0) {}
   /** No copy constructor */
-  atomic_condition_variable(const atomic_condition_variable&) = delete;
-  /** No assignment operator */
-  atomic_condition_variable& operator=(const atomic_condition_variable&) =
+  basic_atomic_condition_variable(const basic_atomic_condition_variable&) =
     delete;
+  /** No assignment operator */
+  basic_atomic_condition_variable&
+  operator=(const basic_atomic_condition_variable&) = delete;
 
   template<class mutex> void wait(mutex &m)
   {
-    const uint32_t val = fetch_add(1, std::memory_order_acquire);
+    const uint64_t val = fetch_add(1, std::memory_order_acquire);
     m.unlock();
-    wait(1 + val);
+    wait_event(val);
     fetch_sub(1, std::memory_order_relaxed);
     m.lock();
   }
 
+  template<class Storage> void wait(atomic_mutex<Storage> &m)
+  {
+    const uint64_t val = fetch_add(1, std::memory_order_acquire);
+    m.unlock();
+    wait_event(val);
+    if (deregister(val))
+      m.lock_requeued();
+    else
+      m.lock();
+  }
+
   template<class mutex> void wait_shared(mutex &m)
   {
-    const uint32_t val = fetch_add(1, std::memory_order_acquire);
+    const uint64_t val = fetch_add(1, std::memory_order_acquire);
     m.unlock_shared();
-    wait(1 + val);
+    wait_event(val);
     fetch_sub(1, std::memory_order_relaxed);
     m.lock_shared();
   }
 
   template<class mutex> void wait_update(mutex &m)
   {
-    const uint32_t val = fetch_add(1, std::memory_order_acquire);
+    const uint64_t val = fetch_add(1, std::memory_order_acquire);
     m.unlock_update();
-    wait(1 + val);
+    wait_event(val);
     fetch_sub(1, std::memory_order_relaxed);
     m.lock_update();
   }
 
+  /** Wait for a signal or a deadline.
+  @return false if the deadline was reached */
+  template<class mutex, class Clock, class Duration>
+  bool wait_until(mutex &m, const std::chrono::time_point<Clock, Duration> &t)
+  {
+    const uint64_t val = fetch_add(1, std::memory_order_acquire);
+    m.unlock();
+    const bool ok = wait_event_until(val, to_steady_clock(t));
+    fetch_sub(1, std::memory_order_relaxed);
+    m.lock();
+    return ok;
+  }
+  /** Wait for a signal or a deadline.
+  @return false if the deadline was reached */
+  template<class Storage, class Clock, class Duration>
+  bool wait_until(atomic_mutex<Storage> &m,
+                  const std::chrono::time_point<Clock, Duration> &t)
+  {
+    const uint64_t val = fetch_add(1, std::memory_order_acquire);
+    m.unlock();
+    const bool ok = wait_event_until(val, to_steady_clock(t));
+    if (deregister(val))
+    {
+      m.lock_requeued();
+      return true;
+    }
+    m.lock();
+    return ok;
+  }
+  /** Wait for a signal or a timeout.
+  @return false if the timeout expired */
+  template<class mutex, class Rep, class Period>
+  bool wait_for(mutex &m, const std::chrono::duration<Rep, Period> &d)
+  { return wait_until(m, std::chrono::steady_clock::now() + d); }
+
+  /** Wait for a signal or a deadline.
+  @return false if the deadline was reached */
+  template<class mutex, class Clock, class Duration>
+  bool wait_shared_until(mutex &m,
+                         const std::chrono::time_point<Clock, Duration> &t)
+  {
+    const uint64_t val = fetch_add(1, std::memory_order_acquire);
+    m.unlock_shared();
+    const bool ok = wait_event_until(val, to_steady_clock(t));
+    fetch_sub(1, std::memory_order_relaxed);
+    m.lock_shared();
+    return ok;
+  }
+  /** Wait for a signal or a timeout.
+  @return false if the timeout expired */
+  template<class mutex, class Rep, class Period>
+  bool wait_shared_for(mutex &m, const std::chrono::duration<Rep, Period> &d)
+  { return wait_shared_until(m, std::chrono::steady_clock::now() + d); }
+
+  /** Wait for a signal or a deadline.
+  @return false if the deadline was reached */
+  template<class mutex, class Clock, class Duration>
+  bool wait_update_until(mutex &m,
+                         const std::chrono::time_point<Clock, Duration> &t)
+  {
+    const uint64_t val = fetch_add(1, std::memory_order_acquire);
+    m.unlock_update();
+    const bool ok = wait_event_until(val, to_steady_clock(t));
+    fetch_sub(1, std::memory_order_relaxed);
+    m.lock_update();
+    return ok;
+  }
+  /** Wait for a signal or a timeout.
+  @return false if the timeout expired */
+  template<class mutex, class Rep, class Period>
+  bool wait_update_for(mutex &m, const std::chrono::duration<Rep, Period> &d)
+  { return wait_update_until(m, std::chrono::steady_clock::now() + d); }
+
   bool is_waiting() const noexcept
-  { return load(std::memory_order_acquire) & (EVENT - 1); }
+  { return load(std::memory_order_acquire) & WAITERS; }
 
   void signal() noexcept
   {
-    if (fetch_add(EVENT, std::memory_order_release) & (EVENT - 1))
+    if (fetch_add(EVENT, std::memory_order_release) & WAITERS)
       notify_one();
   }
 
   void broadcast() noexcept
   {
-    if (fetch_add(EVENT, std::memory_order_release) & (EVENT - 1))
+    if (fetch_add(EVENT, std::memory_order_release) & WAITERS)
       notify_all();
   }
+
+  /** Wake up all waiters, registering them as waiters of a mutex.
+  @param m  the mutex that all waiters are using; must be held */
+  template<class Storage> void broadcast(atomic_mutex<Storage> &m) noexcept
+  {
+    uint64_t v = load(std::memory_order_relaxed), n;
+    do
+      if (!(n = v & WAITERS))
+        return;
+    while (!compare_exchange_weak(v, (v & ~WAITERS) + GENERATION + EVENT,
+                                  std::memory_order_release,
+                                  std::memory_order_relaxed));
+    m.requeue(seq(), uint32_t(((v & ~WAITERS) + GENERATION + EVENT) >> 32),
+              uint32_t(n));
+  }
 };
+
+typedef basic_atomic_condition_variable<false> atomic_condition_variable;
+typedef basic_atomic_condition_variable<true>
+  atomic_process_shared_condition_variable;
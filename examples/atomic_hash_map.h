@@ -0,0 +1,382 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <new>
+#include "atomic_lock_array.h"
+#include "transactional_lock_guard.h"
+
+/** How atomic_hash_map uses a bucket lock */
+template<class Lock>
+struct atomic_hash_map_lock
+{
+  typedef transactional_shared_lock_guard<Lock> shared_guard;
+  static void lock_update(Lock &l) noexcept { l.lock_update(); }
+  static void unlock_update(Lock &l) noexcept { l.unlock_update(); }
+  static void upgrade(Lock &l) noexcept { l.update_lock_upgrade(); }
+};
+
+/** For atomic_mutex, all locks are exclusive */
+template<class Storage>
+struct atomic_hash_map_lock<atomic_mutex<Storage>>
+{
+  typedef atomic_mutex<Storage> Lock;
+  typedef transactional_lock_guard<Lock> shared_guard;
+  static void lock_update(Lock &l) noexcept { l.lock(); }
+  static void unlock_update(Lock &l) noexcept { l.unlock(); }
+  static void upgrade(Lock &) noexcept {}
+};
+
+/** A concurrent hash table with chaining, similar to the buf_pool.page_hash
+of MariaDB Server. Each cache line consists of a Lock (atomic_shared_mutex
+or atomic_mutex) followed by as many hash cells as will fit.
+
+Lookups acquire a shared lock, or elide it with transactional memory.
+An insert acquires an update lock, so that lookups may proceed while
+the duplicate check is being made, and it upgrades the lock only for
+storing the pointer to the new element. An erase acquires an exclusive
+lock.
+
+When the number of elements exceeds the number of cells, a table of
+twice as many buckets will be allocated. The buckets are migrated
+lazily: an insert or erase that encounters the old table will move the
+elements of its bucket (if not done yet) and of one more bucket to the
+new table. Lookups follow the moved buckets to the new table. The retired
+tables will only be freed by the destructor, because a lookup may still
+be accessing them; their total size is less than that of the newest table.
+
+@tparam Key    key type, comparable with ==
+@tparam Value  value type, copyable
+@tparam Hash   hash function of Key
+@tparam Lock   atomic_shared_mutex or atomic_mutex */
+template<typename Key, typename Value, typename Hash = std::hash<Key>,
+         typename Lock = atomic_shared_mutex<>>
+class atomic_hash_map
+{
+  typedef atomic_hash_map_lock<Lock> lock_traits;
+
+  /** An element */
+  struct node
+  {
+    /** next element in the hash chain */
+    node *next;
+    const Key key;
+    Value value;
+  };
+
+  /** Number of cells in a bucket */
+  static constexpr size_t CELLS =
+    (CACHE_LINE_SIZE - sizeof(Lock)) / sizeof(node*);
+  static_assert(CELLS > 0, "Lock does not fit in a cache line");
+
+  /** A cache line */
+  struct alignas(CACHE_LINE_SIZE) bucket
+  {
+    /** the lock that protects the cells */
+    Lock lock;
+    /** the hash chains, or moved() after the bucket was migrated */
+    node *cell[CELLS];
+  };
+
+  /** @return the marker of a migrated cell */
+  static node *moved() noexcept
+  { return reinterpret_cast<node*>(uintptr_t(1)); }
+
+  /** A hash table */
+  struct table
+  {
+    /** number of buckets */
+    const size_t n_buckets;
+    /** the buckets (aligned to CACHE_LINE_SIZE) */
+    bucket *const buckets;
+    /** the allocated memory */
+    char *const mem;
+    /** the larger table to which this is being migrated, or nullptr */
+    std::atomic<table*> next;
+    /** the next bucket to be migrated by help_migrate() */
+    std::atomic<size_t> migrate_cursor;
+    /** number of migrated buckets */
+    std::atomic<size_t> migrated;
+
+    table(size_t n, char *mem) :
+      n_buckets(n),
+      buckets(reinterpret_cast<bucket*>
+              ((uintptr_t(mem) + (CACHE_LINE_SIZE - 1)) &
+               ~uintptr_t(CACHE_LINE_SIZE - 1))),
+      mem(mem), next(nullptr), migrate_cursor(0), migrated(0)
+    {
+      for (size_t i = 0; i < n; i++)
+        new (&buckets[i]) bucket();
+    }
+    ~table()
+    {
+      for (size_t i = 0; i < n_buckets; i++)
+        buckets[i].~bucket();
+      delete[] mem;
+    }
+
+    /** Allocate a table.
+    @param n  number of buckets
+    @return the table
+    @retval nullptr if out of memory */
+    static table *create(size_t n) noexcept
+    {
+      char *mem = new (std::nothrow) char[n * sizeof(bucket) +
+                                          CACHE_LINE_SIZE - 1];
+      if (!mem)
+        return nullptr;
+      if (table *t = new (std::nothrow) table(n, mem))
+        return t;
+      delete[] mem;
+      return nullptr;
+    }
+
+    /** @return number of cells */
+    size_t n_cells() const noexcept { return n_buckets * CELLS; }
+
+    /** Look up the bucket of a hash value.
+    @param h  hash value
+    @param c  the cell index in the bucket
+    @return the bucket */
+    bucket &get(size_t h, size_t &c) const noexcept
+    {
+      const size_t i = h % n_cells();
+      c = i % CELLS;
+      return buckets[i / CELLS];
+    }
+  };
+
+  /** the hash function */
+  const Hash hash;
+  /** the oldest table */
+  table *const oldest;
+  /** the table that inserts and erases start from */
+  std::atomic<table*> current;
+  /** number of elements */
+  std::atomic<size_t> n_items;
+
+  /** Move the elements of an exclusively locked bucket to the next table.
+  @param t  the table that contains b
+  @param b  bucket that has not been migrated */
+  void migrate(table &t, bucket &b) noexcept
+  {
+    table &next = *t.next.load(std::memory_order_acquire);
+    for (node *&head : b.cell)
+    {
+      assert(head != moved());
+      for (node *n = head; n; )
+      {
+        node *const following = n->next;
+        size_t c;
+        bucket &nb = next.get(hash(n->key), c);
+        nb.lock.lock();
+        /* The next table cannot start growing until the migration
+        to it has been completed. */
+        assert(nb.cell[c] != moved());
+        n->next = nb.cell[c];
+        nb.cell[c] = n;
+        nb.lock.unlock();
+        n = following;
+      }
+      head = moved();
+    }
+    if (t.migrated.fetch_add(1, std::memory_order_relaxed) + 1 == t.n_buckets)
+      current.store(&next, std::memory_order_release);
+  }
+
+  /** Migrate one more bucket of a table */
+  void help_migrate(table &t) noexcept
+  {
+    const size_t i = t.migrate_cursor.fetch_add(1, std::memory_order_relaxed);
+    if (i >= t.n_buckets)
+      return;
+    bucket &b = t.buckets[i];
+    b.lock.lock();
+    if (b.cell[0] != moved())
+      migrate(t, b);
+    b.lock.unlock();
+  }
+
+  /** Start migrating a table to a table of twice as many buckets */
+  void grow(table &t) noexcept
+  {
+    table *next = table::create(t.n_buckets * 2);
+    if (!next)
+      return; /* out of memory; keep using the current table */
+    table *expected = nullptr;
+    if (t.next.compare_exchange_strong(expected, next,
+                                       std::memory_order_release,
+                                       std::memory_order_relaxed))
+      help_migrate(t);
+    else
+      delete next;
+  }
+
+  /** Lock the bucket of a hash value in the newest table, migrating
+  any buckets on the way.
+  @param h          hash value
+  @param exclusive  whether to acquire an exclusive lock instead of update
+  @param t          the table that contains the bucket
+  @param c          the cell index in the bucket
+  @return the locked bucket */
+  bucket &lock_for_write(size_t h, bool exclusive, table *&t, size_t &c)
+    noexcept
+  {
+    for (t = current.load(std::memory_order_acquire);; )
+    {
+      bucket &b = t->get(h, c);
+      if (exclusive)
+        b.lock.lock();
+      else
+        lock_traits::lock_update(b.lock);
+      if (b.cell[0] == moved())
+      {
+        if (exclusive)
+          b.lock.unlock();
+        else
+          lock_traits::unlock_update(b.lock);
+        help_migrate(*t);
+      }
+      else if (!t->next.load(std::memory_order_acquire))
+        return b;
+      else
+      {
+        if (!exclusive)
+          lock_traits::upgrade(b.lock);
+        migrate(*t, b);
+        b.lock.unlock();
+        help_migrate(*t);
+      }
+      t = t->next.load(std::memory_order_acquire);
+    }
+  }
+
+public:
+  /** Constructor
+  @param n  initial number of hash cells
+  @param h  the hash function */
+  explicit atomic_hash_map(size_t n = CELLS, const Hash &h = Hash()) :
+    hash(h), oldest(table::create(n > CELLS ? (n + CELLS - 1) / CELLS : 1)),
+    current(oldest), n_items(0)
+  {
+    if (!oldest)
+      throw std::bad_alloc();
+  }
+  atomic_hash_map(const atomic_hash_map&) = delete;
+  atomic_hash_map &operator=(const atomic_hash_map&) = delete;
+
+  ~atomic_hash_map()
+  {
+    for (table *t = oldest; t; )
+    {
+      for (size_t i = 0; i < t->n_buckets; i++)
+        for (node *n : t->buckets[i].cell)
+          if (n != moved())
+            while (n)
+            {
+              node *following = n->next;
+              delete n;
+              n = following;
+            }
+      table *next = t->next.load(std::memory_order_relaxed);
+      delete t;
+      t = next;
+    }
+  }
+
+  /** @return the number of elements */
+  size_t size() const noexcept
+  { return n_items.load(std::memory_order_relaxed); }
+  /** @return the number of hash cells in the newest table */
+  size_t capacity() const noexcept
+  {
+    table *t = current.load(std::memory_order_acquire);
+    while (table *next = t->next.load(std::memory_order_acquire))
+      t = next;
+    return t->n_cells();
+  }
+
+  /** Look up an element.
+  @param key    the key to look up
+  @param value  the value of the element (output)
+  @return whether the element was found */
+  TRANSACTIONAL_TARGET bool find(const Key &key, Value &value) const
+  {
+    const size_t h = hash(key);
+    for (table *t = current.load(std::memory_order_acquire);; )
+    {
+      size_t c;
+      bucket &b = t->get(h, c);
+      {
+        typename lock_traits::shared_guard g{b.lock};
+        node *n = b.cell[c];
+        if (n != moved())
+        {
+          for (; n; n = n->next)
+          {
+            if (n->key == key)
+            {
+              value = n->value;
+              return true;
+            }
+          }
+          return false;
+        }
+      }
+      t = t->next.load(std::memory_order_acquire);
+    }
+  }
+
+  /** Insert an element.
+  @param key    the key
+  @param value  the value
+  @return whether the element was inserted (the key did not exist) */
+  bool insert(const Key &key, const Value &value)
+  {
+    std::unique_ptr<node> n{new node{nullptr, key, value}};
+    table *t;
+    size_t c;
+    bucket &b = lock_for_write(hash(key), false, t, c);
+    for (const node *p = b.cell[c]; p; p = p->next)
+    {
+      if (p->key == key)
+      {
+        lock_traits::unlock_update(b.lock);
+        return false;
+      }
+    }
+    n->next = b.cell[c];
+    lock_traits::upgrade(b.lock);
+    b.cell[c] = n.release();
+    b.lock.unlock();
+    /* Only the current table may grow, so that a table will only be
+    migrated to a table that is not being migrated. */
+    if (n_items.fetch_add(1, std::memory_order_relaxed) >= t->n_cells() &&
+        t == current.load(std::memory_order_acquire))
+      grow(*t);
+    return true;
+  }
+
+  /** Remove an element.
+  @param key  the key
+  @return whether the element was removed (the key existed) */
+  bool erase(const Key &key) noexcept
+  {
+    table *t;
+    size_t c;
+    bucket &b = lock_for_write(hash(key), true, t, c);
+    for (node **p = &b.cell[c]; *p; p = &(*p)->next)
+    {
+      node *n = *p;
+      if (n->key == key)
+      {
+        *p = n->next;
+        b.lock.unlock();
+        n_items.fetch_sub(1, std::memory_order_relaxed);
+        delete n;
+        return true;
+      }
+    }
+    b.lock.unlock();
+    return false;
+  }
+};
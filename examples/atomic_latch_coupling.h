@@ -0,0 +1,279 @@
+#pragma once
+#include <cassert>
+#include <cstddef>
+#include "atomic_shared_mutex.h"
+#include "transactional_lock_guard.h"
+
+/** Hand-over-hand locking (latch coupling, or crabbing) of a path
+from the root of a tree, such as the page latches of a B-tree.
+The held latches are tracked in a fixed-size stack.
+
+All latches must be acquired from the root downwards. The child will be
+acquired before the parent is released. A typical descent is optimistic:
+
+  latch_coupling<> p;
+  p.lock_root_elided(root);
+  while (!is_leaf_parent(node))
+    if (!p.couple(child_of(node), p.SHARED))
+      restart
+  if (!p.couple(leaf, p.EXCLUSIVE))
+    restart pessimistically
+
+If the operation turns out to affect the ancestors (for example, a
+page split), the path must be released, and the descent restarted with
+lock_root(root, UPDATE) and push(child, UPDATE), using release_ancestors()
+whenever a node is unaffected. Once the affected nodes are known,
+upgrade() will convert the update latches to exclusive, from the root
+downwards. Update latches do not conflict with shared latches, so that
+optimistic descents can proceed until then.
+
+A thread that is holding a shared latch on the parent must not wait for
+a latch on the child: the holder of an update latch on the child could
+be waiting in upgrade() for our shared latch on the parent. Even a shared
+latch request may have to wait for an update latch, if it was blocked by
+an exclusive latch (atomic_shared_mutex::lock_shared() would wait in
+lock_update()). Therefore, below a shared latch, couple() and push() will
+only try to acquire the child, and return false if that failed. The path
+should then be released and the descent be restarted. Below an update or
+exclusive latch, the child will be waited for.
+
+With lock_root_elided(), the shared latches of the path will be elided
+in a single memory transaction, like transactional_shared_lock_guard.
+The transaction will be committed when an update or exclusive latch is
+acquired, or when the path is released; if it is aborted, execution will
+resume at lock_root_elided(), which falls back to acquiring the latch.
+Therefore, the object must be in the same function as the descent.
+
+@tparam Latch      atomic_shared_mutex or similar
+@tparam MAX_DEPTH  maximum number of latches held at a time */
+template<class Latch = atomic_shared_mutex<>, size_t MAX_DEPTH = 16>
+class latch_coupling
+{
+public:
+  /** latch modes, in ascending order of strength */
+  enum mode { SHARED, UPDATE, EXCLUSIVE };
+
+private:
+  /** a held latch */
+  struct entry
+  {
+    /** the latch */
+    Latch *latch;
+    /** the held mode */
+    mode held;
+  };
+
+  /** the held latches, from the root downwards */
+  entry path[MAX_DEPTH];
+  /** number of elements in path */
+  size_t depth;
+#ifdef WITH_ELISION
+  /** the root, while the shared latches of path are being elided */
+  const Latch *elided;
+#endif
+
+  static void acquire(Latch &l, mode m) noexcept
+  {
+    switch (m) {
+    case SHARED: l.spin_lock_shared(); return;
+    case UPDATE: l.spin_lock_update(); return;
+    case EXCLUSIVE: l.spin_lock(); return;
+    }
+  }
+  static bool try_acquire(Latch &l, mode m) noexcept
+  {
+    switch (m) {
+    case SHARED: return l.try_lock_shared();
+    case UPDATE: return l.try_lock_update();
+    case EXCLUSIVE: return l.try_lock();
+    }
+    return false;
+  }
+  static void release(const entry &e) noexcept
+  {
+    switch (e.held) {
+    case SHARED: e.latch->unlock_shared(); return;
+    case UPDATE: e.latch->unlock_update(); return;
+    case EXCLUSIVE: e.latch->unlock(); return;
+    }
+  }
+
+#ifdef WITH_ELISION
+  /** Acquire the latches whose shared mode was elided, and commit
+  the memory transaction.
+  @param n  number of path elements to actually acquire */
+  TRANSACTIONAL_INLINE void commit_elided(size_t n) noexcept
+  {
+    for (size_t i = 0; i < n; i++)
+      if (!path[i].latch->try_lock_shared())
+        xabort();
+    xend();
+    elision_committed(elided);
+    elided = nullptr;
+  }
+#endif
+
+  /** Acquire a latch on a child of the last path element.
+  @param child  the child latch
+  @param m      the mode
+  @param keep   whether the ancestors will be kept
+  @return whether the latch was acquired */
+  TRANSACTIONAL_INLINE bool descend(Latch &child, mode m, bool keep)
+    noexcept
+  {
+    assert(depth);
+    assert(depth < MAX_DEPTH);
+#ifdef WITH_ELISION
+    if (elided)
+    {
+      if (m == SHARED)
+      {
+        if (child.get_storage().is_locked())
+          xabort();
+      }
+      else
+      {
+        if (!try_acquire(child, m))
+          xabort();
+        commit_elided(keep ? depth : 0);
+        if (!keep)
+          depth = 0;
+      }
+      path[depth++] = {&child, m};
+      return true;
+    }
+#else
+    (void) keep;
+#endif
+    if (path[depth - 1].held != SHARED)
+      acquire(child, m);
+    else if (!try_acquire(child, m))
+      return false;
+    path[depth++] = {&child, m};
+    return true;
+  }
+
+public:
+  latch_coupling() noexcept : depth(0)
+#ifdef WITH_ELISION
+    , elided(nullptr)
+#endif
+  {}
+  latch_coupling(const latch_coupling &) = delete;
+  TRANSACTIONAL_INLINE ~latch_coupling() noexcept { unlock_all(); }
+
+  /** Acquire the root latch.
+  @param root  the root latch
+  @param m     the mode */
+  void lock_root(Latch &root, mode m) noexcept
+  {
+    assert(!depth);
+    acquire(root, m);
+    path[depth++] = {&root, m};
+  }
+
+  /** Acquire a shared latch on the root, or elide it and the subsequent
+  shared latches in a memory transaction. */
+  TRANSACTIONAL_INLINE void lock_root_elided(Latch &root) noexcept
+  {
+    assert(!depth);
+#ifdef WITH_ELISION
+    for (auto n = elision_supported() ? elision_attempts(&root) : 0; n--; )
+    {
+      const elision_status status = xbegin();
+      if (status == ELISION_STARTED)
+      {
+        if (!root.get_storage().is_locked())
+        {
+          elided = &root;
+          path[depth++] = {&root, SHARED};
+          return;
+        }
+        xabort();
+      }
+      else if (!elision_aborted(&root, status))
+        break;
+    }
+#endif
+    lock_root(root, SHARED);
+  }
+
+  /** Acquire a child latch, and release all the ancestors.
+  @param child  the latch of a child of the last acquired latch
+  @param m      the mode
+  @return whether the latch was acquired
+  @retval false if the last acquired latch is SHARED and the child could
+  not be acquired without waiting; the descent should be restarted */
+  TRANSACTIONAL_INLINE bool couple(Latch &child, mode m) noexcept
+  {
+    if (!descend(child, m, false))
+      return false;
+    release_ancestors();
+    return true;
+  }
+
+  /** Acquire a child latch, keeping the ancestors.
+  @param child  the latch of a child of the last acquired latch
+  @param m      the mode
+  @return whether the latch was acquired; see couple() */
+  TRANSACTIONAL_INLINE bool push(Latch &child, mode m) noexcept
+  { return descend(child, m, true); }
+
+  /** Release all but the last acquired latch, after it was determined
+  that the ancestors will not be affected. */
+  void release_ancestors() noexcept
+  {
+    if (depth <= 1)
+      return;
+    if (!was_elided())
+      for (size_t i = 0; i < depth - 1; i++)
+        release(path[i]);
+    path[0] = path[depth - 1];
+    depth = 1;
+  }
+
+  /** Upgrade all update latches on the path to exclusive, from the
+  root downwards. */
+  void upgrade() noexcept
+  {
+    for (size_t i = 0; i < depth; i++)
+      if (path[i].held == UPDATE)
+      {
+        path[i].latch->update_lock_upgrade();
+        path[i].held = EXCLUSIVE;
+      }
+  }
+
+  /** Release all latches, or commit the memory transaction. */
+  TRANSACTIONAL_INLINE void unlock_all() noexcept
+  {
+#ifdef WITH_ELISION
+    if (elided)
+    {
+      xend();
+      elision_committed(elided);
+      elided = nullptr;
+      depth = 0;
+      return;
+    }
+#endif
+    while (depth)
+      release(path[--depth]);
+  }
+
+  /** @return number of held latches */
+  size_t size() const noexcept { return depth; }
+  /** @return the i-th latch from the root */
+  Latch &operator[](size_t i) const noexcept
+  { assert(i < depth); return *path[i].latch; }
+  /** @return the mode of the i-th latch from the root */
+  mode held(size_t i) const noexcept
+  { assert(i < depth); return path[i].held; }
+
+#ifdef WITH_ELISION
+  /** @return whether the shared latches are being elided */
+  bool was_elided() const noexcept { return elided != nullptr; }
+#else
+  bool was_elided() const noexcept { return false; }
+#endif
+};
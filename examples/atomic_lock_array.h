@@ -0,0 +1,157 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include "atomic_shared_mutex.h"
+
+/** The assumed size of a cache line, in bytes */
+#if defined __s390x__
+constexpr size_t CACHE_LINE_SIZE = 256;
+#elif defined __powerpc64__ || defined __aarch64__ && defined __APPLE__
+constexpr size_t CACHE_LINE_SIZE = 128;
+#else
+constexpr size_t CACHE_LINE_SIZE = 64;
+#endif
+
+/** A striped lock table: an array of N locks, which protect the items
+that map to them by a hash of a key or an address.
+
+The Stride is the distance of consecutive locks in bytes. With a Stride
+of sizeof(Lock), the locks are packed, 16 per cache line for the 4-byte
+atomic_mutex or atomic_shared_mutex. With a Stride of CACHE_LINE_SIZE,
+each lock resides in a separate cache line, which avoids false sharing
+between locks at the cost of memory. Typically, packed locks should be
+embedded in the data that they protect (a hash table bucket), while
+separate cache lines are preferable for a free-standing lock table.
+
+Multiple locks can be acquired in a deadlock-free order by lock(),
+lock_shared() or lock_update(), which sort the indexes. Note that
+update_lock_upgrade() of multiple update locks is not deadlock-free:
+while it waits for the shared lock holders of one lock to leave, they
+may be waiting for a subsequent lock on which the update lock is held.
+
+There is no explicit constructor or destructor. Like atomic_mutex,
+the object is expected to be zero-initialized. */
+template<typename Lock, size_t N, size_t Stride = CACHE_LINE_SIZE>
+class atomic_lock_array
+{
+  static_assert(N && !(N & (N - 1)), "N must be a power of 2");
+  static_assert(!(Stride & (Stride - 1)), "Stride must be a power of 2");
+  static_assert(Stride >= sizeof(Lock), "Stride must fit the Lock");
+
+  struct alignas(Stride) slot { Lock lock; };
+  static_assert(sizeof(slot) == Stride, "compatibility");
+
+  slot slots[N];
+
+  /** @return log2(N) */
+  static constexpr unsigned log2(size_t n)
+  { return n > 1 ? 1 + log2(n / 2) : 0; }
+
+public:
+  /** Number of locks */
+  static constexpr size_t size() { return N; }
+
+  /** @return the index of the lock for a key */
+  static size_t index(uint64_t key) noexcept
+  {
+    /* Fibonacci hashing; the most significant bits of the product
+    are the best mixed ones. */
+    return N == 1 ? 0 : size_t((key * 0x9E3779B97F4A7C15ULL) >>
+                               (64 - log2(N)));
+  }
+  /** @return the index of the lock for an address */
+  static size_t index(const void *addr) noexcept
+  { return index(uint64_t(uintptr_t(addr))); }
+
+  /** @return the lock at an index */
+  Lock &operator[](size_t i) noexcept
+  { assert(i < N); return slots[i].lock; }
+  const Lock &operator[](size_t i) const noexcept
+  { assert(i < N); return slots[i].lock; }
+
+  /** @return the lock for a key */
+  Lock &get(uint64_t key) noexcept { return (*this)[index(key)]; }
+  /** @return the lock for an address */
+  Lock &get(const void *addr) noexcept { return (*this)[index(addr)]; }
+
+  /** Sort and deduplicate lock indexes, to have a deadlock-free order.
+  @param indexes  the lock indexes
+  @param n        number of indexes
+  @return number of distinct indexes */
+  static size_t sort(size_t *indexes, size_t n) noexcept
+  {
+    std::sort(indexes, indexes + n);
+    return size_t(std::unique(indexes, indexes + n) - indexes);
+  }
+
+  /** Acquire multiple exclusive locks.
+  @param indexes  the lock indexes (will be sorted by sort())
+  @param n        number of indexes
+  @return number of distinct indexes, to be passed to unlock() */
+  size_t lock(size_t *indexes, size_t n) noexcept
+  {
+    n = sort(indexes, n);
+    for (size_t i = 0; i < n; i++)
+      (*this)[indexes[i]].lock();
+    return n;
+  }
+  /** Release multiple exclusive locks that were acquired by lock().
+  @param indexes  the sorted lock indexes
+  @param n        the return value of lock() */
+  void unlock(const size_t *indexes, size_t n) noexcept
+  {
+    while (n--)
+      (*this)[indexes[n]].unlock();
+  }
+
+  /** Acquire multiple shared locks.
+  @param indexes  the lock indexes (will be sorted by sort())
+  @param n        number of indexes
+  @return number of distinct indexes, to be passed to unlock_shared() */
+  size_t lock_shared(size_t *indexes, size_t n) noexcept
+  {
+    n = sort(indexes, n);
+    for (size_t i = 0; i < n; i++)
+      (*this)[indexes[i]].lock_shared();
+    return n;
+  }
+  /** Release multiple shared locks that were acquired by lock_shared().
+  @param indexes  the sorted lock indexes
+  @param n        the return value of lock_shared() */
+  void unlock_shared(const size_t *indexes, size_t n) noexcept
+  {
+    while (n--)
+      (*this)[indexes[n]].unlock_shared();
+  }
+
+  /** Acquire multiple update locks.
+  @param indexes  the lock indexes (will be sorted by sort())
+  @param n        number of indexes
+  @return number of distinct indexes, to be passed to unlock_update() */
+  size_t lock_update(size_t *indexes, size_t n) noexcept
+  {
+    n = sort(indexes, n);
+    for (size_t i = 0; i < n; i++)
+      (*this)[indexes[i]].lock_update();
+    return n;
+  }
+  /** Release multiple update locks that were acquired by lock_update().
+  @param indexes  the sorted lock indexes
+  @param n        the return value of lock_update() */
+  void unlock_update(const size_t *indexes, size_t n) noexcept
+  {
+    while (n--)
+      (*this)[indexes[n]].unlock_update();
+  }
+};
+
+/** An array of N atomic_mutex */
+template<size_t N, size_t Stride = CACHE_LINE_SIZE,
+         typename Storage = mutex_storage<>>
+using atomic_mutex_array = atomic_lock_array<atomic_mutex<Storage>, N, Stride>;
+
+/** An array of N atomic_shared_mutex */
+template<size_t N, size_t Stride = CACHE_LINE_SIZE,
+         typename Storage = shared_mutex_storage<>>
+using atomic_shared_mutex_array =
+  atomic_lock_array<atomic_shared_mutex<Storage>, N, Stride>;
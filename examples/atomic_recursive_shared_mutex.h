@@ -2,6 +2,49 @@
 #include "atomic_shared_mutex.h"
 #include <thread>
 
+/** Thread identity of atomic_recursive_shared_mutex: std::thread::id */
+struct thread_id_identity
+{
+  typedef std::thread::id type;
+  /** @return the identity of the current thread */
+  static type self() noexcept { return std::this_thread::get_id(); }
+};
+
+/** Thread identity of atomic_recursive_shared_mutex: a nonzero 32-bit
+token that is assigned to each thread on first use and cached in a
+thread_local variable, so that the ownership check is a load and compare
+instead of a call of std::this_thread::get_id(), and the identity
+takes 4 bytes instead of sizeof(std::thread::id).
+
+The token counter wraps around after 2^32-1 threads have requested a
+token, and then tokens are reused. A reused token is mistaken for a
+holder only if the lock is held, by the thread that the token was
+first assigned to, for as long as it takes to create 2^32-1 other
+threads. */
+struct thread_token_identity
+{
+  typedef uint32_t type;
+  /** @return the identity of the current thread */
+  static type self() noexcept
+  {
+    static thread_local uint32_t token;
+    if (uint32_t t = token)
+      return t;
+    return token = assign();
+  }
+private:
+  /** @return a new token */
+  static uint32_t assign() noexcept
+  {
+    static std::atomic<uint32_t> last;
+    uint32_t t;
+    do
+      t = last.fetch_add(1, std::memory_order_relaxed) + 1;
+    while (!t);
+    return t;
+  }
+};
+
 /** Shared/Update/Exclusive lock with recursion (re-entrancy).
 
 At most one thread may hold exclusive locks, such that no other threads
@@ -22,11 +65,15 @@ update_lock_downgrade(), all locks will be transformed.
 
 There is no explicit constructor or destructor.
 The object may be zero-initialized, depending on the
-value of std::thread::id{}. init() provides delayed
-initialization. destroy() may be invoked to ensure that the
-lock is unoccupied right before destruction.
-
-We keep track of the thread that holds lock() or update_lock().
+value of std::thread::id{} (always with thread_token_identity).
+init() provides delayed initialization. destroy() may be invoked
+to ensure that the lock is unoccupied right before destruction.
+
+We keep track of the thread that holds lock() or update_lock(),
+by an identity that can be std::thread::id (thread_id_identity) or a
+compact 32-bit token (thread_token_identity). With the latter, the object
+is 16 bytes with shared_mutex_storage, or 12 bytes with
+parked_shared_mutex_storage, instead of 24 and 16 bytes.
 The predicates holding_lock(), holding_lock_update(), and
 holding_lock_update_or_lock() are available.
 
@@ -40,17 +87,22 @@ lock_recursive() or lock_update_recursive() will allow
 the recursion or re-entrancy count to be incremented quickly.
 
 This is based on the ssux_lock in MariaDB Server 10.6. */
-template<typename storage = shared_mutex_storage<>>
+template<typename storage = shared_mutex_storage<>,
+         typename identity = thread_id_identity>
 class atomic_recursive_shared_mutex : atomic_shared_mutex<storage>
 {
   using super = atomic_shared_mutex<storage>;
+public:
+  /** the identity of a thread */
+  typedef typename identity::type holder;
+private:
 
   /** Numbers of update and exclusive locks.
   Protected by atomic_shared_mutex. */
   uint32_t recursive;
   /** The owner of update or exclusive locks.
   Protected by atomic_shared_mutex. */
-  std::atomic<std::thread::id> writer{};
+  std::atomic<holder> writer{};
 
   /** The multiplier in recursive for X locks */
   static constexpr uint32_t RECURSIVE_X = 1U;
@@ -63,7 +115,7 @@ class atomic_recursive_shared_mutex : atomic_shared_mutex<storage>
       @tparam U true=update lock, false=exclusive lock */
   template<bool U> void writer_recurse() noexcept
   {
-    assert(writer == std::this_thread::get_id());
+    assert(writer == identity::self());
 #ifndef NDEBUG
     auto rec = (recursive / (U ? RECURSIVE_U : RECURSIVE_X)) & RECURSIVE_MAX;
 #endif
@@ -79,14 +131,14 @@ class atomic_recursive_shared_mutex : atomic_shared_mutex<storage>
 #ifndef NDEBUG
     const auto owner = writer.load(std::memory_order_relaxed);
 #endif
-    assert(owner == std::this_thread::get_id() ||
-           (owner == std::thread::id{} &&
+    assert(owner == identity::self() ||
+           (owner == holder{} &&
             recursive == (U ? RECURSIVE_U : RECURSIVE_X)));
     assert((recursive / (U ? RECURSIVE_U : RECURSIVE_X)) & RECURSIVE_MAX);
 
     if (!(recursive -= U ? RECURSIVE_U : RECURSIVE_X))
     {
-      set_holder(std::thread::id{});
+      set_holder(holder{});
       if (U)
         super::unlock_update();
       else
@@ -99,7 +151,7 @@ public:
   {
     assert(!this->get_storage().is_locked_or_waiting());
     assert(!recursive);
-    assert(writer == std::thread::id{});
+    assert(writer == holder{});
   }
 
   void destroy() noexcept
@@ -110,17 +162,17 @@ public:
 
   /** Transfer the ownership of a write lock to another thread
   @param id the new owner of the U or X lock */
-  void set_holder(std::thread::id id) noexcept
+  void set_holder(holder id) noexcept
   { writer.store(id, std::memory_order_relaxed); }
 
   /** Transfer the writer ownership to the current thread */
-  void set_holder() noexcept { set_holder(std::this_thread::get_id()); }
+  void set_holder() noexcept { set_holder(identity::self()); }
 
   /** @return whether the current thread is holding exclusive or update latch */
   bool holding_lock_update_or_lock() const noexcept
   {
     const bool is_writer = writer.load(std::memory_order_relaxed) ==
-      std::this_thread::get_id();
+      identity::self();
     assert(!is_writer || recursive);
     return is_writer;
   }
@@ -141,18 +193,19 @@ public:
   void lock_shared() noexcept { super::lock_shared(); }
   void spin_lock_shared(unsigned spin_rounds) noexcept
   { super::spin_lock_shared(spin_rounds); }
+  void spin_lock_shared() noexcept { super::spin_lock_shared(); }
   void unlock_shared() noexcept { super::unlock_shared(); }
 
   /** Acquire an update lock */
   void lock_update() noexcept
   {
-    const std::thread::id id = std::this_thread::get_id();
+    const holder id = identity::self();
     if (writer.load(std::memory_order_relaxed) == id)
       writer_recurse<true>();
     else
     {
       super::lock_update();
-      assert(writer.load(std::memory_order_relaxed) == std::thread::id{});
+      assert(writer.load(std::memory_order_relaxed) == holder{});
       assert(!recursive);
       recursive = RECURSIVE_U;
       set_holder(id);
@@ -161,13 +214,28 @@ public:
 
   void spin_lock_update(unsigned spin_rounds) noexcept
   {
-    const std::thread::id id = std::this_thread::get_id();
+    const holder id = identity::self();
     if (writer.load(std::memory_order_relaxed) == id)
       writer_recurse<true>();
     else
     {
       super::spin_lock_update(spin_rounds);
-      assert(writer.load(std::memory_order_relaxed) == std::thread::id{});
+      assert(writer.load(std::memory_order_relaxed) == holder{});
+      assert(!recursive);
+      recursive = RECURSIVE_U;
+      set_holder(id);
+    }
+  }
+
+  void spin_lock_update() noexcept
+  {
+    const holder id = identity::self();
+    if (writer.load(std::memory_order_relaxed) == id)
+      writer_recurse<true>();
+    else
+    {
+      super::spin_lock_update();
+      assert(writer.load(std::memory_order_relaxed) == holder{});
       assert(!recursive);
       recursive = RECURSIVE_U;
       set_holder(id);
@@ -178,9 +246,9 @@ public:
   void lock_update_disowned() noexcept
   {
     assert(!(writer.load(std::memory_order_relaxed) ==
-             std::this_thread::get_id()));
+             identity::self()));
     super::lock_update();
-    assert(writer.load(std::memory_order_relaxed) == std::thread::id{});
+    assert(writer.load(std::memory_order_relaxed) == holder{});
     assert(!recursive);
     recursive = RECURSIVE_U;
   }
@@ -189,9 +257,20 @@ public:
   void spin_lock_update_disowned(unsigned spin_rounds) noexcept
   {
     assert(!(writer.load(std::memory_order_relaxed) ==
-             std::this_thread::get_id()));
+             identity::self()));
     super::spin_lock_update(spin_rounds);
-    assert(writer.load(std::memory_order_relaxed) == std::thread::id{});
+    assert(writer.load(std::memory_order_relaxed) == holder{});
+    assert(!recursive);
+    recursive = RECURSIVE_U;
+  }
+
+  /** Acquire an update lock, for set_holder() to be called later. */
+  void spin_lock_update_disowned() noexcept
+  {
+    assert(!(writer.load(std::memory_order_relaxed) ==
+             identity::self()));
+    super::spin_lock_update();
+    assert(writer.load(std::memory_order_relaxed) == holder{});
     assert(!recursive);
     recursive = RECURSIVE_U;
   }
@@ -199,13 +278,13 @@ public:
   /** Acquire an exclusive lock */
   void lock() noexcept
   {
-    const std::thread::id id = std::this_thread::get_id();
+    const holder id = identity::self();
     if (writer.load(std::memory_order_relaxed) == id)
       writer_recurse<false>();
     else
     {
       super::lock();
-      assert(writer.load(std::memory_order_relaxed) == std::thread::id{});
+      assert(writer.load(std::memory_order_relaxed) == holder{});
       assert(!recursive);
       recursive = RECURSIVE_X;
       set_holder(id);
@@ -215,13 +294,29 @@ public:
   /** Acquire an exclusive lock */
   void spin_lock(unsigned spin_rounds) noexcept
   {
-    const std::thread::id id = std::this_thread::get_id();
+    const holder id = identity::self();
     if (writer.load(std::memory_order_relaxed) == id)
       writer_recurse<false>();
     else
     {
       super::spin_lock(spin_rounds);
-      assert(writer.load(std::memory_order_relaxed) == std::thread::id{});
+      assert(writer.load(std::memory_order_relaxed) == holder{});
+      assert(!recursive);
+      recursive = RECURSIVE_X;
+      set_holder(id);
+    }
+  }
+
+  /** Acquire an exclusive lock */
+  void spin_lock() noexcept
+  {
+    const holder id = identity::self();
+    if (writer.load(std::memory_order_relaxed) == id)
+      writer_recurse<false>();
+    else
+    {
+      super::spin_lock();
+      assert(writer.load(std::memory_order_relaxed) == holder{});
       assert(!recursive);
       recursive = RECURSIVE_X;
       set_holder(id);
@@ -232,9 +327,9 @@ public:
   void lock_disowned() noexcept
   {
     assert(!(writer.load(std::memory_order_relaxed) ==
-             std::this_thread::get_id()));
+             identity::self()));
     super::lock();
-    assert(writer.load(std::memory_order_relaxed) == std::thread::id{});
+    assert(writer.load(std::memory_order_relaxed) == holder{});
     assert(!recursive);
     recursive = RECURSIVE_X;
   }
@@ -243,9 +338,20 @@ public:
   void spin_lock_disowned(unsigned spin_rounds) noexcept
   {
     assert(!(writer.load(std::memory_order_relaxed) ==
-             std::this_thread::get_id()));
+             identity::self()));
     super::spin_lock(spin_rounds);
-    assert(writer.load(std::memory_order_relaxed) == std::thread::id{});
+    assert(writer.load(std::memory_order_relaxed) == holder{});
+    assert(!recursive);
+    recursive = RECURSIVE_X;
+  }
+
+  /** Acquire an exclusive lock, for set_holder() to be called later. */
+  void spin_lock_disowned() noexcept
+  {
+    assert(!(writer.load(std::memory_order_relaxed) ==
+             identity::self()));
+    super::spin_lock();
+    assert(writer.load(std::memory_order_relaxed) == holder{});
     assert(!recursive);
     recursive = RECURSIVE_X;
   }
@@ -266,6 +372,37 @@ public:
     recursive= RECURSIVE_U;
     return true;
   }
+  /** Try to upgrade a shared lock to update until a deadline
+  @return whether the operation succeeded; on failure, the shared lock
+  is still being held */
+  template<class Clock, class Duration>
+  bool
+  shared_lock_upgrade_until(const std::chrono::time_point<Clock, Duration> &t)
+    noexcept
+  {
+    assert(!holding_lock_update_or_lock());
+    if (!super::shared_lock_upgrade_until(t))
+      return false;
+    set_holder();
+    recursive= RECURSIVE_U;
+    return true;
+  }
+  /** Try to upgrade a shared lock to update for a limited time
+  @return whether the operation succeeded */
+  template<class Rep, class Period>
+  bool shared_lock_upgrade_for(const std::chrono::duration<Rep, Period> &d)
+    noexcept
+  { return shared_lock_upgrade_until(std::chrono::steady_clock::now() + d); }
+  /** Upgrade a shared lock to update
+  @return whether the shared lock was held until the upgrade */
+  bool shared_lock_upgrade() noexcept
+  {
+    assert(!holding_lock_update_or_lock());
+    const bool held= super::shared_lock_upgrade();
+    set_holder();
+    recursive= RECURSIVE_U;
+    return held;
+  }
 
   /** Downgrade a single update lock to a shared */
   void shared_lock_downgrade() noexcept
@@ -273,7 +410,7 @@ public:
     assert(holding_lock_update());
     assert(recursive == RECURSIVE_U);
     recursive= 0;
-    set_holder(std::thread::id{});
+    set_holder(holder{});
     super::shared_lock_downgrade();
   }
 
@@ -298,7 +435,7 @@ public:
   @return whether U locks were upgraded to X */
   bool lock_upgraded() noexcept
   {
-    const std::thread::id id = std::this_thread::get_id();
+    const holder id = identity::self();
     if (writer.load(std::memory_order_relaxed) == id)
     {
       assert(recursive);
@@ -324,7 +461,7 @@ public:
       @return whether the update lock was acquired */
   bool try_lock_update() noexcept
   {
-    const std::thread::id id = std::this_thread::get_id();
+    const holder id = identity::self();
     if (writer.load(std::memory_order_relaxed) == id)
     {
       writer_recurse<true>();
@@ -333,7 +470,7 @@ public:
     if (!super::try_lock_update())
       return false;
     assert(!recursive);
-    assert(writer.load(std::memory_order_relaxed) == std::thread::id{});
+    assert(writer.load(std::memory_order_relaxed) == holder{});
     recursive = RECURSIVE_U;
     set_holder(id);
     return true;
@@ -344,11 +481,11 @@ public:
   bool try_lock_update_disowned() noexcept
   {
     assert(!(writer.load(std::memory_order_relaxed) ==
-             std::this_thread::get_id()));
+             identity::self()));
     if (super::try_lock_update())
     {
       assert(!recursive);
-      assert(writer.load(std::memory_order_relaxed) == std::thread::id{});
+      assert(writer.load(std::memory_order_relaxed) == holder{});
       recursive = RECURSIVE_U;
       return true;
     }
@@ -359,7 +496,7 @@ public:
       @return whether an exclusive lock was acquired */
   bool try_lock() noexcept
   {
-    const std::thread::id id = std::this_thread::get_id();
+    const holder id = identity::self();
     if (writer.load(std::memory_order_relaxed) == id)
     {
       writer_recurse<false>();
@@ -367,7 +504,7 @@ public:
     }
     if (super::try_lock())
     {
-      assert(writer.load(std::memory_order_relaxed) == std::thread::id{});
+      assert(writer.load(std::memory_order_relaxed) == holder{});
       assert(!recursive);
       recursive = RECURSIVE_X;
       set_holder(id);
@@ -383,10 +520,10 @@ public:
   bool try_lock_disowned() noexcept
   {
     assert(!(writer.load(std::memory_order_relaxed) ==
-             std::this_thread::get_id()));
+             identity::self()));
     if (super::try_lock())
     {
-      assert(writer.load(std::memory_order_relaxed) == std::thread::id{});
+      assert(writer.load(std::memory_order_relaxed) == holder{});
       assert(!recursive);
       recursive = RECURSIVE_X;
       return true;
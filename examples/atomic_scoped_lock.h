@@ -0,0 +1,237 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <type_traits>
+#include "atomic_shared_mutex.h"
+#include "transactional_lock_guard.h"
+
+/** A request to acquire an atomic_mutex, atomic_shared_mutex or similar
+in some mode, for lock_all(), atomic_scoped_lock or
+transactional_scoped_lock. Different types of locks may be mixed. */
+class lock_request
+{
+public:
+  /** lock modes, in ascending order of strength */
+  enum mode { SHARED, UPDATE, EXCLUSIVE };
+
+private:
+  /** the lock */
+  void *m;
+  /** the requested mode */
+  mode wanted;
+  /** acquire the lock, with initial spinloop */
+  void (*acquire)(void *m);
+  /** release the lock */
+  void (*release)(void *m);
+  /** @return whether the lock conflicts with an elided request */
+  bool (*busy)(const void *m);
+
+  template<class Lock> static void spin_lock(void *m)
+  { static_cast<Lock*>(m)->spin_lock(); }
+  template<class Lock> static void spin_lock_update(void *m)
+  { static_cast<Lock*>(m)->spin_lock_update(); }
+  template<class Lock> static void spin_lock_shared(void *m)
+  { static_cast<Lock*>(m)->spin_lock_shared(); }
+  template<class Lock> static void unlock(void *m)
+  { static_cast<Lock*>(m)->unlock(); }
+  template<class Lock> static void unlock_update(void *m)
+  { static_cast<Lock*>(m)->unlock_update(); }
+  template<class Lock> static void unlock_shared(void *m)
+  { static_cast<Lock*>(m)->unlock_shared(); }
+  /* See transactional_lock_guard::was_elided() and
+  transactional_shared_lock_guard. */
+  template<class Lock> static bool is_locked_or_waiting(const void *m)
+  {
+    return static_cast<const Lock*>(m)->get_storage().
+      is_locked_or_waiting();
+  }
+  template<class Lock> static bool is_locked(const void *m)
+  { return static_cast<const Lock*>(m)->get_storage().is_locked(); }
+
+  lock_request(void *m, mode wanted, void (*acquire)(void*),
+               void (*release)(void*), bool (*busy)(const void*)) noexcept :
+    m(m), wanted(wanted), acquire(acquire), release(release), busy(busy) {}
+
+public:
+  lock_request() = default;
+  /** Request an exclusive lock */
+  template<class Lock, typename = typename std::enable_if<
+             !std::is_same<Lock, lock_request>::value>::type>
+  lock_request(Lock &m) noexcept : lock_request(exclusive(m)) {}
+
+  /** @return a request for an exclusive lock */
+  template<class Lock> static lock_request exclusive(Lock &m) noexcept
+  {
+    return lock_request(&m, EXCLUSIVE, spin_lock<Lock>, unlock<Lock>,
+                        is_locked_or_waiting<Lock>);
+  }
+  /** @return a request for an Update lock of an atomic_shared_mutex */
+  template<class Lock> static lock_request update(Lock &m) noexcept
+  {
+    return lock_request(&m, UPDATE, spin_lock_update<Lock>,
+                        unlock_update<Lock>, is_locked_or_waiting<Lock>);
+  }
+  /** @return a request for a shared lock of an atomic_shared_mutex */
+  template<class Lock> static lock_request shared(Lock &m) noexcept
+  {
+    return lock_request(&m, SHARED, spin_lock_shared<Lock>,
+                        unlock_shared<Lock>, is_locked<Lock>);
+  }
+
+  /** @return the lock */
+  const void *get() const noexcept { return m; }
+  /** @return the requested mode */
+  mode get_mode() const noexcept { return wanted; }
+
+  /** Acquire the lock */
+  void lock() const noexcept { acquire(m); }
+  /** Release the lock */
+  void unlock() const noexcept { release(m); }
+  /** @return whether the lock is held in a conflicting mode */
+  bool is_busy() const noexcept { return busy(m); }
+
+  /** Sort requests by the address of the lock, which is a deadlock-free
+  order, keeping only the strongest mode for each lock.
+  @param r  the requests
+  @param n  number of requests
+  @return number of distinct requests */
+  static size_t sort(lock_request *r, size_t n) noexcept
+  {
+    std::sort(r, r + n, [](const lock_request &a, const lock_request &b)
+              { return a.m == b.m
+                  ? a.wanted > b.wanted
+                  : std::less<const void*>()(a.m, b.m); });
+    return size_t(std::unique(r, r + n,
+                              [](const lock_request &a,
+                                 const lock_request &b)
+                              { return a.m == b.m; }) - r);
+  }
+};
+
+/** Acquire multiple locks in a deadlock-free order. Because the order
+is global, there is no need to release locks and retry as in std::lock():
+each lock is acquired by spin_lock() or similar, which first attempts a
+lock-free acquisition, then spins and finally waits while holding the
+preceding locks. The elements of atomic_lock_array are ordered by their
+address, so their index order is consistent with this.
+@param r  the requests (will be sorted by lock_request::sort())
+@param n  number of requests
+@return number of distinct requests, to be passed to unlock_all() */
+inline size_t lock_all(lock_request *r, size_t n) noexcept
+{
+  n = lock_request::sort(r, n);
+  for (size_t i = 0; i < n; i++)
+    r[i].lock();
+  return n;
+}
+
+/** Release multiple locks that were acquired by lock_all().
+@param r  the sorted requests
+@param n  the return value of lock_all() */
+inline void unlock_all(const lock_request *r, size_t n) noexcept
+{
+  while (n--)
+    r[n].unlock();
+}
+
+/** Similar to std::scoped_lock, for a fixed number of lock requests.
+Locks that are passed directly will be acquired in exclusive mode:
+
+  atomic_scoped_lock<3> g{a, lock_request::update(b),
+                          lock_request::shared(c)};
+
+@tparam N  number of requests */
+template<size_t N>
+class atomic_scoped_lock
+{
+  lock_request requests[N];
+  /** number of distinct requests */
+  const size_t n;
+
+public:
+  template<class... Requests>
+  atomic_scoped_lock(Requests&&... r) noexcept :
+    requests{lock_request(r)...}, n(lock_all(requests, N))
+  { static_assert(sizeof...(Requests) == N, "compatibility"); }
+  atomic_scoped_lock(const atomic_scoped_lock &) = delete;
+  ~atomic_scoped_lock() noexcept { unlock_all(requests, n); }
+};
+
+/** Similar to atomic_scoped_lock, but with optional support for lock
+elision: a single memory transaction covers all requests, such that
+it will be aborted if any lock is being held in a conflicting mode.
+The adaptive elision policy is keyed by the first lock in address order.
+@tparam N  number of requests */
+template<size_t N>
+class transactional_scoped_lock
+{
+  lock_request requests[N];
+  /** number of distinct requests */
+  const size_t n;
+#ifdef WITH_ELISION
+  bool elided;
+
+  /** @return whether any lock is being held in a conflicting mode */
+  bool is_busy() const noexcept
+  {
+    for (size_t i = 0; i < n; i++)
+      if (requests[i].is_busy())
+        return true;
+    return false;
+  }
+#else
+  static constexpr bool elided = false;
+#endif
+
+public:
+  template<class... Requests>
+  TRANSACTIONAL_INLINE transactional_scoped_lock(Requests&&... r) noexcept :
+    requests{lock_request(r)...}, n(lock_request::sort(requests, N))
+  {
+    static_assert(sizeof...(Requests) == N, "compatibility");
+#ifdef WITH_ELISION
+    elided = false;
+    const void *const key = requests[0].get();
+    for (auto k = elision_supported() ? elision_attempts(key) : 0; k--; )
+    {
+      const elision_status status = xbegin();
+      if (status == ELISION_STARTED)
+      {
+        if (!is_busy())
+        {
+          elided = true;
+          return;
+        }
+        xabort();
+      }
+      else if (!elision_aborted(key, status))
+        break;
+    }
+#endif
+    for (size_t i = 0; i < n; i++)
+      requests[i].lock();
+  }
+  transactional_scoped_lock(const transactional_scoped_lock &) = delete;
+  TRANSACTIONAL_INLINE ~transactional_scoped_lock() noexcept
+  {
+#ifdef WITH_ELISION
+    if (was_elided())
+    {
+      xend();
+      elision_committed(requests[0].get());
+    }
+    else
+#endif
+    unlock_all(requests, n);
+  }
+  bool was_elided() const noexcept { return elided; }
+};
+
+#ifdef __cpp_deduction_guides
+template<class... Requests>
+atomic_scoped_lock(Requests&&...) -> atomic_scoped_lock<sizeof...(Requests)>;
+template<class... Requests>
+transactional_scoped_lock(Requests&&...) ->
+  transactional_scoped_lock<sizeof...(Requests)>;
+#endif
@@ -0,0 +1,373 @@
+#pragma once
+#include <atomic>
+#include <cassert>
+#include <climits>
+#include "atomic_wait.h"
+
+/* Tiny equivalents of std::counting_semaphore, std::latch and
+std::barrier, each occupying a single 32-bit word. Like
+atomic_condition_variable, they keep track of waiters in the word itself,
+so that release(), count_down() and the completion of a barrier phase
+will only invoke the operating system when some thread is blocked.
+
+The waits are implemented by atomic_word_wait() and atomic_wait_until(),
+which invoke the same primitives (futex or equivalent) as atomic_mutex.
+
+For memory that is shared between processes, ProcessShared=true will
+wait by process_shared_wait() and notify by process_shared_notify(). */
+
+/** A counting semaphore
+@tparam ProcessShared  whether the object may be shared between processes */
+template<bool ProcessShared>
+class basic_atomic_semaphore : private std::atomic<uint32_t>
+{
+  /** Mask of the number of available units */
+  static constexpr uint32_t COUNT = (1U << 16) - 1;
+  /** A registered waiter in acquire() */
+  static constexpr uint32_t WAITER = 1U << 16;
+
+  void wait_word(uint32_t old) const noexcept
+  {
+    if (ProcessShared)
+      process_shared_wait(*this, old);
+    else
+      atomic_word_wait(*this, old);
+  }
+  void notify_word(uint32_t n) noexcept
+  {
+    if (ProcessShared)
+      process_shared_notify(*this, n);
+    else
+      atomic_word_notify(*this, n);
+  }
+
+  /** Acquire a unit after registering as a waiter.
+  @param v  the current value of the word */
+  void acquire_registered(uint32_t v) noexcept
+  {
+    for (;;)
+    {
+      if (!(v & COUNT))
+      {
+        wait_word(v);
+        v = load(std::memory_order_relaxed);
+      }
+      else if (compare_exchange_weak(v, v - WAITER - 1,
+                                     std::memory_order_acquire,
+                                     std::memory_order_relaxed))
+        return;
+    }
+  }
+
+  /** Acquire a unit after registering as a waiter, or give up.
+  @param v         the current value of the word
+  @param deadline  the time until which to wait
+  @return whether a unit was acquired */
+  bool acquire_registered_until(uint32_t v,
+                                std::chrono::steady_clock::time_point
+                                deadline) noexcept
+  {
+    for (bool timeout = false;;)
+    {
+      if (v & COUNT)
+      {
+        if (compare_exchange_weak(v, v - WAITER - 1,
+                                  std::memory_order_acquire,
+                                  std::memory_order_relaxed))
+          return true;
+      }
+      else if (timeout)
+        break;
+      else
+      {
+        timeout = !atomic_wait_until(*this, v, deadline, ProcessShared);
+        v = load(std::memory_order_relaxed);
+      }
+    }
+
+    v = fetch_sub(WAITER, std::memory_order_relaxed) - WAITER;
+    /* If release() was invoked while we were giving up, a notify_one()
+    may have been directed at us. Pass it on to the remaining waiters. */
+    if ((v & COUNT) && v >= WAITER)
+      notify_word(1);
+    return false;
+  }
+
+public:
+  /** Constructor
+  @param desired  the initial number of available units */
+  constexpr explicit basic_atomic_semaphore(uint32_t desired = 0) noexcept :
+    std::atomic<uint32_t>(desired) {}
+  /** No copy constructor */
+  basic_atomic_semaphore(const basic_atomic_semaphore&) = delete;
+  /** No assignment operator */
+  basic_atomic_semaphore& operator=(const basic_atomic_semaphore&) = delete;
+
+  /** @return the maximum number of available units */
+  static constexpr uint32_t max() noexcept { return COUNT; }
+
+  /** @return whether a unit was acquired without waiting */
+  bool try_acquire() noexcept
+  {
+    uint32_t v = load(std::memory_order_relaxed);
+    while (v & COUNT)
+      if (compare_exchange_weak(v, v - 1, std::memory_order_acquire,
+                                std::memory_order_relaxed))
+        return true;
+    return false;
+  }
+
+  /** Acquire a unit, waiting for release() if needed */
+  void acquire() noexcept
+  {
+    if (!try_acquire())
+      acquire_registered(fetch_add(WAITER, std::memory_order_relaxed) +
+                         WAITER);
+  }
+
+  /** Try to acquire a unit until a deadline.
+  @return whether a unit was acquired */
+  template<class Clock, class Duration>
+  bool try_acquire_until(const std::chrono::time_point<Clock, Duration> &t)
+    noexcept
+  {
+    return try_acquire() ||
+      acquire_registered_until(fetch_add(WAITER, std::memory_order_relaxed) +
+                               WAITER, to_steady_clock(t));
+  }
+  /** Try to acquire a unit until a timeout expires.
+  @return whether a unit was acquired */
+  template<class Rep, class Period>
+  bool try_acquire_for(const std::chrono::duration<Rep, Period> &d) noexcept
+  { return try_acquire_until(std::chrono::steady_clock::now() + d); }
+
+  /** Release units, and wake up waiters if there are any.
+  @param n  number of units to release */
+  void release(uint32_t n = 1) noexcept
+  {
+    assert(n);
+    const uint32_t v = fetch_add(n, std::memory_order_release);
+    assert((v & COUNT) + n <= COUNT);
+    if (v >= WAITER)
+      notify_word(n == 1 ? 1 : INT_MAX);
+  }
+
+  /** @return whether acquire() is waiting */
+  bool is_waiting() const noexcept
+  { return load(std::memory_order_relaxed) >= WAITER; }
+};
+
+typedef basic_atomic_semaphore<false> atomic_semaphore;
+typedef basic_atomic_semaphore<true> atomic_process_shared_semaphore;
+
+/** A single-use countdown latch
+@tparam ProcessShared  whether the object may be shared between processes */
+template<bool ProcessShared>
+class basic_atomic_latch
+{
+  /** Flag that wait() may be blocked */
+  static constexpr uint32_t WAITING = 1U << 31;
+  /** the count, possibly with WAITING */
+  mutable std::atomic<uint32_t> word;
+
+  void wait_word(uint32_t old) const noexcept
+  {
+    if (ProcessShared)
+      process_shared_wait(word, old);
+    else
+      atomic_word_wait(word, old);
+  }
+  void notify_word() noexcept
+  {
+    if (ProcessShared)
+      process_shared_notify(word, INT_MAX);
+    else
+      atomic_word_notify(word, INT_MAX);
+  }
+
+public:
+  /** Constructor
+  @param expected  the initial count */
+  constexpr explicit basic_atomic_latch(uint32_t expected) noexcept :
+    word(expected) {}
+  /** No copy constructor */
+  basic_atomic_latch(const basic_atomic_latch&) = delete;
+  /** No assignment operator */
+  basic_atomic_latch& operator=(const basic_atomic_latch&) = delete;
+
+  /** @return the maximum count */
+  static constexpr uint32_t max() noexcept { return WAITING - 1; }
+
+  /** Decrement the count, and wake up the waiters if it reached 0.
+  @param n  the amount to decrement by */
+  void count_down(uint32_t n = 1) noexcept
+  {
+    const uint32_t v = word.fetch_sub(n, std::memory_order_release);
+    assert((v & ~WAITING) >= n);
+    if (v == (WAITING | n))
+      notify_word();
+  }
+
+  /** @return whether the count has reached 0 */
+  bool try_wait() const noexcept
+  { return !(word.load(std::memory_order_acquire) & ~WAITING); }
+
+  /** Wait for the count to reach 0 */
+  void wait() const noexcept
+  {
+    uint32_t v = word.load(std::memory_order_acquire);
+    while (v & ~WAITING)
+    {
+      if (!(v & WAITING) &&
+          !word.compare_exchange_weak(v, v | WAITING,
+                                      std::memory_order_acquire,
+                                      std::memory_order_acquire))
+        continue;
+      wait_word(v | WAITING);
+      v = word.load(std::memory_order_acquire);
+    }
+  }
+
+  /** Decrement the count and wait for it to reach 0.
+  @param n  the amount to decrement by */
+  void arrive_and_wait(uint32_t n = 1) noexcept
+  {
+    count_down(n);
+    wait();
+  }
+};
+
+typedef basic_atomic_latch<false> atomic_latch;
+typedef basic_atomic_latch<true> atomic_process_shared_latch;
+
+/** The default completion step of atomic_barrier, which does nothing */
+struct atomic_barrier_completion
+{
+  void operator()() noexcept {}
+};
+
+/** A reusable thread barrier. Unlike std::barrier, the size of the
+object does not include the completion step when it is an empty class.
+
+The arrival_token only identifies the phase by a single bit: a thread
+that invoked arrive() must invoke wait() before the next phase could
+complete, that is, before it arrives again. arrive_and_wait() does this.
+
+@tparam Completion     the completion step, to be invoked by the last
+                       arriving thread before the waiters are released;
+                       must be a class type (such as a lambda)
+@tparam ProcessShared  whether the object may be shared between processes */
+template<class Completion = atomic_barrier_completion,
+         bool ProcessShared = false>
+class atomic_barrier : private Completion
+{
+  /** Mask of the number of threads that have yet to arrive */
+  static constexpr uint32_t REMAINING = (1U << 15) - 1;
+  /** One expected thread per phase */
+  static constexpr uint32_t EXPECTED_ONE = 1U << 15;
+  /** Mask of the number of expected threads per phase */
+  static constexpr uint32_t EXPECTED = REMAINING * EXPECTED_ONE;
+  /** The parity of the current phase */
+  static constexpr uint32_t PHASE = 1U << 30;
+  /** Flag that wait() may be blocked */
+  static constexpr uint32_t WAITING = 1U << 31;
+
+  /** REMAINING, EXPECTED, PHASE and WAITING */
+  mutable std::atomic<uint32_t> word;
+
+  void wait_word(uint32_t old) const noexcept
+  {
+    if (ProcessShared)
+      process_shared_wait(word, old);
+    else
+      atomic_word_wait(word, old);
+  }
+  void notify_word() noexcept
+  {
+    if (ProcessShared)
+      process_shared_notify(word, INT_MAX);
+    else
+      atomic_word_notify(word, INT_MAX);
+  }
+
+  /** Complete the current phase after the last thread arrived.
+  @param v  the value of the word after the last arrival */
+  void complete(uint32_t v) noexcept
+  {
+    assert(!(v & REMAINING));
+    Completion::operator()();
+    while (!word.compare_exchange_weak(v, ((v & (EXPECTED | PHASE)) ^ PHASE) |
+                                       (v & EXPECTED) / EXPECTED_ONE,
+                                       std::memory_order_release,
+                                       std::memory_order_relaxed));
+    if (v & WAITING)
+      notify_word();
+  }
+
+public:
+  /** Identification of the phase of arrive() */
+  typedef uint32_t arrival_token;
+
+  /** Constructor
+  @param expected    the number of participating threads
+  @param completion  the completion step */
+  explicit atomic_barrier(uint32_t expected,
+                          Completion completion = Completion()) noexcept :
+    Completion(completion), word(expected * (EXPECTED_ONE + 1))
+  { assert(expected && expected <= max()); }
+  /** No copy constructor */
+  atomic_barrier(const atomic_barrier&) = delete;
+  /** No assignment operator */
+  atomic_barrier& operator=(const atomic_barrier&) = delete;
+
+  /** @return the maximum number of participating threads */
+  static constexpr uint32_t max() noexcept { return REMAINING; }
+
+  /** Arrive at the barrier, completing the phase if this was the last
+  expected arrival.
+  @param n  the number of arrivals
+  @return the token to pass to wait() */
+  arrival_token arrive(uint32_t n = 1) noexcept
+  {
+    const uint32_t v = word.fetch_sub(n, std::memory_order_acq_rel) - n;
+    assert(((v + n) & REMAINING) >= n);
+    if (!(v & REMAINING))
+      complete(v);
+    return v & PHASE;
+  }
+
+  /** Wait for the completion of a phase.
+  @param phase  the return value of arrive() */
+  void wait(arrival_token phase) const noexcept
+  {
+    uint32_t v = word.load(std::memory_order_acquire);
+    while ((v & PHASE) == phase)
+    {
+      if (!(v & WAITING) &&
+          !word.compare_exchange_weak(v, v | WAITING,
+                                      std::memory_order_acquire,
+                                      std::memory_order_acquire))
+        continue;
+      wait_word(v | WAITING);
+      v = word.load(std::memory_order_acquire);
+    }
+  }
+
+  /** Arrive at the barrier and wait for the completion of the phase */
+  void arrive_and_wait() noexcept { wait(arrive()); }
+
+  /** Arrive at the barrier, and stop participating in subsequent phases */
+  void arrive_and_drop() noexcept
+  {
+    const uint32_t v =
+      word.fetch_sub(EXPECTED_ONE + 1, std::memory_order_acq_rel) -
+      (EXPECTED_ONE + 1);
+    assert(((v + EXPECTED_ONE + 1) & REMAINING) >= 1);
+    if (!(v & REMAINING))
+      complete(v);
+  }
+
+  /** @return whether a thread may be blocked in wait() */
+  bool is_waiting() const noexcept
+  { return word.load(std::memory_order_relaxed) & WAITING; }
+};
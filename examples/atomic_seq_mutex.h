@@ -0,0 +1,155 @@
+#pragma once
+#include "atomic_shared_mutex.h"
+
+/** A sequence lock: an atomic_shared_mutex and a 4-byte sequence number,
+which is odd while an exclusive lock is being held.
+
+Writers invoke lock() and unlock(), which reuse atomic_shared_mutex.
+Optimistic readers do not write to the cache line: they invoke
+read_begin() before and read_validate() after reading the data, and
+retry if the data may have been modified in between. Pessimistic readers
+invoke lock_shared() and unlock_shared(); see seq_shared_lock_guard.
+
+Because optimistic readers may run concurrently with a writer, the
+protected data must be accessed by std::atomic operations; the memory
+order may be std::memory_order_relaxed, both for reads and writes.
+
+With the default Storage, the object is 12 bytes: the 8 bytes of
+atomic_shared_mutex and a word of its own for the sequence number.
+The lock words have no bits to spare. The outer word is a count of
+waiters and the inner word is a count of shared lock holders, below
+the flags of the exclusive and update locks. Folding the sequence
+number into one of them would leave it only a few bits, and an
+optimistic reader that is descheduled while the number wraps around
+would accept inconsistent data. A lock word also changes whenever
+readers acquire or release a shared lock or waiters come and go.
+read_validate() would then have to mask those bits on every read.
+
+There is no explicit constructor or destructor. Like atomic_mutex,
+the object is expected to be zero-initialized.
+@tparam Storage  the storage of the atomic_shared_mutex */
+template<typename Storage = shared_mutex_storage<>>
+class atomic_seq_mutex
+{
+  /** twice the number of completed writes, plus 1 during a write */
+  std::atomic<uint32_t> seq;
+  /** the lock of writers and pessimistic readers */
+  atomic_shared_mutex<Storage> m;
+
+  /** Start a write after the exclusive lock was acquired */
+  void write_begin() noexcept
+  {
+    assert(!(seq.load(std::memory_order_relaxed) & 1));
+    seq.store(seq.load(std::memory_order_relaxed) + 1,
+              std::memory_order_relaxed);
+    /* Pair with read_validate(), so that a reader that observes any
+    subsequent write will observe the odd sequence number. */
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+public:
+  constexpr const Storage& get_storage() const { return m.get_storage(); }
+
+  /** @return whether an exclusive lock is being held */
+  bool is_write_locked() const noexcept
+  { return seq.load(std::memory_order_acquire) & 1; }
+
+  /** Acquire an exclusive lock */
+  void lock() noexcept { m.lock(); write_begin(); }
+  /** Acquire an exclusive lock, with initial spinloop */
+  void spin_lock() noexcept { m.spin_lock(); write_begin(); }
+  /** @return whether the exclusive lock was acquired */
+  bool try_lock() noexcept
+  {
+    if (!m.try_lock())
+      return false;
+    write_begin();
+    return true;
+  }
+  /** Release an exclusive lock */
+  void unlock() noexcept
+  {
+    assert(is_write_locked());
+    seq.store(seq.load(std::memory_order_relaxed) + 1,
+              std::memory_order_release);
+    m.unlock();
+  }
+
+  /** Start an optimistic read.
+  @return the sequence number to pass to read_validate() */
+  uint32_t read_begin() const noexcept
+  { return seq.load(std::memory_order_acquire); }
+  /** Check if an optimistic read was consistent.
+  @param s  the return value of read_begin()
+  @return whether no write was in progress since read_begin() */
+  bool read_validate(uint32_t s) const noexcept
+  {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return !(s & 1) && seq.load(std::memory_order_relaxed) == s;
+  }
+
+  /** Acquire a shared lock, which blocks writers */
+  void lock_shared() noexcept { m.lock_shared(); }
+  /** Acquire a shared lock, with initial spinloop */
+  void spin_lock_shared() noexcept { m.spin_lock_shared(); }
+  /** Release a shared lock */
+  void unlock_shared() noexcept { m.unlock_shared(); }
+};
+
+/** A reader of atomic_seq_mutex, in the spirit of
+transactional_shared_lock_guard: the first attempts are optimistic, and
+after they fail, a shared lock will be acquired. Typical usage:
+
+  seq_shared_lock_guard<atomic_seq_mutex<>> g{m};
+  do
+    copy = data.load(std::memory_order_relaxed);
+  while (!g.validate());
+
+@tparam mutex     atomic_seq_mutex
+@tparam ATTEMPTS  number of optimistic attempts before lock_shared() */
+template<class mutex, unsigned ATTEMPTS = 4>
+class seq_shared_lock_guard
+{
+  mutex &m;
+  /** the sequence number of the current optimistic attempt */
+  uint32_t seq;
+  /** number of failed attempts */
+  unsigned failed = 0;
+  /** whether the shared lock is being held */
+  bool locked = false;
+
+public:
+  seq_shared_lock_guard(mutex &m) noexcept : m(m)
+  {
+    if (ATTEMPTS)
+      seq = m.read_begin();
+    else
+    {
+      m.lock_shared();
+      locked = true;
+    }
+  }
+  seq_shared_lock_guard(const seq_shared_lock_guard &) = delete;
+  ~seq_shared_lock_guard() noexcept { if (locked) m.unlock_shared(); }
+
+  /** Validate the reads since the start of the current attempt.
+  If they may be inconsistent, start another attempt, which will be
+  pessimistic after ATTEMPTS failures.
+  @return whether the reads were consistent */
+  bool validate() noexcept
+  {
+    if (locked || m.read_validate(seq))
+      return true;
+    if (++failed < ATTEMPTS)
+      seq = m.read_begin();
+    else
+    {
+      m.lock_shared();
+      locked = true;
+    }
+    return false;
+  }
+
+  /** @return whether the shared lock was avoided */
+  bool was_elided() const noexcept { return !locked; }
+};
@@ -0,0 +1,274 @@
+#include "profiled_mutex_storage.h"
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+
+namespace
+{
+/** The registry of lock_profile records */
+struct lock_registry
+{
+  /** protects the lists */
+  std::mutex mutex;
+  /** all records (never freed) */
+  std::vector<lock_profile*> all;
+  /** records that are not in use */
+  lock_profile *free_list = nullptr;
+};
+}
+
+/** @return the registry, which is never freed, so that locks may be
+created and destroyed during the construction or destruction of
+static objects */
+static lock_registry &get_registry()
+{
+  static lock_registry *registry = new lock_registry;
+  return *registry;
+}
+
+/** @return the histogram bucket of a duration in nanoseconds */
+static unsigned bucket(uint64_t ns) noexcept
+{
+  unsigned b = 0;
+  while (ns >>= 1)
+    b++;
+  return b < lock_profile::BUCKETS ? b : lock_profile::BUCKETS - 1;
+}
+
+namespace
+{
+/** Updates of one lock_profile by the current thread */
+struct batch
+{
+  lock_profile *profile;
+  /** lock_profile::serial when the batch was started */
+  uint64_t serial;
+  /** number of pending updates */
+  unsigned events;
+  uint32_t count[lock_profile::N_EVENTS];
+  uint64_t wait_ns;
+  uint32_t wait_hist[lock_profile::BUCKETS];
+  uint32_t hold_hist[lock_profile::BUCKETS];
+
+  /** Apply the pending updates */
+  void flush() noexcept
+  {
+    if (!events)
+      return;
+    events = 0;
+    /* If the lock was destroyed meanwhile, discard the updates. A lock
+    that is concurrently being destroyed may still receive them. */
+    if (profile->serial.load(std::memory_order_relaxed) == serial)
+    {
+      for (unsigned i = 0; i < lock_profile::N_EVENTS; i++)
+        if (count[i])
+          profile->count[i].fetch_add(count[i], std::memory_order_relaxed);
+      if (wait_ns)
+        profile->wait_ns.fetch_add(wait_ns, std::memory_order_relaxed);
+      for (unsigned i = 0; i < lock_profile::BUCKETS; i++)
+      {
+        if (wait_hist[i])
+          profile->wait_hist[i].fetch_add(wait_hist[i],
+                                          std::memory_order_relaxed);
+        if (hold_hist[i])
+          profile->hold_hist[i].fetch_add(hold_hist[i],
+                                          std::memory_order_relaxed);
+      }
+    }
+    std::fill_n(count, lock_profile::N_EVENTS, 0);
+    wait_ns = 0;
+    std::fill_n(wait_hist, lock_profile::BUCKETS, 0);
+    std::fill_n(hold_hist, lock_profile::BUCKETS, 0);
+  }
+};
+
+/** The updates by the current thread, for a few locks at a time */
+struct thread_batches
+{
+  /** log2 of the number of slots */
+  static constexpr unsigned SLOTS_LOG2 = 4;
+  batch slots[1U << SLOTS_LOG2];
+  /** counter for lock_profile::HOLD_SAMPLING */
+  unsigned acquisitions;
+
+  ~thread_batches() { flush(); }
+
+  void flush() noexcept
+  {
+    for (auto &b : slots)
+      b.flush();
+  }
+
+  /** @return the batch for a lock_profile */
+  batch &get(lock_profile *profile) noexcept
+  {
+    batch &b = slots[uint64_t(uintptr_t(profile)) * 0x9E3779B97F4A7C15ULL >>
+                     (64 - SLOTS_LOG2)];
+    const uint64_t serial = profile->serial.load(std::memory_order_relaxed);
+    /* If the record was reused for another lock, flush() will discard
+    the pending updates for the previous lock. */
+    if (b.profile != profile || b.serial != serial)
+    {
+      b.flush();
+      b.profile = profile;
+      b.serial = serial;
+    }
+    return b;
+  }
+};
+
+thread_local thread_batches batches;
+}
+
+lock_profile *lock_profile::create()
+{
+  lock_registry &registry = get_registry();
+  std::lock_guard<std::mutex> g{registry.mutex};
+  lock_profile *p = registry.free_list;
+  if (p)
+    registry.free_list = p->next_free;
+  else
+  {
+    p = new lock_profile();
+    registry.all.push_back(p);
+  }
+  p->serial.fetch_add(1, std::memory_order_relaxed);
+  return p;
+}
+
+void lock_profile::destroy() noexcept
+{
+  lock_registry &registry = get_registry();
+  std::lock_guard<std::mutex> g{registry.mutex};
+  serial.fetch_add(1, std::memory_order_relaxed);
+  name.store(nullptr, std::memory_order_relaxed);
+  for (auto &c : count)
+    c.store(0, std::memory_order_relaxed);
+  wait_ns.store(0, std::memory_order_relaxed);
+  for (auto &h : wait_hist)
+    h.store(0, std::memory_order_relaxed);
+  for (auto &h : hold_hist)
+    h.store(0, std::memory_order_relaxed);
+  next_free = registry.free_list;
+  registry.free_list = this;
+}
+
+void lock_profile::add(event e) noexcept
+{
+  batch &b = batches.get(this);
+  b.count[e]++;
+  if (++b.events >= BATCH)
+    b.flush();
+}
+
+void lock_profile::add_wait(event e, uint64_t start) noexcept
+{
+  const uint64_t ns = now() - start;
+  batch &b = batches.get(this);
+  b.wait_ns += ns;
+  if (e != N_EVENTS)
+  {
+    b.count[e]++;
+    b.wait_hist[bucket(ns)]++;
+  }
+  if (++b.events >= BATCH)
+    b.flush();
+}
+
+void lock_profile::add_hold(uint64_t start) noexcept
+{
+  const uint64_t ns = now() - start;
+  batch &b = batches.get(this);
+  b.hold_hist[bucket(ns)]++;
+  if (++b.events >= BATCH)
+    b.flush();
+}
+
+uint64_t lock_profile::now() noexcept
+{
+  using namespace std::chrono;
+  return uint64_t(duration_cast<nanoseconds>(steady_clock::now().
+                                             time_since_epoch()).count());
+}
+
+uint64_t lock_profile::start_hold() noexcept
+{
+  if (++batches.acquisitions % HOLD_SAMPLING)
+    return 0;
+  const uint64_t t = now();
+  return t ? t : 1;
+}
+
+void lock_profile::flush() noexcept { batches.flush(); }
+
+std::vector<lock_profile::snapshot> lock_profile::top(size_t n)
+{
+  flush();
+  std::vector<snapshot> s;
+  {
+    lock_registry &registry = get_registry();
+    std::lock_guard<std::mutex> g{registry.mutex};
+    for (const lock_profile *p : registry.all)
+    {
+      if (!p->in_use())
+        continue;
+      snapshot r;
+      const char *name = p->name.load(std::memory_order_relaxed);
+      if (name)
+        r.name = name;
+      for (unsigned i = 0; i < N_EVENTS; i++)
+        r.count[i] = p->count[i].load(std::memory_order_relaxed);
+      r.wait_ns = p->wait_ns.load(std::memory_order_relaxed);
+      for (unsigned i = 0; i < BUCKETS; i++)
+      {
+        r.wait_hist[i] = p->wait_hist[i].load(std::memory_order_relaxed);
+        r.hold_hist[i] = p->hold_hist[i].load(std::memory_order_relaxed);
+      }
+      s.push_back(std::move(r));
+    }
+  }
+
+  auto hotter = [](const snapshot &a, const snapshot &b)
+  {
+    return a.wait_ns != b.wait_ns
+      ? a.wait_ns > b.wait_ns
+      : a.count[CONTENDED] > b.count[CONTENDED];
+  };
+  if (s.size() > n)
+  {
+    std::partial_sort(s.begin(), s.begin() + n, s.end(), hotter);
+    s.resize(n);
+  }
+  else
+    std::sort(s.begin(), s.end(), hotter);
+  return s;
+}
+
+/** Write the non-empty buckets of a histogram */
+static void dump_histogram(FILE *f, const char *what, const uint64_t *hist)
+{
+  fprintf(f, "  %s:", what);
+  for (unsigned i = 0; i < lock_profile::BUCKETS; i++)
+    if (hist[i])
+      fprintf(f, " %s%llu:%llu", i == lock_profile::BUCKETS - 1 ? ">=" : "",
+              1ULL << i, static_cast<unsigned long long>(hist[i]));
+  fputs(" (ns:count)\n", f);
+}
+
+void lock_profile::dump(FILE *f, size_t n)
+{
+  for (const snapshot &s : top(n))
+  {
+    fprintf(f, "%s: %llu uncontended, %llu contended, %llu blocked,"
+            " %llu spun, %llu wakeups, %llu ns waited\n",
+            s.name.empty() ? "(unnamed)" : s.name.c_str(),
+            static_cast<unsigned long long>(s.count[UNCONTENDED]),
+            static_cast<unsigned long long>(s.count[CONTENDED]),
+            static_cast<unsigned long long>(s.count[BLOCKED]),
+            static_cast<unsigned long long>(s.count[SPUN]),
+            static_cast<unsigned long long>(s.count[WAKEUPS]),
+            static_cast<unsigned long long>(s.wait_ns));
+    dump_histogram(f, "wait", s.wait_hist);
+    dump_histogram(f, "hold", s.hold_hist);
+  }
+}
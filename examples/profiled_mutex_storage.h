@@ -0,0 +1,410 @@
+#pragma once
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "atomic_shared_mutex.h"
+
+/** Contention statistics of one lock.
+
+The records are owned by a global registry, and they are never freed,
+so that a delayed update from a thread will not access freed memory.
+A record is reused after the lock that was using it has been destroyed.
+
+Updates are batched in each thread, and they are applied to the record
+every BATCH events, or when the thread exits, or on flush(). A snapshot
+may therefore miss some recent events. */
+struct lock_profile
+{
+  /** Counted events */
+  enum event
+  {
+    /** the lock was acquired at the first attempt */
+    UNCONTENDED,
+    /** the lock was acquired after the first attempt failed */
+    CONTENDED,
+    /** a CONTENDED acquisition entered the blocking wait,
+    after any spinloop had failed */
+    BLOCKED,
+    /** a CONTENDED acquisition succeeded in the spinloop,
+    without entering the blocking wait */
+    SPUN,
+    /** a waiting thread was notified on release */
+    WAKEUPS,
+    N_EVENTS
+  };
+
+  /** Number of histogram buckets; bucket i counts durations of
+  [2**i,2**(i+1)) nanoseconds, and the last bucket counts anything longer */
+  static constexpr unsigned BUCKETS = 32;
+  /** Number of events that a thread may accumulate before flushing */
+  static constexpr unsigned BATCH = 64;
+  /** Hold times are measured for 1 out of this many acquisitions */
+  static constexpr unsigned HOLD_SAMPLING = 64;
+
+  /** A copy of the statistics */
+  struct snapshot
+  {
+    /** name of the lock, or empty */
+    std::string name;
+    /** event counts */
+    uint64_t count[N_EVENTS];
+    /** total waiting time in nanoseconds */
+    uint64_t wait_ns;
+    /** histogram of waiting times of CONTENDED acquisitions */
+    uint64_t wait_hist[BUCKETS];
+    /** histogram of sampled exclusive (or update) lock hold times */
+    uint64_t hold_hist[BUCKETS];
+  };
+
+  /** Allocate a record from the registry */
+  static lock_profile *create();
+  /** Return a record to the registry */
+  void destroy() noexcept;
+
+  /** Assign a name, for snapshot. The string must not be freed
+  while the lock exists. */
+  void set_name(const char *name) noexcept
+  { this->name.store(name, std::memory_order_relaxed); }
+
+  /** Count an event */
+  void add(event e) noexcept;
+  /** Count an event and a wait time
+  @param e      the event, or N_EVENTS to only add to the total wait_ns
+  @param start  the return value of now() when the wait started */
+  void add_wait(event e, uint64_t start) noexcept;
+  /** Record a hold time
+  @param start  the return value of start_hold() */
+  void add_hold(uint64_t start) noexcept;
+
+  /** @return the current time in nanoseconds */
+  static uint64_t now() noexcept;
+  /** @return the start time to pass to add_hold(), or 0 if this
+  acquisition is not being sampled */
+  static uint64_t start_hold() noexcept;
+
+  /** Apply the pending updates of the current thread */
+  static void flush() noexcept;
+
+  /** @return whether the record is being used by a lock */
+  bool in_use() const noexcept
+  { return serial.load(std::memory_order_relaxed) & 1; }
+
+  /** Take a snapshot of the most contended locks, ordered by the total
+  waiting time and the number of CONTENDED acquisitions.
+  @param n  maximum number of snapshots
+  @return snapshots of at most n locks */
+  static std::vector<snapshot> top(size_t n);
+  /** Write top(n) in a human readable format */
+  static void dump(FILE *f, size_t n);
+
+  /** incremented on create() and destroy(); odd while in use */
+  std::atomic<uint64_t> serial;
+  /** name of the lock, or nullptr */
+  std::atomic<const char*> name;
+  /** event counts */
+  std::atomic<uint64_t> count[N_EVENTS];
+  /** total waiting time in nanoseconds */
+  std::atomic<uint64_t> wait_ns;
+  /** histogram of waiting times */
+  std::atomic<uint64_t> wait_hist[BUCKETS];
+  /** histogram of sampled hold times */
+  std::atomic<uint64_t> hold_hist[BUCKETS];
+  /** next free record in the registry */
+  lock_profile *next_free;
+};
+
+/** A mutex_storage wrapper that collects contention statistics into a
+lock_profile, and reports them by lock_profile::top().
+
+Example: atomic_mutex<profiled_mutex_storage<>> */
+template<typename Inner = mutex_storage<>>
+class profiled_mutex_storage
+{
+  using type = typename Inner::type;
+  Inner inner;
+  /** start time of a sampled hold, or 0 */
+  uint64_t hold_start = 0;
+  /** the statistics */
+  lock_profile *const profile;
+
+public:
+  profiled_mutex_storage() : inner(), profile(lock_profile::create()) {}
+  ~profiled_mutex_storage() { profile->destroy(); }
+
+  /** Assign a name to the mutex, for lock_profile::top() */
+  void set_name(const char *name) const noexcept { profile->set_name(name); }
+  /** @return the statistics */
+  const lock_profile &get_profile() const noexcept { return *profile; }
+
+  bool is_locked() const noexcept { return inner.is_locked(); }
+  bool is_locked_or_waiting() const noexcept
+  { return inner.is_locked_or_waiting(); }
+  bool is_locked_not_waiting() const noexcept
+  { return inner.is_locked_not_waiting(); }
+
+private:
+  friend class atomic_mutex<profiled_mutex_storage>;
+
+  void acquired() noexcept { hold_start = lock_profile::start_hold(); }
+
+  unsigned default_spin_rounds() const noexcept
+  { return inner.default_spin_rounds(); }
+
+  bool lock_impl() noexcept
+  {
+    if (!inner.lock_impl())
+      return false;
+    profile->add(lock_profile::UNCONTENDED);
+    acquired();
+    return true;
+  }
+  void lock_wait() noexcept
+  {
+    const uint64_t start = lock_profile::now();
+    profile->add(lock_profile::BLOCKED);
+    inner.lock_wait();
+    profile->add_wait(lock_profile::CONTENDED, start);
+    acquired();
+  }
+  void spin_lock_wait(unsigned spin_rounds) noexcept
+  {
+    const uint64_t start = lock_profile::now();
+    type lk = inner.register_waiter();
+    if (inner.spin_lock_registered(lk, spin_rounds))
+      profile->add(lock_profile::SPUN);
+    else
+    {
+      profile->add(lock_profile::BLOCKED);
+      inner.lock_wait_registered(lk);
+    }
+    profile->add_wait(lock_profile::CONTENDED, start);
+    acquired();
+  }
+  bool lock_wait_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  {
+    const uint64_t start = lock_profile::now();
+    profile->add(lock_profile::BLOCKED);
+    const bool locked = inner.lock_wait_until(deadline);
+    profile->add_wait(lock_profile::CONTENDED, start);
+    if (locked)
+      acquired();
+    return locked;
+  }
+  bool lock_wait_until(std::chrono::steady_clock::time_point deadline,
+                       bool (*cancel)(const void *ctx), const void *ctx)
+    noexcept
+  {
+    const uint64_t start = lock_profile::now();
+    profile->add(lock_profile::BLOCKED);
+    const bool locked = inner.lock_wait_until(deadline, cancel, ctx);
+    profile->add_wait(lock_profile::CONTENDED, start);
+    if (locked)
+      acquired();
+    return locked;
+  }
+  void notify_cancel() noexcept
+  {
+    profile->add(lock_profile::WAKEUPS);
+    inner.notify_cancel();
+  }
+  void notify_cancel_done() noexcept { inner.notify_cancel_done(); }
+  void lock_requeued() noexcept
+  {
+    const uint64_t start = lock_profile::now();
+    profile->add(lock_profile::BLOCKED);
+    inner.lock_requeued();
+    profile->add_wait(lock_profile::CONTENDED, start);
+    acquired();
+  }
+  void requeue(std::atomic<uint32_t> &from, uint32_t val, uint32_t n)
+    noexcept
+  { inner.requeue(from, val, n); }
+
+  bool unlock_impl() noexcept
+  {
+    if (hold_start)
+    {
+      profile->add_hold(hold_start);
+      hold_start = 0;
+    }
+    return inner.unlock_impl();
+  }
+  void unlock_notify() noexcept
+  {
+    profile->add(lock_profile::WAKEUPS);
+    inner.unlock_notify();
+  }
+};
+
+/** A shared_mutex_storage wrapper that collects contention statistics
+into a lock_profile, and reports them by lock_profile::top().
+
+The hold times are measured for update and exclusive locks.
+For spin_lock_update() and spin_lock(), a CONTENDED acquisition is
+counted as neither BLOCKED nor SPUN, because that is decided inside
+atomic_mutex.
+Wake-ups of waiting update or exclusive lock requests are not counted.
+
+Example: atomic_shared_mutex<profiled_shared_mutex_storage<>> */
+template<typename Inner = shared_mutex_storage<>>
+class profiled_shared_mutex_storage
+{
+  using type = typename Inner::type;
+  Inner inner;
+  /** start time of a sampled hold of the update or exclusive lock, or 0 */
+  uint64_t hold_start = 0;
+  /** the statistics */
+  lock_profile *const profile;
+
+public:
+  profiled_shared_mutex_storage() : inner(), profile(lock_profile::create())
+  {}
+  ~profiled_shared_mutex_storage() { profile->destroy(); }
+
+  /** Assign a name to the mutex, for lock_profile::top() */
+  void set_name(const char *name) const noexcept { profile->set_name(name); }
+  /** @return the statistics */
+  const lock_profile &get_profile() const noexcept { return *profile; }
+
+  bool is_locked() const noexcept { return inner.is_locked(); }
+  bool is_locked_or_waiting() const noexcept
+  { return inner.is_locked_or_waiting(); }
+
+private:
+  friend class atomic_shared_mutex<profiled_shared_mutex_storage>;
+
+  void acquired() noexcept { hold_start = lock_profile::start_hold(); }
+
+  unsigned default_spin_rounds() const noexcept
+  { return inner.default_spin_rounds(); }
+
+  bool try_lock_outer() noexcept
+  {
+    if (!inner.try_lock_outer())
+      return false;
+    profile->add(lock_profile::UNCONTENDED);
+    acquired();
+    return true;
+  }
+  void lock_outer() noexcept
+  {
+    if (try_lock_outer())
+      return;
+    const uint64_t start = lock_profile::now();
+    profile->add(lock_profile::BLOCKED);
+    inner.lock_outer();
+    profile->add_wait(lock_profile::CONTENDED, start);
+    acquired();
+  }
+  void spin_lock_outer(unsigned spin_rounds) noexcept
+  {
+    if (try_lock_outer())
+      return;
+    const uint64_t start = lock_profile::now();
+    inner.spin_lock_outer(spin_rounds);
+    profile->add_wait(lock_profile::CONTENDED, start);
+    acquired();
+  }
+  void spin_lock_outer() noexcept
+  { spin_lock_outer(inner.default_spin_rounds()); }
+  bool lock_outer_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  {
+    if (try_lock_outer())
+      return true;
+    const uint64_t start = lock_profile::now();
+    profile->add(lock_profile::BLOCKED);
+    const bool locked = inner.lock_outer_until(deadline);
+    profile->add_wait(lock_profile::CONTENDED, start);
+    if (locked)
+      acquired();
+    return locked;
+  }
+  bool upgrade_outer_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  {
+    if (try_lock_outer())
+      return true;
+    const uint64_t start = lock_profile::now();
+    profile->add(lock_profile::BLOCKED);
+    const bool locked = inner.upgrade_outer_until(deadline);
+    profile->add_wait(lock_profile::CONTENDED, start);
+    if (locked)
+      acquired();
+    return locked;
+  }
+  void unlock_outer() noexcept
+  {
+    if (hold_start)
+    {
+      profile->add_hold(hold_start);
+      hold_start = 0;
+    }
+    inner.unlock_outer();
+  }
+
+  void shared_lock_wait() noexcept
+  {
+    const uint64_t start = lock_profile::now();
+    profile->add(lock_profile::BLOCKED);
+    inner.shared_lock_wait();
+    profile->add_wait(lock_profile::CONTENDED, start);
+  }
+  bool shared_lock_wait_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  {
+    const uint64_t start = lock_profile::now();
+    profile->add(lock_profile::BLOCKED);
+    const bool locked = inner.shared_lock_wait_until(deadline);
+    profile->add_wait(lock_profile::CONTENDED, start);
+    return locked;
+  }
+  void spin_shared_lock_wait(unsigned spin_rounds) noexcept
+  {
+    const uint64_t start = lock_profile::now();
+    if (inner.spin_shared_lock_inner(spin_rounds))
+      profile->add(lock_profile::SPUN);
+    else
+    {
+      profile->add(lock_profile::BLOCKED);
+      inner.shared_lock_wait();
+    }
+    profile->add_wait(lock_profile::CONTENDED, start);
+  }
+
+  bool shared_lock_inner() noexcept
+  {
+    if (!inner.shared_lock_inner())
+      return false;
+    profile->add(lock_profile::UNCONTENDED);
+    return true;
+  }
+  bool shared_unlock_inner() noexcept { return inner.shared_unlock_inner(); }
+
+  type lock_inner() noexcept { return inner.lock_inner(); }
+  /* The waits for shared lock holders to leave are only added to the
+  total waiting time, because the acquisition was already counted. */
+  void lock_inner_wait(type lk) noexcept
+  {
+    const uint64_t start = lock_profile::now();
+    inner.lock_inner_wait(lk);
+    profile->add_wait(lock_profile::N_EVENTS, start);
+  }
+  bool lock_inner_wait_until(type lk,
+                             std::chrono::steady_clock::time_point deadline)
+    noexcept
+  {
+    const uint64_t start = lock_profile::now();
+    const bool locked = inner.lock_inner_wait_until(lk, deadline);
+    profile->add_wait(lock_profile::N_EVENTS, start);
+    return locked;
+  }
+  void unlock_inner() noexcept { inner.unlock_inner(); }
+
+  void shared_unlock_inner_notify() noexcept
+  {
+    profile->add(lock_profile::WAKEUPS);
+    inner.shared_unlock_inner_notify();
+  }
+};
@@ -0,0 +1,65 @@
+#include "sharded_shared_mutex_storage.h"
+#include <thread>
+
+/** log2 of the number of slots in visible_readers[] */
+static constexpr unsigned SLOTS_LOG2 = 12;
+
+/** The visible readers table. The slots are packed, because each thread
+is likely to access only a few of them, in different cache lines. */
+static std::atomic<const void*> visible_readers[1U << SLOTS_LOG2];
+
+/** A thread-local variable, whose address identifies the thread */
+static thread_local char thread_id;
+
+std::atomic<const void*> &sharded_readers::slot(const void *lock) noexcept
+{
+  const uint64_t h = (uint64_t(uintptr_t(&thread_id)) ^
+                      uint64_t(uintptr_t(lock)) * 0x9E3779B97F4A7C15ULL) *
+    0x9E3779B97F4A7C15ULL;
+  return visible_readers[h >> (64 - SLOTS_LOG2)];
+}
+
+void sharded_readers::revoke(const void *lock,
+                             std::atomic<uint32_t> &migrated) noexcept
+{
+  /* Rather than polling each entry until the reader leaves, take over
+  the entries, so that the scan completes in one pass, and block until
+  the last reader that we took over releases migrated. */
+  for (auto &s : visible_readers)
+  {
+    if (s.load(std::memory_order_relaxed) != lock)
+      continue;
+    /* Count the entry before deleting it, so that the reader that fails
+    to delete it will find migrated nonzero. */
+    migrated.fetch_add(1, std::memory_order_relaxed);
+    const void *expected = lock;
+    if (!s.compare_exchange_strong(expected, nullptr))
+      migrated.fetch_sub(1, std::memory_order_relaxed);
+  }
+  while (const uint32_t m = migrated.load(std::memory_order_acquire))
+    atomic_word_wait(migrated, m);
+}
+
+bool sharded_readers::revoke_until
+  (const void *lock, std::chrono::steady_clock::time_point deadline) noexcept
+{
+  for (const auto &s : visible_readers)
+  {
+    if (s.load() != lock)
+      continue;
+    while (s.load() == lock)
+    {
+      if (std::chrono::steady_clock::now() >= deadline)
+        return false;
+      std::this_thread::yield();
+    }
+  }
+  return true;
+}
+
+uint64_t sharded_readers::now() noexcept
+{
+  using namespace std::chrono;
+  return uint64_t(duration_cast<nanoseconds>(steady_clock::now().
+                                             time_since_epoch()).count());
+}
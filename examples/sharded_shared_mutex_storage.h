@@ -0,0 +1,257 @@
+#pragma once
+#include "atomic_shared_mutex.h"
+
+/** The visible readers table of sharded_shared_mutex_storage.
+
+Each slot may hold the address of a lock that a thread is holding a
+shared lock on. The slot is determined by a hash of the address of the
+lock and of a thread-local variable. */
+struct sharded_readers
+{
+  /** A revocation inhibits the table for this many times the time
+  that the revocation took. A revocation holds the outer lock, stalling
+  all other exclusive and update lock requests, while it scans the
+  entire table and while it waits for the readers in the table to leave.
+  This keeps scanning below 1/(INHIBIT+1) of the time. */
+  static constexpr unsigned INHIBIT = 9;
+
+  /** @return the slot of the current thread for a lock */
+  static std::atomic<const void*> &slot(const void *lock) noexcept;
+  /** Wait for all table entries for a lock to be released.
+  The caller must have prevented new entries from being created.
+  The table is scanned once, deleting the entries and counting them
+  in migrated, which will be waited for by atomic_word_wait().
+  @param lock      the lock
+  @param migrated  the count of deleted entries that are held */
+  static void revoke(const void *lock, std::atomic<uint32_t> &migrated)
+    noexcept;
+  /** Wait for all table entries for a lock to be released, or a deadline.
+  The entries will be polled, because they cannot be migrated back.
+  @return whether the entries were released */
+  static bool revoke_until(const void *lock,
+                           std::chrono::steady_clock::time_point deadline)
+    noexcept;
+  /** @return the current time in nanoseconds */
+  static uint64_t now() noexcept;
+};
+
+/** A shared_mutex_storage wrapper with a scalable reader indicator,
+based on BRAVO (Biased Locking for Reader-Writer Locks) by Dave Dice and
+Alex Kogan.
+
+While the lock is biased towards readers, lock_shared() will publish
+the shared lock in a slot of the global sharded_readers table instead of
+incrementing the lock word, so that readers on different processors will
+not contend for the same cache line.
+
+An exclusive lock request will revoke the bias and wait for the readers
+in the table to leave. Because that involves scanning the entire table
+while holding the outer lock, the bias will be inhibited for
+sharded_readers::INHIBIT times as long as the revocation took. Until then, all shared lock requests will use
+the lock word, as with the plain shared_mutex_storage. The bias will be
+re-enabled by the next shared lock acquisition after that.
+
+A shared lock must be released by the thread that acquired it.
+The is_locked_or_waiting() check does not account for the readers
+in the table.
+
+There is no explicit constructor or destructor. Like shared_mutex_storage,
+the object is expected to be zero-initialized, which enables the bias.
+
+Example: atomic_shared_mutex<sharded_shared_mutex_storage<>> */
+template<typename Inner = shared_mutex_storage<>>
+class sharded_shared_mutex_storage
+{
+  using type = typename Inner::type;
+  /** returned by lock_inner() when only the table needs to be drained */
+  static constexpr type X = Inner::X;
+
+  Inner inner;
+  /** 0 if readers may use the table; otherwise, the sharded_readers::now()
+  until which the bias must not be re-enabled */
+  std::atomic<uint64_t> bias;
+  /** number of shared locks whose table entries sharded_readers::revoke()
+  deleted; they will be released by decrementing this */
+  std::atomic<uint32_t> migrated;
+
+public:
+  bool is_locked() const noexcept { return inner.is_locked(); }
+  bool is_locked_or_waiting() const noexcept
+  { return inner.is_locked_or_waiting(); }
+  /** @return whether lock_shared() may use the table */
+  bool is_biased() const noexcept
+  { return !bias.load(std::memory_order_relaxed); }
+
+private:
+  friend class atomic_shared_mutex<sharded_shared_mutex_storage>;
+
+  /** Re-enable the bias after the inhibition period, while holding
+  a shared lock on the lock word */
+  void enable_bias() noexcept
+  {
+    const uint64_t b = bias.load(std::memory_order_relaxed);
+    if (b && sharded_readers::now() >= b)
+      bias.store(0, std::memory_order_release);
+  }
+
+  /** Disable the bias before waiting for the table to be drained.
+  @return the start time of the revocation, or 0 if no bias was enabled */
+  uint64_t disable_bias() noexcept
+  {
+    if (bias.load(std::memory_order_relaxed))
+      return 0;
+    /* Pair with the loads in shared_lock_inner(). Until the revocation
+    completes, the bias must not be re-enabled. */
+    bias.store(~uint64_t{0});
+    return sharded_readers::now();
+  }
+  /** Release a shared lock whose table entry was deleted by
+  sharded_readers::revoke() */
+  void shared_unlock_migrated() noexcept
+  {
+    if (migrated.fetch_sub(1, std::memory_order_release) == 1)
+      atomic_word_notify(migrated, 1);
+  }
+  /** Delete the table entry of a shared lock.
+  @return whether the entry had been migrated by sharded_readers::revoke() */
+  bool shared_unlock_slot(std::atomic<const void*> &s) noexcept
+  {
+    const void *expected = this;
+    if (s.compare_exchange_strong(expected, nullptr,
+                                  std::memory_order_release,
+                                  std::memory_order_acquire))
+      return false;
+    shared_unlock_migrated();
+    return true;
+  }
+
+  /** Inhibit the bias after a revocation that started at start */
+  void inhibit_bias(uint64_t start) noexcept
+  {
+    const uint64_t end = sharded_readers::now();
+    bias.store(end + sharded_readers::INHIBIT * (end - start) + 1,
+               std::memory_order_relaxed);
+  }
+
+  unsigned default_spin_rounds() const noexcept
+  { return inner.default_spin_rounds(); }
+
+  bool try_lock_outer() noexcept { return inner.try_lock_outer(); }
+  void lock_outer() noexcept { inner.lock_outer(); }
+  void spin_lock_outer(unsigned spin_rounds) noexcept
+  { inner.spin_lock_outer(spin_rounds); }
+  void spin_lock_outer() noexcept { inner.spin_lock_outer(); }
+  bool lock_outer_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  { return inner.lock_outer_until(deadline); }
+  void unlock_outer() noexcept { inner.unlock_outer(); }
+  /* An exclusive lock request will set the flag in inner before
+  revoking the table, so a shared lock in the table will not be
+  mistaken for an absence of pending requests. */
+  bool upgrade_outer_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  { return inner.upgrade_outer_until(deadline); }
+
+  void shared_lock_wait() noexcept
+  {
+    inner.shared_lock_wait();
+    enable_bias();
+  }
+  bool shared_lock_wait_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  {
+    if (!inner.shared_lock_wait_until(deadline))
+      return false;
+    enable_bias();
+    return true;
+  }
+  void spin_shared_lock_wait(unsigned spin_rounds) noexcept
+  {
+    inner.spin_shared_lock_wait(spin_rounds);
+    enable_bias();
+  }
+
+  bool shared_lock_inner() noexcept
+  {
+    if (!bias.load(std::memory_order_relaxed))
+    {
+      std::atomic<const void*> &s = sharded_readers::slot(this);
+      const void *expected = nullptr;
+      if (!s.load(std::memory_order_relaxed) &&
+          s.compare_exchange_strong(expected, this))
+      {
+        /* Pair with the store in disable_bias(): either we observe the
+        revocation, or the revocation will observe our slot. */
+        if (!bias.load())
+          return true;
+        shared_unlock_slot(s);
+      }
+    }
+    if (!inner.shared_lock_inner())
+      return false;
+    enable_bias();
+    return true;
+  }
+  bool shared_unlock_inner() noexcept
+  {
+    std::atomic<const void*> &s = sharded_readers::slot(this);
+    if (s.load(std::memory_order_relaxed) == this)
+    {
+      shared_unlock_slot(s);
+      return false;
+    }
+    /* Pair with the compare_exchange_strong() in sharded_readers::revoke()
+    that may have deleted our entry. While it is waiting for migrated,
+    no shared locks can be held on the lock word. */
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (migrated.load(std::memory_order_relaxed))
+    {
+      shared_unlock_migrated();
+      return false;
+    }
+    return inner.shared_unlock_inner();
+  }
+
+  type lock_inner() noexcept
+  {
+    if (type lk = inner.lock_inner())
+      return lk;
+    return is_biased() ? type(X) : 0;
+  }
+  void lock_inner_wait(type lk) noexcept
+  {
+    if (lk != X)
+      inner.lock_inner_wait(lk);
+    if (const uint64_t start = disable_bias())
+    {
+      sharded_readers::revoke(this, migrated);
+      inhibit_bias(start);
+    }
+  }
+  bool lock_inner_wait_until(type lk,
+                             std::chrono::steady_clock::time_point deadline)
+    noexcept
+  {
+    if (lk != X && !inner.lock_inner_wait_until(lk, deadline))
+      return false;
+    if (const uint64_t start = disable_bias())
+    {
+      if (!sharded_readers::revoke_until(this, deadline))
+      {
+        /* Some readers may remain in the table. Re-enable the bias,
+        so that the next exclusive lock request will revoke it again. */
+        bias.store(0, std::memory_order_relaxed);
+        /* Withdraw the request. Any lock_shared() that is blocked by
+        it is waiting in lock_outer(), which our caller will release. */
+        inner.unlock_inner();
+        return false;
+      }
+      inhibit_bias(start);
+    }
+    return true;
+  }
+  void unlock_inner() noexcept { inner.unlock_inner(); }
+
+  void shared_unlock_inner_notify() noexcept
+  { inner.shared_unlock_inner_notify(); }
+};
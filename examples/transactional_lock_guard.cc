@@ -3,8 +3,11 @@
 #endif
 
 #include "transactional_lock_guard.h"
-#if defined __powerpc64__ || defined __s390__
-# include <htmxlintrin.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#if defined __powerpc64__ || defined __s390__ || defined __aarch64__
+# include <cstring>
 # include <setjmp.h>
 # include <signal.h>
 /**
@@ -16,21 +19,9 @@ static void ill_handler(int sig)
 {
   siglongjmp(ill_jmp, sig);
 }
-/**
-  Here we are testing we can do a transaction without SIGILL
-  and a 1 instruction store can succeed.
-*/
-__attribute__((noinline))
-static void test_tm(bool *r)
-{
-  if (__TM_simple_begin() == _HTM_TBEGIN_STARTED)
-  {
-    *r= true;
-    __TM_end();
-  }
-}
 
-static bool can_elide()
+/** @return whether test_tm() completed without SIGILL */
+static bool can_execute(void (*test_tm)(bool*))
 {
   bool r= false;
   sigset_t oset;
@@ -51,14 +42,48 @@ static bool can_elide()
   sigprocmask(SIG_SETMASK, &oset, NULL);
   return r;
 }
+#endif
+
+#if defined __powerpc64__ || defined __s390__
+# include <htmxlintrin.h>
+/**
+  Here we are testing we can do a transaction without SIGILL
+  and a 1 instruction store can succeed.
+*/
+__attribute__((noinline))
+static void test_tm(bool *r)
+{
+  if (__TM_simple_begin() == _HTM_TBEGIN_STARTED)
+  {
+    *r= true;
+    __TM_end();
+  }
+}
+
+static elision_capability can_elide()
+{
+# ifdef __s390__
+  return {can_execute(test_tm) ? ELISION_TX : ELISION_NONE, false};
+# else
+  return {can_execute(test_tm) ? ELISION_HTM : ELISION_NONE, false};
+# endif
+}
 
-bool have_transactional_memory = can_elide();
+/** The transaction diagnostic block of the current thread */
+static thread_local TM_buff_type tm_buff;
 
 __attribute__((target("hot","htm")))
-bool xbegin()
+elision_status xbegin()
 {
-  return have_transactional_memory &&
-    __TM_simple_begin() == _HTM_TBEGIN_STARTED;
+  if (__TM_begin(tm_buff) == _HTM_TBEGIN_STARTED)
+    return ELISION_STARTED;
+  if (__TM_is_footprint_exceed(tm_buff))
+    return ELISION_CAPACITY;
+  if (__TM_is_user_abort(tm_buff))
+    return ELISION_BUSY;
+  if (__TM_is_conflict(tm_buff) || !__TM_is_failure_persistent(tm_buff))
+    return ELISION_RETRY;
+  return ELISION_ABORT;
 }
 
 __attribute__((target("hot","htm")))
@@ -68,32 +93,176 @@ __attribute__((target("hot","htm")))
 void xend() { __TM_end(); }
 
 #elif defined __aarch64__
-/* FIXME: Implement a runtime check for Transactional Memory Extension (TME) */
+# ifdef __linux__
+#  include <sys/auxv.h>
+#  ifndef HWCAP_CPUID
+#   define HWCAP_CPUID (1UL << 11)
+#  endif
+# endif
+
+/** Execute TSTART, and TCOMMIT if a transaction was started. */
+TRANSACTIONAL_TARGET __attribute__((noinline))
+static void test_tm(bool *r)
+{
+  uint64_t status;
+  __asm__ __volatile__ ("tstart %x0" : "=r"(status) :: "memory");
+  if (!status)
+    __asm__ __volatile__ ("tcommit" ::: "memory");
+  *r= true;
+}
+
+static elision_capability can_elide()
+{
+  /* Linux does not define a HWCAP2 flag for TME, but it may let us read
+  the TME field of ID_AA64ISAR0_EL1 (bits 27:24). Even if the processor
+  implements TME, the operating system may not have enabled it at EL0,
+  in which case TSTART would raise SIGILL. */
+  bool implemented= false;
+# ifdef __linux__
+  if (getauxval(AT_HWCAP) & HWCAP_CPUID)
+  {
+    uint64_t isar0;
+    __asm__ ("mrs %0, ID_AA64ISAR0_EL1" : "=r"(isar0));
+    implemented= (isar0 >> 24 & 15) != 0;
+  }
+# endif
+  const bool enabled= can_execute(test_tm);
+  if (!implemented && !enabled)
+    return {ELISION_NONE, false};
+  return {ELISION_TME, !enabled};
+}
 #elif defined _MSC_VER && (defined _M_IX86 || defined _M_X64)
 # include <intrin.h>
 
-static bool can_elide()
+static elision_capability can_elide()
 {
   int regs[4];
   __cpuid(regs, 0);
   if (regs[0] < 7)
-    return false;
+    return {ELISION_NONE, false};
   __cpuidex(regs, 7, 0);
-  return regs[1] & 1U << 11; /* Restricted Transactional Memory (RTM) */
+  if (!(regs[1] & 1U << 11)) /* Restricted Transactional Memory (RTM) */
+    return {ELISION_NONE, false};
+  /* RTM_ALWAYS_ABORT is set when RTM was disabled by a microcode update */
+  return {ELISION_RTM, (regs[3] & 1U << 11) != 0};
 }
-
-bool have_transactional_memory = can_elide();
 #elif defined __GNUC__ && (defined __i386__ || defined __x86_64__)
 # include <cpuid.h>
 
-static bool can_elide()
+static elision_capability can_elide()
 {
   if (__get_cpuid_max(0, nullptr) < 7)
-    return false;
+    return {ELISION_NONE, false};
   unsigned eax, ebx, ecx, edx;
   __cpuid_count(7, 0, eax, ebx, ecx, edx);
-  return ebx & 1U << 11; /* Restricted Transactional Memory (RTM) */
+  if (!(ebx & 1U << 11)) /* Restricted Transactional Memory (RTM) */
+    return {ELISION_NONE, false};
+  /* RTM_ALWAYS_ABORT is set when RTM was disabled by a microcode update */
+  return {ELISION_RTM, (edx & 1U << 11) != 0};
 }
+#endif
+
+/** The capability, detected at startup */
+static const elision_capability capability = can_elide();
+
+bool have_transactional_memory =
+  capability.isa != ELISION_NONE && !capability.disabled;
+
+elision_capability elision_capabilities() noexcept { return capability; }
+
+
+/** Maximum number of transactions to attempt per acquisition */
+static constexpr unsigned ELISION_ATTEMPTS = 3;
+/** The penalty of an aborted transaction; a committed one is worth 1 */
+static constexpr uint32_t ELISION_ABORT_WEIGHT = 4;
+/** The penalty at which a cooling-off period starts */
+static constexpr uint32_t ELISION_PENALTY_MAX = 64;
+/** Number of acquisitions in a cooling-off period of a thread */
+static constexpr uint32_t ELISION_COOLDOWN = 1024;
+/** log2 of the number of slots in elision_penalty[] */
+static constexpr unsigned ELISION_SLOTS_LOG2 = 6;
+/** log2 of the number of slots in elision_cooldown[] */
+static constexpr unsigned ELISION_COOLDOWN_SLOTS_LOG2 = 3;
 
-bool have_transactional_memory = can_elide();
+/** The penalty of the locks that map to a slot, in a cache line of its
+own (the assumed size is like CACHE_LINE_SIZE in atomic_lock_array.h) */
+struct
+#if defined __s390x__
+alignas(256)
+#elif defined __powerpc64__ || defined __aarch64__ && defined __APPLE__
+alignas(128)
+#else
+alignas(64)
 #endif
+elision_penalty_slot
+{
+  std::atomic<uint32_t> penalty;
+};
+static elision_penalty_slot elision_penalty[1U << ELISION_SLOTS_LOG2];
+
+/** A cooling-off period of the current thread */
+struct elision_cooldown_slot
+{
+  /** the lock on which elision is not being attempted */
+  const void *lock;
+  /** the remaining acquisitions in the cooling-off period */
+  uint32_t remaining;
+};
+static thread_local elision_cooldown_slot
+elision_cooldown[1U << ELISION_COOLDOWN_SLOTS_LOG2];
+
+/** @return a hash of a lock address
+@param log2  log2 of the number of slots */
+static size_t elision_hash(const void *lock, unsigned log2) noexcept
+{
+  /* Fibonacci hashing; the 2 least significant bits are always 0. */
+  return size_t(uint64_t(uintptr_t(lock) >> 2) * 0x9E3779B97F4A7C15ULL >>
+                (64 - log2));
+}
+
+unsigned elision_attempts(const void *lock) noexcept
+{
+  auto &cooldown = elision_cooldown[elision_hash(lock,
+                                                 ELISION_COOLDOWN_SLOTS_LOG2)];
+  if (cooldown.lock != lock || !cooldown.remaining)
+    return ELISION_ATTEMPTS;
+  cooldown.remaining--;
+  return 0;
+}
+
+bool elision_aborted(const void *lock, elision_status status) noexcept
+{
+  if (status != ELISION_CAPACITY)
+  {
+    auto &slot = elision_penalty[elision_hash(lock, ELISION_SLOTS_LOG2)].
+      penalty;
+    uint32_t penalty = slot.load(std::memory_order_relaxed);
+    /* Concurrent updates may be lost; this is only a heuristic. */
+    if (penalty + ELISION_ABORT_WEIGHT < ELISION_PENALTY_MAX)
+    {
+      slot.compare_exchange_strong(penalty, penalty + ELISION_ABORT_WEIGHT,
+                                   std::memory_order_relaxed);
+      return status == ELISION_RETRY;
+    }
+    /* Elision is not paying off. Saturate the penalty, so that the other
+    threads will cool off after their next abort. */
+    if (penalty != ELISION_PENALTY_MAX)
+      slot.compare_exchange_strong(penalty, ELISION_PENALTY_MAX,
+                                   std::memory_order_relaxed);
+  }
+  /* The critical section is too large, or elision is not paying off.
+  Cool off in this thread, without writing to shared memory. */
+  elision_cooldown[elision_hash(lock, ELISION_COOLDOWN_SLOTS_LOG2)] =
+    {lock, ELISION_COOLDOWN};
+  return false;
+}
+
+void elision_committed(const void *lock) noexcept
+{
+  auto &slot = elision_penalty[elision_hash(lock, ELISION_SLOTS_LOG2)].penalty;
+  uint32_t penalty = slot.load(std::memory_order_relaxed);
+  /* Avoid writes to the shared cache line when there is no penalty. */
+  if (penalty)
+    slot.compare_exchange_strong(penalty, penalty - 1,
+                                 std::memory_order_relaxed);
+}
@@ -11,12 +11,67 @@
 # error /* Transactional memory has not been implemented for this ISA */
 #endif
 
+/** The kinds of hardware transactional memory */
+enum elision_isa
+{
+  /** not available */
+  ELISION_NONE,
+  /** IA-32 or AMD64 Restricted Transactional Memory (RTM) */
+  ELISION_RTM,
+  /** POWER v2.07 Hardware Transactional Memory */
+  ELISION_HTM,
+  /** IBM z/Architecture Transactional-Execution Facility */
+  ELISION_TX,
+  /** ARMv8 Transactional Memory Extension */
+  ELISION_TME
+};
+
+/** The lock elision capability of the current process */
+struct elision_capability
+{
+  /** the kind of transactional memory that the processor implements */
+  elision_isa isa;
+  /** whether isa is present but was disabled by a microcode update
+  or by the operating system */
+  bool disabled;
+};
+
 #ifndef WITH_ELISION
 # define TRANSACTIONAL_TARGET /* nothing */
 # define TRANSACTIONAL_INLINE /* nothing */
+
+/** @return whether the transactional_lock_guard will attempt elision */
+constexpr bool elision_supported() { return false; }
+/** @return the lock elision capability of the current process */
+inline elision_capability elision_capabilities() noexcept
+{ return {ELISION_NONE, false}; }
 #else
-# if defined __i386__||defined __x86_64__||defined _M_IX86||defined _M_X64
+/** whether elision_capabilities() reported a usable isa; detected at
+startup, and never changed afterwards */
 extern bool have_transactional_memory;
+/** @return whether the transactional_lock_guard will attempt elision */
+inline bool elision_supported() { return have_transactional_memory; }
+/** @return the lock elision capability of the current process */
+elision_capability elision_capabilities() noexcept;
+
+/** The outcome of xbegin() */
+enum elision_status
+{
+  /** the transaction was started */
+  ELISION_STARTED,
+  /** the transaction was aborted by a transient cause, such as a conflict
+  with another thread; a retry may succeed */
+  ELISION_RETRY,
+  /** the transaction was aborted by xabort(), typically because the lock
+  was being held */
+  ELISION_BUSY,
+  /** the transaction exceeded the capacity of the processor */
+  ELISION_CAPACITY,
+  /** the transaction was aborted by another cause, such as a system call */
+  ELISION_ABORT
+};
+
+# if defined __i386__||defined __x86_64__||defined _M_IX86||defined _M_X64
 #  include <immintrin.h>
 #  ifdef __GNUC__
 #   define TRANSACTIONAL_TARGET __attribute__((target("rtm")))
@@ -26,21 +81,30 @@ extern bool have_transactional_memory;
 #   define TRANSACTIONAL_INLINE /* nothing */
 #  endif
 
-TRANSACTIONAL_INLINE static inline bool xbegin()
-{ return have_transactional_memory && _xbegin() == _XBEGIN_STARTED; }
+TRANSACTIONAL_INLINE static inline elision_status xbegin()
+{
+  const unsigned status = _xbegin();
+  if (status == _XBEGIN_STARTED)
+    return ELISION_STARTED;
+  if (status & _XABORT_CAPACITY)
+    return ELISION_CAPACITY;
+  if (status & _XABORT_EXPLICIT)
+    return ELISION_BUSY;
+  if (status & (_XABORT_RETRY | _XABORT_CONFLICT))
+    return ELISION_RETRY;
+  return ELISION_ABORT;
+}
 TRANSACTIONAL_INLINE static inline void xabort() { _xabort(0); }
 TRANSACTIONAL_INLINE static inline void xend() { _xend(); }
 # elif defined __powerpc64__ || defined __s390__
 #  define TRANSACTIONAL_TARGET __attribute__((target("hot")))
 #  define TRANSACTIONAL_INLINE __attribute__((target("hot"),always_inline))
-extern bool have_transactional_memory;
 
-bool xbegin();
-bool xabort();
-bool xend();
+elision_status xbegin();
+void xabort();
+void xend();
 # elif defined __aarch64__
-/* FIXME: No runtime detection of TME has been implemented! */
-constexpr bool have_transactional_memory = true;
+#  include <cstdint>
 
 #  define TRANSACTIONAL_INLINE __attribute__((always_inline))
 #  ifdef __clang__
@@ -49,19 +113,56 @@ constexpr bool have_transactional_memory = true;
 #   define TRANSACTIONAL_TARGET __attribute__((target("+tme")))
 #  endif
 
-TRANSACTIONAL_INLINE static inline bool xbegin()
+TRANSACTIONAL_INLINE static inline elision_status xbegin()
 {
-  int ret;
-  __asm__ __volatile__ ("tstart %x0" : "=r"(ret) :: "memory");
-  return !ret;
+  /* The TME failure causes, as in _TMFAILURE_RTRY, _TMFAILURE_CNCL,
+  _TMFAILURE_MEM and _TMFAILURE_SIZE of <arm_acle.h> */
+  constexpr uint64_t RTRY = 1U << 15, CNCL = 1U << 16, MEM = 1U << 17,
+    SIZE = 1U << 20;
+  uint64_t status;
+  __asm__ __volatile__ ("tstart %x0" : "=r"(status) :: "memory");
+  if (!status)
+    return ELISION_STARTED;
+  if (status & SIZE)
+    return ELISION_CAPACITY;
+  if (status & CNCL)
+    return ELISION_BUSY;
+  if (status & (RTRY | MEM))
+    return ELISION_RETRY;
+  return ELISION_ABORT;
 }
 
 TRANSACTIONAL_INLINE static inline void xabort()
-{ __asm__ __volatile__ ("tcancel %x0" :: "n"(i) :: "memory"); }
+{ __asm__ __volatile__ ("tcancel #0" ::: "memory"); }
 
 TRANSACTIONAL_INLINE static inline void xend()
 { __asm__ volatile ("tcommit" ::: "memory"); }
 # endif
+
+/* Adaptive elision.
+
+For each lock, we keep a penalty that is incremented by
+ELISION_ABORT_WEIGHT on every aborted transaction and decremented on
+every committed one, down to 0. Once the penalty is 0, nothing is written
+while transactions keep committing. When the penalty reaches a threshold,
+or a transaction exceeds the capacity of the processor, the thread will
+not attempt elision on the lock for a cooling-off period of a number of
+acquisitions, which is counted in a small thread-local table. In order to
+not grow the locks, the penalty is stored in a small table of cache-line
+sized slots that is indexed by a hash of the lock address, like the
+adaptive spinning of atomic_mutex. All of this is only accessed outside
+transactions. */
+
+/** @return the number of transactions to attempt on a lock before
+acquiring it, if elision_supported(); 0 during a cooling-off period */
+unsigned elision_attempts(const void *lock) noexcept;
+/** Note that a transaction on a lock was aborted.
+@param lock    the lock
+@param status  the cause of the abort (not ELISION_STARTED)
+@return whether another attempt may succeed */
+bool elision_aborted(const void *lock, elision_status status) noexcept;
+/** Note that a transaction on a lock was committed. */
+void elision_committed(const void *lock) noexcept;
 #endif
 
 template<class mutex>
@@ -73,11 +174,17 @@ public:
   TRANSACTIONAL_INLINE transactional_lock_guard(mutex &m) : m(m)
   {
 #ifdef WITH_ELISION
-    if (xbegin())
+    for (auto n = elision_supported() ? elision_attempts(&m) : 0; n--; )
     {
-      if (was_elided())
-        return;
-      xabort();
+      const elision_status status = xbegin();
+      if (status == ELISION_STARTED)
+      {
+        if (was_elided())
+          return;
+        xabort();
+      }
+      else if (!elision_aborted(&m, status))
+        break;
     }
 #endif
     m.lock();
@@ -86,7 +193,12 @@ public:
   TRANSACTIONAL_INLINE ~transactional_lock_guard() noexcept
   {
 #ifdef WITH_ELISION
-    if (was_elided()) xend(); else
+    if (was_elided())
+    {
+      xend();
+      elision_committed(&m);
+    }
+    else
 #endif
     m.unlock();
   }
@@ -113,16 +225,22 @@ public:
   TRANSACTIONAL_INLINE transactional_shared_lock_guard(mutex &m) : m(m)
   {
 #ifdef WITH_ELISION
-    if (xbegin())
+    elided = false;
+    for (auto n = elision_supported() ? elision_attempts(&m) : 0; n--; )
     {
-      if (!m.get_storage().is_locked())
+      const elision_status status = xbegin();
+      if (status == ELISION_STARTED)
       {
-        elided = true;
-        return;
+        if (!m.get_storage().is_locked())
+        {
+          elided = true;
+          return;
+        }
+        xabort();
       }
-      xabort();
+      else if (!elision_aborted(&m, status))
+        break;
     }
-    elided = false;
 #endif
     m.lock_shared();
   }
@@ -131,7 +249,12 @@ public:
   TRANSACTIONAL_INLINE ~transactional_shared_lock_guard() noexcept
   {
 #ifdef WITH_ELISION
-    if (was_elided()) xend(); else
+    if (was_elided())
+    {
+      xend();
+      elision_committed(&m);
+    }
+    else
 #endif
     m.unlock_shared();
   }
@@ -148,11 +271,17 @@ public:
   TRANSACTIONAL_INLINE transactional_update_lock_guard(mutex &m) : m(m)
   {
 #ifdef WITH_ELISION
-    if (xbegin())
+    for (auto n = elision_supported() ? elision_attempts(&m) : 0; n--; )
     {
-      if (was_elided())
-        return;
-      xabort();
+      const elision_status status = xbegin();
+      if (status == ELISION_STARTED)
+      {
+        if (was_elided())
+          return;
+        xabort();
+      }
+      else if (!elision_aborted(&m, status))
+        break;
     }
 #endif
     m.lock_update();
@@ -162,7 +291,12 @@ public:
   TRANSACTIONAL_INLINE ~transactional_update_lock_guard() noexcept
   {
 #ifdef WITH_ELISION
-    if (was_elided()) xend(); else
+    if (was_elided())
+    {
+      xend();
+      elision_committed(&m);
+    }
+    else
 #endif
     m.unlock_update();
   }
@@ -0,0 +1,1377 @@
+/* Benchmark of atomic_sync and the native locks.
+
+For each lock, for each combination of the thread counts, thread
+placements, critical section lengths, non-critical work lengths and read
+ratios, the threads will acquire and release the lock for a while. We
+report the throughput, percentiles of the lock acquisition latency, the
+spread of the per-thread operation counts (max-min)/mean as a measure of
+fairness, and on Linux the number of voluntary context switches, which
+approximates the number of futex waits.
+
+On Linux, the following events are counted per operation by
+perf_event_open(), if the kernel and perf_event_paranoid permit it:
+cache misses, coherence misses (by default L1D load misses, which on a
+contended lock are dominated by the transfers of the lock cache line;
+or a raw event that is specified by --coherence), context switches,
+and futex system calls (the tracepoint syscalls:sys_enter_futex).
+
+The locks that are based on a Storage are instantiated by
+run_mutex_storage<Storage> and run_shared_mutex_storage<Storage>, which
+also check that the Storage was released after each run. To compare a
+new Storage with the reference mutex_storage or shared_mutex_storage,
+add it to benchmarks[] and invoke for example
+
+  bench_atomic_sync --locks=atomic_mutex,my_mutex --baseline=atomic_mutex
+
+The hash table benchmarks compare atomic_hash_map with std::unordered_map
+that is protected by std::shared_mutex. */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#if __cplusplus >= 201703L || defined _MSVC_LANG && _MSVC_LANG >= 201703L
+# include <shared_mutex>
+# define HAVE_STD_SHARED_MUTEX
+#endif
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <pthread.h>
+# include <sys/resource.h>
+#endif
+#ifdef __linux__
+# include <unistd.h>
+# include <sys/syscall.h>
+# include <linux/perf_event.h>
+#endif
+
+#include "atomic_mutex.h"
+#include "atomic_shared_mutex.h"
+#include "atomic_recursive_shared_mutex.h"
+#include "atomic_condition_variable.h"
+#include "atomic_hash_map.h"
+#include "sharded_shared_mutex_storage.h"
+#include "atomic_cohort_mutex.h"
+#include "parking_lot.h"
+#include "transactional_lock_guard.h"
+
+/** The kind of an operation */
+enum op { SHARED, UPDATE, EXCLUSIVE };
+
+/** The placement of the threads */
+enum placement
+{
+  /** not pinned */
+  FLOAT,
+  /** thread i is pinned to processor i modulo the number of processors */
+  CPU,
+  /** the processors of each NUMA node are filled before the next node */
+  COMPACT,
+  /** the threads are distributed round-robin between the NUMA nodes */
+  SPREAD
+};
+
+static const char *const placement_names[] = {"none", "cpu", "compact",
+                                              "spread"};
+
+/** The events that are counted by perf_event_open() */
+enum event
+{
+  CACHE_MISSES, COHERENCE_MISSES, CONTEXT_SWITCHES, FUTEX_CALLS, N_EVENTS
+};
+
+/** an event count that is not available */
+constexpr uint64_t NO_COUNT = UINT64_MAX;
+
+/** Parameters of one run */
+struct run_config
+{
+  unsigned threads;
+  /** units of work in the critical section */
+  unsigned cs;
+  /** units of work outside the critical section */
+  unsigned ncs;
+  /** percentage of SHARED operations */
+  unsigned read_pct;
+  /** percentage of UPDATE among the non-SHARED operations */
+  unsigned update_pct;
+  /** duration of the run in milliseconds */
+  unsigned duration_ms;
+  /** the placement of the threads */
+  placement pin;
+};
+
+/** A histogram of latencies, with 8 linear sub-buckets per power of 2 */
+class latency_histogram
+{
+  static constexpr unsigned LINEAR = 16;
+  static constexpr unsigned SUB_LOG2 = 3;
+  static constexpr unsigned SIZE = LINEAR + (64 - 4) * (1U << SUB_LOG2);
+  uint64_t count[SIZE];
+
+  static unsigned index(uint64_t ns) noexcept
+  {
+    if (ns < LINEAR)
+      return unsigned(ns);
+    unsigned e = 63;
+    while (!(ns >> e))
+      e--;
+    const unsigned sub =
+      unsigned(ns >> (e - SUB_LOG2)) & ((1U << SUB_LOG2) - 1);
+    return LINEAR + (e - 4) * (1U << SUB_LOG2) + sub;
+  }
+  static uint64_t lower_bound(unsigned i) noexcept
+  {
+    if (i < LINEAR)
+      return i;
+    i -= LINEAR;
+    const unsigned e = i / (1U << SUB_LOG2) + 4;
+    const uint64_t sub = i % (1U << SUB_LOG2);
+    return (uint64_t{1} << e) + (sub << (e - SUB_LOG2));
+  }
+
+public:
+  latency_histogram() { clear(); }
+  void clear() noexcept { memset(count, 0, sizeof count); }
+  void add(uint64_t ns) noexcept { count[index(ns)]++; }
+  void merge(const latency_histogram &h) noexcept
+  {
+    for (unsigned i = 0; i < SIZE; i++)
+      count[i] += h.count[i];
+  }
+  /** @return the lower bound of the bucket of a percentile, in ns */
+  uint64_t percentile(double p) const noexcept
+  {
+    uint64_t total = 0;
+    for (auto c : count)
+      total += c;
+    if (!total)
+      return 0;
+    const uint64_t rank = uint64_t(p / 100.0 * double(total - 1));
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < SIZE; i++)
+      if ((seen += count[i]) > rank)
+        return lower_bound(i);
+    return lower_bound(SIZE - 1);
+  }
+};
+
+/** Statistics of one thread */
+struct alignas(64) thread_result
+{
+  uint64_t ops;
+  /** number of modifications of the protected data */
+  uint64_t writes;
+  /** voluntary context switches */
+  uint64_t vcsw;
+  /** counts of the events, or NO_COUNT */
+  uint64_t events[N_EVENTS];
+  latency_histogram latency;
+};
+
+/** The result of one run */
+struct run_result
+{
+  double seconds;
+  uint64_t ops;
+  uint64_t p50, p99, p999;
+  double spread;
+  uint64_t vcsw;
+  /** total counts of the events, or NO_COUNT */
+  uint64_t events[N_EVENTS];
+};
+
+/** The data that is protected by the lock under test */
+static struct alignas(64) { uint64_t word[8]; } protected_data;
+
+static std::atomic<unsigned> ready;
+static std::atomic<bool> go, stop;
+
+static uint64_t now_ns() noexcept
+{
+  using namespace std::chrono;
+  return uint64_t(duration_cast<nanoseconds>(steady_clock::now().
+                                             time_since_epoch()).count());
+}
+
+/** @return the number of voluntary context switches of this thread */
+static uint64_t voluntary_context_switches() noexcept
+{
+#if defined RUSAGE_THREAD
+  rusage ru;
+  if (!getrusage(RUSAGE_THREAD, &ru))
+    return uint64_t(ru.ru_nvcsw);
+#endif
+  return 0;
+}
+
+/** Processors in the order of COMPACT and SPREAD placement;
+empty if the NUMA topology is not known */
+static std::vector<unsigned> compact_cpus, spread_cpus;
+
+/** Determine the processors of each NUMA node */
+static void init_placement()
+{
+#ifdef __linux__
+  std::vector<std::vector<unsigned>> nodes;
+  for (unsigned node = 0; node < 1024; node++)
+  {
+    char name[64];
+    snprintf(name, sizeof name, "/sys/devices/system/node/node%u/cpulist",
+             node);
+    FILE *f = fopen(name, "r");
+    if (!f)
+      continue;
+    std::vector<unsigned> cpus;
+    unsigned first, last;
+    int c;
+    while (fscanf(f, "%u", &first) == 1)
+    {
+      last = first;
+      if ((c = fgetc(f)) == '-' && fscanf(f, "%u", &last) == 1)
+        c = fgetc(f);
+      while (first <= last)
+        cpus.push_back(first++);
+      if (c != ',')
+        break;
+    }
+    fclose(f);
+    if (!cpus.empty())
+      nodes.push_back(cpus);
+  }
+
+  for (const auto &n : nodes)
+    compact_cpus.insert(compact_cpus.end(), n.begin(), n.end());
+  for (size_t i = 0; spread_cpus.size() < compact_cpus.size(); i++)
+    for (const auto &n : nodes)
+      if (i < n.size())
+        spread_cpus.push_back(n[i]);
+#endif
+}
+
+/** Pin the current thread to a processor */
+static void pin_thread(const run_config &c, unsigned id) noexcept
+{
+  unsigned cpu;
+  if (c.pin == CPU || compact_cpus.empty())
+  {
+    const unsigned n = std::thread::hardware_concurrency();
+    cpu = n ? id % n : 0;
+  }
+  else
+  {
+    const auto &cpus = c.pin == COMPACT ? compact_cpus : spread_cpus;
+    cpu = cpus[id % cpus.size()];
+  }
+#ifdef _WIN32
+  SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR{1} << (cpu % 64));
+#elif defined __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+#else
+  (void) cpu;
+#endif
+}
+
+#ifdef __linux__
+/** The perf_event_open() attributes of the events; size=0 if the event
+is not available */
+static perf_event_attr event_attr[N_EVENTS];
+
+/** Initialize event_attr[].
+@param coherence  raw event for COHERENCE_MISSES, or 0 for L1D load misses */
+static void init_events(uint64_t coherence)
+{
+  for (auto &attr : event_attr)
+  {
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_hv = 1;
+  }
+  event_attr[CACHE_MISSES].type = PERF_TYPE_HARDWARE;
+  event_attr[CACHE_MISSES].config = PERF_COUNT_HW_CACHE_MISSES;
+  if (coherence)
+  {
+    event_attr[COHERENCE_MISSES].type = PERF_TYPE_RAW;
+    event_attr[COHERENCE_MISSES].config = coherence;
+  }
+  else
+  {
+    event_attr[COHERENCE_MISSES].type = PERF_TYPE_HW_CACHE;
+    event_attr[COHERENCE_MISSES].config = PERF_COUNT_HW_CACHE_L1D |
+      PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+  }
+  event_attr[CONTEXT_SWITCHES].type = PERF_TYPE_SOFTWARE;
+  event_attr[CONTEXT_SWITCHES].config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+
+  event_attr[FUTEX_CALLS].size = 0;
+  for (const char *dir : {"/sys/kernel/tracing", "/sys/kernel/debug/tracing"})
+  {
+    char name[128];
+    snprintf(name, sizeof name, "%s/events/syscalls/sys_enter_futex/id", dir);
+    FILE *f = fopen(name, "r");
+    if (!f)
+      continue;
+    unsigned long long id;
+    if (fscanf(f, "%llu", &id) == 1)
+    {
+      event_attr[FUTEX_CALLS].size = sizeof event_attr[FUTEX_CALLS];
+      event_attr[FUTEX_CALLS].type = PERF_TYPE_TRACEPOINT;
+      event_attr[FUTEX_CALLS].config = id;
+    }
+    fclose(f);
+    break;
+  }
+}
+#endif
+
+/** Counters of the events of the current thread */
+class thread_counters
+{
+  /** voluntary context switches at start() */
+  uint64_t vcsw;
+#ifdef __linux__
+  /** the perf_event_open() file descriptors, or -1 */
+  int fd[N_EVENTS];
+  /** the count, time enabled and time running at start() */
+  uint64_t start_value[N_EVENTS][3];
+
+  bool read_event(unsigned i, uint64_t (&value)[3]) const noexcept
+  { return fd[i] >= 0 && read(fd[i], value, sizeof value) == sizeof value; }
+#endif
+
+public:
+  /** Open the counters of the current thread */
+  thread_counters() noexcept
+  {
+#ifdef __linux__
+    for (unsigned i = 0; i < N_EVENTS; i++)
+    {
+      fd[i] = -1;
+      perf_event_attr attr = event_attr[i];
+      if (!attr.size)
+        continue;
+      fd[i] = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                          PERF_FLAG_FD_CLOEXEC));
+      /* With perf_event_paranoid=2, only user-space events can be counted.
+      The software events and tracepoints occur in the kernel. */
+      if (fd[i] < 0 && attr.type != PERF_TYPE_SOFTWARE &&
+          attr.type != PERF_TYPE_TRACEPOINT)
+      {
+        attr.exclude_kernel = 1;
+        fd[i] = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                            PERF_FLAG_FD_CLOEXEC));
+      }
+    }
+#endif
+  }
+  ~thread_counters()
+  {
+#ifdef __linux__
+    for (int f : fd)
+      if (f >= 0)
+        close(f);
+#endif
+  }
+  thread_counters(const thread_counters&) = delete;
+
+  /** Start counting */
+  void start() noexcept
+  {
+    vcsw = voluntary_context_switches();
+#ifdef __linux__
+    for (unsigned i = 0; i < N_EVENTS; i++)
+      if (fd[i] >= 0 && !read_event(i, start_value[i]))
+      {
+        close(fd[i]);
+        fd[i] = -1;
+      }
+#endif
+  }
+
+  /** Stop counting.
+  @param r  the statistics to update */
+  void stop(thread_result &r) noexcept
+  {
+    r.vcsw = voluntary_context_switches() - vcsw;
+    for (auto &e : r.events)
+      e = NO_COUNT;
+#ifdef __linux__
+    for (unsigned i = 0; i < N_EVENTS; i++)
+    {
+      uint64_t value[3];
+      if (!read_event(i, value))
+        continue;
+      const uint64_t count = value[0] - start_value[i][0];
+      const uint64_t enabled = value[1] - start_value[i][1];
+      const uint64_t running = value[2] - start_value[i][2];
+      /* Scale the count if the event was multiplexed with others. */
+      if (running == enabled)
+        r.events[i] = count;
+      else if (running)
+        r.events[i] = uint64_t(double(count) * double(enabled) /
+                               double(running));
+    }
+#endif
+  }
+};
+
+/** xorshift32 */
+static uint32_t next_random(uint32_t &x) noexcept
+{
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+/** Non-critical work; seed determines the next operation,
+so this cannot be optimized away */
+static void local_work(unsigned units, uint32_t &seed) noexcept
+{
+  while (units--)
+    next_random(seed);
+}
+
+/* Critical sections */
+static uint64_t read_work(unsigned units) noexcept
+{
+  uint64_t sum = 0;
+  for (unsigned i = 0; i < units; i++)
+    sum += reinterpret_cast<volatile uint64_t&>(protected_data.word[i & 7]);
+  return sum;
+}
+static void write_work(unsigned units) noexcept
+{
+  for (unsigned i = 0; i < units; i++)
+  {
+    volatile uint64_t &w = protected_data.word[i & 7];
+    w = w + 1;
+  }
+}
+
+/* Adapters for the locks. Each defines critical(op, f), which invokes
+f(SHARED) or f(EXCLUSIVE) while holding (or eliding) the lock in the
+requested mode. An UPDATE operation invokes f(SHARED) while holding an
+update lock, and f(EXCLUSIVE) after upgrading it. Exclusive-only locks
+execute all other than SHARED operations in exclusive mode. */
+
+template<class mutex>
+struct exclusive_adapter
+{
+  mutex m;
+  template<class F> void critical(op o, const F &f)
+  {
+    m.lock();
+    f(o == SHARED ? SHARED : EXCLUSIVE);
+    m.unlock();
+  }
+};
+
+struct atomic_spin_mutex_adapter
+{
+  atomic_mutex<> m;
+  template<class F> void critical(op o, const F &f)
+  {
+    m.spin_lock();
+    f(o == SHARED ? SHARED : EXCLUSIVE);
+    m.unlock();
+  }
+};
+
+template<class mutex>
+struct update_adapter
+{
+  mutex m;
+  template<class F> void critical(op o, const F &f)
+  {
+    switch (o) {
+    case SHARED:
+      m.lock_shared();
+      f(SHARED);
+      m.unlock_shared();
+      return;
+    case UPDATE:
+      m.lock_update();
+      f(SHARED);
+      m.update_lock_upgrade();
+      f(EXCLUSIVE);
+      m.update_lock_downgrade();
+      m.unlock_update();
+      return;
+    case EXCLUSIVE:
+      m.lock();
+      f(EXCLUSIVE);
+      m.unlock();
+      return;
+    }
+  }
+};
+
+struct atomic_spin_shared_mutex_adapter
+{
+  atomic_shared_mutex<> m;
+  template<class F> void critical(op o, const F &f)
+  {
+    switch (o) {
+    case SHARED:
+      m.spin_lock_shared();
+      f(SHARED);
+      m.unlock_shared();
+      return;
+    case UPDATE:
+      m.spin_lock_update();
+      f(SHARED);
+      m.update_lock_upgrade();
+      f(EXCLUSIVE);
+      m.update_lock_downgrade();
+      m.unlock_update();
+      return;
+    case EXCLUSIVE:
+      m.spin_lock();
+      f(EXCLUSIVE);
+      m.unlock();
+      return;
+    }
+  }
+};
+
+struct elided_mutex_adapter
+{
+  atomic_mutex<> m;
+  template<class F> TRANSACTIONAL_TARGET void critical(op o, const F &f)
+  {
+    transactional_lock_guard<atomic_mutex<>> g{m};
+    f(o == SHARED ? SHARED : EXCLUSIVE);
+  }
+};
+
+struct elided_shared_mutex_adapter
+{
+  atomic_shared_mutex<> m;
+  template<class F> TRANSACTIONAL_TARGET void critical(op o, const F &f)
+  {
+    if (o == SHARED)
+    {
+      transactional_shared_lock_guard<atomic_shared_mutex<>> g{m};
+      f(SHARED);
+    }
+    else
+    {
+      transactional_lock_guard<atomic_shared_mutex<>> g{m};
+      f(EXCLUSIVE);
+    }
+  }
+};
+
+#ifdef HAVE_STD_SHARED_MUTEX
+struct std_shared_mutex_adapter
+{
+  std::shared_mutex m;
+  template<class F> void critical(op o, const F &f)
+  {
+    if (o == SHARED)
+    {
+      m.lock_shared();
+      f(SHARED);
+      m.unlock_shared();
+    }
+    else
+    {
+      m.lock();
+      f(EXCLUSIVE);
+      m.unlock();
+    }
+  }
+};
+#endif
+
+#ifdef _WIN32
+struct srwlock_adapter
+{
+  SRWLOCK m = SRWLOCK_INIT;
+  template<class F> void critical(op o, const F &f)
+  {
+    if (o == SHARED)
+    {
+      AcquireSRWLockShared(&m);
+      f(SHARED);
+      ReleaseSRWLockShared(&m);
+    }
+    else
+    {
+      AcquireSRWLockExclusive(&m);
+      f(EXCLUSIVE);
+      ReleaseSRWLockExclusive(&m);
+    }
+  }
+};
+#else
+struct pthread_rwlock_adapter
+{
+  pthread_rwlock_t m = PTHREAD_RWLOCK_INITIALIZER;
+  ~pthread_rwlock_adapter() { pthread_rwlock_destroy(&m); }
+  template<class F> void critical(op o, const F &f)
+  {
+    if (o == SHARED)
+    {
+      pthread_rwlock_rdlock(&m);
+      f(SHARED);
+      pthread_rwlock_unlock(&m);
+    }
+    else
+    {
+      pthread_rwlock_wrlock(&m);
+      f(EXCLUSIVE);
+      pthread_rwlock_unlock(&m);
+    }
+  }
+};
+#endif
+
+/** Wait until all threads have been created, and start counting. */
+static void start_thread(const run_config &c, unsigned id,
+                         thread_counters &counters)
+{
+  if (c.pin != FLOAT)
+    pin_thread(c, id);
+  ready.fetch_add(1);
+  while (!go.load(std::memory_order_acquire))
+    std::this_thread::yield();
+  counters.start();
+}
+
+template<class Adapter>
+static void lock_worker(Adapter &a, const run_config &c, unsigned id,
+                        thread_result &r)
+{
+  uint32_t seed = 2463534242U + id * 0x9E3779B9U;
+  thread_counters counters;
+  start_thread(c, id, counters);
+
+  while (!stop.load(std::memory_order_relaxed))
+  {
+    op o = EXCLUSIVE;
+    if (next_random(seed) % 100 < c.read_pct)
+      o = SHARED;
+    else if (next_random(seed) % 100 < c.update_pct)
+      o = UPDATE;
+    const uint64_t start = now_ns();
+    bool first = true;
+    a.critical(o, [&](op mode) {
+      if (first)
+      {
+        r.latency.add(now_ns() - start);
+        first = false;
+      }
+      if (mode == SHARED)
+        seed += uint32_t(read_work(c.cs));
+      else
+      {
+        write_work(c.cs);
+        r.writes += c.cs;
+      }
+    });
+    r.ops++;
+    local_work(c.ncs, seed);
+  }
+
+  counters.stop(r);
+}
+
+/** Run the threads, and summarize the results.
+@param c        the parameters
+@param worker   the thread function
+@param on_stop  function to invoke after the stop flag was set */
+template<class Worker, class Stop>
+static run_result run(const run_config &c, const Worker &worker,
+                      const Stop &on_stop)
+{
+  std::vector<thread_result> results(c.threads);
+  std::vector<std::thread> t(c.threads);
+  ready = 0;
+  go = false;
+  stop = false;
+  memset(&protected_data, 0, sizeof protected_data);
+
+  for (unsigned i = 0; i < c.threads; i++)
+  {
+    results[i] = thread_result{};
+    t[i] = std::thread(worker, i, std::ref(results[i]));
+  }
+  while (ready.load() != c.threads)
+    std::this_thread::yield();
+
+  const auto start = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  std::this_thread::sleep_for(std::chrono::milliseconds(c.duration_ms));
+  stop.store(true);
+  const auto end = std::chrono::steady_clock::now();
+  on_stop();
+  for (auto &th : t)
+    th.join();
+
+  run_result r{};
+  r.seconds = std::chrono::duration<double>(end - start).count();
+  latency_histogram latency;
+  uint64_t min_ops = UINT64_MAX, max_ops = 0, writes = 0;
+  for (const auto &tr : results)
+  {
+    r.ops += tr.ops;
+    r.vcsw += tr.vcsw;
+    writes += tr.writes;
+    latency.merge(tr.latency);
+    if (tr.ops < min_ops)
+      min_ops = tr.ops;
+    if (tr.ops > max_ops)
+      max_ops = tr.ops;
+    for (unsigned i = 0; i < N_EVENTS; i++)
+      if (r.events[i] != NO_COUNT)
+        r.events[i] = tr.events[i] == NO_COUNT
+          ? NO_COUNT : r.events[i] + tr.events[i];
+  }
+  uint64_t sum = 0;
+  for (auto w : protected_data.word)
+    sum += w;
+  if (sum != writes)
+  {
+    fprintf(stderr, "lost updates: %llu != %llu\n",
+            static_cast<unsigned long long>(sum),
+            static_cast<unsigned long long>(writes));
+    abort();
+  }
+  r.p50 = latency.percentile(50);
+  r.p99 = latency.percentile(99);
+  r.p999 = latency.percentile(99.9);
+  r.spread = r.ops ? double(max_ops - min_ops) * c.threads / double(r.ops) : 0;
+  return r;
+}
+
+/** Check that a lock was released after a run */
+template<class Adapter> static void check_released(const Adapter&) {}
+
+static void check_released(bool locked_or_waiting)
+{
+  if (locked_or_waiting)
+  {
+    fputs("the lock was not released\n", stderr);
+    abort();
+  }
+}
+template<class Storage>
+static void check_released(const exclusive_adapter<atomic_mutex<Storage>> &a)
+{ check_released(a.m.get_storage().is_locked_or_waiting()); }
+template<class Storage>
+static void
+check_released(const update_adapter<atomic_shared_mutex<Storage>> &a)
+{ check_released(a.m.get_storage().is_locked_or_waiting()); }
+
+template<class Adapter>
+static run_result run_lock(const run_config &c)
+{
+  /* Some locks, such as atomic_recursive_shared_mutex, expect to be
+  zero-initialized. The locks will be reused between runs. */
+  static Adapter a;
+  const run_result r = run(c, [&c](unsigned id, thread_result &r)
+                           { lock_worker(a, c, id, r); }, []{});
+  check_released(a);
+  return r;
+}
+
+/** Benchmark atomic_mutex<Storage> */
+template<class Storage>
+static run_result run_mutex_storage(const run_config &c)
+{ return run_lock<exclusive_adapter<atomic_mutex<Storage>>>(c); }
+
+/** Benchmark atomic_shared_mutex<Storage> */
+template<class Storage>
+static run_result run_shared_mutex_storage(const run_config &c)
+{ return run_lock<update_adapter<atomic_shared_mutex<Storage>>>(c); }
+
+/* Condition variable ping-pong: a token is passed around a ring of
+threads. The latency is the time that a thread waited for the token. */
+
+template<class mutex, class condition>
+struct token_ring
+{
+  mutex m;
+  condition cv;
+  unsigned turn;
+};
+
+template<class Ring, class Wait, class Notify>
+static void ring_worker(Ring &ring, const run_config &c, unsigned id,
+                        thread_result &r, const Wait &wait,
+                        const Notify &notify)
+{
+  uint32_t seed = 2463534242U + id * 0x9E3779B9U;
+  thread_counters counters;
+  start_thread(c, id, counters);
+
+  for (;;)
+  {
+    const uint64_t start = now_ns();
+    ring.m.lock();
+    while (ring.turn != id && !stop.load(std::memory_order_relaxed))
+      wait(ring);
+    if (ring.turn != id)
+    {
+      ring.m.unlock();
+      break;
+    }
+    r.latency.add(now_ns() - start);
+    write_work(c.cs);
+    r.writes += c.cs;
+    ring.turn = (id + 1) % c.threads;
+    notify(ring);
+    ring.m.unlock();
+    r.ops++;
+    local_work(c.ncs, seed);
+  }
+
+  counters.stop(r);
+}
+
+static run_result run_atomic_condition_variable(const run_config &c)
+{
+  typedef token_ring<atomic_mutex<>, atomic_condition_variable> ring_t;
+  static ring_t ring;
+  ring.turn = 0;
+  return run(c, [&c](unsigned id, thread_result &tr) {
+    ring_worker(ring, c, id, tr,
+                [](ring_t &ring) { ring.cv.wait(ring.m); },
+                [&c](ring_t &ring) {
+                  if (c.threads == 2) ring.cv.signal();
+                  else ring.cv.broadcast(ring.m);
+                });
+  }, []{
+    ring.m.lock();
+    ring.cv.broadcast(ring.m);
+    ring.m.unlock();
+  });
+}
+
+static run_result run_std_condition_variable(const run_config &c)
+{
+  typedef token_ring<std::mutex, std::condition_variable> ring_t;
+  static ring_t ring;
+  ring.turn = 0;
+  return run(c, [&c](unsigned id, thread_result &tr) {
+    ring_worker(ring, c, id, tr,
+                [](ring_t &ring) {
+                  std::unique_lock<std::mutex> lk{ring.m, std::adopt_lock};
+                  ring.cv.wait(lk);
+                  lk.release();
+                },
+                [&c](ring_t &ring) {
+                  if (c.threads == 2) ring.cv.notify_one();
+                  else ring.cv.notify_all();
+                });
+  }, []{
+    ring.m.lock();
+    ring.cv.notify_all();
+    ring.m.unlock();
+  });
+}
+
+/* Hash table lookups, inserts and erases of random keys. The latency
+is that of the entire operation; the critical section length is ignored. */
+
+/** Number of distinct keys in the hash table benchmarks */
+constexpr uint32_t HASH_KEYS = 1U << 16;
+
+#ifdef HAVE_STD_SHARED_MUTEX
+/** std::unordered_map protected by std::shared_mutex */
+struct std_unordered_map
+{
+  std::shared_mutex m;
+  std::unordered_map<uint32_t, uint64_t> map;
+
+  bool find(uint32_t key, uint64_t &value)
+  {
+    std::shared_lock<std::shared_mutex> g{m};
+    auto i = map.find(key);
+    if (i == map.end())
+      return false;
+    value = i->second;
+    return true;
+  }
+  bool insert(uint32_t key, uint64_t value)
+  {
+    std::lock_guard<std::shared_mutex> g{m};
+    return map.emplace(key, value).second;
+  }
+  bool erase(uint32_t key)
+  {
+    std::lock_guard<std::shared_mutex> g{m};
+    return map.erase(key) != 0;
+  }
+};
+#endif
+
+template<class Map>
+static void hash_map_worker(Map &map, const run_config &c, unsigned id,
+                            thread_result &r)
+{
+  uint32_t seed = 2463534242U + id * 0x9E3779B9U;
+  thread_counters counters;
+  start_thread(c, id, counters);
+
+  while (!stop.load(std::memory_order_relaxed))
+  {
+    const uint32_t key = next_random(seed) % HASH_KEYS;
+    const uint64_t start = now_ns();
+    uint64_t value;
+    if (next_random(seed) % 100 < c.read_pct)
+    {
+      if (map.find(key, value))
+        seed += uint32_t(value);
+    }
+    else if (next_random(seed) & 1)
+      map.insert(key, key);
+    else
+      map.erase(key);
+    r.latency.add(now_ns() - start);
+    r.ops++;
+    local_work(c.ncs, seed);
+  }
+
+  counters.stop(r);
+}
+
+template<class Map>
+static run_result run_hash_map(const run_config &c)
+{
+  /* The contents of the table will be reused between runs. */
+  static Map map;
+  return run(c, [&c](unsigned id, thread_result &r)
+             { hash_map_worker(map, c, id, r); }, []{});
+}
+
+typedef atomic_recursive_shared_mutex<shared_mutex_storage<>,
+                                      thread_token_identity>
+  compact_recursive_shared_mutex;
+
+/** A benchmark of a lock */
+struct benchmark
+{
+  const char *name;
+  run_result (*run)(const run_config&);
+  /** whether the lock distinguishes SHARED operations */
+  bool shared;
+  /** whether this is condition variable ping-pong,
+  which requires at least 2 threads */
+  bool ring;
+};
+
+static const benchmark benchmarks[] = {
+  {"atomic_mutex", run_mutex_storage<mutex_storage<>>, false, false},
+  {"atomic_spin_mutex", run_lock<atomic_spin_mutex_adapter>, false, false},
+  {"queued_mutex", run_mutex_storage<queued_mutex_storage<>>, false, false},
+#ifdef __linux__
+  {"pi_mutex", run_mutex_storage<pi_mutex_storage<>>, false, false},
+#endif
+  {"parked_mutex", run_mutex_storage<parked_mutex_storage<>>, false, false},
+  {"compact_mutex", run_mutex_storage<mutex_storage<uint16_t>>, false, false},
+  {"atomic_cohort_mutex", run_lock<exclusive_adapter<atomic_cohort_mutex<>>>,
+   false, false},
+  {"atomic_shared_mutex", run_shared_mutex_storage<shared_mutex_storage<>>,
+   true, false},
+  {"atomic_spin_shared_mutex", run_lock<atomic_spin_shared_mutex_adapter>,
+   true, false},
+  {"sharded_shared_mutex",
+   run_shared_mutex_storage<sharded_shared_mutex_storage<>>, true, false},
+  {"batched_shared_mutex",
+   run_shared_mutex_storage<batched_shared_mutex_storage<>>, true, false},
+  {"wide_shared_mutex",
+   run_shared_mutex_storage<shared_mutex_storage<uint64_t>>, true, false},
+  {"parked_shared_mutex",
+   run_shared_mutex_storage<parked_shared_mutex_storage<>>, true, false},
+  {"atomic_recursive_shared_mutex",
+   run_lock<update_adapter<atomic_recursive_shared_mutex<>>>, true, false},
+  {"compact_recursive_shared_mutex",
+   run_lock<update_adapter<compact_recursive_shared_mutex>>, true, false},
+  {"elided_atomic_mutex", run_lock<elided_mutex_adapter>, false, false},
+  {"elided_atomic_shared_mutex", run_lock<elided_shared_mutex_adapter>,
+   true, false},
+  {"std::mutex", run_lock<exclusive_adapter<std::mutex>>, false, false},
+#ifdef HAVE_STD_SHARED_MUTEX
+  {"std::shared_mutex", run_lock<std_shared_mutex_adapter>, true, false},
+#endif
+#ifdef _WIN32
+  {"SRWLOCK", run_lock<srwlock_adapter>, true, false},
+#else
+  {"pthread_rwlock_t", run_lock<pthread_rwlock_adapter>, true, false},
+#endif
+  {"atomic_condition_variable", run_atomic_condition_variable, false, true},
+  {"std::condition_variable", run_std_condition_variable, false, true},
+  {"atomic_hash_map", run_hash_map<atomic_hash_map<uint32_t, uint64_t>>,
+   true, false},
+  {"atomic_hash_map<atomic_mutex>",
+   run_hash_map<atomic_hash_map<uint32_t, uint64_t, std::hash<uint32_t>,
+                                atomic_mutex<>>>, true, false},
+#ifdef HAVE_STD_SHARED_MUTEX
+  {"std::unordered_map", run_hash_map<std_unordered_map>, true, false},
+#endif
+};
+
+enum output_format { TEXT, CSV, JSON };
+
+/** Format a ratio.
+@param buf   the output buffer
+@param n     the numerator
+@param d     the denominator
+@param none  the output if the ratio is not available
+@return the formatted ratio */
+static const char *ratio(char (&buf)[32], double n, double d,
+                         const char *none)
+{
+  if (d <= 0)
+    return none;
+  snprintf(buf, sizeof buf, "%.3f", n / d);
+  return buf;
+}
+
+/** Output one result
+@param baseline  the result of the baseline lock for the same
+                 configuration, or nullptr */
+static void output(output_format format, bool first, const benchmark &b,
+                   const run_config &c, const run_result &r,
+                   const run_result *baseline)
+{
+  const double ops_per_s = r.seconds > 0 ? double(r.ops) / r.seconds : 0;
+  const unsigned read_pct = b.shared ? c.read_pct : 0;
+  const char *const none = format == TEXT ? "-" : format == CSV ? "" : "null";
+  char buf[N_EVENTS + 1][32];
+  const char *per_op[N_EVENTS];
+  for (unsigned i = 0; i < N_EVENTS; i++)
+    per_op[i] = ratio(buf[i], double(r.events[i]),
+                      r.events[i] == NO_COUNT ? 0 : double(r.ops), none);
+  const char *rel = ratio(buf[N_EVENTS], ops_per_s,
+                          baseline && baseline->seconds > 0
+                          ? double(baseline->ops) / baseline->seconds : 0,
+                          none);
+  switch (format) {
+  case TEXT:
+    if (first)
+      printf("%-30s %7s %5s %5s %4s %7s %12s %6s %8s %8s %8s %6s %10s"
+             " %8s %8s %8s %8s\n",
+             "lock", "threads", "cs", "ncs", "read", "pin", "ops/s", "rel",
+             "p50ns", "p99ns", "p99.9ns", "spread", "vcsw",
+             "miss/op", "coh/op", "csw/op", "futex/op");
+    printf("%-30s %7u %5u %5u %4u %7s %12.0f %6s %8llu %8llu %8llu %6.3f"
+           " %10llu %8s %8s %8s %8s\n",
+           b.name, c.threads, c.cs, c.ncs, read_pct, placement_names[c.pin],
+           ops_per_s, rel,
+           static_cast<unsigned long long>(r.p50),
+           static_cast<unsigned long long>(r.p99),
+           static_cast<unsigned long long>(r.p999), r.spread,
+           static_cast<unsigned long long>(r.vcsw),
+           per_op[CACHE_MISSES], per_op[COHERENCE_MISSES],
+           per_op[CONTEXT_SWITCHES], per_op[FUTEX_CALLS]);
+    break;
+  case CSV:
+    if (first)
+      puts("lock,threads,cs,ncs,read_pct,update_pct,pin,seconds,ops,"
+           "ops_per_s,rel,p50_ns,p99_ns,p999_ns,spread,vcsw,"
+           "cache_misses_per_op,coherence_misses_per_op,"
+           "context_switches_per_op,futex_calls_per_op");
+    printf("%s,%u,%u,%u,%u,%u,%s,%f,%llu,%f,%s,%llu,%llu,%llu,%f,%llu,"
+           "%s,%s,%s,%s\n",
+           b.name, c.threads, c.cs, c.ncs, read_pct, c.update_pct,
+           placement_names[c.pin], r.seconds,
+           static_cast<unsigned long long>(r.ops), ops_per_s, rel,
+           static_cast<unsigned long long>(r.p50),
+           static_cast<unsigned long long>(r.p99),
+           static_cast<unsigned long long>(r.p999), r.spread,
+           static_cast<unsigned long long>(r.vcsw),
+           per_op[CACHE_MISSES], per_op[COHERENCE_MISSES],
+           per_op[CONTEXT_SWITCHES], per_op[FUTEX_CALLS]);
+    break;
+  case JSON:
+    printf("%s\n  {\"lock\": \"%s\", \"threads\": %u, \"cs\": %u, "
+           "\"ncs\": %u, \"read_pct\": %u, \"update_pct\": %u, "
+           "\"pin\": \"%s\", "
+           "\"seconds\": %f, \"ops\": %llu, \"ops_per_s\": %f, "
+           "\"rel\": %s, "
+           "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, "
+           "\"spread\": %f, \"vcsw\": %llu, "
+           "\"cache_misses_per_op\": %s, \"coherence_misses_per_op\": %s, "
+           "\"context_switches_per_op\": %s, \"futex_calls_per_op\": %s}",
+           first ? "[" : ",", b.name, c.threads, c.cs, c.ncs, read_pct,
+           c.update_pct, placement_names[c.pin], r.seconds,
+           static_cast<unsigned long long>(r.ops), ops_per_s, rel,
+           static_cast<unsigned long long>(r.p50),
+           static_cast<unsigned long long>(r.p99),
+           static_cast<unsigned long long>(r.p999), r.spread,
+           static_cast<unsigned long long>(r.vcsw),
+           per_op[CACHE_MISSES], per_op[COHERENCE_MISSES],
+           per_op[CONTEXT_SWITCHES], per_op[FUTEX_CALLS]);
+    break;
+  }
+  fflush(stdout);
+}
+
+/** Parse a comma-separated list of numbers.
+@return whether the list was valid */
+static bool parse_list(const char *s, std::vector<unsigned> &list)
+{
+  list.clear();
+  for (;;)
+  {
+    char *endp;
+    const unsigned long n = strtoul(s, &endp, 0);
+    if (endp == s || n > 1000000)
+      return false;
+    list.push_back(unsigned(n));
+    if (!*endp)
+      return true;
+    if (*endp != ',')
+      return false;
+    s = endp + 1;
+  }
+}
+
+/** @return whether a lock name matches a comma-separated list */
+static bool selected(const char *name, const std::string &list)
+{
+  if (list.empty())
+    return true;
+  const size_t len = strlen(name);
+  for (size_t pos = 0;; pos++)
+  {
+    const size_t end = list.find(',', pos);
+    const size_t n = (end == std::string::npos ? list.size() : end) - pos;
+    if (n == len && !list.compare(pos, n, name))
+      return true;
+    if (end == std::string::npos)
+      return false;
+    pos = end;
+  }
+}
+
+/** Parse a comma-separated list of thread placements.
+@return whether the list was valid */
+static bool parse_placements(const char *s, std::vector<placement> &list)
+{
+  list.clear();
+  for (;;)
+  {
+    const size_t n = strcspn(s, ",");
+    unsigned p = FLOAT;
+    while (strlen(placement_names[p]) != n ||
+           strncmp(s, placement_names[p], n))
+      if (++p > SPREAD)
+        return false;
+    list.push_back(placement(p));
+    if (!s[n])
+      return true;
+    s += n + 1;
+  }
+}
+
+static int usage(const char *argv0)
+{
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "--threads=N,...   thread counts (default: 1,2,4,... up to"
+          " twice the processors)\n"
+          "--cs=N,...        work units in critical sections (default: 1)\n"
+          "--ncs=N,...       work units outside critical sections"
+          " (default: 0,100)\n"
+          "--read=PCT,...    percentage of shared operations"
+          " (default: 0,90)\n"
+          "--update=PCT      percentage of update among the other"
+          " operations (default: 10)\n"
+          "--duration=MS     duration of each run (default: 200)\n"
+          "--locks=NAME,...  locks to test (default: all)\n"
+          "--format=F        text, csv or json (default: text)\n"
+          "--pin             pin the threads to processors\n"
+          "--pin=P,...       thread placements: none, cpu (same as --pin),"
+          "\n                  compact or spread over the NUMA nodes\n"
+          "--baseline=NAME   report the throughput relative to a lock;"
+          " an exclusive\n                  baseline is compared with"
+          " every read ratio\n"
+          "--coherence=RAW   raw perf event for coherence misses"
+          " (default: L1D load misses)\n"
+          "--list            list the locks\n",
+          argv0);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  std::vector<unsigned> threads, cs{1}, ncs{0, 100}, read{0, 90};
+  run_config c{};
+  c.update_pct = 10;
+  c.duration_ms = 200;
+  output_format format = TEXT;
+  std::string locks;
+  std::vector<placement> pins{FLOAT};
+  const benchmark *baseline = nullptr;
+  uint64_t coherence = 0;
+
+  for (int i = 1; i < argc; i++)
+  {
+    const char *arg = argv[i];
+    std::vector<unsigned> n;
+    if (!strncmp(arg, "--threads=", 10))
+    {
+      if (!parse_list(arg + 10, threads))
+        return usage(*argv);
+    }
+    else if (!strncmp(arg, "--cs=", 5))
+    {
+      if (!parse_list(arg + 5, cs))
+        return usage(*argv);
+    }
+    else if (!strncmp(arg, "--ncs=", 6))
+    {
+      if (!parse_list(arg + 6, ncs))
+        return usage(*argv);
+    }
+    else if (!strncmp(arg, "--read=", 7))
+    {
+      if (!parse_list(arg + 7, read))
+        return usage(*argv);
+    }
+    else if (!strncmp(arg, "--update=", 9))
+    {
+      if (!parse_list(arg + 9, n) || n.size() != 1 || n[0] > 100)
+        return usage(*argv);
+      c.update_pct = n[0];
+    }
+    else if (!strncmp(arg, "--duration=", 11))
+    {
+      if (!parse_list(arg + 11, n) || n.size() != 1 || !n[0])
+        return usage(*argv);
+      c.duration_ms = n[0];
+    }
+    else if (!strncmp(arg, "--locks=", 8))
+      locks = arg + 8;
+    else if (!strcmp(arg, "--format=text"))
+      format = TEXT;
+    else if (!strcmp(arg, "--format=csv"))
+      format = CSV;
+    else if (!strcmp(arg, "--format=json"))
+      format = JSON;
+    else if (!strcmp(arg, "--pin"))
+      pins = {CPU};
+    else if (!strncmp(arg, "--pin=", 6))
+    {
+      if (!parse_placements(arg + 6, pins))
+        return usage(*argv);
+    }
+    else if (!strncmp(arg, "--baseline=", 11))
+    {
+      baseline = nullptr;
+      for (const auto &b : benchmarks)
+        if (!strcmp(b.name, arg + 11))
+          baseline = &b;
+      if (!baseline)
+        return usage(*argv);
+    }
+    else if (!strncmp(arg, "--coherence=", 12))
+    {
+      char *endp;
+      coherence = strtoull(arg + 12, &endp, 0);
+      if (endp == arg + 12 || *endp || !coherence)
+        return usage(*argv);
+    }
+    else if (!strcmp(arg, "--list"))
+    {
+      for (const auto &b : benchmarks)
+        puts(b.name);
+      return 0;
+    }
+    else
+      return usage(*argv);
+  }
+
+  for (unsigned r : read)
+    if (r > 100)
+      return usage(*argv);
+
+  if (threads.empty())
+  {
+    const unsigned n = std::thread::hardware_concurrency();
+    for (unsigned t = 1; t <= 2 * (n ? n : 1); t *= 2)
+      threads.push_back(t);
+  }
+
+  init_placement();
+#ifdef __linux__
+  init_events(coherence);
+#else
+  (void) coherence;
+#endif
+
+  /* The baseline is run first, so that the other locks can be compared
+  with it. */
+  std::vector<const benchmark*> order;
+  if (baseline)
+    order.push_back(baseline);
+  for (const auto &b : benchmarks)
+    if (&b != baseline && selected(b.name, locks))
+      order.push_back(&b);
+
+  std::vector<std::pair<run_config, run_result>> baseline_results;
+  /* A baseline that does not distinguish SHARED operations only ran
+  with read_pct=0, and it is compared with every read ratio. */
+  const auto find_baseline = [&baseline_results, baseline]
+    (const run_config &c) -> const run_result*
+  {
+    for (const auto &b : baseline_results)
+      if (b.first.threads == c.threads && b.first.pin == c.pin &&
+          (!baseline->shared || b.first.read_pct == c.read_pct) &&
+          b.first.cs == c.cs && b.first.ncs == c.ncs)
+        return &b.second;
+    return nullptr;
+  };
+
+  bool first = true;
+  for (const benchmark *b : order)
+  {
+    for (unsigned t : threads)
+    {
+      if (!t || (b->ring && t < 2))
+        continue;
+      c.threads = t;
+      for (placement p : pins)
+      {
+        c.pin = p;
+        for (unsigned r : b->shared ? read : std::vector<unsigned>{0})
+        {
+          c.read_pct = r;
+          for (unsigned k : cs)
+          {
+            c.cs = k;
+            for (unsigned l : ncs)
+            {
+              c.ncs = l;
+              const run_result result = b->run(c);
+              if (b == baseline)
+                baseline_results.emplace_back(c, result);
+              output(format, first, *b, c, result, find_baseline(c));
+              first = false;
+            }
+          }
+        }
+      }
+    }
+  }
+  if (format == JSON)
+    puts(first ? "[]" : "\n]");
+  return 0;
+}
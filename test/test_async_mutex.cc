@@ -0,0 +1,299 @@
+#include <cstdio>
+#include <thread>
+#include <cassert>
+#include <mutex>
+#include <deque>
+#include <exception>
+#include "atomic_async_mutex.h"
+
+constexpr unsigned N_THREADS = 4;
+constexpr unsigned N_COROUTINES = 8;
+constexpr unsigned N_ROUNDS = 1000;
+
+/** A coroutine that starts eagerly and frees itself at completion */
+struct task
+{
+  struct promise_type
+  {
+    task get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+};
+
+/** An executor that resumes coroutines in a dedicated thread */
+class queue_executor
+{
+  std::mutex m;
+  std::deque<std::coroutine_handle<>> queue;
+public:
+  void post(std::coroutine_handle<> h)
+  {
+    std::lock_guard<std::mutex> g{m};
+    queue.push_back(h);
+  }
+  /** @return whether a coroutine was resumed */
+  bool run_one()
+  {
+    std::coroutine_handle<> h;
+    {
+      std::lock_guard<std::mutex> g{m};
+      if (queue.empty())
+        return false;
+      h = queue.front();
+      queue.pop_front();
+    }
+    h.resume();
+    return true;
+  }
+};
+
+static atomic_async_mutex<> m;
+static atomic_async_shared_mutex<> sux;
+static atomic_async_condition_variable<> cv;
+static queue_executor executor;
+
+static bool critical;
+static unsigned counter;
+static std::atomic<unsigned> done, waiting;
+static bool ready;
+
+static void wait_for_done(unsigned n)
+{
+  while (done.load() < n)
+    std::this_thread::yield();
+}
+
+static task async_counter(bool use_executor)
+{
+  for (auto i = N_ROUNDS; i--; )
+  {
+    if (use_executor)
+      co_await m.lock_async(executor);
+    else
+      co_await m.lock_async();
+    assert(!critical);
+    critical = true;
+    counter++;
+    critical = false;
+    m.unlock();
+  }
+  done++;
+}
+
+static void test_mutex()
+{
+  for (auto i = N_COROUTINES; i--; )
+    async_counter(false);
+  for (auto i = N_ROUNDS; i--; )
+  {
+    if (i & 1)
+      m.lock();
+    else
+      while (!m.try_lock())
+        std::this_thread::yield();
+    assert(!critical);
+    critical = true;
+    counter++;
+    critical = false;
+    m.unlock();
+  }
+}
+
+static task async_shared_mutex(unsigned id)
+{
+  for (auto i = N_ROUNDS; i--; )
+  {
+    switch ((i + id) % 3) {
+    case 0:
+      co_await sux.lock_async();
+      assert(!critical);
+      critical = true;
+      counter++;
+      critical = false;
+      sux.unlock();
+      break;
+    case 1:
+      co_await sux.lock_update_async();
+      assert(!critical);
+      sux.unlock_update();
+      break;
+    default:
+      co_await sux.lock_shared_async();
+      assert(!critical);
+      sux.unlock_shared();
+    }
+  }
+  done++;
+}
+
+static task async_exclusive(bool use_executor)
+{
+  if (use_executor)
+    co_await sux.lock_async(executor);
+  else
+    co_await sux.lock_async();
+  assert(!critical);
+  critical = true;
+  counter++;
+  critical = false;
+  sux.unlock();
+  done++;
+}
+
+static void test_shared_mutex(unsigned id)
+{
+  for (auto i = N_COROUTINES; i--; )
+    async_shared_mutex(id * N_COROUTINES + i);
+  for (auto i = N_ROUNDS; i--; )
+  {
+    if (i & 1)
+    {
+      sux.lock_shared();
+      assert(!critical);
+      sux.unlock_shared();
+    }
+    else
+    {
+      sux.lock();
+      assert(!critical);
+      critical = true;
+      counter++;
+      critical = false;
+      sux.unlock();
+    }
+  }
+}
+
+static task async_condition()
+{
+  co_await m.lock_async();
+  waiting++;
+  while (!ready)
+    co_await cv.wait_async(m);
+  assert(!critical);
+  critical = true;
+  counter++;
+  critical = false;
+  m.unlock();
+  done++;
+}
+
+int main(int, char **)
+{
+  /* The lock is acquired without suspending. */
+  async_counter(false);
+  assert(done == 1);
+  assert(counter == N_ROUNDS);
+
+  /* A coroutine of another thread is resumed by unlock(). */
+  m.lock();
+  std::thread([]{ async_counter(false); }).join();
+  assert(m.is_async_waiting());
+  assert(done == 1);
+  m.unlock();
+  assert(done == 2);
+  assert(!m.is_async_waiting());
+  assert(!m.get_storage().is_locked_or_waiting());
+
+  /* A coroutine is resumed on an executor, in another thread. */
+  std::thread([]{ m.lock(); async_counter(true); m.unlock(); }).join();
+  assert(done == 2);
+  while (executor.run_one());
+  assert(done == 3);
+  assert(!m.get_storage().is_locked_or_waiting());
+
+  fputs("atomic_async_mutex", stderr);
+
+  done = 0;
+  counter = 0;
+  std::thread t[N_THREADS];
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_mutex);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  wait_for_done(N_THREADS * N_COROUTINES);
+  assert(counter == N_THREADS * (N_COROUTINES + 1) * N_ROUNDS);
+  assert(!m.is_async_waiting());
+  assert(!m.get_storage().is_locked_or_waiting());
+
+  done = 0;
+  std::atomic<bool> run{true};
+  std::thread worker([&run]{
+    while (run.load())
+      if (!executor.run_one())
+        std::this_thread::yield();
+  });
+  for (auto i = N_COROUTINES; i--; )
+    async_counter(true);
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_mutex);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  wait_for_done((N_THREADS + 1) * N_COROUTINES);
+  run = false;
+  worker.join();
+  assert(!m.get_storage().is_locked_or_waiting());
+
+  fputs(", executor", stderr);
+
+  /* An exclusive lock request of a coroutine is granted the outer lock
+  in unlock_update(), and then the exclusive lock in unlock_shared(). */
+  done = 0;
+  for (bool use_executor : {false, true})
+  {
+    sux.lock_update();
+    sux.lock_shared();
+    std::thread([use_executor]{ async_exclusive(use_executor); }).join();
+    assert(sux.is_async_waiting());
+    sux.unlock_update();
+    assert(sux.is_async_waiting());
+    assert(!done);
+    sux.unlock_shared();
+    assert(!sux.is_async_waiting());
+    while (executor.run_one());
+    assert(done == 1);
+    done = 0;
+  }
+  assert(!sux.get_storage().is_locked_or_waiting());
+
+  counter = 0;
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_shared_mutex, i);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  wait_for_done(N_THREADS * N_COROUTINES);
+  assert(!sux.is_async_waiting());
+  assert(!sux.get_storage().is_locked_or_waiting());
+
+  fputs(", atomic_async_shared_mutex", stderr);
+
+  done = 0;
+  counter = 0;
+  for (auto i = N_COROUTINES; i--; )
+    async_condition();
+  assert(waiting == N_COROUTINES);
+  assert(cv.is_waiting());
+  m.lock();
+  cv.notify_one(m);
+  m.unlock();
+  assert(done == 0);
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread([]{
+      std::lock_guard<atomic_async_mutex<>> g{m};
+      ready = true;
+      cv.notify_all(m);
+    });
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(done == N_COROUTINES);
+  assert(counter == N_COROUTINES);
+  assert(!cv.is_waiting());
+  assert(!m.is_async_waiting());
+  assert(!m.get_storage().is_locked_or_waiting());
+
+  fputs(", atomic_async_condition_variable.\n", stderr);
+  return 0;
+}
@@ -18,6 +18,7 @@ typedef atomic_shared_mutex<> typeof_sux;
 static typeof_m m;
 static typeof_sux sux;
 static atomic_condition_variable cv;
+static_assert(sizeof cv == 8, "compatibility");
 
 TRANSACTIONAL_TARGET static void test_condition_variable()
 {
@@ -36,6 +37,39 @@ TRANSACTIONAL_TARGET static void test_condition_variable()
   pending--;
 }
 
+static bool released;
+
+static void test_broadcast()
+{
+  m.lock();
+  while (!released)
+    cv.wait(m);
+  pending--;
+  m.unlock();
+}
+
+static atomic_mutex<queued_mutex_storage<>> q_m;
+
+static void test_queued_broadcast()
+{
+  q_m.lock();
+  while (!released)
+    cv.wait(q_m);
+  pending--;
+  q_m.unlock();
+}
+
+static atomic_mutex<mutex_storage<uint16_t>> compact_m;
+
+static void test_compact_broadcast()
+{
+  compact_m.lock();
+  while (!released)
+    cv.wait(compact_m);
+  pending--;
+  compact_m.unlock();
+}
+
 #include <condition_variable>
 static std::condition_variable_any cva;
 
@@ -115,7 +149,62 @@ int main(int, char **)
     assert(!pending);
   }
 
-  fputs("(any), ", stderr);
+  for (auto j = N_ROUNDS; j--; )
+  {
+    for (auto i = N_THREADS; i--; )
+      t[i] = std::thread(test_broadcast);
+    m.lock();
+    pending = N_THREADS;
+    released = true;
+    cv.broadcast(m);
+    m.unlock();
+    for (auto i = N_THREADS; i--; )
+      t[i].join();
+    assert(!cv.is_waiting());
+    assert(!pending);
+    assert(!m.get_storage().is_locked_or_waiting());
+    released = false;
+  }
+
+  fputs("(requeue), (any), ", stderr);
+
+  for (auto j = N_ROUNDS; j--; )
+  {
+    for (auto i = N_THREADS; i--; )
+      t[i] = std::thread(test_queued_broadcast);
+    q_m.lock();
+    pending = N_THREADS;
+    released = true;
+    cv.broadcast(q_m);
+    q_m.unlock();
+    for (auto i = N_THREADS; i--; )
+      t[i].join();
+    assert(!cv.is_waiting());
+    assert(!pending);
+    assert(!q_m.get_storage().is_locked_or_waiting());
+    released = false;
+  }
+
+  fputs("atomic_mutex<queued_mutex_storage>, ", stderr);
+
+  for (auto j = N_ROUNDS; j--; )
+  {
+    for (auto i = N_THREADS; i--; )
+      t[i] = std::thread(test_compact_broadcast);
+    compact_m.lock();
+    pending = N_THREADS;
+    released = true;
+    cv.broadcast(compact_m);
+    compact_m.unlock();
+    for (auto i = N_THREADS; i--; )
+      t[i].join();
+    assert(!cv.is_waiting());
+    assert(!pending);
+    assert(!compact_m.get_storage().is_locked_or_waiting());
+    released = false;
+  }
+
+  fputs("atomic_mutex<mutex_storage<uint16_t>>, ", stderr);
 
   for (auto j = N_ROUNDS; j--; )
   {
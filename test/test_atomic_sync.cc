@@ -13,35 +13,41 @@ constexpr unsigned N_THREADS = 30;
 constexpr unsigned N_ROUNDS = 100;
 constexpr unsigned M_ROUNDS = 100;
 
-#if defined WITH_SPINLOOP && defined SPINLOOP
+#ifdef WITH_SPINLOOP
+# ifdef SPINLOOP
+#  define SPIN_ROUNDS SPINLOOP
+# else
+#  define SPIN_ROUNDS /* default_spin_rounds() */
+# endif
 # define ATOMIC_MUTEX_NAME(m) "atomic_spin_" #m
 /** Like atomic_mutex, but with a spinloop in lock() */
 template<typename storage = mutex_storage<>>
 class atomic_spin_mutex : public atomic_mutex<storage>
 {
 public:
-  void lock() noexcept { atomic_mutex<storage>::spin_lock(SPINLOOP); }
+  void lock() noexcept { atomic_mutex<storage>::spin_lock(SPIN_ROUNDS); }
 };
 /** Like atomic_shared_mutex, but with spinloops */
 template<typename storage = shared_mutex_storage<>>
 class atomic_spin_shared_mutex : public atomic_shared_mutex<storage>
 {
 public:
-  void lock() noexcept { this->spin_lock(SPINLOOP); }
-  void shared_lock() noexcept { this->spin_lock_shared(SPINLOOP); }
-  void update_lock() noexcept { this->spin_lock_update(SPINLOOP); }
+  void lock() noexcept { this->spin_lock(SPIN_ROUNDS); }
+  void shared_lock() noexcept { this->spin_lock_shared(SPIN_ROUNDS); }
+  void update_lock() noexcept { this->spin_lock_update(SPIN_ROUNDS); }
 };
-template<typename storage = shared_mutex_storage<>>
+template<typename storage = shared_mutex_storage<>,
+         typename identity = thread_id_identity>
 class atomic_spin_recursive_shared_mutex :
-  public atomic_recursive_shared_mutex<storage>
+  public atomic_recursive_shared_mutex<storage, identity>
 {
 public:
-  void lock_shared() noexcept { this->spin_lock_shared(SPINLOOP); }
-  void lock_update() noexcept { this->spin_lock_update(SPINLOOP); }
+  void lock_shared() noexcept { this->spin_lock_shared(SPIN_ROUNDS); }
+  void lock_update() noexcept { this->spin_lock_update(SPIN_ROUNDS); }
   void lock_update_disowned() noexcept
-  { this->spin_lock_update_disowned(SPINLOOP); }
-  void lock() noexcept { this->spin_lock(SPINLOOP); }
-  void lock_disowned() noexcept { this->spin_lock_disowned(SPINLOOP); }
+  { this->spin_lock_update_disowned(SPIN_ROUNDS); }
+  void lock() noexcept { this->spin_lock(SPIN_ROUNDS); }
+  void lock_disowned() noexcept { this->spin_lock_disowned(SPIN_ROUNDS); }
 };
 #else
 # define ATOMIC_MUTEX_NAME(m) "atomic_" #m
@@ -52,6 +58,11 @@ public:
 // MSVC does not recognize typeof
 typedef atomic_spin_mutex<> typeof_m;
 static typeof_m m;
+typedef atomic_spin_mutex<mutex_storage<uint16_t>> typeof_compact_m;
+/** Two mutexes in one 32-bit word, which their waiters will wait on */
+alignas(4) static typeof_compact_m compact_m[2];
+static_assert(sizeof compact_m == 4, "compatibility");
+static unsigned compact_neighbour;
 
 #if !defined WITH_ELISION || defined NDEBUG
 # define transactional_assert(x) assert(x)
@@ -59,7 +70,8 @@ static typeof_m m;
 # define transactional_assert(x) if (!x) goto abort;
 #endif
 
-TRANSACTIONAL_TARGET static void test_atomic_mutex()
+template<typename typeof_m>
+TRANSACTIONAL_TARGET static void test_atomic_mutex(typeof_m &m)
 {
   for (auto i = N_ROUNDS * M_ROUNDS; i--; )
   {
@@ -78,8 +90,16 @@ abort:
 
 typedef atomic_spin_shared_mutex<> typeof_sux;
 static typeof_sux sux;
+typedef atomic_spin_shared_mutex<batched_shared_mutex_storage<>>
+  typeof_batched_sux;
+static typeof_batched_sux batched_sux;
+typedef atomic_spin_shared_mutex<shared_mutex_storage<uint64_t>>
+  typeof_wide_sux;
+static typeof_wide_sux wide_sux;
+static_assert(sizeof wide_sux == 8, "compatibility");
 
-TRANSACTIONAL_TARGET static void test_shared_mutex()
+template<typename typeof_sux>
+TRANSACTIONAL_TARGET static void test_shared_mutex(typeof_sux &sux)
 {
   for (auto i = N_ROUNDS; i--; )
   {
@@ -128,9 +148,16 @@ abort:
 #endif
 }
 
-static atomic_spin_recursive_shared_mutex<> recursive_sux;
+typedef atomic_spin_recursive_shared_mutex<> typeof_recursive_sux;
+static typeof_recursive_sux recursive_sux;
+typedef atomic_spin_recursive_shared_mutex<shared_mutex_storage<>,
+                                           thread_token_identity>
+  typeof_compact_recursive_sux;
+static typeof_compact_recursive_sux compact_recursive_sux;
+static_assert(sizeof compact_recursive_sux == 16, "compatibility");
 
-static void test_recursive_shared_mutex()
+template<typename typeof_recursive_sux>
+static void test_recursive_shared_mutex(typeof_recursive_sux &recursive_sux)
 {
   for (auto i = N_ROUNDS; i--; )
   {
@@ -192,31 +219,112 @@ int main(int, char **)
   fputs(ATOMIC_MUTEX_NAME(mutex), stderr);
 #endif
 
+  {
+    const elision_capability c = elision_capabilities();
+    assert(elision_supported() == (c.isa != ELISION_NONE && !c.disabled));
+    (void) c;
+  }
+
+#ifdef WITH_ELISION
+  {
+    /* Aborts on a lock will eventually start a cooling-off period. */
+    static char lock;
+    unsigned retries = 0;
+    while (elision_aborted(&lock, ELISION_RETRY))
+      retries++;
+    assert(retries);
+    assert(!elision_attempts(&lock));
+    assert(!elision_aborted(&lock, ELISION_CAPACITY));
+    /* The cooling-off period is per thread, but the penalty is shared:
+    another thread will cool off after its first abort. */
+    std::thread([]{
+      assert(elision_attempts(&lock));
+      assert(!elision_aborted(&lock, ELISION_RETRY));
+      assert(!elision_attempts(&lock));
+    }).join();
+  }
+#endif
+
   assert(!m.get_storage().is_locked_or_waiting());
   for (auto i = N_THREADS; i--; )
-    t[i]= std::thread(test_atomic_mutex);
+    t[i]= std::thread(test_atomic_mutex<typeof_m>, std::ref(m));
   for (auto i = N_THREADS; i--; )
     t[i].join();
   assert(!m.get_storage().is_locked_or_waiting());
 
+  fputs(", " ATOMIC_MUTEX_NAME(mutex<mutex_storage<uint16_t>>), stderr);
+
+  for (auto i = N_THREADS; i--; )
+    if (i & 1)
+      t[i]= std::thread([]{
+        for (auto j = N_ROUNDS * M_ROUNDS; j--; )
+        {
+          compact_m[1].lock();
+          compact_neighbour++;
+          compact_m[1].unlock();
+        }
+      });
+    else
+      t[i]= std::thread(test_atomic_mutex<typeof_compact_m>,
+                        std::ref(compact_m[0]));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(compact_neighbour == N_THREADS / 2 * N_ROUNDS * M_ROUNDS);
+  assert(!compact_m[0].get_storage().is_locked_or_waiting());
+  assert(!compact_m[1].get_storage().is_locked_or_waiting());
+
   fputs(", " ATOMIC_MUTEX_NAME(shared_mutex), stderr);
 
   assert(!sux.get_storage().is_locked_or_waiting());
   for (auto i = N_THREADS; i--; )
-    t[i]= std::thread(test_shared_mutex);
+    t[i]= std::thread(test_shared_mutex<typeof_sux>, std::ref(sux));
   for (auto i = N_THREADS; i--; )
     t[i].join();
   assert(!sux.get_storage().is_locked_or_waiting());
 
+  fputs(", " ATOMIC_MUTEX_NAME(shared_mutex<batched_shared_mutex_storage>),
+        stderr);
+
+  assert(!batched_sux.get_storage().is_locked_or_waiting());
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_shared_mutex<typeof_batched_sux>,
+                      std::ref(batched_sux));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!batched_sux.get_storage().is_locked_or_waiting());
+
+  fputs(", " ATOMIC_MUTEX_NAME(shared_mutex<shared_mutex_storage<uint64_t>>),
+        stderr);
+
+  assert(!wide_sux.get_storage().is_locked_or_waiting());
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_shared_mutex<typeof_wide_sux>, std::ref(wide_sux));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!wide_sux.get_storage().is_locked_or_waiting());
+
   fputs(", " ATOMIC_MUTEX_NAME(recursive_shared_mutex), stderr);
 
   recursive_sux.init();
   for (auto i = N_THREADS; i--; )
-    t[i]= std::thread(test_recursive_shared_mutex);
+    t[i]= std::thread(test_recursive_shared_mutex<typeof_recursive_sux>,
+                      std::ref(recursive_sux));
   for (auto i = N_THREADS; i--; )
     t[i].join();
   recursive_sux.destroy();
 
+  fputs(", " ATOMIC_MUTEX_NAME(recursive_shared_mutex<thread_token_identity>),
+        stderr);
+
+  compact_recursive_sux.init();
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_recursive_shared_mutex
+                      <typeof_compact_recursive_sux>,
+                      std::ref(compact_recursive_sux));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  compact_recursive_sux.destroy();
+
   fputs(".\n", stderr);
 
   return 0;
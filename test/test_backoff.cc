@@ -0,0 +1,83 @@
+#include <cstdio>
+#include <thread>
+#include <functional>
+#include <cassert>
+#include "atomic_mutex.h"
+#include "atomic_shared_mutex.h"
+
+static bool critical;
+
+constexpr unsigned N_THREADS = 16;
+constexpr unsigned N_ROUNDS = 1000;
+
+template<typename Backoff>
+static void
+test_atomic_mutex(atomic_mutex<mutex_storage<uint32_t, Backoff>> &m)
+{
+  for (auto i = N_ROUNDS; i--; )
+  {
+    m.spin_lock();
+    assert(!critical);
+    critical = true;
+    critical = false;
+    m.unlock();
+  }
+}
+
+template<typename Backoff>
+static void
+test_shared_mutex(atomic_shared_mutex<shared_mutex_storage<uint32_t, Backoff>>
+                  &sux)
+{
+  for (auto i = N_ROUNDS; i--; )
+  {
+    sux.spin_lock();
+    assert(!critical);
+    critical = true;
+    critical = false;
+    sux.unlock();
+
+    sux.spin_lock_shared();
+    assert(!critical);
+    sux.unlock_shared();
+
+    sux.spin_lock_update();
+    assert(!critical);
+    sux.update_lock_upgrade();
+    critical = true;
+    critical = false;
+    sux.update_lock_downgrade();
+    sux.unlock_update();
+  }
+}
+
+template<typename Backoff>
+static void test_backoff(const char *name)
+{
+  std::thread t[N_THREADS];
+
+  static atomic_mutex<mutex_storage<uint32_t, Backoff>> m;
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_atomic_mutex<Backoff>, std::ref(m));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!m.get_storage().is_locked_or_waiting());
+
+  static atomic_shared_mutex<shared_mutex_storage<uint32_t, Backoff>> sux;
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_shared_mutex<Backoff>, std::ref(sux));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!sux.get_storage().is_locked_or_waiting());
+
+  fputs(name, stderr);
+}
+
+int main(int, char **)
+{
+  test_backoff<pause_backoff>("pause_backoff");
+  test_backoff<exponential_backoff>(", exponential_backoff");
+  test_backoff<monitor_backoff>(", monitor_backoff");
+  fputs(".\n", stderr);
+  return 0;
+}
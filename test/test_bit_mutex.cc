@@ -0,0 +1,91 @@
+#include <cstdio>
+#include <thread>
+#include <cassert>
+#include <mutex>
+#include <chrono>
+#include "atomic_bit_mutex.h"
+
+constexpr unsigned N_THREADS = 8;
+constexpr unsigned N_ROUNDS = 10000;
+
+/** A node of a singly linked list */
+struct alignas(4) node
+{
+  node *next;
+};
+
+static node nodes[N_THREADS][N_ROUNDS];
+
+/** A list head, locked by the least significant bits of the pointer */
+static atomic_bit_mutex<uintptr_t> head;
+/** A counter in the upper bits, locked by bits 0 and 1 */
+static atomic_bit_mutex<uint32_t> counter;
+/** A counter in the least significant bits, locked by bits 40 and 41 */
+static atomic_bit_mutex<uint64_t, 40> high;
+
+static void test_bit_mutex(unsigned id)
+{
+  for (unsigned i = 0; i < N_ROUNDS; i++)
+  {
+    /* Push a node to the list. */
+    {
+      std::lock_guard<atomic_bit_mutex<uintptr_t>> g{head};
+      node &n = nodes[id][i];
+      n.next = reinterpret_cast<node*>(head.load());
+      head.store(reinterpret_cast<uintptr_t>(&n));
+    }
+
+    if (i & 1)
+      counter.lock();
+    else
+      while (!counter.try_lock())
+        std::this_thread::yield();
+    assert(counter.is_locked());
+    counter.store(counter.load(std::memory_order_relaxed) + 4);
+    counter.unlock();
+
+    high.lock();
+    high.store(high.load(std::memory_order_relaxed) + 1);
+    high.unlock();
+  }
+}
+
+int main(int, char **)
+{
+  assert(!head.is_locked_or_waiting());
+  head.lock();
+  assert(head.is_locked());
+  assert(!head.load());
+  head.unlock();
+  assert(!head.is_locked_or_waiting());
+
+  {
+    /* A blocked lock() will wait on the upper half of the word. */
+    high.lock();
+    std::thread w([]{ high.lock(); high.unlock(); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    high.unlock();
+    w.join();
+  }
+  assert(!high.is_locked_or_waiting());
+
+  std::thread t[N_THREADS];
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_bit_mutex, i);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+
+  assert(!head.is_locked_or_waiting());
+  assert(!counter.is_locked_or_waiting());
+  assert(!high.is_locked_or_waiting());
+  assert(counter.load() == 4 * N_THREADS * N_ROUNDS);
+  assert(high.load() == N_THREADS * N_ROUNDS);
+
+  unsigned n = 0;
+  for (node *p = reinterpret_cast<node*>(head.load()); p; p = p->next)
+    n++;
+  assert(n == N_THREADS * N_ROUNDS);
+
+  fputs("atomic_bit_mutex.\n", stderr);
+  return 0;
+}
@@ -0,0 +1,85 @@
+#include <cstdio>
+#include <thread>
+#include <cassert>
+#include <chrono>
+#include <mutex>
+#include "atomic_cohort_mutex.h"
+#include "transactional_lock_guard.h"
+
+static bool critical;
+
+constexpr unsigned N_THREADS = 8;
+constexpr unsigned N_ROUNDS = 10000;
+
+typedef atomic_cohort_mutex<> cohort_mutex;
+typedef atomic_cohort_mutex<2, queued_mutex_storage<>, 4> queued_cohort_mutex;
+
+static cohort_mutex m;
+static queued_cohort_mutex q_m;
+
+template<typename Mutex>
+TRANSACTIONAL_TARGET static void test_cohort_mutex(Mutex &m)
+{
+  for (auto i = N_ROUNDS; i--; )
+  {
+    switch (i % 4) {
+    case 0:
+      if (!m.try_lock())
+        continue;
+      break;
+    case 1:
+      if (!m.try_lock_for(std::chrono::microseconds(100)))
+        continue;
+      break;
+    case 2:
+      {
+        transactional_lock_guard<Mutex> g{m};
+        critical = true;
+        critical = false;
+      }
+      continue;
+    default:
+      m.lock();
+    }
+    assert(!critical);
+    critical = true;
+    critical = false;
+#ifndef __SANITIZE_THREAD__ /* which would flag unlock() in another thread */
+    if (i % 64 < 4)
+    {
+      /* Transfer the ownership to another thread */
+      std::thread([&m]{ m.unlock(); }).join();
+      continue;
+    }
+#endif
+    m.unlock();
+  }
+}
+
+int main(int, char **)
+{
+  std::thread t[N_THREADS];
+
+  {
+    std::lock_guard<cohort_mutex> g{m};
+    assert(m.get_storage().is_locked());
+  }
+  assert(!m.get_storage().is_locked_or_waiting());
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_cohort_mutex<cohort_mutex>, std::ref(m));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!m.get_storage().is_locked_or_waiting());
+
+  fputs("atomic_cohort_mutex", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_cohort_mutex<queued_cohort_mutex>, std::ref(q_m));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!q_m.get_storage().is_locked_or_waiting());
+
+  fputs(", atomic_cohort_mutex<queued_mutex_storage>.\n", stderr);
+  return 0;
+}
@@ -0,0 +1,84 @@
+#include <cstdio>
+#include <thread>
+#include <cassert>
+#include <mutex>
+#include "atomic_combining_mutex.h"
+
+constexpr unsigned N_THREADS = 8;
+constexpr unsigned N_ROUNDS = 20000;
+
+/** Statistics that are protected by a combining mutex */
+struct stats
+{
+  bool critical;
+  unsigned count;
+  unsigned long long sum;
+};
+
+static atomic_combining_mutex<> m;
+static stats s;
+/** fewer slots than threads, so that execute() will have to fall back */
+static atomic_combining_mutex<2, mutex_storage<>, exponential_backoff> m2;
+static stats s2;
+
+template<class Mutex>
+static void test_combining(Mutex &mutex, stats &st, unsigned id)
+{
+  for (unsigned i = 0; i < N_ROUNDS; i++)
+  {
+    if (i % 8 == (id & 7))
+    {
+      std::lock_guard<Mutex> g{mutex};
+      assert(!st.critical);
+      st.critical = true;
+      st.count++;
+      st.sum += i;
+      st.critical = false;
+      continue;
+    }
+    unsigned before = ~0U;
+    mutex.execute([&]{
+      assert(!st.critical);
+      st.critical = true;
+      before = st.count++;
+      st.sum += i;
+      st.critical = false;
+    }, i & 1 ? 0 : 100);
+    assert(before < N_THREADS * N_ROUNDS);
+  }
+}
+
+int main(int, char **)
+{
+  {
+    unsigned n = 0;
+    m.execute([&n]{ n++; });
+    assert(n == 1);
+    const auto f = [&n]{ n++; };
+    m.execute(f);
+    assert(n == 2);
+    assert(!m.get_storage().is_locked_or_waiting());
+  }
+
+  std::thread t[N_THREADS];
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread([i]{ test_combining(m, s, i); });
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!m.get_storage().is_locked_or_waiting());
+  assert(s.count == N_THREADS * N_ROUNDS);
+  assert(s.sum == N_THREADS * (N_ROUNDS * (N_ROUNDS - 1ULL) / 2));
+
+  fputs("atomic_combining_mutex", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread([i]{ test_combining(m2, s2, i); });
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!m2.get_storage().is_locked_or_waiting());
+  assert(s2.count == N_THREADS * N_ROUNDS);
+  assert(s2.sum == N_THREADS * (N_ROUNDS * (N_ROUNDS - 1ULL) / 2));
+
+  fputs(", 2 slots.\n", stderr);
+  return 0;
+}
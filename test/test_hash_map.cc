@@ -0,0 +1,72 @@
+#include <cstdio>
+#include <thread>
+#include <cassert>
+#include "atomic_hash_map.h"
+
+constexpr unsigned N_THREADS = 8;
+constexpr unsigned N_KEYS = 10000;
+
+template<class Map>
+static void test_hash_map(Map &map, unsigned id)
+{
+  for (unsigned i = 0; i < N_KEYS; i++)
+  {
+    const unsigned key = i * N_THREADS + id;
+    bool inserted = map.insert(key, uint64_t{key} * 3);
+    assert(inserted);
+    inserted = map.insert(key, 0);
+    assert(!inserted);
+    uint64_t value = 0;
+    bool found = map.find(key, value);
+    assert(found);
+    assert(value == uint64_t{key} * 3);
+    /* Look up a key of another thread, which may or may not exist */
+    const unsigned other = (i * 7919 % N_KEYS) * N_THREADS +
+      (id + 1) % N_THREADS;
+    if (map.find(other, value))
+      assert(value == uint64_t{other} * 3);
+    /* Remove an earlier key */
+    if (i & 1)
+    {
+      found = map.erase(key - N_THREADS);
+      assert(found);
+      found = map.erase(key - N_THREADS);
+      assert(!found);
+    }
+    (void) inserted;
+    (void) found;
+  }
+}
+
+template<class Map>
+static void test()
+{
+  Map map{16};
+  std::thread t[N_THREADS];
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_hash_map<Map>, std::ref(map), i);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+
+  assert(map.size() == N_THREADS * N_KEYS / 2);
+  assert(map.capacity() >= map.size());
+  for (unsigned key = 0; key < N_THREADS * N_KEYS; key++)
+  {
+    uint64_t value;
+    const bool found = map.find(key, value);
+    assert(found == !!(key / N_THREADS & 1));
+    assert(!found || value == uint64_t{key} * 3);
+    (void) found;
+  }
+}
+
+int main(int, char **)
+{
+  test<atomic_hash_map<unsigned, uint64_t>>();
+  fputs("atomic_hash_map<atomic_shared_mutex>", stderr);
+  test<atomic_hash_map<unsigned, uint64_t, std::hash<unsigned>,
+                       atomic_mutex<>>>();
+  fputs(", atomic_hash_map<atomic_mutex>.\n", stderr);
+  return 0;
+}
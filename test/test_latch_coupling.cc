@@ -0,0 +1,220 @@
+#include <cstdio>
+#include <thread>
+#include <cassert>
+#include "atomic_latch_coupling.h"
+
+constexpr unsigned N_THREADS = 8;
+constexpr unsigned N_ROUNDS = 10000;
+constexpr unsigned FANOUT = 4;
+constexpr unsigned LEVELS = 3;
+
+/** A node of a tree */
+struct node
+{
+  atomic_shared_mutex<> latch;
+  /** sum of the counts of the descendant leaves, or the count of a leaf;
+  modified under exclusive latches on the entire path */
+  unsigned total;
+  /** number of visits of a leaf; modified under an exclusive leaf latch */
+  unsigned hits;
+  /** the child nodes, or nullptr for leaves */
+  node *child[FANOUT];
+};
+
+static node nodes[1 + FANOUT + FANOUT * FANOUT];
+static node &root = nodes[0];
+
+typedef latch_coupling<atomic_shared_mutex<>, LEVELS> path;
+
+/** @return a pseudo-random number */
+static unsigned lcg(unsigned &seed)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+/** Check the totals of the children of a shared latched node */
+static void check(const node &n)
+{
+  unsigned total = 0;
+  for (const node *c : n.child)
+    total += c->total;
+  assert(total == n.total);
+  (void) total;
+}
+
+/** @return the child of a node for a key, and shift the key */
+static node *next(const node *n, unsigned &key)
+{
+  node *c = n->child[key % FANOUT];
+  key /= FANOUT;
+  return c;
+}
+
+/** Descend to a leaf with shared latches.
+@return whether the descent completed without a restart */
+TRANSACTIONAL_TARGET static bool read(unsigned key)
+{
+  path p;
+  p.lock_root_elided(root.latch);
+  node *n = &root;
+  while (n->child[0])
+  {
+    check(*n);
+    n = next(n, key);
+    if (!p.couple(n->latch, path::SHARED))
+      return false;
+    assert(p.size() == 1);
+  }
+  (void) n->total;
+  return true;
+}
+
+static void reader(unsigned id)
+{
+  unsigned seed = id;
+  for (unsigned i = 0; i < N_ROUNDS; i++)
+    for (const unsigned key = lcg(seed); !read(key); )
+      std::this_thread::yield();
+}
+
+/** Increment the hits of a leaf, with shared latches on the ancestors.
+@return whether the descent completed without a restart */
+TRANSACTIONAL_TARGET static bool visit_optimistic(unsigned key)
+{
+  path p;
+  p.lock_root_elided(root.latch);
+  node *n = &root;
+  while (n->child[0]->child[0])
+  {
+    n = next(n, key);
+    if (!p.couple(n->latch, path::SHARED))
+      return false;
+  }
+  n = next(n, key);
+  if (!p.couple(n->latch, path::EXCLUSIVE))
+    return false;
+  assert(!p.was_elided());
+  n->hits++;
+  return true;
+}
+
+/** Increment the hits of a leaf: optimistically, and on conflict,
+with update latches that the optimistic descents will not wait for */
+TRANSACTIONAL_TARGET static void visit(unsigned k)
+{
+  if (visit_optimistic(k))
+    return;
+  path p;
+  p.lock_root(root.latch, path::UPDATE);
+  node *n = &root;
+  while (n->child[0])
+  {
+    n = next(n, k);
+    p.couple(n->latch, path::UPDATE);
+  }
+  p.upgrade();
+  assert(p.held(0) == path::EXCLUSIVE);
+  n->hits++;
+}
+
+/** Increment the count of a leaf and the totals of its ancestors */
+TRANSACTIONAL_TARGET static void insert(unsigned key)
+{
+  node *affected[LEVELS];
+  path p;
+  p.lock_root(root.latch, path::UPDATE);
+  affected[0] = &root;
+  for (unsigned level = 1; level < LEVELS; level++)
+  {
+    affected[level] = next(affected[level - 1], key);
+    p.push(affected[level]->latch, path::UPDATE);
+  }
+  assert(p.size() == LEVELS);
+  p.upgrade();
+  for (node *n : affected)
+    n->total++;
+}
+
+static void writer(unsigned id)
+{
+  unsigned seed = id;
+  for (unsigned i = 0; i < N_ROUNDS; i++)
+  {
+    const unsigned key = lcg(seed);
+    if (i & 1)
+      insert(key);
+    else
+      visit(key);
+  }
+}
+
+TRANSACTIONAL_TARGET int main(int, char **)
+{
+  for (unsigned i = 0; i < FANOUT; i++)
+  {
+    nodes[0].child[i] = &nodes[1 + i];
+    for (unsigned j = 0; j < FANOUT; j++)
+      nodes[1 + i].child[j] = &nodes[1 + FANOUT + i * FANOUT + j];
+  }
+
+  {
+    /* Below a shared latch, a conflicting latch is not waited for. */
+    std::atomic<unsigned> state{0};
+    std::thread h([&state]{
+      root.child[0]->latch.lock_update();
+      state = 1;
+      while (state == 1)
+        std::this_thread::yield();
+      root.child[0]->latch.update_lock_upgrade();
+      state = 3;
+      while (state == 3)
+        std::this_thread::yield();
+      root.child[0]->latch.unlock();
+    });
+    while (!state)
+      std::this_thread::yield();
+    path p;
+    p.lock_root(root.latch, path::SHARED);
+    assert(!p.couple(root.child[0]->latch, path::EXCLUSIVE));
+    assert(!p.couple(root.child[0]->latch, path::UPDATE));
+    state = 2;
+    while (state != 3)
+      std::this_thread::yield();
+    assert(!p.couple(root.child[0]->latch, path::SHARED));
+    assert(p.size() == 1);
+    state = 4;
+    h.join();
+    assert(p.couple(root.child[0]->latch, path::UPDATE));
+    assert(p.size() == 1);
+    assert(&p[0] == &root.child[0]->latch);
+    assert(!root.latch.get_storage().is_locked_or_waiting());
+    /* Below an update latch, the child is waited for. */
+    assert(p.push(root.child[0]->child[0]->latch, path::UPDATE));
+    p.upgrade();
+    assert(p.held(0) == path::EXCLUSIVE);
+    assert(p.held(1) == path::EXCLUSIVE);
+  }
+  for (const node &n : nodes)
+    assert(!n.latch.get_storage().is_locked_or_waiting());
+
+  std::thread t[N_THREADS];
+  for (unsigned i = N_THREADS; i--; )
+    t[i] = std::thread(i & 1 ? writer : reader, i);
+  for (unsigned i = N_THREADS; i--; )
+    t[i].join();
+
+  unsigned hits = 0;
+  for (const node &n : nodes)
+  {
+    assert(!n.latch.get_storage().is_locked_or_waiting());
+    hits += n.hits;
+    if (n.child[0])
+      check(n);
+  }
+  assert(root.total == N_THREADS / 2 * N_ROUNDS / 2);
+  assert(hits == N_THREADS / 2 * N_ROUNDS / 2);
+
+  fputs("latch_coupling.\n", stderr);
+  return 0;
+}
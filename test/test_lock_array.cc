@@ -0,0 +1,134 @@
+#include <cstdio>
+#include <thread>
+#include <cassert>
+#include "atomic_lock_array.h"
+
+constexpr unsigned N_THREADS = 8;
+constexpr unsigned N_ROUNDS = 20000;
+constexpr size_t N_ACCOUNTS = 256;
+constexpr size_t N_STRIPES = 16;
+
+static_assert(sizeof(atomic_mutex_array<16, sizeof(atomic_mutex<>)>) == 64,
+              "packed");
+static_assert(sizeof(atomic_mutex_array<16>) == 16 * CACHE_LINE_SIZE,
+              "one per cache line");
+
+/** Balances that are protected by the stripes of an array */
+static uint64_t accounts[N_ACCOUNTS];
+
+static atomic_mutex_array<N_STRIPES> m;
+static atomic_shared_mutex_array<N_STRIPES, sizeof(atomic_shared_mutex<>)>
+  sux;
+
+/** @return a pseudo-random account number */
+static size_t next(uint64_t &seed)
+{
+  seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return size_t(seed >> 33) % N_ACCOUNTS;
+}
+
+/** Move money between accounts, holding the stripes of all of them */
+template<typename Array>
+static void transfer(Array &a, size_t *stripes, const size_t *acct)
+{
+  stripes[0] = a.index(uint64_t(acct[0]));
+  stripes[1] = a.index(uint64_t(acct[1]));
+  stripes[2] = a.index(&accounts[acct[2]]);
+  stripes[3] = a.index(&accounts[acct[3]]);
+  /* Acquire the stripes of the keys and the addresses */
+  size_t n = a.lock(stripes, 4);
+  assert(n >= 1 && n <= 4);
+  for (size_t i = 1; i < n; i++)
+    assert(stripes[i - 1] < stripes[i]);
+  accounts[acct[0]]--;
+  accounts[acct[1]]++;
+  a.unlock(stripes, n);
+}
+
+static void test_mutex_array()
+{
+  uint64_t seed = uint64_t(uintptr_t(&seed));
+  size_t stripes[4], acct[4];
+  for (auto i = N_ROUNDS; i--; )
+  {
+    acct[0] = acct[2] = next(seed);
+    acct[1] = acct[3] = next(seed);
+    transfer(m, stripes, acct);
+  }
+}
+
+static void test_shared_mutex_array()
+{
+  uint64_t seed = uint64_t(uintptr_t(&seed));
+  size_t stripes[N_STRIPES], acct[4];
+  for (auto i = N_ROUNDS; i--; )
+  {
+    acct[0] = acct[2] = next(seed);
+    acct[1] = acct[3] = next(seed);
+    switch (i % 3)
+    {
+    case 0:
+      transfer(sux, stripes, acct);
+      break;
+    case 1:
+      {
+        /* Read the total, holding all stripes in shared mode */
+        for (size_t s = N_STRIPES; s--; )
+          stripes[s] = s;
+        size_t n = sux.lock_shared(stripes, N_STRIPES);
+        assert(n == N_STRIPES);
+        uint64_t sum = 0;
+        for (auto a : accounts)
+          sum += a;
+        assert(!sum);
+        sux.unlock_shared(stripes, n);
+      }
+      break;
+    case 2:
+      {
+        /* Update locks exclude the other writers */
+        stripes[0] = sux.index(uint64_t(acct[0]));
+        stripes[1] = sux.index(uint64_t(acct[1]));
+        size_t n = sux.lock_update(stripes, 2);
+        const uint64_t a0 = accounts[acct[0]], a1 = accounts[acct[1]];
+        std::this_thread::yield();
+        if (a0 != accounts[acct[0]] || a1 != accounts[acct[1]])
+          assert(!"modified");
+        sux.unlock_update(stripes, n);
+      }
+    }
+  }
+}
+
+int main(int, char **)
+{
+  std::thread t[N_THREADS];
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_mutex_array);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  for (size_t i = 0; i < N_STRIPES; i++)
+    assert(!m[i].get_storage().is_locked_or_waiting());
+
+  uint64_t sum = 0;
+  for (auto a : accounts)
+    sum += a;
+  assert(!sum);
+
+  fputs("atomic_mutex_array", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_shared_mutex_array);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  for (size_t i = 0; i < N_STRIPES; i++)
+    assert(!sux[i].get_storage().is_locked_or_waiting());
+
+  for (auto a : accounts)
+    sum += a;
+  assert(!sum);
+
+  fputs(", atomic_shared_mutex_array.\n", stderr);
+  return 0;
+}
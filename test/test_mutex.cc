@@ -26,13 +26,35 @@ static void test_atomic_mutex()
   }
 }
 
-#if defined WITH_SPINLOOP && defined SPINLOOP
+static atomic_mutex<queued_mutex_storage<>> q_m;
+
+static void test_queued_mutex()
+{
+  for (auto i = N_ROUNDS; i; i--)
+  {
+    if (i & 1)
+      q_m.lock();
+    else
+      q_m.spin_lock();
+    assert(!critical);
+    critical = true;
+    critical = false;
+    q_m.unlock();
+  }
+}
+
+#ifdef WITH_SPINLOOP
+# ifdef SPINLOOP
+#  define SPIN_ROUNDS SPINLOOP
+# else
+#  define SPIN_ROUNDS /* default_spin_rounds() */
+# endif
 /** Like atomic_mutex, but with a spinloop in lock() */
 template<typename storage = mutex_storage<>>
 class atomic_spin_mutex : public atomic_mutex<storage>
 {
 public:
-  void lock() noexcept { atomic_mutex<storage>::spin_lock(SPINLOOP); }
+  void lock() noexcept { atomic_mutex<storage>::spin_lock(SPIN_ROUNDS); }
 };
 
 static atomic_spin_mutex<> a_sm;
@@ -90,7 +112,15 @@ int main(int argc, char **argv)
   for (auto i = N_THREADS; i--; )
     t[i].join();
 
-#if defined WITH_SPINLOOP && defined SPINLOOP
+  const auto start_queued_mutex = std::chrono::steady_clock::now();
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_queued_mutex);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!q_m.get_storage().is_locked_or_waiting());
+
+#ifdef WITH_SPINLOOP
   const auto start_atomic_spin_mutex = std::chrono::steady_clock::now();
 
   for (auto i = N_THREADS; i--; )
@@ -107,14 +137,17 @@ int main(int argc, char **argv)
 
   const auto start_output = std::chrono::steady_clock::now();
   using duration = std::chrono::duration<double>;
-#if defined WITH_SPINLOOP && defined SPINLOOP
-  fprintf(stderr, "atomic_mutex: %lfs, atomic_spin_mutex: %lfs, mutex: %lfs\n",
-          duration{start_atomic_spin_mutex - start_atomic_mutex}.count(),
+#ifdef WITH_SPINLOOP
+  fprintf(stderr, "atomic_mutex: %lfs, queued_mutex: %lfs, "
+          "atomic_spin_mutex: %lfs, mutex: %lfs\n",
+          duration{start_queued_mutex - start_atomic_mutex}.count(),
+          duration{start_atomic_spin_mutex - start_queued_mutex}.count(),
           duration{start_mutex - start_atomic_spin_mutex}.count(),
           duration{start_output - start_mutex}.count());
 #else
-  fprintf(stderr, "atomic_mutex: %lfs, mutex: %lfs\n",
-          duration{start_mutex - start_atomic_mutex}.count(),
+  fprintf(stderr, "atomic_mutex: %lfs, queued_mutex: %lfs, mutex: %lfs\n",
+          duration{start_queued_mutex - start_atomic_mutex}.count(),
+          duration{start_mutex - start_queued_mutex}.count(),
           duration{start_output - start_mutex}.count());
 #endif
 
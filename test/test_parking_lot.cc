@@ -0,0 +1,205 @@
+#include <cstdio>
+#include <thread>
+#include <cassert>
+#include <chrono>
+#include <mutex>
+#include "atomic_condition_variable.h"
+#include "parking_lot.h"
+
+typedef atomic_mutex<parked_mutex_storage<>> parked_mutex;
+typedef atomic_shared_mutex<parked_shared_mutex_storage<>>
+  parked_shared_mutex;
+
+/** A structure whose padding byte holds a lock */
+struct record
+{
+  uint32_t key;
+  uint16_t value;
+  parked_mutex m;
+};
+
+static_assert(sizeof(parked_mutex) == 1, "compatibility");
+static_assert(sizeof(parked_shared_mutex) == 4, "compatibility");
+static_assert(sizeof(record) == 8, "compatibility");
+
+static record r;
+static parked_shared_mutex sux;
+static bool critical;
+
+constexpr unsigned N_THREADS = 8;
+constexpr unsigned N_ROUNDS = 10000;
+/** Number of threads that will make the parking lot grow */
+constexpr unsigned N_MANY = 64;
+
+static atomic_condition_variable cv;
+static unsigned waiting;
+static bool ready;
+
+static void test_parked_mutex()
+{
+  for (auto i = N_ROUNDS; i--; )
+  {
+    switch (i % 4) {
+    case 0:
+      if (!r.m.try_lock())
+        continue;
+      break;
+    case 1:
+      if (!r.m.try_lock_for(std::chrono::microseconds(100)))
+        continue;
+      break;
+    case 2:
+      r.m.spin_lock();
+      break;
+    default:
+      r.m.lock();
+    }
+    assert(!critical);
+    critical = true;
+    r.value++;
+    critical = false;
+    r.m.unlock();
+  }
+}
+
+static void test_parked_shared_mutex()
+{
+  for (auto i = N_ROUNDS; i--; )
+  {
+    switch (i % 4) {
+    case 0:
+      sux.lock();
+      assert(!critical);
+      critical = true;
+      r.key++;
+      critical = false;
+      sux.unlock();
+      break;
+    case 1:
+      if (!sux.try_lock_for(std::chrono::microseconds(100)))
+        break;
+      assert(!critical);
+      critical = true;
+      r.key++;
+      critical = false;
+      sux.unlock();
+      break;
+    case 2:
+      if (!sux.try_lock_shared_for(std::chrono::microseconds(100)))
+        break;
+      assert(!critical);
+      sux.unlock_shared();
+      break;
+    default:
+      sux.lock_shared();
+      assert(!critical);
+      sux.unlock_shared();
+    }
+  }
+}
+
+static void test_condition()
+{
+  std::lock_guard<parked_mutex> g{r.m};
+  waiting++;
+  while (!ready)
+    cv.wait(r.m);
+}
+
+static bool always(const void*) noexcept { return true; }
+static bool never(const void*) noexcept { return false; }
+
+int main(int, char **)
+{
+  /* An idle parking lot */
+  assert(!parking_lot_park(&r, never, nullptr));
+  assert(!parking_lot_park(&r, always, nullptr,
+                           std::chrono::steady_clock::now() +
+                           std::chrono::milliseconds(1)));
+  assert(!parking_lot_unpark_one(&r));
+  assert(!parking_lot_unpark_all(&r));
+
+  {
+    /* Threads that are parked on adjacent bytes are distinct. */
+    const char *addr = reinterpret_cast<const char*>(&r);
+    std::thread t[2];
+    for (unsigned i = 2; i--; )
+      t[i] = std::thread([addr, i]
+                         { while (!parking_lot_park(addr + i, always,
+                                                    nullptr)); });
+    while (!parking_lot_unpark_one(addr + 1))
+      std::this_thread::yield();
+    t[1].join();
+    while (!parking_lot_unpark_all(addr))
+      std::this_thread::yield();
+    t[0].join();
+  }
+
+  fputs("parking_lot", stderr);
+
+  assert(!r.m.get_storage().is_locked_or_waiting());
+  r.m.lock();
+  assert(r.m.get_storage().is_locked_not_waiting());
+  {
+    /* A blocked lock() will set the PARKED flag. */
+    std::thread t([]{ r.m.lock(); r.m.unlock(); });
+    while (r.m.get_storage().is_locked_not_waiting())
+      std::this_thread::yield();
+    assert(r.m.get_storage().is_locked());
+    r.m.unlock();
+    t.join();
+  }
+  assert(!r.m.get_storage().is_locked_or_waiting());
+
+  r.m.lock();
+  std::thread(
+    []{ assert(!r.m.try_lock_for(std::chrono::milliseconds(1))); }).join();
+  r.m.unlock();
+  std::thread([]{
+    assert(r.m.try_lock_for(std::chrono::milliseconds(1)));
+    r.m.unlock();
+  }).join();
+
+  std::thread t[N_MANY];
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_parked_mutex);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!r.m.get_storage().is_locked_or_waiting());
+
+  fputs(", parked_mutex_storage", stderr);
+
+  sux.lock_shared();
+  std::thread(
+    []{ assert(!sux.try_lock_for(std::chrono::milliseconds(1))); }).join();
+  sux.unlock_shared();
+  assert(!sux.get_storage().is_locked_or_waiting());
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_parked_shared_mutex);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!sux.get_storage().is_locked_or_waiting());
+
+  fputs(", parked_shared_mutex_storage", stderr);
+
+  for (auto i = N_MANY; i--; )
+    t[i] = std::thread(test_condition);
+  for (;;)
+  {
+    std::lock_guard<parked_mutex> g{r.m};
+    if (waiting == N_MANY)
+    {
+      ready = true;
+      cv.broadcast(r.m);
+      break;
+    }
+  }
+  for (auto i = N_MANY; i--; )
+    t[i].join();
+  assert(!r.m.get_storage().is_locked_or_waiting());
+  assert(!cv.is_waiting());
+
+  fputs(", broadcast(m).\n", stderr);
+  return 0;
+}
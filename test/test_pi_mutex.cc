@@ -0,0 +1,107 @@
+#include <cstdio>
+#include <thread>
+#include <cassert>
+#include <chrono>
+#include <mutex>
+#include "atomic_condition_variable.h"
+
+static bool critical;
+
+constexpr unsigned N_THREADS = 8;
+constexpr unsigned N_ROUNDS = 10000;
+
+static atomic_mutex<pi_mutex_storage<>> m;
+static atomic_condition_variable cv;
+static unsigned waiting;
+static bool ready;
+
+static void test_pi_mutex()
+{
+  for (auto i = N_ROUNDS; i--; )
+  {
+    switch (i % 4) {
+    case 0:
+      if (!m.try_lock())
+        continue;
+      break;
+    case 1:
+      if (!m.try_lock_for(std::chrono::microseconds(100)))
+        continue;
+      break;
+    case 2:
+      m.spin_lock();
+      break;
+    default:
+      m.lock();
+    }
+    assert(!critical);
+    critical = true;
+    critical = false;
+    m.unlock();
+  }
+}
+
+static void test_condition()
+{
+  std::lock_guard<atomic_mutex<pi_mutex_storage<>>> g{m};
+  waiting++;
+  while (!ready)
+    cv.wait(m);
+}
+
+int main(int, char **)
+{
+  assert(!m.get_storage().is_locked_or_waiting());
+  m.lock();
+  assert(m.get_storage().is_locked_not_waiting());
+
+  {
+    /* A blocked lock() will set the WAITERS flag in the kernel. */
+    std::thread t([]{ m.lock(); m.unlock(); });
+    while (m.get_storage().is_locked_not_waiting())
+      std::this_thread::yield();
+    assert(m.get_storage().is_locked());
+    m.unlock();
+    t.join();
+  }
+  assert(!m.get_storage().is_locked_or_waiting());
+
+  m.lock();
+  std::thread(
+    []{ assert(!m.try_lock_for(std::chrono::milliseconds(1))); }).join();
+  m.unlock();
+  std::thread(
+    []{ assert(m.try_lock_for(std::chrono::milliseconds(1))); m.unlock(); })
+    .join();
+
+  fputs("pi_mutex_storage", stderr);
+
+  std::thread t[N_THREADS];
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_pi_mutex);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!m.get_storage().is_locked_or_waiting());
+
+  fputs(", contention", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_condition);
+  for (;;)
+  {
+    std::lock_guard<atomic_mutex<pi_mutex_storage<>>> g{m};
+    if (waiting == N_THREADS)
+    {
+      ready = true;
+      cv.broadcast(m);
+      break;
+    }
+  }
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!m.get_storage().is_locked_or_waiting());
+  assert(!cv.is_waiting());
+
+  fputs(", broadcast(m).\n", stderr);
+  return 0;
+}
@@ -0,0 +1,183 @@
+#include <cstdio>
+#include <cassert>
+#include <new>
+#include "atomic_condition_variable.h"
+#include "atomic_shared_mutex.h"
+#ifdef _WIN32
+# include <thread>
+#else
+# include <sys/mman.h>
+# include <sys/wait.h>
+# include <unistd.h>
+#endif
+
+constexpr unsigned N_PROCESSES = 4;
+constexpr unsigned N_ROUNDS = 10000;
+constexpr unsigned N_BARRIERS = 100;
+
+typedef mutex_storage<uint32_t, pause_backoff, true> mutex_s;
+typedef shared_mutex_storage<uint32_t, pause_backoff, true> sux_s;
+typedef batched_shared_mutex_storage<uint32_t, pause_backoff, true> b_sux_s;
+
+/** The objects that are shared between the processes */
+struct shared_state
+{
+  atomic_mutex<mutex_s> m;
+  atomic_shared_mutex<sux_s> sux;
+  atomic_shared_mutex<b_sux_s> b_sux;
+  atomic_process_shared_condition_variable cv;
+  /** number of processes that have arrived at the barrier; protected by m */
+  unsigned arrived;
+  /** number of completed barriers; protected by m */
+  unsigned generation;
+  /** number of completed critical sections */
+  unsigned count;
+  bool critical;
+};
+
+static shared_state *s;
+
+static void test_mutex()
+{
+  for (auto i = N_ROUNDS; i--; )
+  {
+    switch (i % 3) {
+    case 0:
+      if (!s->m.try_lock_for(std::chrono::microseconds(100)))
+        continue;
+      break;
+    case 1:
+      s->m.spin_lock();
+      break;
+    default:
+      s->m.lock();
+    }
+    assert(!s->critical);
+    s->critical = true;
+    s->count++;
+    s->critical = false;
+    s->m.unlock();
+  }
+}
+
+template<typename Mutex>
+static void test_shared_mutex(Mutex &sux)
+{
+  for (auto i = N_ROUNDS; i--; )
+  {
+    switch (i % 4) {
+    case 0:
+      sux.lock_shared();
+      assert(!s->critical);
+      sux.unlock_shared();
+      break;
+    case 1:
+      sux.lock_update();
+      assert(!s->critical);
+      sux.update_lock_upgrade();
+      assert(!s->critical);
+      s->critical = true;
+      s->critical = false;
+      sux.unlock();
+      break;
+    case 2:
+      if (!sux.try_lock_for(std::chrono::microseconds(100)))
+        break;
+      assert(!s->critical);
+      s->critical = true;
+      s->critical = false;
+      sux.unlock();
+      break;
+    default:
+      sux.lock();
+      assert(!s->critical);
+      s->critical = true;
+      s->critical = false;
+      sux.unlock();
+    }
+  }
+}
+
+/** Wait for all processes to arrive, by broadcast(m) or broadcast() */
+static void test_barrier()
+{
+  for (unsigned i = 0; i < N_BARRIERS; i++)
+  {
+    s->m.lock();
+    if (++s->arrived == N_PROCESSES)
+    {
+      s->arrived = 0;
+      s->generation++;
+      if (i & 1)
+        s->cv.broadcast(s->m);
+      else
+        s->cv.broadcast();
+    }
+    else
+      while (s->generation == i)
+        if (i % 4 == 3)
+          s->cv.wait_for(s->m, std::chrono::milliseconds(1));
+        else
+          s->cv.wait(s->m);
+    s->m.unlock();
+  }
+}
+
+static void test_process()
+{
+  test_mutex();
+  test_shared_mutex(s->sux);
+  test_shared_mutex(s->b_sux);
+  test_barrier();
+}
+
+int main(int, char **)
+{
+#ifdef _WIN32
+  /* There is no fork(); the process-shared primitives will be polled
+  by threads. */
+  s = new shared_state();
+  std::thread t[N_PROCESSES];
+  for (auto i = N_PROCESSES; i--; )
+    t[i] = std::thread(test_process);
+  for (auto i = N_PROCESSES; i--; )
+    t[i].join();
+#else
+  void *p = mmap(nullptr, sizeof *s, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  assert(p != MAP_FAILED);
+  s = new (p) shared_state();
+
+  pid_t pid[N_PROCESSES];
+  for (auto i = N_PROCESSES; i--; )
+  {
+    pid[i] = fork();
+    assert(pid[i] >= 0);
+    if (!pid[i])
+    {
+      test_process();
+      _exit(0);
+    }
+  }
+  for (auto i = N_PROCESSES; i--; )
+  {
+    int status;
+    if (waitpid(pid[i], &status, 0) != pid[i] ||
+        !WIFEXITED(status) || WEXITSTATUS(status))
+      return 1;
+  }
+#endif
+
+  assert(!s->m.get_storage().is_locked_or_waiting());
+  assert(!s->sux.get_storage().is_locked_or_waiting());
+  assert(!s->b_sux.get_storage().is_locked_or_waiting());
+  assert(!s->cv.is_waiting());
+  assert(s->arrived == 0);
+  assert(s->generation == N_BARRIERS);
+  assert(s->count >= N_PROCESSES * (N_ROUNDS - (N_ROUNDS + 2) / 3));
+  assert(s->count <= N_PROCESSES * N_ROUNDS);
+  fprintf(stderr, "process-shared atomic_mutex, atomic_shared_mutex, "
+          "atomic_condition_variable: %u processes, %u critical sections.\n",
+          N_PROCESSES, s->count);
+  return 0;
+}
@@ -0,0 +1,171 @@
+#include <cstdio>
+#include <thread>
+#include <chrono>
+#include <cassert>
+#include "profiled_mutex_storage.h"
+
+static bool critical;
+
+constexpr unsigned N_THREADS = 8;
+constexpr unsigned N_ROUNDS = 10000;
+
+typedef atomic_mutex<profiled_mutex_storage<>> profiled_mutex;
+typedef atomic_shared_mutex<profiled_shared_mutex_storage<>>
+  profiled_shared_mutex;
+
+static profiled_mutex m;
+static profiled_shared_mutex sux;
+
+static void test_profiled_mutex()
+{
+  for (auto i = N_ROUNDS; i--; )
+  {
+    if (i & 1)
+      m.lock();
+    else
+      m.spin_lock();
+    assert(!critical);
+    critical = true;
+    critical = false;
+    m.unlock();
+  }
+}
+
+static void test_profiled_shared_mutex()
+{
+  for (auto i = N_ROUNDS; i--; )
+  {
+    sux.lock();
+    assert(!critical);
+    critical = true;
+    critical = false;
+    sux.unlock();
+
+    sux.spin_lock_shared();
+    assert(!critical);
+    sux.unlock_shared();
+
+    sux.lock_update();
+    assert(!critical);
+    sux.update_lock_upgrade();
+    critical = true;
+    critical = false;
+    sux.update_lock_downgrade();
+    sux.unlock_update();
+  }
+}
+
+/** @return whether a snapshot accounts for all acquisitions
+@param s             the snapshot
+@param acquisitions  the number of acquisitions
+@param all_spun      whether each CONTENDED one is BLOCKED or SPUN */
+static bool check(const lock_profile::snapshot &s, uint64_t acquisitions,
+                  bool all_spun)
+{
+  const uint64_t waited =
+    s.count[lock_profile::BLOCKED] + s.count[lock_profile::SPUN];
+  if (s.count[lock_profile::UNCONTENDED] + s.count[lock_profile::CONTENDED]
+      != acquisitions ||
+      (all_spun
+       ? waited != s.count[lock_profile::CONTENDED]
+       : waited > s.count[lock_profile::CONTENDED]))
+    return false;
+  uint64_t waits = 0;
+  for (auto w : s.wait_hist)
+    waits += w;
+  return waits == s.count[lock_profile::CONTENDED];
+}
+
+static bool cancelled(const void *) { return true; }
+
+int main(int, char **)
+{
+  std::thread t[N_THREADS];
+
+  m.get_storage().set_name("m");
+  sux.get_storage().set_name("sux");
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_profiled_mutex);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!m.get_storage().is_locked_or_waiting());
+
+  fputs("profiled_mutex_storage", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_profiled_shared_mutex);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!sux.get_storage().is_locked_or_waiting());
+
+  fputs(", profiled_shared_mutex_storage", stderr);
+
+  {
+    /* The cancel-taking waits are passed through to the inner storage. */
+    profiled_mutex c;
+    profiled_shared_mutex s;
+    c.lock();
+    if (c.try_lock_until(std::chrono::steady_clock::now() +
+                         std::chrono::seconds(10), cancelled, &c))
+      assert(!"not cancelled");
+    c.notify_cancel();
+    c.notify_cancel_done();
+    c.unlock();
+    s.lock_shared();
+    if (!s.shared_lock_upgrade())
+      assert(!"interrupted");
+    s.unlock_update();
+    s.lock_shared();
+    if (!s.shared_lock_upgrade_for(std::chrono::milliseconds(1)))
+      assert(!"timed out");
+    s.update_lock_upgrade();
+    s.unlock();
+    assert(!c.get_storage().is_locked_or_waiting());
+    assert(!s.get_storage().is_locked_or_waiting());
+  }
+
+  const lock_profile *reused_profile;
+  {
+    /* This lock will be destroyed before the report. */
+    profiled_mutex unused;
+    unused.lock();
+    unused.unlock();
+    reused_profile = &unused.get_storage().get_profile();
+  }
+
+  {
+    /* The record will be reused while this thread has a pending batch
+    for the destroyed lock. */
+    profiled_mutex reused;
+    assert(&reused.get_storage().get_profile() == reused_profile);
+    reused.lock();
+    reused.unlock();
+    lock_profile::flush();
+    if (reused_profile->count[lock_profile::UNCONTENDED] != 1)
+      assert(!"reused");
+  }
+
+  /* The threads flushed their counts on exit. */
+  const auto top = lock_profile::top(2);
+  assert(top.size() == 2);
+  for (const auto &s : top)
+  {
+    if (s.name == "m")
+    {
+      if (!check(s, N_THREADS * N_ROUNDS, true))
+        assert(!"m");
+    }
+    else if (s.name == "sux")
+    {
+      if (!check(s, 3 * N_THREADS * N_ROUNDS, false))
+        assert(!"sux");
+    }
+    else
+      assert(!"unexpected lock");
+  }
+
+  fputs(".\n", stderr);
+  lock_profile::dump(stderr, 2);
+  return 0;
+}
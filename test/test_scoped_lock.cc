@@ -0,0 +1,194 @@
+#include <cstdio>
+#include <thread>
+#include <cassert>
+#include "atomic_scoped_lock.h"
+#include "atomic_lock_array.h"
+
+constexpr unsigned N_THREADS = 8;
+constexpr unsigned N_ROUNDS = 10000;
+constexpr unsigned N_ACCOUNTS = 16;
+constexpr unsigned BALANCE = 1000;
+
+/** An account of a ledger */
+struct account
+{
+  atomic_mutex<> m;
+  unsigned balance;
+};
+
+static account accounts[N_ACCOUNTS];
+
+/** A record that is guarded by an atomic_shared_mutex */
+struct record
+{
+  atomic_shared_mutex<> m;
+  unsigned value;
+};
+
+static record records[2];
+static atomic_shared_mutex_array<64> stripes;
+static unsigned striped[64];
+
+/** @return a pseudo-random number */
+static unsigned lcg(unsigned &seed)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+TRANSACTIONAL_TARGET static void transfer(unsigned id)
+{
+  unsigned seed = id;
+  for (unsigned i = 0; i < N_ROUNDS; i++)
+  {
+    /* The accounts may be equal. */
+    account &from = accounts[lcg(seed) % N_ACCOUNTS];
+    account &to = accounts[lcg(seed) % N_ACCOUNTS];
+    unsigned amount = lcg(seed) % 16;
+
+    if (i & 1)
+    {
+      atomic_scoped_lock<2> g{from.m, to.m};
+      if (from.balance < amount)
+        amount = from.balance;
+      from.balance -= amount;
+      to.balance += amount;
+    }
+    else
+    {
+      transactional_scoped_lock<2> g{from.m, to.m};
+      if (from.balance < amount)
+        amount = from.balance;
+      from.balance -= amount;
+      to.balance += amount;
+    }
+  }
+}
+
+TRANSACTIONAL_TARGET static void mixed(unsigned id)
+{
+  for (unsigned i = 0; i < N_ROUNDS; i++)
+  {
+    record &s = records[(i + id) & 1];
+    record &x = records[(i + id + 1) & 1];
+    switch (i % 3) {
+    case 0:
+    {
+      /* Copy s to x while holding S on s and X on x. */
+      atomic_scoped_lock<2> g{lock_request::shared(s.m), x.m};
+      x.value = s.value + 1;
+      break;
+    }
+    case 1:
+    {
+      /* The U lock supersedes the S lock on the same mutex. */
+      transactional_scoped_lock<3> g{lock_request::shared(s.m),
+                                     lock_request::update(s.m),
+                                     lock_request::shared(x.m)};
+      (void) (s.value + x.value);
+      break;
+    }
+    default:
+    {
+      atomic_scoped_lock<2> g{lock_request::shared(s.m),
+                              lock_request::shared(x.m)};
+      (void) (s.value + x.value);
+    }
+    }
+  }
+}
+
+static void striped_lock(unsigned id)
+{
+  unsigned seed = id;
+  for (unsigned i = 0; i < N_ROUNDS; i++)
+  {
+    size_t idx[4];
+    lock_request r[4];
+    for (unsigned j = 0; j < 4; j++)
+    {
+      idx[j] = lcg(seed) % 16;
+      r[j] = lock_request::exclusive(stripes[idx[j]]);
+    }
+    /* The index order of the stripes is consistent with lock_all(). */
+    if (i & 1)
+    {
+      const size_t n = lock_all(r, 4);
+      for (unsigned j = 0; j < 4; j++)
+        striped[idx[j]]++;
+      unlock_all(r, n);
+    }
+    else
+    {
+      const size_t n = stripes.lock(idx, 4);
+      for (unsigned j = 0; j < n; j++)
+        striped[idx[j]]++;
+      stripes.unlock(idx, n);
+    }
+  }
+}
+
+int main(int, char **)
+{
+  {
+    lock_request r[] = {
+      lock_request::shared(records[1].m),
+      lock_request::exclusive(records[0].m),
+      lock_request::update(records[1].m),
+      lock_request::shared(records[0].m)
+    };
+    const size_t n = lock_all(r, 4);
+    assert(n == 2);
+    assert(r[0].get() < r[1].get());
+    assert(r[0].get() == &records[0].m);
+    assert(r[0].get_mode() == lock_request::EXCLUSIVE);
+    assert(r[1].get_mode() == lock_request::UPDATE);
+    assert(records[0].m.get_storage().is_locked());
+    assert(!records[1].m.get_storage().is_locked());
+    assert(records[1].m.get_storage().is_locked_or_waiting());
+    assert(!records[1].m.try_lock_update());
+    assert(records[1].m.try_lock_shared());
+    records[1].m.unlock_shared();
+    unlock_all(r, n);
+    assert(!records[0].m.get_storage().is_locked_or_waiting());
+    assert(!records[1].m.get_storage().is_locked_or_waiting());
+  }
+
+  for (auto &a : accounts)
+    a.balance = BALANCE;
+
+  std::thread t[N_THREADS];
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(transfer, i);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+
+  unsigned total = 0;
+  for (auto &a : accounts)
+  {
+    assert(!a.m.get_storage().is_locked_or_waiting());
+    total += a.balance;
+  }
+  assert(total == N_ACCOUNTS * BALANCE);
+
+  fputs("atomic_scoped_lock", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(mixed, i);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  for (auto &r : records)
+    assert(!r.m.get_storage().is_locked_or_waiting());
+
+  fputs(", mixed modes", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(striped_lock, i);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  for (size_t i = 0; i < stripes.size(); i++)
+    assert(!stripes[i].get_storage().is_locked_or_waiting());
+
+  fputs(", lock_all.\n", stderr);
+  return 0;
+}
@@ -0,0 +1,170 @@
+#include <cstdio>
+#include <thread>
+#include <cassert>
+#include "atomic_semaphore.h"
+
+constexpr unsigned N_THREADS = 8;
+constexpr unsigned N_ROUNDS = 10000;
+constexpr unsigned N_PHASES = 1000;
+constexpr unsigned N_UNITS = 3;
+
+static atomic_semaphore binary{1};
+static atomic_semaphore pool{N_UNITS};
+static bool critical;
+static unsigned counter;
+static std::atomic<unsigned> in_use;
+
+static void test_semaphore(unsigned id)
+{
+  for (unsigned i = 0; i < N_ROUNDS; i++)
+  {
+    if ((i + id) & 1)
+      binary.acquire();
+    else
+      while (!binary.try_acquire_for(std::chrono::milliseconds(1)));
+    assert(!critical);
+    critical = true;
+    counter++;
+    critical = false;
+    binary.release();
+
+    pool.acquire();
+    const unsigned n = in_use.fetch_add(1, std::memory_order_relaxed);
+    assert(n < N_UNITS);
+    (void) n;
+    in_use.fetch_sub(1, std::memory_order_relaxed);
+    pool.release();
+  }
+}
+
+static atomic_latch latch{N_THREADS};
+static unsigned arrived[N_THREADS];
+
+static void test_latch(unsigned id)
+{
+  arrived[id] = id + 1;
+  if (id & 1)
+    latch.arrive_and_wait();
+  else
+  {
+    latch.count_down();
+    latch.wait();
+  }
+  assert(latch.try_wait());
+  for (unsigned i = 0; i < N_THREADS; i++)
+    assert(arrived[i] == i + 1);
+}
+
+/** per-thread counters of completed phases */
+static unsigned phases[N_THREADS];
+
+/** The completion step, which checks that every participant arrived */
+struct check_phase
+{
+  unsigned *completed;
+  unsigned participants;
+  void operator()() noexcept
+  {
+    const unsigned phase = (*completed)++;
+    unsigned n = 0;
+    for (unsigned p : phases)
+      n += p > phase;
+    assert(n == participants);
+    (void) n;
+  }
+};
+
+static unsigned completed;
+static atomic_barrier<check_phase> barrier{N_THREADS,
+                                           check_phase{&completed, N_THREADS}};
+static_assert(sizeof(atomic_barrier<>) == 4, "compatibility");
+
+static void test_barrier(unsigned id)
+{
+  for (unsigned i = 0; i < N_PHASES; i++)
+  {
+    phases[id]++;
+    if (i & 1)
+      barrier.arrive_and_wait();
+    else
+      barrier.wait(barrier.arrive());
+    assert(completed > i);
+  }
+}
+
+static atomic_barrier<> dropping{N_THREADS};
+static std::atomic<unsigned> dropped;
+
+static void test_drop(unsigned id)
+{
+  /* Thread id participates in id + 1 phases. */
+  for (unsigned i = 0; i < id; i++)
+    dropping.arrive_and_wait();
+  dropping.arrive_and_drop();
+  dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+int main(int, char **)
+{
+  static_assert(sizeof binary == 4, "compatibility");
+  static_assert(sizeof latch == 4, "compatibility");
+
+  {
+    atomic_semaphore s;
+    assert(!s.try_acquire());
+    assert(!s.try_acquire_for(std::chrono::milliseconds(1)));
+    assert(!s.is_waiting());
+    s.release(2);
+    assert(s.try_acquire());
+    assert(s.try_acquire_until(std::chrono::steady_clock::now()));
+    assert(!s.try_acquire());
+
+    std::thread t([&s]{ s.acquire(); });
+    while (!s.is_waiting())
+      std::this_thread::yield();
+    s.release();
+    t.join();
+    assert(!s.is_waiting());
+    assert(!s.try_acquire());
+  }
+
+  std::thread t[N_THREADS];
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_semaphore, i);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(counter == N_THREADS * N_ROUNDS);
+  assert(!binary.is_waiting());
+  assert(!pool.is_waiting());
+  for (auto i = N_UNITS; i--; )
+    assert(pool.try_acquire());
+  assert(!pool.try_acquire());
+
+  fputs("atomic_semaphore", stderr);
+
+  assert(!latch.try_wait());
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_latch, i);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(latch.try_wait());
+
+  fputs(", atomic_latch", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_barrier, i);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(completed == N_PHASES);
+  assert(!barrier.is_waiting());
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_drop, i);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(dropped == N_THREADS);
+  assert(!dropping.is_waiting());
+
+  fputs(", atomic_barrier.\n", stderr);
+  return 0;
+}
@@ -0,0 +1,100 @@
+#include <cstdio>
+#include <thread>
+#include <cassert>
+#include <mutex>
+#include <chrono>
+#include "atomic_seq_mutex.h"
+
+constexpr unsigned N_READERS = 6;
+constexpr unsigned N_WRITERS = 2;
+constexpr unsigned N_ROUNDS = 10000;
+
+/** A record whose fields are updated together */
+struct snapshot
+{
+  std::atomic<uint32_t> a, b, c, d;
+};
+
+static atomic_seq_mutex<> m;
+static snapshot s;
+static std::atomic<unsigned> elided, pessimistic;
+
+static void writer()
+{
+  for (unsigned i = N_ROUNDS; i--; )
+  {
+    std::lock_guard<atomic_seq_mutex<>> g{m};
+    assert(m.is_write_locked());
+    const uint32_t v = s.a.load(std::memory_order_relaxed) + 1;
+    s.a.store(v, std::memory_order_relaxed);
+    s.b.store(v, std::memory_order_relaxed);
+    s.c.store(v, std::memory_order_relaxed);
+    s.d.store(v, std::memory_order_relaxed);
+  }
+}
+
+static void reader()
+{
+  for (unsigned i = N_ROUNDS; i--; )
+  {
+    uint32_t a, b, c, d;
+    seq_shared_lock_guard<atomic_seq_mutex<>> g{m};
+    do
+    {
+      a = s.a.load(std::memory_order_relaxed);
+      b = s.b.load(std::memory_order_relaxed);
+      /* Let a writer interfere. */
+      if (!(i % 64))
+        std::this_thread::yield();
+      c = s.c.load(std::memory_order_relaxed);
+      d = s.d.load(std::memory_order_relaxed);
+    }
+    while (!g.validate());
+    assert(a == b);
+    assert(a == c);
+    assert(a == d);
+    (g.was_elided() ? elided : pessimistic).fetch_add(1);
+  }
+}
+
+int main(int, char **)
+{
+  assert(!m.is_write_locked());
+  const uint32_t seq = m.read_begin();
+  assert(m.read_validate(seq));
+  m.lock();
+  assert(!m.read_validate(seq));
+  assert(!m.read_validate(m.read_begin()));
+  m.unlock();
+  assert(!m.read_validate(seq));
+  assert(m.read_validate(m.read_begin()));
+
+  {
+    std::thread w;
+    {
+      /* Without optimistic attempts, the shared lock blocks writers. */
+      seq_shared_lock_guard<atomic_seq_mutex<>, 0> g{m};
+      assert(!g.was_elided());
+      w = std::thread([]{ m.lock(); m.unlock(); });
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      assert(!m.is_write_locked());
+      assert(g.validate());
+    }
+    w.join();
+  }
+  assert(m.try_lock());
+  m.unlock();
+
+  std::thread t[N_READERS + N_WRITERS];
+  for (unsigned i = N_READERS + N_WRITERS; i--; )
+    t[i] = std::thread(i < N_WRITERS ? writer : reader);
+  for (unsigned i = N_READERS + N_WRITERS; i--; )
+    t[i].join();
+
+  assert(!m.get_storage().is_locked_or_waiting());
+  assert(s.a == N_WRITERS * N_ROUNDS);
+  assert(elided + pessimistic == N_READERS * N_ROUNDS);
+  fprintf(stderr, "atomic_seq_mutex: %u optimistic, %u pessimistic reads.\n",
+          elided.load(), pessimistic.load());
+  return 0;
+}
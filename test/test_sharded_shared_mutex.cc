@@ -0,0 +1,116 @@
+#include <cstdio>
+#include <thread>
+#include <chrono>
+#include <cassert>
+#include "sharded_shared_mutex_storage.h"
+
+static bool critical;
+/** number of threads that are holding a shared lock */
+static std::atomic<unsigned> readers;
+
+constexpr unsigned N_THREADS = 8;
+constexpr unsigned N_ROUNDS = 20000;
+/** one out of this many operations is exclusive */
+constexpr unsigned WRITE_RATIO = 100;
+
+typedef atomic_shared_mutex<sharded_shared_mutex_storage<>>
+  sharded_shared_mutex;
+
+static sharded_shared_mutex sux;
+
+static void test_sharded_shared_mutex(unsigned id)
+{
+  for (auto i = N_ROUNDS; i--; )
+  {
+    switch ((i + id) % WRITE_RATIO) {
+    case 0:
+      sux.lock();
+      assert(!critical);
+      assert(!readers);
+      critical = true;
+      critical = false;
+      sux.unlock();
+      break;
+    case 1:
+      sux.lock_update();
+      assert(!critical);
+      sux.update_lock_upgrade();
+      assert(!readers);
+      critical = true;
+      critical = false;
+      sux.update_lock_downgrade();
+      sux.unlock_update();
+      break;
+    case 2:
+      if (sux.try_lock_for(std::chrono::microseconds(10)))
+      {
+        assert(!critical);
+        assert(!readers);
+        sux.unlock();
+      }
+      break;
+    case 3:
+      sux.lock_shared();
+      if (sux.shared_lock_upgrade_for(std::chrono::microseconds(10)))
+      {
+        sux.update_lock_upgrade();
+        assert(!critical);
+        assert(!readers);
+        sux.unlock();
+      }
+      else
+        sux.unlock_shared();
+      break;
+    default:
+      if (i & 1)
+        sux.lock_shared();
+      else
+        sux.spin_lock_shared();
+      readers++;
+      assert(!critical);
+      readers--;
+      sux.unlock_shared();
+    }
+  }
+}
+
+int main(int, char **)
+{
+  std::thread t[N_THREADS];
+
+  assert(sux.get_storage().is_biased());
+  sux.lock_shared();
+  sux.unlock_shared();
+  sux.lock();
+  assert(!sux.get_storage().is_biased());
+  sux.unlock();
+
+  /* Make lock() take over a shared lock from the table. */
+  while (!sux.get_storage().is_biased())
+  {
+    sux.lock_shared();
+    sux.unlock_shared();
+  }
+  sux.lock_shared();
+  t[0] = std::thread([]{ sux.lock(); critical = true; sux.unlock(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  assert(!critical);
+  sux.unlock_shared();
+  t[0].join();
+  assert(critical);
+  critical = false;
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_sharded_shared_mutex, i);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!sux.get_storage().is_locked_or_waiting());
+  /* All shared locks must have been released. */
+  bool locked = sux.try_lock();
+  assert(locked);
+  sux.unlock();
+  (void) locked;
+
+  fputs("sharded_shared_mutex_storage.\n", stderr);
+  return 0;
+}
@@ -0,0 +1,176 @@
+#include <cstdio>
+#include <thread>
+#include <cassert>
+#include <chrono>
+#include <atomic>
+#include "atomic_shared_mutex.h"
+#include "parking_lot.h"
+
+static bool critical;
+
+constexpr unsigned N_THREADS = 30;
+constexpr unsigned N_ROUNDS = 1000;
+
+using std::chrono::milliseconds;
+
+static atomic_shared_mutex<> sux;
+static atomic_shared_mutex<shared_mutex_storage<uint64_t>> wide_sux;
+static atomic_shared_mutex<parked_shared_mutex_storage<>> parked_sux;
+
+template<typename SharedMutex>
+static void test_shared_lock_upgrade(SharedMutex &sux)
+{
+  for (auto i = N_ROUNDS; i--; )
+  {
+    switch (i % 4) {
+    case 0:
+      sux.lock();
+      assert(!critical);
+      critical = true;
+      critical = false;
+      sux.unlock();
+      break;
+    case 1:
+      sux.lock_update();
+      assert(!critical);
+      sux.update_lock_upgrade();
+      critical = true;
+      critical = false;
+      sux.unlock();
+      break;
+    default:
+      sux.lock_shared();
+      assert(!critical);
+      sux.shared_lock_upgrade();
+      assert(!critical);
+      if (i & 1)
+        sux.unlock_update();
+      else
+      {
+        sux.update_lock_upgrade();
+        critical = true;
+        critical = false;
+        sux.unlock();
+      }
+    }
+  }
+}
+
+template<typename SharedMutex>
+static void test(SharedMutex &sux)
+{
+  {
+    /* The upgrade waits for unlock_update() in another thread. */
+    std::atomic<bool> locked{false};
+    std::thread u([&sux, &locked]{
+      sux.lock_update();
+      locked = true;
+      std::this_thread::sleep_for(milliseconds(10));
+      sux.unlock_update();
+    });
+    while (!locked)
+      std::this_thread::yield();
+    sux.lock_shared();
+    if (!sux.shared_lock_upgrade())
+      assert(!"interrupted");
+    sux.unlock_update();
+    u.join();
+  }
+  assert(!sux.get_storage().is_locked_or_waiting());
+  /* The flag of the waiting upgrade was cleared, so that the next
+  exclusive lock will not wake up any waiters. */
+  assert(!sux.get_storage().is_upgrade_pending());
+  sux.lock();
+  sux.unlock();
+
+  {
+    /* A timed out upgrade clears its flag as well. */
+    std::atomic<bool> locked{false}, timed_out{false};
+    std::thread u([&sux, &locked, &timed_out]{
+      sux.lock_update();
+      locked = true;
+      while (!timed_out)
+        std::this_thread::yield();
+      sux.unlock_update();
+    });
+    while (!locked)
+      std::this_thread::yield();
+    sux.lock_shared();
+    if (sux.shared_lock_upgrade_for(milliseconds(1)))
+      assert(!"not timed out");
+    assert(!sux.get_storage().is_upgrade_pending());
+    sux.unlock_shared();
+    timed_out = true;
+    u.join();
+  }
+  assert(!sux.get_storage().is_locked_or_waiting());
+
+  {
+    /* The holder of the update lock requests an exclusive lock, which
+    waits for the shared lock of the blocked upgrade. */
+    std::atomic<bool> locked{false};
+    sux.lock_shared();
+    std::thread u([&sux, &locked]{
+      sux.lock_update();
+      locked = true;
+      std::this_thread::sleep_for(milliseconds(10));
+      sux.update_lock_upgrade();
+      assert(!critical);
+      critical = true;
+      critical = false;
+      sux.unlock();
+    });
+    while (!locked)
+      std::this_thread::yield();
+    if (sux.shared_lock_upgrade())
+      assert(!"not interrupted");
+    assert(!critical);
+    sux.unlock_update();
+    u.join();
+  }
+  assert(!sux.get_storage().is_locked_or_waiting());
+
+  {
+    /* Two concurrent upgrades: the winner requests an exclusive lock,
+    which waits for the shared lock of the loser. */
+    std::atomic<bool> upgraded{false};
+    sux.lock_shared();
+    std::thread w([&sux, &upgraded]{
+      sux.lock_shared();
+      if (!sux.shared_lock_upgrade())
+        assert(!"interrupted");
+      upgraded = true;
+      sux.update_lock_upgrade();
+      assert(!critical);
+      critical = true;
+      critical = false;
+      sux.unlock();
+    });
+    while (!upgraded)
+      std::this_thread::yield();
+    if (sux.shared_lock_upgrade())
+      assert(!"not interrupted");
+    assert(!critical);
+    sux.unlock_update();
+    w.join();
+  }
+  assert(!sux.get_storage().is_locked_or_waiting());
+
+  std::thread t[N_THREADS];
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_shared_lock_upgrade<SharedMutex>, std::ref(sux));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!sux.get_storage().is_locked_or_waiting());
+}
+
+int main(int, char **)
+{
+  test(sux);
+  fputs("atomic_shared_mutex", stderr);
+  test(wide_sux);
+  fputs(", atomic_shared_mutex<shared_mutex_storage<uint64_t>>", stderr);
+  test(parked_sux);
+  fputs(", atomic_shared_mutex<parked_shared_mutex_storage>\n", stderr);
+  return 0;
+}
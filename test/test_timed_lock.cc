@@ -0,0 +1,267 @@
+#include <cstdio>
+#include <thread>
+#include <cassert>
+#include <chrono>
+#include "atomic_mutex.h"
+#include "atomic_shared_mutex.h"
+#include "atomic_condition_variable.h"
+
+static bool critical;
+
+constexpr unsigned N_THREADS = 30;
+constexpr unsigned N_ROUNDS = 1000;
+
+using std::chrono::steady_clock;
+using std::chrono::milliseconds;
+using std::chrono::microseconds;
+
+static atomic_mutex<> m;
+static atomic_mutex<mutex_storage<uint16_t>> compact_m;
+static atomic_mutex<queued_mutex_storage<>> q_m;
+static atomic_shared_mutex<> sux;
+static atomic_shared_mutex<batched_shared_mutex_storage<>> batched_sux;
+static atomic_shared_mutex<shared_mutex_storage<uint64_t>> wide_sux;
+static atomic_condition_variable cv;
+
+template<typename Mutex>
+static void test_atomic_mutex(Mutex &m)
+{
+  for (auto i = N_ROUNDS; i--; )
+  {
+    if (!m.try_lock_for(microseconds(100)))
+      continue;
+    assert(!critical);
+    critical = true;
+    critical = false;
+    m.unlock();
+  }
+}
+
+static void test_queued_mutex()
+{
+  for (auto i = N_ROUNDS; i--; )
+  {
+    if (i & 1)
+      q_m.lock();
+    else if (!q_m.try_lock_for(microseconds(100)))
+      continue;
+    assert(!critical);
+    critical = true;
+    critical = false;
+    q_m.unlock();
+  }
+}
+
+template<typename SharedMutex>
+static void test_shared_mutex(SharedMutex &sux)
+{
+  for (auto i = N_ROUNDS; i--; )
+  {
+    if (sux.try_lock_for(microseconds(100)))
+    {
+      assert(!critical);
+      critical = true;
+      critical = false;
+      sux.unlock();
+    }
+    if (sux.try_lock_shared_for(microseconds(100)))
+    {
+      assert(!critical);
+      sux.unlock_shared();
+    }
+    if (sux.try_lock_update_until(steady_clock::now() + microseconds(100)))
+    {
+      assert(!critical);
+      sux.update_lock_upgrade();
+      critical = true;
+      critical = false;
+      sux.update_lock_downgrade();
+      sux.unlock_update();
+    }
+    sux.lock_shared();
+    if (sux.shared_lock_upgrade_for(microseconds(100)))
+    {
+      assert(!critical);
+      sux.update_lock_upgrade();
+      critical = true;
+      critical = false;
+      sux.unlock();
+    }
+    else
+      sux.unlock_shared();
+  }
+}
+
+/** Check that a timed acquisition fails after the timeout. */
+template<typename F>
+static void expect_timeout(F try_lock)
+{
+  const auto start = steady_clock::now();
+  std::thread t([&try_lock]{ if (try_lock()) assert(!"acquired"); });
+  t.join();
+  if (steady_clock::now() - start < milliseconds(10))
+    assert(!"premature timeout");
+}
+
+int main(int, char **)
+{
+  std::thread t[N_THREADS];
+
+  m.lock();
+  expect_timeout([]{ return m.try_lock_for(milliseconds(10)); });
+  m.unlock();
+  assert(!m.get_storage().is_locked_or_waiting());
+  if (m.try_lock_until(std::chrono::system_clock::now() + milliseconds(1)))
+    m.unlock();
+  else
+    assert(!"timeout");
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_atomic_mutex<atomic_mutex<>>, std::ref(m));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!m.get_storage().is_locked_or_waiting());
+
+  fputs("atomic_mutex", stderr);
+
+  compact_m.lock();
+  expect_timeout([]{ return compact_m.try_lock_for(milliseconds(10)); });
+  compact_m.unlock();
+  assert(!compact_m.get_storage().is_locked_or_waiting());
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_atomic_mutex<decltype(compact_m)>,
+                       std::ref(compact_m));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!compact_m.get_storage().is_locked_or_waiting());
+
+  fputs(", atomic_mutex<mutex_storage<uint16_t>>", stderr);
+
+  q_m.lock();
+  expect_timeout([]{ return q_m.try_lock_for(milliseconds(10)); });
+  q_m.unlock();
+  assert(!q_m.get_storage().is_locked_or_waiting());
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_queued_mutex);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!q_m.get_storage().is_locked_or_waiting());
+
+  fputs(", atomic_mutex<queued_mutex_storage>", stderr);
+
+  sux.lock();
+  expect_timeout([]{ return sux.try_lock_shared_for(milliseconds(10)); });
+  expect_timeout([]{ return sux.try_lock_update_for(milliseconds(10)); });
+  sux.unlock();
+  sux.lock_shared();
+  /* The withdrawn X lock request must not block further S locks. */
+  expect_timeout([]{ return sux.try_lock_for(milliseconds(10)); });
+  if (sux.try_lock_shared())
+    sux.unlock_shared();
+  else
+    assert(!"blocked");
+  sux.unlock_shared();
+  assert(!sux.get_storage().is_locked_or_waiting());
+
+  {
+    /* The update lock is held by another thread. */
+    std::atomic<unsigned> state{0};
+    std::thread u([&state]{
+      sux.lock_update();
+      state = 1;
+      while (state == 1)
+        std::this_thread::yield();
+      sux.unlock_update();
+    });
+    while (!state)
+      std::this_thread::yield();
+    sux.lock_shared();
+    const auto start = steady_clock::now();
+    if (sux.shared_lock_upgrade_for(milliseconds(10)))
+      assert(!"acquired");
+    if (steady_clock::now() - start < milliseconds(10))
+      assert(!"premature timeout");
+    state = 2;
+    if (!sux.shared_lock_upgrade_for(std::chrono::seconds(10)))
+      assert(!"timeout");
+    sux.unlock_update();
+    u.join();
+  }
+  assert(!sux.get_storage().is_locked_or_waiting());
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_shared_mutex<atomic_shared_mutex<>>,
+                       std::ref(sux));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!sux.get_storage().is_locked_or_waiting());
+
+  fputs(", atomic_shared_mutex", stderr);
+
+  wide_sux.lock();
+  expect_timeout([]{ return wide_sux.try_lock_shared_for(milliseconds(10)); });
+  expect_timeout([]{ return wide_sux.try_lock_update_for(milliseconds(10)); });
+  wide_sux.unlock();
+  wide_sux.lock_shared();
+  expect_timeout([]{ return wide_sux.try_lock_for(milliseconds(10)); });
+  if (wide_sux.try_lock_shared())
+    wide_sux.unlock_shared();
+  else
+    assert(!"blocked");
+  wide_sux.unlock_shared();
+  assert(!wide_sux.get_storage().is_locked_or_waiting());
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_shared_mutex<decltype(wide_sux)>,
+                       std::ref(wide_sux));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!wide_sux.get_storage().is_locked_or_waiting());
+
+  fputs(", atomic_shared_mutex<shared_mutex_storage<uint64_t>>", stderr);
+
+  batched_sux.lock();
+  expect_timeout([]{
+    return batched_sux.try_lock_shared_for(milliseconds(10));
+  });
+  batched_sux.unlock();
+  batched_sux.lock_shared();
+  {
+    /* A lock_shared() that is blocked by the X lock request must be
+    woken up when the request is withdrawn. */
+    std::thread r;
+    expect_timeout([&r]{
+      r = std::thread([]{ batched_sux.lock_shared();
+                          batched_sux.unlock_shared(); });
+      return batched_sux.try_lock_for(milliseconds(10));
+    });
+    r.join();
+  }
+  batched_sux.unlock_shared();
+  assert(!batched_sux.get_storage().is_locked_or_waiting());
+
+  fputs(", atomic_shared_mutex<batched_shared_mutex_storage>", stderr);
+
+  m.lock();
+  if (cv.wait_for(m, milliseconds(10)))
+    assert(!"signalled");
+  assert(!cv.is_waiting());
+  bool signalled = false;
+  std::thread s([&signalled]{
+    m.lock();
+    signalled = true;
+    cv.signal();
+    m.unlock();
+  });
+  while (!signalled)
+    if (!cv.wait_for(m, std::chrono::seconds(10)))
+      assert(!"timeout");
+  m.unlock();
+  s.join();
+  assert(!cv.is_waiting());
+
+  fputs(", atomic_condition_variable.\n", stderr);
+  return 0;
+}